@@ -1,25 +1,245 @@
 #include "action.h"
+#include "fill_item.h"
+#include "layer_item.h"
+#include "stroke_batch.h"
+#include <QGraphicsPathItem>
 
-constexpr Action::Action() {
-  // Constructor implementation here
+namespace {
+// Removing an item from the scene also takes it out of its parent.
+void restoreItem(QGraphicsScene *scene, QGraphicsItem *parent,
+                 QGraphicsItem *item) {
+  if (parent)
+    item->setParentItem(parent);
+  else
+    scene->addItem(item);
 }
+} // namespace
+
+Action::Action() : undone(false) {}
 
 Action::~Action() {}
+
+qint64 Action::itemMemoryUsage(const QGraphicsItem *item) {
+  // Rough per-item overhead of QGraphicsItem and its private data.
+  qint64 bytes = 256;
+  if (auto strokeItem = dynamic_cast<const StrokeItem *>(item)) {
+    bytes += qint64(strokeItem->segments().capacity()) *
+             qint64(sizeof(StrokeItem::Segment));
+  } else if (item->type() == StrokeBatchItem::Type) {
+    const StrokeBatchItem *batch = static_cast<const StrokeBatchItem *>(item);
+    for (const StrokeBatchItem::Member &member : batch->members()) {
+      bytes += qint64(sizeof(StrokeBatchItem::Member)) +
+               qint64(member.segments.capacity()) *
+                   qint64(sizeof(StrokeItem::Segment));
+    }
+  } else if (item->type() == FillItem::Type) {
+    bytes += qint64(static_cast<const FillItem *>(item)->rects().capacity()) *
+             qint64(sizeof(QRectF));
+  } else if (auto pathItem = dynamic_cast<const QGraphicsPathItem *>(item)) {
+    bytes += qint64(pathItem->path().elementCount()) *
+             qint64(sizeof(QPainterPath::Element));
+  }
+  // A layer keeps all of its items alive.
+  for (const QGraphicsItem *child : item->childItems()) {
+    bytes += itemMemoryUsage(child);
+  }
+  return bytes;
+}
+
+qint64 Action::ownedMemoryUsage() const {
+  // Items in the scene are the board's, not the history's; they are only
+  // kept alive here once this action has taken them out.
+  qint64 bytes = 0;
+  for (const QGraphicsItem *item : ownedItems())
+    bytes += itemMemoryUsage(item);
+  return bytes;
+}
+
+// DrawAction and DeleteAction remember the scene and layer when they are
+// created, because an item that has been removed no longer knows either.
+DrawAction::DrawAction(QGraphicsItem *item)
+    : scene(item->scene()), parent(item->parentItem()), item(item) {}
+
 DrawAction::~DrawAction() {
-  // Optional cleanup
+  // Items are freed by History through ownedItems()
+}
+
+void DrawAction::undo() {
+  scene->removeItem(item);
+  undone = true;
 }
-DrawAction::DrawAction(QGraphicsItem *item) : item(item) {}
 
-void DrawAction::undo() { item->scene()->removeItem(item); }
+void DrawAction::redo() {
+  restoreItem(scene, parent, item);
+  undone = false;
+}
 
-void DrawAction::redo() { item->scene()->addItem(item); }
+QList<QGraphicsItem *> DrawAction::ownedItems() const {
+  return undone ? QList<QGraphicsItem *>{item} : QList<QGraphicsItem *>();
+}
 
-DeleteAction::DeleteAction(QGraphicsItem *item) : item(item) {}
+QList<QGraphicsItem *> DrawAction::referencedItems() const {
+  return QList<QGraphicsItem *>{item};
+}
+
+qint64 DrawAction::memoryUsage() const {
+  return qint64(sizeof(*this)) + ownedMemoryUsage();
+}
+
+DeleteAction::DeleteAction(QGraphicsItem *item)
+    : scene(item->scene()), parent(item->parentItem()), item(item) {}
 
 DeleteAction::~DeleteAction() {
-  // Optional cleanup
+  // Items are freed by History through ownedItems()
+}
+
+void DeleteAction::undo() {
+  restoreItem(scene, parent, item);
+  undone = true;
 }
 
-void DeleteAction::undo() { item->scene()->addItem(item); }
+void DeleteAction::redo() {
+  scene->removeItem(item);
+  undone = false;
+}
+
+QList<QGraphicsItem *> DeleteAction::ownedItems() const {
+  return undone ? QList<QGraphicsItem *>() : QList<QGraphicsItem *>{item};
+}
+
+QList<QGraphicsItem *> DeleteAction::referencedItems() const {
+  return QList<QGraphicsItem *>{item};
+}
+
+qint64 DeleteAction::memoryUsage() const {
+  return qint64(sizeof(*this)) + ownedMemoryUsage();
+}
+
+ReplaceAction::ReplaceAction(QGraphicsScene *scene, QGraphicsItem *parent,
+                             const QList<QGraphicsItem *> &removedItems,
+                             const QList<QGraphicsItem *> &addedItems)
+    : scene(scene), parent(parent), removedItems(removedItems),
+      addedItems(addedItems) {}
+
+ReplaceAction::~ReplaceAction() {
+  // Items are freed by History through ownedItems()
+}
+
+void ReplaceAction::undo() {
+  for (QGraphicsItem *item : addedItems)
+    scene->removeItem(item);
+  for (QGraphicsItem *item : removedItems)
+    restoreItem(scene, parent, item);
+  undone = true;
+}
+
+void ReplaceAction::redo() {
+  for (QGraphicsItem *item : removedItems)
+    scene->removeItem(item);
+  for (QGraphicsItem *item : addedItems)
+    restoreItem(scene, parent, item);
+  undone = false;
+}
+
+QList<QGraphicsItem *> ReplaceAction::ownedItems() const {
+  return undone ? addedItems : removedItems;
+}
+
+QList<QGraphicsItem *> ReplaceAction::referencedItems() const {
+  return removedItems + addedItems;
+}
 
-void DeleteAction::redo() { item->scene()->removeItem(item); }
+qint64 ReplaceAction::memoryUsage() const {
+  return qint64(sizeof(*this)) +
+         qint64(removedItems.size() + addedItems.size()) *
+             qint64(sizeof(QGraphicsItem *)) +
+         ownedMemoryUsage();
+}
+
+void ReplaceAction::addRemovedItem(QGraphicsItem *item) {
+  removedItems.append(item);
+}
+
+void ReplaceAction::addAddedItem(QGraphicsItem *item) {
+  addedItems.append(item);
+}
+
+bool ReplaceAction::takeAddedItem(QGraphicsItem *item) {
+  return addedItems.removeOne(item);
+}
+
+MoveAction::MoveAction(const QList<QGraphicsItem *> &items,
+                       const QPointF &offset)
+    : items(items), offset(offset) {}
+
+void MoveAction::undo() {
+  moveItems(-offset);
+  undone = true;
+}
+
+void MoveAction::redo() {
+  moveItems(offset);
+  undone = false;
+}
+
+QList<QGraphicsItem *> MoveAction::ownedItems() const {
+  return QList<QGraphicsItem *>();
+}
+
+QList<QGraphicsItem *> MoveAction::referencedItems() const { return items; }
+
+qint64 MoveAction::memoryUsage() const {
+  return qint64(sizeof(*this)) +
+         qint64(items.size()) * qint64(sizeof(QGraphicsItem *));
+}
+
+void MoveAction::moveItems(const QPointF &by) {
+  for (QGraphicsItem *item : items) {
+    item->moveBy(by.x(), by.y());
+    if (LayerItem *layer = LayerItem::of(item))
+      layer->reindex(item);
+  }
+}
+
+CompoundAction::CompoundAction() {}
+
+CompoundAction::~CompoundAction() { qDeleteAll(actions); }
+
+void CompoundAction::add(Action *action) { actions.append(action); }
+
+bool CompoundAction::isEmpty() const { return actions.isEmpty(); }
+
+int CompoundAction::count() const { return int(actions.size()); }
+
+void CompoundAction::undo() {
+  for (int i = int(actions.size()) - 1; i >= 0; --i)
+    actions.at(i)->undo();
+  undone = true;
+}
+
+void CompoundAction::redo() {
+  for (Action *action : actions)
+    action->redo();
+  undone = false;
+}
+
+QList<QGraphicsItem *> CompoundAction::ownedItems() const {
+  QList<QGraphicsItem *> items;
+  for (Action *action : actions)
+    items += action->ownedItems();
+  return items;
+}
+
+QList<QGraphicsItem *> CompoundAction::referencedItems() const {
+  QList<QGraphicsItem *> items;
+  for (Action *action : actions)
+    items += action->referencedItems();
+  return items;
+}
+
+qint64 CompoundAction::memoryUsage() const {
+  qint64 bytes = qint64(sizeof(*this));
+  for (Action *action : actions)
+    bytes += action->memoryUsage();
+  return bytes;
+}
@@ -1,32 +1,139 @@
+// action.h
+#ifndef ACTION_H
+#define ACTION_H
+
+#include "memory_pool.h"
 #include <QGraphicsItem>
 #include <QGraphicsScene>
+#include <QList>
+#include <QPointF>
 
+// Actions are made for every stroke, shape, paste and erase; the concrete
+// classes come from per-class pools rather than the general heap.
 class Action {
 public:
-  constexpr Action();
+  Action();
   virtual ~Action();
   virtual void undo() = 0;
   virtual void redo() = 0;
+
+  // Items that currently live only in this action, i.e. the action removed
+  // them from the scene. History frees these when it drops the action.
+  virtual QList<QGraphicsItem *> ownedItems() const = 0;
+  // Every item this action moves into or out of the scene, owned or not.
+  virtual QList<QGraphicsItem *> referencedItems() const = 0;
+  // Approximate bytes kept alive by this action, including the items it
+  // owns; changes as the action is undone and redone.
+  virtual qint64 memoryUsage() const = 0;
+
+  static qint64 itemMemoryUsage(const QGraphicsItem *item);
+
+protected:
+  // What itemMemoryUsage() adds up to over ownedItems().
+  qint64 ownedMemoryUsage() const;
+
+  bool undone;
 };
 
-class DrawAction : public Action {
+class DrawAction : public Action, public PoolAllocated<DrawAction> {
 public:
   DrawAction(QGraphicsItem *item);
   ~DrawAction();
   void undo() override;
   void redo() override;
+  QList<QGraphicsItem *> ownedItems() const override;
+  QList<QGraphicsItem *> referencedItems() const override;
+  qint64 memoryUsage() const override;
 
 private:
+  QGraphicsScene *scene;
+  // Layer the item goes back into, if any.
+  QGraphicsItem *parent;
   QGraphicsItem *item;
 };
 
-class DeleteAction : public Action {
+class DeleteAction : public Action, public PoolAllocated<DeleteAction> {
 public:
   DeleteAction(QGraphicsItem *item);
   ~DeleteAction();
   void undo() override;
   void redo() override;
+  QList<QGraphicsItem *> ownedItems() const override;
+  QList<QGraphicsItem *> referencedItems() const override;
+  qint64 memoryUsage() const override;
 
 private:
+  QGraphicsScene *scene;
+  // Layer the item goes back into, if any.
+  QGraphicsItem *parent;
   QGraphicsItem *item;
 };
+
+class ReplaceAction : public Action, public PoolAllocated<ReplaceAction> {
+public:
+  // Every item goes back into parent, or to the top level of the scene
+  // when it is null.
+  ReplaceAction(QGraphicsScene *scene, QGraphicsItem *parent,
+                const QList<QGraphicsItem *> &removedItems,
+                const QList<QGraphicsItem *> &addedItems);
+  ~ReplaceAction();
+  void undo() override;
+  void redo() override;
+  QList<QGraphicsItem *> ownedItems() const override;
+  QList<QGraphicsItem *> referencedItems() const override;
+  qint64 memoryUsage() const override;
+
+  // Extend a replacement that is still being built during a gesture. The
+  // caller has already applied the change to the scene.
+  void addRemovedItem(QGraphicsItem *item);
+  void addAddedItem(QGraphicsItem *item);
+  // Forgets an item this action added; returns false if it was not one.
+  bool takeAddedItem(QGraphicsItem *item);
+
+private:
+  QGraphicsScene *scene;
+  QGraphicsItem *parent;
+  QList<QGraphicsItem *> removedItems;
+  QList<QGraphicsItem *> addedItems;
+};
+
+// Moves items by one offset, e.g. a dragged selection. The items stay in
+// the scene throughout, so none is ever owned.
+class MoveAction : public Action, public PoolAllocated<MoveAction> {
+public:
+  // The caller has already moved the items.
+  MoveAction(const QList<QGraphicsItem *> &items, const QPointF &offset);
+  void undo() override;
+  void redo() override;
+  QList<QGraphicsItem *> ownedItems() const override;
+  QList<QGraphicsItem *> referencedItems() const override;
+  qint64 memoryUsage() const override;
+
+private:
+  void moveItems(const QPointF &by);
+
+  QList<QGraphicsItem *> items;
+  QPointF offset;
+};
+
+// Groups the actions of one user gesture into a single undo step. Children
+// are undone in reverse order and redone in order.
+class CompoundAction : public Action, public PoolAllocated<CompoundAction> {
+public:
+  CompoundAction();
+  ~CompoundAction();
+  // Takes ownership of an already applied action.
+  void add(Action *action);
+  bool isEmpty() const;
+  int count() const;
+  void undo() override;
+  void redo() override;
+  QList<QGraphicsItem *> ownedItems() const override;
+  QList<QGraphicsItem *> referencedItems() const override;
+  qint64 memoryUsage() const override;
+
+private:
+  QList<Action *> actions;
+};
+
+#endif // ACTION_H
@@ -0,0 +1,264 @@
+// canvas_mime_data.cpp
+#include "canvas_mime_data.h"
+#include "raster_exporter.h"
+#include "shape_registry.h"
+#include <QGraphicsPathItem>
+#include <QDataStream>
+#include <QPainter>
+#include <QtMath>
+
+namespace {
+const char *const imageFormat = "application/x-qt-image";
+const char *const svgFormat = "image/svg+xml";
+// Longest side of the image offered to other programs.
+const int maxImageSide = 8192;
+
+QString svgNumber(qreal value) { return QString::number(value, 'g', 6); }
+
+QString svgPaint(const QColor &color) {
+  return color.alpha() == 0 ? QString("none") : color.name();
+}
+
+QString svgStyle(const DocumentItem &item) {
+  const QPen &pen = item.pen;
+  QString cap = "square";
+  if (pen.capStyle() == Qt::RoundCap)
+    cap = "round";
+  else if (pen.capStyle() == Qt::FlatCap)
+    cap = "butt";
+  QString join = "bevel";
+  if (pen.joinStyle() == Qt::RoundJoin)
+    join = "round";
+  else if (pen.joinStyle() == Qt::MiterJoin)
+    join = "miter";
+
+  const bool filled = item.kind != DocumentItem::Path &&
+                      item.brush.style() != Qt::NoBrush;
+  QString style =
+      QString(" stroke=\"%1\" stroke-width=\"%2\" stroke-linecap=\"%3\""
+              " stroke-linejoin=\"%4\"")
+          .arg(pen.style() == Qt::NoPen ? QString("none")
+                                        : svgPaint(pen.color()))
+          .arg(svgNumber(pen.widthF()))
+          .arg(cap)
+          .arg(join);
+  style += QString(" fill=\"%1\"")
+               .arg(filled ? svgPaint(item.brush.color()) : QString("none"));
+  return style;
+}
+} // namespace
+
+const char *const CanvasMimeData::itemsFormat = "application/x-canvas-items";
+
+CanvasMimeData::CanvasMimeData(const QVector<DocumentItem> &items)
+    : snapshot(items) {}
+
+const QVector<DocumentItem> &CanvasMimeData::items() const {
+  return snapshot;
+}
+
+QStringList CanvasMimeData::formats() const {
+  return QStringList{itemsFormat, imageFormat, svgFormat};
+}
+
+bool CanvasMimeData::hasFormat(const QString &mimeType) const {
+  return formats().contains(mimeType);
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+QVariant CanvasMimeData::retrieveData(const QString &mimeType,
+                                      QMetaType type) const {
+  Q_UNUSED(type);
+  return encode(mimeType);
+}
+#else
+QVariant CanvasMimeData::retrieveData(const QString &mimeType,
+                                      QVariant::Type type) const {
+  Q_UNUSED(type);
+  return encode(mimeType);
+}
+#endif
+
+QVariant CanvasMimeData::encode(const QString &mimeType) const {
+  if (mimeType == itemsFormat) {
+    if (itemsCache.isEmpty())
+      itemsCache = encodeItems();
+    return itemsCache;
+  }
+  if (mimeType == imageFormat) {
+    if (imageCache.isNull())
+      imageCache = renderImage();
+    return imageCache;
+  }
+  if (mimeType == svgFormat) {
+    if (svgCache.isEmpty())
+      svgCache = encodeSvg();
+    return svgCache;
+  }
+  return QVariant();
+}
+
+QByteArray CanvasMimeData::encodeItems() const {
+  QByteArray byteArray;
+  QDataStream dataStream(&byteArray, QIODevice::WriteOnly);
+
+  for (const DocumentItem &item : snapshot) {
+    if (item.kind == DocumentItem::Path) {
+      // Uniform strokes keep the old tag so older versions can paste them.
+      bool variableWidth = false;
+      for (const StrokeItem::Segment &segment : item.segments)
+        variableWidth = variableWidth || segment.widthScale != 1.0;
+      dataStream << QString(variableWidth ? "Stroke2" : "Stroke");
+      dataStream << item.start << item.pos << item.pen
+                 << quint32(item.segments.size());
+      for (const StrokeItem::Segment &segment : item.segments) {
+        dataStream << segment.control1 << segment.control2 << segment.end;
+        if (variableWidth)
+          dataStream << segment.widthScale;
+      }
+    } else if (item.kind == DocumentItem::Fill) {
+      dataStream << QString("Fill");
+      dataStream << item.pos << item.brush << quint32(item.rects.size());
+      for (const QRectF &rect : item.rects) {
+        dataStream << rect;
+      }
+    } else if (const ShapeTool *shape = ShapeRegistry::forKind(item.kind)) {
+      dataStream << QString(shape->streamTag());
+      shape->write(dataStream, item);
+    }
+  }
+  return byteArray;
+}
+
+QVector<DocumentItem> CanvasMimeData::decodeItems(const QByteArray &data) {
+  QVector<DocumentItem> items;
+  QDataStream dataStream(data);
+
+  while (!dataStream.atEnd()) {
+    QString itemType;
+    dataStream >> itemType;
+
+    DocumentItem item;
+    if (const ShapeTool *shape = ShapeRegistry::forStreamTag(itemType)) {
+      if (!shape->read(dataStream, item))
+        break;
+      items.append(item);
+    } else if (itemType == "Stroke" || itemType == "Stroke2") {
+      // Stroke2 adds a width scale after each segment.
+      const bool variableWidth = itemType == "Stroke2";
+      quint32 segmentCount = 0;
+      dataStream >> item.start >> item.pos >> item.pen >> segmentCount;
+      for (quint32 i = 0; i < segmentCount && !dataStream.atEnd(); ++i) {
+        StrokeItem::Segment segment;
+        dataStream >> segment.control1 >> segment.control2 >> segment.end;
+        if (variableWidth)
+          dataStream >> segment.widthScale;
+        item.segments.append(segment);
+      }
+      items.append(item);
+    } else if (itemType == "Fill") {
+      quint32 rectCount = 0;
+      dataStream >> item.pos >> item.brush >> rectCount;
+      item.kind = DocumentItem::Fill;
+      item.pen = QPen(Qt::NoPen);
+      for (quint32 i = 0; i < rectCount && !dataStream.atEnd(); ++i) {
+        QRectF rect;
+        dataStream >> rect;
+        item.rects.append(rect);
+      }
+      items.append(item);
+    } else if (itemType == "Path") {
+      // Written by older versions; split into strokes like a saved path.
+      QPainterPath path;
+      QPointF pos;
+      QPen pen;
+      dataStream >> path >> pos >> pen;
+      QGraphicsPathItem pathItem(path);
+      pathItem.setPen(pen);
+      pathItem.setPos(pos);
+      items += DocumentWriter::snapshot(QList<QGraphicsItem *>() << &pathItem);
+    } else {
+      // Unknown tag: the rest of the stream cannot be read.
+      break;
+    }
+  }
+  return items;
+}
+
+QImage CanvasMimeData::renderImage() const {
+  const QRectF source = bounds();
+  if (source.isEmpty())
+    return QImage();
+
+  const qreal scale =
+      qMin<qreal>(1.0, maxImageSide / qMax(source.width(), source.height()));
+  QImage image(qCeil(source.width() * scale), qCeil(source.height() * scale),
+               QImage::Format_ARGB32_Premultiplied);
+  image.fill(Qt::transparent);
+
+  QPainter painter(&image);
+  painter.setRenderHint(QPainter::Antialiasing);
+  painter.scale(scale, scale);
+  painter.translate(-source.topLeft());
+  RasterExporter::paintItems(&painter, snapshot, source);
+  return image;
+}
+
+QByteArray CanvasMimeData::encodeSvg() const {
+  const QRectF source = bounds();
+  QString svg =
+      QString("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%1\" "
+              "height=\"%2\" viewBox=\"%3 %4 %1 %2\">\n")
+          .arg(svgNumber(source.width()))
+          .arg(svgNumber(source.height()))
+          .arg(svgNumber(source.left()))
+          .arg(svgNumber(source.top()));
+
+  for (const DocumentItem &item : snapshot) {
+    QString element;
+    if (item.kind == DocumentItem::Path) {
+      QString data = QString("M%1 %2")
+                         .arg(svgNumber(item.start.x()))
+                         .arg(svgNumber(item.start.y()));
+      for (const StrokeItem::Segment &segment : item.segments) {
+        data += QString(" C%1 %2 %3 %4 %5 %6")
+                    .arg(svgNumber(segment.control1.x()))
+                    .arg(svgNumber(segment.control1.y()))
+                    .arg(svgNumber(segment.control2.x()))
+                    .arg(svgNumber(segment.control2.y()))
+                    .arg(svgNumber(segment.end.x()))
+                    .arg(svgNumber(segment.end.y()));
+      }
+      element = QString("<path d=\"%1\"").arg(data);
+    } else if (item.kind == DocumentItem::Fill) {
+      QString data;
+      for (const QRectF &rect : item.rects) {
+        data += QString("M%1 %2h%3v%4h%5z")
+                    .arg(svgNumber(rect.left()))
+                    .arg(svgNumber(rect.top()))
+                    .arg(svgNumber(rect.width()))
+                    .arg(svgNumber(rect.height()))
+                    .arg(svgNumber(-rect.width()));
+      }
+      element = QString("<path d=\"%1\"").arg(data);
+    } else if (const ShapeTool *shape = ShapeRegistry::forKind(item.kind)) {
+      element = shape->svgElement(item);
+    } else {
+      continue;
+    }
+    svg += QString(" <g transform=\"translate(%1 %2)\">")
+               .arg(svgNumber(item.pos.x()))
+               .arg(svgNumber(item.pos.y()));
+    svg += element + svgStyle(item) + "/></g>\n";
+  }
+  svg += "</svg>\n";
+  return svg.toUtf8();
+}
+
+QRectF CanvasMimeData::bounds() const {
+  QRectF result;
+  for (const DocumentItem &item : snapshot) {
+    result = result.united(item.sceneBounds);
+  }
+  return result;
+}
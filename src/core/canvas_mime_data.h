@@ -0,0 +1,57 @@
+// canvas_mime_data.h
+#ifndef CANVAS_MIME_DATA_H
+#define CANVAS_MIME_DATA_H
+
+#include "document.h"
+#include <QByteArray>
+#include <QImage>
+#include <QMimeData>
+#include <QStringList>
+#include <QVariant>
+#include <QVector>
+
+// Clipboard contents for copied canvas items. Holds a snapshot of the
+// selection and only encodes it when a consumer asks for a format: the
+// canvas item stream for other instances of the app, an image for other
+// programs, or SVG. A paste within the same process reads items() directly
+// and never goes through any encoding.
+class CanvasMimeData : public QMimeData {
+  Q_OBJECT
+
+public:
+  static const char *const itemsFormat;
+
+  explicit CanvasMimeData(const QVector<DocumentItem> &items);
+
+  const QVector<DocumentItem> &items() const;
+  // Reads an itemsFormat stream, e.g. from another instance. Stops at the
+  // first item it cannot decode. Safe to call from a worker thread.
+  static QVector<DocumentItem> decodeItems(const QByteArray &data);
+
+  QStringList formats() const override;
+  bool hasFormat(const QString &mimeType) const override;
+
+protected:
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+  QVariant retrieveData(const QString &mimeType,
+                        QMetaType type) const override;
+#else
+  QVariant retrieveData(const QString &mimeType,
+                        QVariant::Type type) const override;
+#endif
+
+private:
+  QVariant encode(const QString &mimeType) const;
+  QByteArray encodeItems() const;
+  QImage renderImage() const;
+  QByteArray encodeSvg() const;
+  QRectF bounds() const;
+
+  QVector<DocumentItem> snapshot;
+  // Encodings already handed out; platforms tend to ask more than once.
+  mutable QByteArray itemsCache;
+  mutable QImage imageCache;
+  mutable QByteArray svgCache;
+};
+
+#endif // CANVAS_MIME_DATA_H
@@ -0,0 +1,346 @@
+// chunk_store.cpp
+#include "chunk_store.h"
+#include "fill_item.h"
+#include "layer_item.h"
+#include "shape_registry.h"
+#include "stroke_batch.h"
+#include <QFile>
+#include <QRunnable>
+#include <QtMath>
+#include <algorithm>
+
+// A chunk file on disk, removed once nothing holds on to it any more.
+class ChunkFile {
+public:
+  explicit ChunkFile(const QString &name) : name(name) {}
+  ~ChunkFile() { QFile::remove(name); }
+
+  const QString name;
+};
+
+namespace {
+// Most chunks one update() marks resident; a view spanning more than this
+// is zoomed too far out to page anything in or out usefully.
+const int maxVisibleChunks = 4096;
+
+class WriteChunkTask : public QRunnable {
+public:
+  WriteChunkTask(QObject *store, int id,
+                 const QSharedPointer<ChunkFile> &file,
+                 const QVector<DocumentItem> &items)
+      : store(store), id(id), file(file), items(items) {}
+
+  void run() override {
+    const bool ok = DocumentWriter::write(file->name, items);
+    QMetaObject::invokeMethod(store, "batchWritten", Qt::QueuedConnection,
+                              Q_ARG(int, id), Q_ARG(bool, ok));
+  }
+
+private:
+  QObject *store;
+  int id;
+  QSharedPointer<ChunkFile> file;
+  QVector<DocumentItem> items;
+};
+} // namespace
+
+ChunkStore::ChunkStore(QGraphicsScene *scene, QObject *parent)
+    : QObject(parent), scene(scene), nextBatchId(0) {
+  // Chunk files are written one at a time, in the order they were stored.
+  writeThreads.setMaxThreadCount(1);
+}
+
+ChunkStore::~ChunkStore() { writeThreads.waitForDone(); }
+
+void ChunkStore::setItemReleaseHandler(
+    const std::function<void(QGraphicsItem *)> &f) {
+  itemReleaseHandler = f;
+}
+
+void ChunkStore::setItemLoadHandler(
+    const std::function<bool(QGraphicsItem *, quint16)> &f) {
+  itemLoadHandler = f;
+}
+
+ChunkStore::Key ChunkStore::keyAt(const QPointF &point) {
+  const qint32 x = qint32(qFloor(point.x() / chunkSize));
+  const qint32 y = qint32(qFloor(point.y() / chunkSize));
+  return (Key(quint32(x)) << 32) | Key(quint32(y));
+}
+
+QRectF ChunkStore::chunkRect(Key key) {
+  const qint32 x = qint32(quint32(key >> 32));
+  const qint32 y = qint32(quint32(key));
+  return QRectF(qreal(x) * chunkSize, qreal(y) * chunkSize, chunkSize,
+                chunkSize);
+}
+
+bool ChunkStore::isPageable(const QGraphicsItem *item) {
+  // Only items the document format stores can leave the scene; batches
+  // come back as their member strokes.
+  if (item->type() != StrokeItem::Type &&
+      item->type() != StrokeBatchItem::Type &&
+      item->type() != FillItem::Type &&
+      !ShapeRegistry::forItemType(item->type()))
+    return false;
+  const QGraphicsItem *parent = item->parentItem();
+  return (!parent || parent->type() == LayerItem::Type) &&
+         item->childItems().isEmpty() && !item->isSelected();
+}
+
+QString ChunkStore::fileName(int id) const {
+  return directory.filePath(QString("chunk-%1.fspd").arg(id));
+}
+
+void ChunkStore::track(const QGraphicsItem *item) {
+  resident.insert(keyAt(item->sceneBoundingRect().center()));
+}
+
+void ChunkStore::update(
+    const QRectF &visible,
+    const std::function<bool(QGraphicsItem *)> &canUnload) {
+  if (visible.isEmpty())
+    return;
+
+  const QRectF nearby =
+      visible.adjusted(-chunkSize, -chunkSize, chunkSize, chunkSize);
+  const QList<Key> storedKeys = stored.keys();
+  for (Key key : storedKeys) {
+    if (chunkRect(key).intersects(nearby))
+      load(key);
+  }
+
+  // Chunks between nearby and hold stay as they are, so panning back and
+  // forth across a chunk edge does not page it in and out every time.
+  const QRectF hold = visible.adjusted(-2 * chunkSize, -2 * chunkSize,
+                                       2 * chunkSize, 2 * chunkSize);
+  if (directory.isValid()) {
+    const QList<Key> residentKeys = resident.values();
+    for (Key key : residentKeys) {
+      if (!chunkRect(key).intersects(hold))
+        store(key, hold, canUnload);
+    }
+  }
+
+  // Anything drawn or dropped in view from now on is covered as well.
+  const qint64 left = qFloor(visible.left() / chunkSize);
+  const qint64 right = qFloor(visible.right() / chunkSize);
+  const qint64 top = qFloor(visible.top() / chunkSize);
+  const qint64 bottom = qFloor(visible.bottom() / chunkSize);
+  if ((right - left + 1) * (bottom - top + 1) > maxVisibleChunks)
+    return;
+  for (qint64 x = left; x <= right; ++x) {
+    for (qint64 y = top; y <= bottom; ++y) {
+      resident.insert((Key(quint32(qint32(x))) << 32) |
+                      Key(quint32(qint32(y))));
+    }
+  }
+}
+
+void ChunkStore::store(
+    Key key, const QRectF &hold,
+    const std::function<bool(QGraphicsItem *)> &canUnload) {
+  const QList<QGraphicsItem *> candidates = scene->items(
+      chunkRect(key), Qt::IntersectsItemBoundingRect, Qt::AscendingOrder);
+
+  QList<QGraphicsItem *> leaving;
+  bool staying = false;
+  for (QGraphicsItem *item : candidates) {
+    const QRectF bounds = item->sceneBoundingRect();
+    if (keyAt(bounds.center()) != key)
+      continue;
+    if (bounds.intersects(hold) || !isPageable(item) ||
+        (canUnload && !canUnload(item))) {
+      staying = true;
+      continue;
+    }
+    leaving.append(item);
+  }
+  if (!staying)
+    resident.remove(key);
+  if (leaving.isEmpty())
+    return;
+
+  Batch batch;
+  batch.id = nextBatchId++;
+  batch.file = QSharedPointer<ChunkFile>::create(fileName(batch.id));
+  batch.items = DocumentWriter::snapshot(leaving);
+  batch.orders.reserve(batch.items.size());
+  for (const DocumentItem &item : batch.items) {
+    batch.bounds = batch.bounds.united(item.sceneBounds);
+    batch.orders.append(item.order);
+  }
+  batch.written = false;
+
+  // The snapshot shares stroke geometry, so deleting the items leaves it as
+  // the only copy until the file is written.
+  for (QGraphicsItem *item : leaving) {
+    if (itemReleaseHandler)
+      itemReleaseHandler(item);
+    scene->removeItem(item);
+    delete item;
+  }
+  writeThreads.start(
+      new WriteChunkTask(this, batch.id, batch.file, batch.items));
+  stored[key].append(batch);
+}
+
+void ChunkStore::load(Key key) {
+  const QList<Batch> batches = stored.take(key);
+  QHash<LayerItem *, QList<QGraphicsItem *>> placed;
+  for (const Batch &batch : batches) {
+    if (!batch.written) {
+      // Still being written, or the write failed; the file goes once the
+      // write and any Pages are done with it.
+      for (int i = 0; i < batch.items.size(); ++i) {
+        rebuild(batch.items.at(i), batch.orders.at(i), placed);
+      }
+      continue;
+    }
+
+    DocumentReader reader(batch.file->name);
+    QString error;
+    if (!reader.open(&error)) {
+      qWarning("Could not reload a canvas chunk: %s", qPrintable(error));
+      continue;
+    }
+    for (int i = 0; i < reader.itemCount(); ++i) {
+      DocumentItem item;
+      if (reader.readItem(i, &item))
+        rebuild(item, batch.orders.value(i), placed);
+    }
+  }
+  // Rebuilt items were added on top; items from other chunks that were
+  // drawn later may overlap them.
+  for (auto it = placed.begin(); it != placed.end(); ++it) {
+    it.key()->restack(it.value());
+  }
+  if (!batches.isEmpty())
+    resident.insert(key);
+}
+
+void ChunkStore::rebuild(const DocumentItem &item, quint64 order,
+                         QHash<LayerItem *, QList<QGraphicsItem *>> &placed) {
+  QGraphicsItem *graphicsItem = item.createGraphicsItem();
+  if (!graphicsItem || !itemLoadHandler ||
+      !itemLoadHandler(graphicsItem, item.layer)) {
+    if (!itemLoadHandler)
+      delete graphicsItem;
+    return;
+  }
+  if (LayerItem *layer = LayerItem::of(graphicsItem)) {
+    LayerItem::setStackOrder(graphicsItem, order);
+    placed[layer].append(graphicsItem);
+  }
+}
+
+void ChunkStore::batchWritten(int id, bool ok) {
+  for (QList<Batch> &batches : stored) {
+    for (Batch &batch : batches) {
+      if (batch.id != id)
+        continue;
+      // Should writing fail, the chunk stays in memory; it still leaves
+      // the scene.
+      if (ok) {
+        batch.written = true;
+        batch.items.clear();
+      }
+      return;
+    }
+  }
+}
+
+bool ChunkStore::hasStoredItems() const { return !stored.isEmpty(); }
+
+QRectF ChunkStore::storedBounds() const {
+  QRectF bounds;
+  for (const QList<Batch> &batches : stored) {
+    for (const Batch &batch : batches) {
+      bounds = bounds.united(batch.bounds);
+    }
+  }
+  return bounds;
+}
+
+QVector<DocumentItem> ChunkStore::storedItems() const {
+  return pages().read();
+}
+
+ChunkStore::Pages ChunkStore::pages() const {
+  Pages pages;
+  for (const QList<Batch> &chunk : stored) {
+    for (const Batch &batch : chunk) {
+      pages.batches.append(batch);
+    }
+  }
+  // Batch ids grow with every pass, so sorting by id restores store order.
+  std::sort(pages.batches.begin(), pages.batches.end(),
+            [](const Batch &a, const Batch &b) { return a.id < b.id; });
+  return pages;
+}
+
+bool ChunkStore::Pages::isEmpty() const { return batches.isEmpty(); }
+
+QVector<DocumentItem> ChunkStore::Pages::read() const {
+  QVector<DocumentItem> items;
+  for (const Batch &batch : batches) {
+    if (!batch.written) {
+      items += batch.items;
+      continue;
+    }
+    DocumentReader reader(batch.file->name);
+    if (!reader.open())
+      continue;
+    for (int i = 0; i < reader.itemCount(); ++i) {
+      DocumentItem item;
+      if (reader.readItem(i, &item)) {
+        item.order = batch.orders.value(i);
+        items.append(item);
+      }
+    }
+  }
+  return items;
+}
+
+QVector<DocumentItem>
+ChunkStore::interleave(QVector<DocumentItem> stored,
+                       const QVector<DocumentItem> &resident,
+                       const QVector<DocumentLayer> &layers) {
+  if (stored.isEmpty())
+    return resident;
+
+  // Items of layers that are gone sort first, as all stored items used to.
+  QHash<quint16, int> layerIndex;
+  for (int i = 0; i < layers.size(); ++i) {
+    layerIndex.insert(layers.at(i).id, i);
+  }
+  auto below = [&layerIndex](const DocumentItem &a, const DocumentItem &b) {
+    const int layerA = layerIndex.value(a.layer, -1);
+    const int layerB = layerIndex.value(b.layer, -1);
+    if (layerA != layerB)
+      return layerA < layerB;
+    if (a.z != b.z)
+      return a.z < b.z;
+    return a.order < b.order;
+  };
+  std::stable_sort(stored.begin(), stored.end(), below);
+
+  // The scene is already in this order, so one merge pass does.
+  QVector<DocumentItem> items;
+  items.reserve(stored.size() + resident.size());
+  int next = 0;
+  for (const DocumentItem &item : resident) {
+    while (next < stored.size() && below(stored.at(next), item))
+      items.append(stored.at(next++));
+    items.append(item);
+  }
+  while (next < stored.size())
+    items.append(stored.at(next++));
+  return items;
+}
+
+void ChunkStore::clear() {
+  // Files go once pending writes and Pages are done with them.
+  stored.clear();
+  resident.clear();
+}
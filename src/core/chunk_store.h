@@ -0,0 +1,130 @@
+// chunk_store.h
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include "document.h"
+#include <QGraphicsItem>
+#include <QGraphicsScene>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QRectF>
+#include <QSet>
+#include <QSharedPointer>
+#include <QTemporaryDir>
+#include <QThreadPool>
+#include <QVector>
+#include <functional>
+
+class ChunkFile;
+class LayerItem;
+
+// Pages an unbounded board in and out of the scene in square chunks of
+// scene space. An item belongs to the chunk holding the centre of its scene
+// bounding rect. Chunks that end up far from the view have their items
+// written to a temporary file and deleted; they are rebuilt once the view
+// comes near again. Files are written on a worker thread, and a chunk that
+// is needed again before its write finished is rebuilt from memory.
+class ChunkStore : public QObject {
+  Q_OBJECT
+
+public:
+  static const int chunkSize = 2048;
+
+  class Pages;
+
+  explicit ChunkStore(QGraphicsScene *scene, QObject *parent = nullptr);
+  ~ChunkStore();
+
+  // Called for every item right before the store deletes it.
+  void setItemReleaseHandler(const std::function<void(QGraphicsItem *)> &f);
+  // Receives every rebuilt item, scene-less, with the id of the layer it
+  // was paged out of; the handler adds it, or deletes it and returns false.
+  // Items added to a layer go back to their place in its stacking order.
+  void setItemLoadHandler(
+      const std::function<bool(QGraphicsItem *, quint16)> &f);
+
+  // Marks the chunk under a finished item as holding items, so it is
+  // considered when chunks are paged out.
+  void track(const QGraphicsItem *item);
+  // Rebuilds stored chunks within a chunk of visible and pages out chunks
+  // more than two chunks away from it. Items canUnload rejects, selected
+  // items and items reaching into that margin always stay.
+  void update(const QRectF &visible,
+              const std::function<bool(QGraphicsItem *)> &canUnload);
+
+  bool hasStoredItems() const;
+  QRectF storedBounds() const;
+  // Every paged-out item, in the order the chunks were stored.
+  QVector<DocumentItem> storedItems() const;
+  // What is paged out now, to be read later on any thread.
+  Pages pages() const;
+  // Board in stacking order: stored items, as storedItems() returns them,
+  // slotted in among resident ones, a snapshot of the scene in ascending
+  // order, by layer, z and LayerItem::stackOrder(). layers is the layer
+  // table, bottom layer first. Safe to call on any thread.
+  static QVector<DocumentItem>
+  interleave(QVector<DocumentItem> stored,
+             const QVector<DocumentItem> &resident,
+             const QVector<DocumentLayer> &layers);
+  // Drops all stored chunks without rebuilding them.
+  void clear();
+
+private slots:
+  void batchWritten(int id, bool ok);
+
+private:
+  typedef quint64 Key;
+
+  // Items of one chunk paged out in one pass.
+  struct Batch {
+    int id;
+    // Shared with pending writes and Pages; the last one removes it.
+    QSharedPointer<ChunkFile> file;
+    QRectF bounds;
+    // Kept until the file is written, or for good if writing failed.
+    QVector<DocumentItem> items;
+    // DocumentItem::order of each item; files do not keep it.
+    QVector<quint64> orders;
+    bool written;
+  };
+
+  static Key keyAt(const QPointF &point);
+  static QRectF chunkRect(Key key);
+  static bool isPageable(const QGraphicsItem *item);
+  QString fileName(int id) const;
+
+  void store(Key key, const QRectF &hold,
+             const std::function<bool(QGraphicsItem *)> &canUnload);
+  void load(Key key);
+  // Builds item and hands it to the load handler; items that went into a
+  // layer are collected for LayerItem::restack().
+  void rebuild(const DocumentItem &item, quint64 order,
+               QHash<LayerItem *, QList<QGraphicsItem *>> &placed);
+
+  QGraphicsScene *scene;
+  QTemporaryDir directory;
+  QThreadPool writeThreads;
+  // Chunks that may still have items in the scene.
+  QSet<Key> resident;
+  QHash<Key, QList<Batch>> stored;
+  int nextBatchId;
+  std::function<void(QGraphicsItem *)> itemReleaseHandler;
+  std::function<bool(QGraphicsItem *, quint16)> itemLoadHandler;
+};
+
+// Paged-out items as they were when ChunkStore::pages() was taken. It keeps
+// the chunk files it needs, so it can be read while the store pages chunks
+// back in and out.
+class ChunkStore::Pages {
+public:
+  bool isEmpty() const;
+  // Every item, in the order the chunks were stored; reads the files.
+  QVector<DocumentItem> read() const;
+
+private:
+  friend class ChunkStore;
+  QVector<Batch> batches;
+};
+
+#endif // CHUNK_STORE_H
@@ -0,0 +1,550 @@
+// document.cpp
+#include "document.h"
+#include "fill_item.h"
+#include "layer_item.h"
+#include "shape_registry.h"
+#include "stroke_batch.h"
+#include <QGraphicsPathItem>
+#include <QSaveFile>
+#include <QtEndian>
+#include <cstring>
+
+namespace {
+const char magic[4] = {'F', 'S', 'P', 'D'};
+const int headerSize = 32;
+const int recordHeadSize = 40;
+const int indexEntrySize = 24;
+// Layer table entry without its name.
+const int layerHeadSize = 6;
+const quint8 layerHiddenFlag = 0x01;
+const quint8 layerLockedFlag = 0x02;
+// Record flag: a float32 width scale per segment follows the points.
+const quint8 widthScalesFlag = 0x01;
+// Bytes buffered before each write to the save file.
+const int chunkSize = 1 << 20;
+
+void putU8(QByteArray &out, quint8 value) { out.append(char(value)); }
+
+template <typename T> void putLittleEndian(QByteArray &out, T value) {
+  uchar bytes[sizeof(T)];
+  qToLittleEndian(value, bytes);
+  out.append(reinterpret_cast<const char *>(bytes), int(sizeof(T)));
+}
+
+void putU16(QByteArray &out, quint16 value) { putLittleEndian(out, value); }
+
+void putU32(QByteArray &out, quint32 value) { putLittleEndian(out, value); }
+
+void putU64(QByteArray &out, quint64 value) { putLittleEndian(out, value); }
+
+void putF32(QByteArray &out, qreal value) {
+  const float f = float(value);
+  quint32 bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  putU32(out, bits);
+}
+
+void putPoint(QByteArray &out, const QPointF &point) {
+  putF32(out, point.x());
+  putF32(out, point.y());
+}
+
+quint16 getU16(const uchar *p) { return qFromLittleEndian<quint16>(p); }
+
+quint32 getU32(const uchar *p) { return qFromLittleEndian<quint32>(p); }
+
+// Whether a record head at offset lies between the header and the index.
+// Compares without adding to offset, which a damaged index could wrap.
+bool recordFits(quint64 offset, qint64 indexOffset) {
+  return offset >= quint64(headerSize) &&
+         quint64(indexOffset) >= quint64(recordHeadSize) &&
+         offset <= quint64(indexOffset) - recordHeadSize;
+}
+
+quint64 getU64(const uchar *p) { return qFromLittleEndian<quint64>(p); }
+
+qreal getF32(const uchar *p) {
+  const quint32 bits = getU32(p);
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return qreal(f);
+}
+
+QPointF getPoint(const uchar *p) { return QPointF(getF32(p), getF32(p + 4)); }
+
+quint32 pointCount(const DocumentItem &item) {
+  if (item.kind == DocumentItem::Path)
+    return 1 + 3 * quint32(item.segments.size());
+  if (item.kind == DocumentItem::Fill)
+    return 2 * quint32(item.rects.size());
+  return 2;
+}
+
+bool hasWidthScales(const DocumentItem &item) {
+  if (item.kind != DocumentItem::Path)
+    return false;
+  for (const StrokeItem::Segment &segment : item.segments) {
+    if (segment.widthScale != 1.0)
+      return true;
+  }
+  return false;
+}
+
+quint64 recordSize(const DocumentItem &item) {
+  quint64 size = recordHeadSize + 8 * quint64(pointCount(item));
+  if (hasWidthScales(item))
+    size += 4 * quint64(item.segments.size());
+  return size;
+}
+
+void appendRecord(QByteArray &out, const DocumentItem &item) {
+  const bool widthScales = hasWidthScales(item);
+  putU8(out, item.kind);
+  putU8(out, quint8(item.pen.style()));
+  putU8(out, quint8(item.pen.capStyle() >> 4));
+  putU8(out, quint8(item.pen.joinStyle() >> 6));
+  putU32(out, item.pen.color().rgba());
+  putF32(out, item.pen.widthF());
+  putU32(out, item.brush.color().rgba());
+  putU8(out, quint8(item.brush.style()));
+  putU8(out, widthScales ? widthScalesFlag : 0);
+  putU16(out, item.layer);
+  putPoint(out, item.pos);
+  putF32(out, item.z);
+  putU32(out, pointCount(item));
+  putU32(out, item.tag);
+
+  if (item.kind == DocumentItem::Fill) {
+    for (const QRectF &rect : item.rects) {
+      putPoint(out, rect.topLeft());
+      putPoint(out, rect.bottomRight());
+    }
+    return;
+  }
+  if (item.kind != DocumentItem::Path) {
+    putPoint(out, item.extent.p1());
+    putPoint(out, item.extent.p2());
+    return;
+  }
+  putPoint(out, item.start);
+  for (const StrokeItem::Segment &segment : item.segments) {
+    putPoint(out, segment.control1);
+    putPoint(out, segment.control2);
+    putPoint(out, segment.end);
+  }
+  if (widthScales) {
+    for (const StrokeItem::Segment &segment : item.segments) {
+      putF32(out, segment.widthScale);
+    }
+  }
+}
+
+DocumentItem baseItem(DocumentItem::Kind kind, const QGraphicsItem *item) {
+  DocumentItem documentItem;
+  documentItem.kind = kind;
+  documentItem.pos = item->pos();
+  documentItem.z = item->zValue();
+  documentItem.sceneBounds = item->sceneBoundingRect();
+  documentItem.tag = item->data(DocumentItem::tagKey).toUInt();
+  documentItem.order = LayerItem::stackOrder(item);
+  if (const LayerItem *layer = LayerItem::of(item))
+    documentItem.layer = layer->id();
+  return documentItem;
+}
+
+// Splits a generic path into stroke-style records, one per subpath; lines
+// become degenerate cubics.
+void appendPathRecords(QVector<DocumentItem> &out,
+                       const QGraphicsPathItem *item) {
+  const QPainterPath path = item->path();
+  DocumentItem record = baseItem(DocumentItem::Path, item);
+  record.pen = item->pen();
+  bool open = false;
+
+  for (int i = 0; i < path.elementCount(); ++i) {
+    const QPainterPath::Element element = path.elementAt(i);
+    if (element.isMoveTo()) {
+      if (open)
+        out.append(record);
+      record.start = element;
+      record.segments.clear();
+      open = true;
+    } else if (element.isLineTo()) {
+      StrokeItem::Segment segment;
+      segment.control1 = record.segments.isEmpty()
+                             ? record.start
+                             : record.segments.last().end;
+      segment.control2 = element;
+      segment.end = element;
+      record.segments.append(segment);
+    } else if (element.isCurveTo() && i + 2 < path.elementCount()) {
+      StrokeItem::Segment segment;
+      segment.control1 = element;
+      segment.control2 = path.elementAt(i + 1);
+      segment.end = path.elementAt(i + 2);
+      record.segments.append(segment);
+      i += 2;
+    }
+  }
+  if (open)
+    out.append(record);
+}
+} // namespace
+
+QVector<DocumentItem>
+DocumentWriter::snapshot(const QList<QGraphicsItem *> &items) {
+  QVector<DocumentItem> result;
+  result.reserve(items.size());
+
+  for (QGraphicsItem *item : items) {
+    if (const ShapeTool *shape = ShapeRegistry::forItemType(item->type())) {
+      DocumentItem record = baseItem(shape->kind(), item);
+      shape->snapshot(item, record);
+      result.append(record);
+    } else if (auto strokeItem = dynamic_cast<StrokeItem *>(item)) {
+      DocumentItem record = baseItem(DocumentItem::Path, item);
+      record.pen = strokeItem->pen();
+      record.start = strokeItem->startPoint();
+      record.segments = strokeItem->segments();
+      result.append(record);
+    } else if (item->type() == StrokeBatchItem::Type) {
+      // Batches are a scene-side optimization; documents keep one record
+      // per stroke.
+      const StrokeBatchItem *batch = static_cast<StrokeBatchItem *>(item);
+      for (const StrokeBatchItem::Member &member : batch->members()) {
+        DocumentItem record = baseItem(DocumentItem::Path, item);
+        record.sceneBounds = member.bounds.translated(item->pos());
+        record.pen = member.pen;
+        record.start = member.start;
+        record.segments = member.segments;
+        record.tag = member.tag;
+        record.order = member.order;
+        result.append(record);
+      }
+    } else if (item->type() == FillItem::Type) {
+      const FillItem *fill = static_cast<FillItem *>(item);
+      DocumentItem record = baseItem(DocumentItem::Fill, item);
+      record.pen = QPen(Qt::NoPen);
+      record.brush = fill->brush();
+      record.rects = fill->rects();
+      result.append(record);
+    } else if (auto pathItem = dynamic_cast<QGraphicsPathItem *>(item)) {
+      appendPathRecords(result, pathItem);
+    }
+  }
+  return result;
+}
+
+bool DocumentWriter::write(const QString &fileName,
+                           const QVector<DocumentItem> &items,
+                           QString *errorString) {
+  return write(fileName, items, QVector<DocumentLayer>(), errorString);
+}
+
+bool DocumentWriter::write(const QString &fileName,
+                           const QVector<DocumentItem> &items,
+                           const QVector<DocumentLayer> &layers,
+                           QString *errorString) {
+  QSaveFile file(fileName);
+  if (!file.open(QIODevice::WriteOnly)) {
+    if (errorString)
+      *errorString = file.errorString();
+    return false;
+  }
+  if (!write(&file, items, layers) || !file.commit()) {
+    if (errorString)
+      *errorString = file.errorString();
+    file.cancelWriting();
+    return false;
+  }
+  return true;
+}
+
+bool DocumentWriter::write(QIODevice *device,
+                           const QVector<DocumentItem> &items,
+                           const QVector<DocumentLayer> &layers,
+                           QString *errorString) {
+  // Record sizes are known up front, so the index offset can go into the
+  // header and the whole file is written front to back.
+  QVector<quint64> offsets;
+  offsets.reserve(items.size());
+  quint64 offset = headerSize;
+  for (const DocumentItem &item : items) {
+    offsets.append(offset);
+    offset += recordSize(item);
+  }
+
+  QByteArray chunk;
+  chunk.reserve(chunkSize + recordHeadSize);
+  chunk.append(magic, 4);
+  putU16(chunk, DocumentReader::version);
+  putU16(chunk, 0);
+  putU32(chunk, quint32(items.size()));
+  putU32(chunk, 0);
+  putU64(chunk, offset);
+  putU64(chunk, layers.isEmpty()
+                    ? 0
+                    : offset + quint64(items.size()) * indexEntrySize);
+
+  auto flush = [device, &chunk]() {
+    const bool ok = device->write(chunk) == chunk.size();
+    chunk.resize(0);
+    return ok;
+  };
+
+  bool ok = true;
+  for (const DocumentItem &item : items) {
+    appendRecord(chunk, item);
+    if (chunk.size() >= chunkSize && !(ok = flush()))
+      break;
+  }
+
+  for (int i = 0; ok && i < items.size(); ++i) {
+    const QRectF &bounds = items.at(i).sceneBounds;
+    putU64(chunk, offsets.at(i));
+    putF32(chunk, bounds.left());
+    putF32(chunk, bounds.top());
+    putF32(chunk, bounds.right());
+    putF32(chunk, bounds.bottom());
+    if (chunk.size() >= chunkSize)
+      ok = flush();
+  }
+
+  if (ok && !layers.isEmpty()) {
+    putU32(chunk, quint32(layers.size()));
+    for (const DocumentLayer &layer : layers) {
+      const QByteArray name = layer.name.toUtf8().left(0xffff);
+      putU16(chunk, layer.id);
+      putU8(chunk, (layer.hidden ? layerHiddenFlag : 0) |
+                       (layer.locked ? layerLockedFlag : 0));
+      putU8(chunk, 0);
+      putU16(chunk, quint16(name.size()));
+      chunk.append(name);
+    }
+  }
+
+  if (ok)
+    ok = flush();
+  if (!ok && errorString)
+    *errorString = device->errorString();
+  return ok;
+}
+
+void DocumentWriter::encodeRecord(const DocumentItem &item, QByteArray &out) {
+  appendRecord(out, item);
+}
+
+DocumentReader::DocumentReader(const QString &fileName)
+    : file(fileName), data(nullptr), dataSize(0), count(0), indexOffset(0) {}
+
+DocumentReader::DocumentReader(const QByteArray &document)
+    : bytes(document), data(nullptr), dataSize(0), count(0), indexOffset(0) {}
+
+DocumentReader::~DocumentReader() {
+  if (data && file.isOpen())
+    file.unmap(const_cast<uchar *>(data));
+}
+
+bool DocumentReader::open(QString *errorString) {
+  if (file.fileName().isEmpty()) {
+    dataSize = bytes.size();
+    data = reinterpret_cast<const uchar *>(bytes.constData());
+  } else {
+    if (!file.open(QIODevice::ReadOnly)) {
+      if (errorString)
+        *errorString = file.errorString();
+      return false;
+    }
+    dataSize = file.size();
+    data = dataSize > 0 ? file.map(0, dataSize) : nullptr;
+    if (!data) {
+      if (errorString)
+        *errorString = QString("Could not map %1").arg(file.fileName());
+      return false;
+    }
+  }
+
+  if (dataSize < headerSize || std::memcmp(data, magic, 4) != 0) {
+    if (errorString)
+      *errorString = QString("Not a Pencil Draw document");
+    return false;
+  }
+  if (getU16(data + 4) > version) {
+    if (errorString)
+      *errorString = QString("Document was written by a newer version");
+    return false;
+  }
+
+  count = getU32(data + 8);
+  indexOffset = qint64(getU64(data + 16));
+  if (indexOffset < headerSize || indexOffset > dataSize ||
+      quint64(dataSize - indexOffset) / indexEntrySize < count) {
+    if (errorString)
+      *errorString = QString("Document index is damaged");
+    count = 0;
+    return false;
+  }
+
+  const quint64 layerOffset = getU64(data + 24);
+  if (layerOffset && !readLayers(qint64(layerOffset))) {
+    if (errorString)
+      *errorString = QString("Document layer table is damaged");
+    count = 0;
+    return false;
+  }
+  return true;
+}
+
+bool DocumentReader::readLayers(qint64 offset) {
+  if (offset < indexOffset || offset > dataSize - 4)
+    return false;
+  const quint32 layerCount = getU32(data + offset);
+  const uchar *p = data + offset + 4;
+  const uchar *end = data + dataSize;
+  for (quint32 i = 0; i < layerCount; ++i) {
+    if (end - p < layerHeadSize)
+      return false;
+    const int nameSize = getU16(p + 4);
+    if (end - p - layerHeadSize < nameSize)
+      return false;
+    DocumentLayer layer;
+    layer.id = getU16(p);
+    layer.hidden = p[2] & layerHiddenFlag;
+    layer.locked = p[2] & layerLockedFlag;
+    layer.name = QString::fromUtf8(
+        reinterpret_cast<const char *>(p + layerHeadSize), nameSize);
+    layerTable.append(layer);
+    p += layerHeadSize + nameSize;
+  }
+  return true;
+}
+
+int DocumentReader::itemCount() const { return int(count); }
+
+const QVector<DocumentLayer> &DocumentReader::layers() const {
+  return layerTable;
+}
+
+QRectF DocumentReader::itemBounds(int index) const {
+  const uchar *entry = data + indexOffset + qint64(index) * indexEntrySize;
+  return QRectF(QPointF(getF32(entry + 8), getF32(entry + 12)),
+                QPointF(getF32(entry + 16), getF32(entry + 20)));
+}
+
+QGraphicsItem *DocumentReader::createItem(int index) const {
+  DocumentItem item;
+  return readItem(index, &item) ? item.createGraphicsItem() : nullptr;
+}
+
+bool DocumentReader::readItem(int index, DocumentItem *item) const {
+  if (index < 0 || quint32(index) >= count)
+    return false;
+
+  const uchar *entry = data + indexOffset + qint64(index) * indexEntrySize;
+  const quint64 offset = getU64(entry);
+  if (!recordFits(offset, indexOffset))
+    return false;
+
+  if (!decodeRecord(data + offset, quint64(indexOffset) - offset, item))
+    return false;
+  item->sceneBounds = itemBounds(index);
+  return true;
+}
+
+quint32 DocumentReader::maxTag() const {
+  quint32 tag = 0;
+  for (quint32 i = 0; i < count; ++i) {
+    const uchar *entry = data + indexOffset + qint64(i) * indexEntrySize;
+    const quint64 offset = getU64(entry);
+    if (!recordFits(offset, indexOffset))
+      continue;
+    const quint32 stored = getU32(data + offset + 36);
+    if (stored < untaggedBase)
+      tag = qMax(tag, stored);
+  }
+  return tag;
+}
+
+bool DocumentReader::decodeRecord(const uchar *record, quint64 size,
+                                  DocumentItem *item) {
+  if (size < quint64(recordHeadSize))
+    return false;
+  const quint32 points = getU32(record + 32);
+  const quint64 available = size - recordHeadSize;
+  if (available / 8 < points)
+    return false;
+  const bool widthScales = record[17] & widthScalesFlag;
+  if (widthScales &&
+      (available - 8 * quint64(points)) / 4 < quint64(points / 3))
+    return false;
+
+  const quint8 kind = record[0];
+  if (kind == DocumentItem::Path) {
+    if (points == 0 || (points - 1) % 3 != 0)
+      return false;
+  } else if (kind == DocumentItem::Fill) {
+    if (points == 0 || points % 2 != 0)
+      return false;
+  } else if (!ShapeRegistry::forKind(kind) || points != 2) {
+    return false;
+  }
+
+  item->kind = DocumentItem::Kind(kind);
+  item->pen = QPen(QColor::fromRgba(getU32(record + 4)), getF32(record + 8),
+                   Qt::PenStyle(record[1]), Qt::PenCapStyle(record[2] << 4),
+                   Qt::PenJoinStyle(record[3] << 6));
+  item->brush = QBrush(QColor::fromRgba(getU32(record + 12)),
+                       Qt::BrushStyle(record[16]));
+  item->pos = getPoint(record + 20);
+  item->z = getF32(record + 28);
+  item->layer = getU16(record + 18);
+  item->tag = getU32(record + 36);
+
+  const uchar *p = record + recordHeadSize;
+  if (item->kind == DocumentItem::Fill) {
+    item->rects.reserve(int(points / 2));
+    for (const uchar *q = p; q < p + 8 * qint64(points); q += 16) {
+      item->rects.append(QRectF(getPoint(q), getPoint(q + 8)));
+    }
+    return true;
+  }
+  if (item->kind != DocumentItem::Path) {
+    item->extent = QLineF(getPoint(p), getPoint(p + 8));
+    return true;
+  }
+  item->start = getPoint(p);
+  item->segments.reserve(int((points - 1) / 3));
+  for (const uchar *q = p + 8; q < p + 8 * qint64(points); q += 24) {
+    StrokeItem::Segment segment;
+    segment.control1 = getPoint(q);
+    segment.control2 = getPoint(q + 8);
+    segment.end = getPoint(q + 16);
+    item->segments.append(segment);
+  }
+  if (widthScales) {
+    const uchar *scales = p + 8 * qint64(points);
+    for (int i = 0; i < item->segments.size(); ++i) {
+      item->segments[i].widthScale = getF32(scales + 4 * i);
+    }
+  }
+  return true;
+}
+
+QGraphicsItem *DocumentItem::createGraphicsItem() const {
+  QGraphicsItem *item = nullptr;
+  if (kind == Path) {
+    item = new StrokeItem(start, segments, pen);
+  } else if (kind == Fill) {
+    item = new FillItem(rects, brush);
+  } else if (const ShapeTool *shape = ShapeRegistry::forKind(kind)) {
+    item = shape->create(*this);
+  }
+  if (!item)
+    return nullptr;
+
+  item->setPos(pos);
+  item->setZValue(z);
+  if (tag)
+    item->setData(tagKey, tag);
+  return item;
+}
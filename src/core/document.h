@@ -0,0 +1,157 @@
+// document.h
+#ifndef DOCUMENT_H
+#define DOCUMENT_H
+
+#include "stroke_item.h"
+#include <QBrush>
+#include <QFile>
+#include <QGraphicsItem>
+#include <QLineF>
+#include <QList>
+#include <QPen>
+#include <QRectF>
+#include <QString>
+#include <QVector>
+
+// Binary board format (.fspd), little endian throughout:
+//
+//   header   magic "FSPD", u16 version, u16 reserved, u32 item count,
+//            u32 reserved, u64 offset of the index, u64 offset of the
+//            layer table or 0
+//   records  one per item, in stacking order, each a fixed 40-byte head
+//            followed by a raw array of float32 x/y point pairs and, for
+//            pressure strokes (flag in the head), a float32 width scale
+//            per segment; the head holds the u16 id of the item's layer
+//            and its u32 tag (0 when it has none). Fills store the
+//            top-left and bottom-right corner of each of their rectangles
+//   index    per item: u64 record offset and float32 scene bounds
+//   layers   u32 count, then per layer from the bottom up: u16 id,
+//            u8 flags (1 hidden, 2 locked), u8 reserved, u16 name length
+//            and the UTF-8 name
+//
+// The index comes last so the file can be written in one streaming pass.
+// Readers map the file and only decode the records they are asked for.
+// Files without a layer table, and readers that ignore it, keep every item
+// on one layer: the table and layer ids use fields that used to be zero.
+struct DocumentItem {
+  // Kinds other than Path and Fill belong to the shapes in ShapeRegistry;
+  // add-on shapes take unused values.
+  enum Kind : quint8 {
+    Rectangle = 1,
+    Ellipse = 2,
+    Line = 3,
+    Path = 4,
+    Fill = 5
+  };
+
+  // QGraphicsItem::data() key under which items keep their tag.
+  static const int tagKey = 0;
+
+  DocumentItem() : kind(Path), z(0), layer(0), tag(0), order(0) {}
+
+  // Builds a new, scene-less item with this geometry, pen, position, z and
+  // tag.
+  QGraphicsItem *createGraphicsItem() const;
+
+  Kind kind;
+  QPointF pos;
+  qreal z;
+  // LayerItem::id() of the layer holding the item
+  quint16 layer;
+  // Tells the item apart across snapshots, chunk files and the autosave
+  // journal; 0 until it gets one.
+  quint32 tag;
+  // LayerItem::stackOrder() of the item. Not stored: records keep their
+  // stacking order by where they are in the file.
+  quint64 order;
+  QPen pen;
+  QBrush brush;
+  QRectF sceneBounds;
+  // Shapes: the two points the shape spans, e.g. the corners of a
+  // rectangle or the ends of a line
+  QLineF extent;
+  // Path: a stroke start point and its cubic segments
+  QPointF start;
+  QVector<StrokeItem::Segment> segments;
+  // Fill: the filled area as disjoint rectangles
+  QVector<QRectF> rects;
+};
+
+struct DocumentLayer {
+  DocumentLayer() : id(0), hidden(false), locked(false) {}
+
+  quint16 id;
+  QString name;
+  bool hidden;
+  bool locked;
+};
+
+class DocumentWriter {
+public:
+  // Copies what is needed to save items. Must run on the GUI thread; stroke
+  // segments are shared rather than copied, so this is cheap.
+  static QVector<DocumentItem> snapshot(const QList<QGraphicsItem *> &items);
+  // Streams items to fileName in fixed-size chunks. Safe to call from a
+  // worker thread.
+  static bool write(const QString &fileName,
+                    const QVector<DocumentItem> &items,
+                    QString *errorString = nullptr);
+  // Also writes the layer table, bottom layer first. Without layers the
+  // file has no table.
+  static bool write(const QString &fileName,
+                    const QVector<DocumentItem> &items,
+                    const QVector<DocumentLayer> &layers,
+                    QString *errorString = nullptr);
+  // Streams the same bytes to an open device, e.g. a QBuffer.
+  static bool write(QIODevice *device, const QVector<DocumentItem> &items,
+                    const QVector<DocumentLayer> &layers,
+                    QString *errorString = nullptr);
+  // Appends the record of item, as stored in documents, to out.
+  static void encodeRecord(const DocumentItem &item, QByteArray &out);
+};
+
+class DocumentReader {
+public:
+  static const quint16 version = 1;
+  // Loading a document tags records stored without one with this plus
+  // their index, so every item of a file can be told apart.
+  static const quint32 untaggedBase = 0x80000000u;
+
+  explicit DocumentReader(const QString &fileName);
+  // Reads a document held in memory, e.g. one received over the network.
+  explicit DocumentReader(const QByteArray &document);
+  ~DocumentReader();
+
+  // Maps the file, if any, and validates the header and index; no record is
+  // decoded.
+  bool open(QString *errorString = nullptr);
+  int itemCount() const;
+  // The layer table, bottom layer first; empty for files without one.
+  const QVector<DocumentLayer> &layers() const;
+  QRectF itemBounds(int index) const;
+  // Decodes one record into a new, scene-less item, or nullptr if the
+  // record is damaged.
+  QGraphicsItem *createItem(int index) const;
+  // Decodes one record without building an item; false if it is damaged.
+  bool readItem(int index, DocumentItem *item) const;
+  // Largest tag below untaggedBase any record carries, or 0; reads only
+  // the record heads.
+  quint32 maxTag() const;
+  // Decodes the record at the start of size bytes; sceneBounds is left
+  // alone. False if the record is damaged or does not fit.
+  static bool decodeRecord(const uchar *record, quint64 size,
+                           DocumentItem *item);
+
+private:
+  bool readLayers(qint64 offset);
+
+  QFile file;
+  QByteArray bytes;
+  const uchar *data;
+  qint64 dataSize;
+  quint32 count;
+  qint64 indexOffset;
+  QVector<DocumentLayer> layerTable;
+};
+
+#endif // DOCUMENT_H
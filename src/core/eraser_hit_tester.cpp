@@ -0,0 +1,388 @@
+// eraser_hit_tester.cpp
+#include "eraser_hit_tester.h"
+#include "fill_item.h"
+#include "geometry_kernels.h"
+#include "shape_registry.h"
+#include "stroke_batch.h"
+#include <QGraphicsPathItem>
+#include <QLineF>
+#include <QPainterPathStroker>
+#include <QtMath>
+#include <algorithm>
+
+namespace {
+// Maximum distance in pixels between the flattened polyline and the curve
+// it approximates, measured along the control polygon.
+const qreal flatness = 2.0;
+const int maxStepsPerSegment = 32;
+const int edgesPerBlock = 16;
+
+qreal squaredDistanceToSegment(const QPointF &point, const QPointF &a,
+                               const QPointF &b) {
+  const qreal dx = b.x() - a.x();
+  const qreal dy = b.y() - a.y();
+  const qreal px = point.x() - a.x();
+  const qreal py = point.y() - a.y();
+  const qreal lengthSquared = dx * dx + dy * dy;
+
+  qreal t = 0.0;
+  if (lengthSquared > 0.0) {
+    t = qBound<qreal>(0.0, (px * dx + py * dy) / lengthSquared, 1.0);
+  }
+  const qreal ex = px - t * dx;
+  const qreal ey = py - t * dy;
+  return ex * ex + ey * ey;
+}
+
+qreal penHalfWidth(const QPen &pen) {
+  // Width 0 is a cosmetic one-pixel pen.
+  return qMax<qreal>(pen.widthF() / 2.0, 0.5);
+}
+
+// Pressure strokes are tested at their widest point.
+qreal strokeHalfWidth(QPen pen, qreal widthScale) {
+  pen.setWidthF(pen.widthF() * widthScale);
+  return penHalfWidth(pen);
+}
+
+// Whether one of the polyline's edges first to last - 1 passes within
+// reach of center.
+bool blockHits(const EraserHitTester::Polyline &polyline, int first,
+               int last, const QPointF &center, qreal reachSquared) {
+  float distances[edgesPerBlock];
+  GeometryKernels::squaredDistances(polyline.xs.constData() + first,
+                                    polyline.ys.constData() + first,
+                                    last - first, center, distances);
+  for (int i = 0; i < last - first; ++i) {
+    if (distances[i] <= reachSquared)
+      return true;
+  }
+  return false;
+}
+
+qreal squaredDistanceToPoint(const QPointF &center, float x, float y) {
+  const qreal dx = center.x() - x;
+  const qreal dy = center.y() - y;
+  return dx * dx + dy * dy;
+}
+} // namespace
+
+bool EraserHitTester::hits(QGraphicsItem *item, const QPointF &scenePos,
+                           qreal radius) {
+  const Entry &entry = entryFor(item);
+  const QPointF center = item->mapFromScene(scenePos);
+
+  if (entry.useStroker) {
+    QPainterPath eraserPath;
+    eraserPath.addEllipse(center, radius, radius);
+    QPainterPathStroker stroker;
+    stroker.setWidth(1);
+    return eraserPath.intersects(stroker.createStroke(item->shape()));
+  }
+
+  const qreal reach = radius + entry.halfWidth;
+  for (const Polyline &polyline : entry.polylines) {
+    if (polylineHits(polyline, center, reach))
+      return true;
+  }
+  for (const QRectF &area : entry.areas) {
+    const qreal dx = qMax<qreal>(
+        0.0, qMax(area.left() - center.x(), center.x() - area.right()));
+    const qreal dy = qMax<qreal>(
+        0.0, qMax(area.top() - center.y(), center.y() - area.bottom()));
+    if (dx * dx + dy * dy <= reach * reach)
+      return true;
+  }
+  return false;
+}
+
+bool EraserHitTester::splitStroke(StrokeItem *stroke, const QPointF &scenePos,
+                                  qreal radius, QList<StrokeItem *> &pieces) {
+  const Entry &entry = entryFor(stroke);
+  if (entry.polylines.isEmpty())
+    return false;
+
+  // Copies share data with the cache; the entry itself may move once the
+  // pieces are seeded below.
+  const Polyline polyline = entry.polylines.first();
+  const qreal halfWidth = entry.halfWidth;
+  const QPointF center = stroke->mapFromScene(scenePos);
+  const qreal reach = radius + halfWidth;
+  const qreal reachSquared = reach * reach;
+  const int pointCount = int(polyline.xs.size());
+
+  if (pointCount == 1) {
+    return squaredDistanceToPoint(center, polyline.xs.at(0),
+                                  polyline.ys.at(0)) <= reachSquared;
+  }
+
+  // Source segments touched by the eraser, in ascending order.
+  QVector<int> hitSegments;
+  float distances[edgesPerBlock];
+  for (int block = 0; block < polyline.blockBounds.size(); ++block) {
+    const QRectF &box = polyline.blockBounds.at(block);
+    if (center.x() < box.left() - reach || center.x() > box.right() + reach ||
+        center.y() < box.top() - reach || center.y() > box.bottom() + reach)
+      continue;
+
+    const int first = block * edgesPerBlock;
+    const int last = qMin(first + edgesPerBlock, pointCount - 1);
+    GeometryKernels::squaredDistances(polyline.xs.constData() + first,
+                                      polyline.ys.constData() + first,
+                                      last - first, center, distances);
+    for (int i = first; i < last; ++i) {
+      if (distances[i - first] > reachSquared)
+        continue;
+      const int segment = polyline.sourceSegments.at(i);
+      if (hitSegments.isEmpty() || hitSegments.last() != segment) {
+        hitSegments.append(segment);
+      }
+    }
+  }
+
+  if (hitSegments.isEmpty())
+    return false;
+
+  const QVector<StrokeItem::Segment> &segments = stroke->segments();
+  int first = 0;
+  for (int k = 0; k <= hitSegments.size(); ++k) {
+    const int last =
+        k < hitSegments.size() ? hitSegments.at(k) : int(segments.size());
+    if (last > first) {
+      const QPointF start =
+          first == 0 ? stroke->startPoint() : segments.at(first - 1).end;
+      StrokeItem *piece = new StrokeItem(
+          start, segments.mid(first, last - first), stroke->pen());
+      piece->setFlags(stroke->flags());
+      piece->setPos(stroke->pos());
+      piece->setZValue(stroke->zValue());
+      seedPiece(piece, polyline, halfWidth, first, last);
+      pieces.append(piece);
+    }
+    first = last + 1;
+  }
+  return true;
+}
+
+const QVector<EraserHitTester::Polyline> &
+EraserHitTester::polylines(QGraphicsItem *item) {
+  return entryFor(item).polylines;
+}
+
+qreal EraserHitTester::halfPenWidth(QGraphicsItem *item) {
+  return entryFor(item).halfWidth;
+}
+
+void EraserHitTester::forget(QGraphicsItem *item) { cache.remove(item); }
+
+void EraserHitTester::clear() { cache.clear(); }
+
+qreal EraserHitTester::distanceToSegment(const QPointF &point,
+                                         const QPointF &a, const QPointF &b) {
+  return qSqrt(squaredDistanceToSegment(point, a, b));
+}
+
+bool EraserHitTester::polylineHits(const Polyline &polyline,
+                                   const QPointF &center, qreal reach) {
+  const int pointCount = int(polyline.xs.size());
+  const qreal reachSquared = reach * reach;
+
+  if (pointCount == 1) {
+    return squaredDistanceToPoint(center, polyline.xs.at(0),
+                                  polyline.ys.at(0)) <= reachSquared;
+  }
+
+  for (int block = 0; block < polyline.blockBounds.size(); ++block) {
+    const QRectF &box = polyline.blockBounds.at(block);
+    if (center.x() < box.left() - reach || center.x() > box.right() + reach ||
+        center.y() < box.top() - reach || center.y() > box.bottom() + reach)
+      continue;
+
+    const int first = block * edgesPerBlock;
+    if (blockHits(polyline, first, qMin(first + edgesPerBlock, pointCount - 1),
+                  center, reachSquared))
+      return true;
+  }
+  return false;
+}
+
+EraserHitTester::Entry EraserHitTester::prepare(QGraphicsItem *item) {
+  Entry entry;
+  stamp(item, entry);
+  buildEntry(item, entry);
+  return entry;
+}
+
+void EraserHitTester::adopt(QGraphicsItem *item, const Entry &entry) {
+  cache.insert(item, entry);
+}
+
+const EraserHitTester::Entry &EraserHitTester::entryFor(QGraphicsItem *item) {
+  Entry current;
+  stamp(item, current);
+
+  Entry &entry = cache[item];
+  if (entry.type != current.type || entry.revision != current.revision ||
+      entry.bounds != current.bounds) {
+    entry = current;
+    buildEntry(item, entry);
+  }
+  return entry;
+}
+
+void EraserHitTester::stamp(QGraphicsItem *item, Entry &entry) {
+  entry.type = item->type();
+  entry.bounds = item->boundingRect();
+  entry.revision = 0;
+  if (StrokeItem *stroke = dynamic_cast<StrokeItem *>(item)) {
+    entry.revision = stroke->revision();
+  }
+}
+
+void EraserHitTester::buildEntry(QGraphicsItem *item, Entry &entry) {
+  entry.polylines.clear();
+  entry.areas.clear();
+  entry.useStroker = false;
+  entry.halfWidth = 0;
+
+  if (auto strokeItem = dynamic_cast<StrokeItem *>(item)) {
+    entry.halfWidth = strokeHalfWidth(strokeItem->pen(),
+                                      strokeItem->maxWidthScale());
+    entry.polylines.append(
+        flattenStroke(strokeItem->startPoint(), strokeItem->segments()));
+  } else if (item->type() == StrokeBatchItem::Type) {
+    // One polyline per member, tested at the widest member's pen.
+    const StrokeBatchItem *batch = static_cast<StrokeBatchItem *>(item);
+    for (const StrokeBatchItem::Member &member : batch->members()) {
+      entry.halfWidth = qMax(entry.halfWidth,
+                             strokeHalfWidth(member.pen, member.widthScale));
+      entry.polylines.append(flattenStroke(member.start, member.segments));
+    }
+  } else if (const ShapeTool *shape =
+                 ShapeRegistry::forItemType(item->type())) {
+    entry.halfWidth = penHalfWidth(shape->itemPen(item));
+
+    for (const QPolygonF &polygon : shape->outline(item)) {
+      entry.polylines.append(polylineFor(polygon));
+    }
+  } else if (item->type() == FillItem::Type) {
+    entry.areas = static_cast<FillItem *>(item)->rects();
+  } else if (auto pathItem = dynamic_cast<QGraphicsPathItem *>(item)) {
+    entry.halfWidth = penHalfWidth(pathItem->pen());
+
+    for (const QPolygonF &polygon : pathItem->path().toSubpathPolygons()) {
+      entry.polylines.append(polylineFor(polygon));
+    }
+  } else {
+    // Anything else (text, pixmaps, custom items) keeps the exact but slow
+    // outline test against its shape.
+    entry.useStroker = true;
+  }
+}
+
+EraserHitTester::Polyline
+EraserHitTester::flattenStroke(const QPointF &start,
+                               const QVector<StrokeItem::Segment> &segments) {
+  // Step counts come first, so the points can be evaluated a whole segment
+  // at a time straight into their place.
+  Polyline polyline;
+  QVector<int> stepCounts;
+  stepCounts.reserve(segments.size());
+  QVector<int> &sources = polyline.sourceSegments;
+  QPointF from = start;
+  for (int i = 0; i < segments.size(); ++i) {
+    const StrokeItem::Segment &segment = segments.at(i);
+    const qreal hull = QLineF(from, segment.control1).length() +
+                       QLineF(segment.control1, segment.control2).length() +
+                       QLineF(segment.control2, segment.end).length();
+    const int steps = qBound(1, qCeil(hull / flatness), maxStepsPerSegment);
+    stepCounts.append(steps);
+    for (int step = 0; step < steps; ++step) {
+      sources.append(i);
+    }
+    from = segment.end;
+  }
+
+  polyline.xs.resize(sources.size() + 1);
+  polyline.ys.resize(sources.size() + 1);
+  float *x = polyline.xs.data();
+  float *y = polyline.ys.data();
+  *x++ = float(start.x());
+  *y++ = float(start.y());
+  from = start;
+  for (int i = 0; i < segments.size(); ++i) {
+    const StrokeItem::Segment &segment = segments.at(i);
+    const int steps = stepCounts.at(i);
+    GeometryKernels::evaluateCubic(from, segment.control1, segment.control2,
+                                   segment.end, steps, x, y);
+    x += steps;
+    y += steps;
+    from = segment.end;
+  }
+  finishPolyline(polyline);
+  return polyline;
+}
+
+void EraserHitTester::seedPiece(StrokeItem *piece, const Polyline &source,
+                                qreal halfWidth, int firstSegment,
+                                int lastSegment) {
+  // Edges are stored in source-segment order, so the piece's edges are one
+  // contiguous run of the original polyline.
+  const QVector<int> &sources = source.sourceSegments;
+  const int firstEdge = int(
+      std::lower_bound(sources.begin(), sources.end(), firstSegment) -
+      sources.begin());
+  const int lastEdge = int(
+      std::lower_bound(sources.begin(), sources.end(), lastSegment) -
+      sources.begin());
+
+  Entry &entry = cache[piece];
+  entry.type = piece->type();
+  entry.revision = piece->revision();
+  entry.bounds = piece->boundingRect();
+  entry.halfWidth = halfWidth;
+  entry.useStroker = false;
+  entry.polylines.clear();
+  entry.areas.clear();
+
+  Polyline polyline;
+  polyline.xs = source.xs.mid(firstEdge, lastEdge - firstEdge + 1);
+  polyline.ys = source.ys.mid(firstEdge, lastEdge - firstEdge + 1);
+  polyline.sourceSegments.reserve(lastEdge - firstEdge);
+  for (int i = firstEdge; i < lastEdge; ++i) {
+    polyline.sourceSegments.append(sources.at(i) - firstSegment);
+  }
+  finishPolyline(polyline);
+  entry.polylines.append(polyline);
+}
+
+EraserHitTester::Polyline
+EraserHitTester::polylineFor(const QPolygonF &polygon) {
+  Polyline polyline;
+  polyline.xs.reserve(polygon.size());
+  polyline.ys.reserve(polygon.size());
+  for (const QPointF &point : polygon) {
+    polyline.xs.append(float(point.x()));
+    polyline.ys.append(float(point.y()));
+  }
+  finishPolyline(polyline);
+  return polyline;
+}
+
+void EraserHitTester::finishPolyline(Polyline &polyline) {
+  const int pointCount = int(polyline.xs.size());
+  polyline.blockBounds.clear();
+  if (pointCount == 0)
+    return;
+
+  const int edgeCount = qMax(pointCount - 1, 1);
+  polyline.blockBounds.reserve((edgeCount + edgesPerBlock - 1) /
+                               edgesPerBlock);
+  for (int first = 0; first < edgeCount; first += edgesPerBlock) {
+    const int last = qMin(first + edgesPerBlock, pointCount - 1);
+    polyline.blockBounds.append(
+        GeometryKernels::bounds(polyline.xs.constData() + first,
+                                polyline.ys.constData() + first,
+                                last - first + 1));
+  }
+}
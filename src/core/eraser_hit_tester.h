@@ -0,0 +1,88 @@
+// eraser_hit_tester.h
+#ifndef ERASER_HIT_TESTER_H
+#define ERASER_HIT_TESTER_H
+
+#include "stroke_item.h"
+#include <QGraphicsItem>
+#include <QHash>
+#include <QList>
+#include <QPainterPath>
+#include <QPointF>
+#include <QPolygonF>
+#include <QRectF>
+#include <QVector>
+
+// Tests the round eraser against scene items. Each item is flattened once
+// into polylines in item coordinates, with bounding boxes per block of
+// segments, and kept until its geometry changes. A query then only runs the
+// point-to-segment distance test on segments whose block is in reach.
+// Flattening, block bounds and distances run on GeometryKernels.
+class EraserHitTester {
+public:
+  struct Polyline {
+    // Points as separate x and y coordinates.
+    QVector<float> xs;
+    QVector<float> ys;
+    // StrokeItem segment each polyline edge was flattened from, or empty for
+    // items that are not strokes.
+    QVector<int> sourceSegments;
+    QVector<QRectF> blockBounds;
+  };
+
+  // Cached outline of one item, valid while its type, revision and bounds
+  // stay the same.
+  struct Entry {
+    Entry() : type(-1), revision(0), halfWidth(0), useStroker(false) {}
+
+    int type;
+    quint64 revision;
+    QRectF bounds;
+    qreal halfWidth;
+    bool useStroker;
+    QVector<Polyline> polylines;
+    // Filled areas the eraser hits anywhere inside, not just at the edge.
+    QVector<QRectF> areas;
+  };
+
+  // Builds the entry for an item not shown yet, e.g. on a worker thread
+  // while importing; adopt() then hands it to the cache.
+  static Entry prepare(QGraphicsItem *item);
+  void adopt(QGraphicsItem *item, const Entry &entry);
+
+  // True when the eraser circle at scenePos touches the painted outline of
+  // item, taking the item's pen width into account.
+  bool hits(QGraphicsItem *item, const QPointF &scenePos, qreal radius);
+  // Cuts stroke where the eraser circle touches it. Returns false when the
+  // stroke is not hit; otherwise fills pieces with new, scene-less strokes
+  // for the surviving runs (possibly none). The pieces start out with their
+  // outline already cached, sliced from the original stroke's entry.
+  bool splitStroke(StrokeItem *stroke, const QPointF &scenePos, qreal radius,
+                   QList<StrokeItem *> &pieces);
+  // Cached flattened outline of item; empty when the item uses the fallback.
+  const QVector<Polyline> &polylines(QGraphicsItem *item);
+  // Half of the pen width the cached outline was built with.
+  qreal halfPenWidth(QGraphicsItem *item);
+
+  void forget(QGraphicsItem *item);
+  void clear();
+
+  static qreal distanceToSegment(const QPointF &point, const QPointF &a,
+                                 const QPointF &b);
+  static bool polylineHits(const Polyline &polyline, const QPointF &center,
+                           qreal reach);
+
+private:
+  const Entry &entryFor(QGraphicsItem *item);
+  static void stamp(QGraphicsItem *item, Entry &entry);
+  static void buildEntry(QGraphicsItem *item, Entry &entry);
+  static Polyline flattenStroke(const QPointF &start,
+                                const QVector<StrokeItem::Segment> &segments);
+  static Polyline polylineFor(const QPolygonF &polygon);
+  static void finishPolyline(Polyline &polyline);
+  void seedPiece(StrokeItem *piece, const Polyline &source, qreal halfWidth,
+                 int firstSegment, int lastSegment);
+
+  QHash<QGraphicsItem *, Entry> cache;
+};
+
+#endif // ERASER_HIT_TESTER_H
@@ -0,0 +1,68 @@
+// fill_item.cpp
+#include "fill_item.h"
+#include <QPainterPath>
+#include <QStyle>
+#include <QStyleOptionGraphicsItem>
+
+FillItem::FillItem(const QVector<QRectF> &rects, const QBrush &brush,
+                   QGraphicsItem *parent)
+    : QGraphicsItem(parent), rectList(rects), fillBrush(brush) {
+  setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+  for (const QRectF &rect : rectList) {
+    bounds |= rect;
+  }
+}
+
+const QVector<QRectF> &FillItem::rects() const { return rectList; }
+
+QBrush FillItem::brush() const { return fillBrush; }
+
+void FillItem::drawRects(QPainter *painter, const QVector<QRectF> &rects,
+                         const QRectF &clip) {
+  QVector<QRectF> visible;
+  visible.reserve(rects.size());
+  for (const QRectF &rect : rects) {
+    if (rect.intersects(clip))
+      visible.append(rect);
+  }
+  if (visible.isEmpty())
+    return;
+
+  painter->save();
+  painter->setRenderHint(QPainter::Antialiasing, false);
+  painter->setPen(Qt::NoPen);
+  painter->drawRects(visible.constData(), int(visible.size()));
+  painter->restore();
+}
+
+QRectF FillItem::boundingRect() const { return bounds; }
+
+QPainterPath FillItem::shape() const {
+  QPainterPath path;
+  for (const QRectF &rect : rectList) {
+    path.addRect(rect);
+  }
+  return path;
+}
+
+void FillItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
+                     QWidget *widget) {
+  Q_UNUSED(widget);
+
+  painter->setBrush(fillBrush);
+  drawRects(painter, rectList, option->exposedRect);
+
+  if (option->state & QStyle::State_Selected) {
+    const QColor fgcolor = option->palette.windowText().color();
+    const QColor bgcolor(fgcolor.red() > 127 ? 0 : 255,
+                         fgcolor.green() > 127 ? 0 : 255,
+                         fgcolor.blue() > 127 ? 0 : 255);
+    painter->setBrush(Qt::NoBrush);
+    painter->setPen(QPen(bgcolor, 0, Qt::SolidLine));
+    painter->drawRect(bounds);
+    painter->setPen(QPen(fgcolor, 0, Qt::DashLine));
+    painter->drawRect(bounds);
+  }
+}
+
+int FillItem::type() const { return Type; }
@@ -0,0 +1,41 @@
+// fill_item.h
+#ifndef FILL_ITEM_H
+#define FILL_ITEM_H
+
+#include <QBrush>
+#include <QGraphicsItem>
+#include <QPainter>
+#include <QRectF>
+#include <QVector>
+
+// Area painted by the fill tool: disjoint rectangles, as FloodFiller
+// collects them, in one brush and without an outline.
+class FillItem : public QGraphicsItem {
+public:
+  enum { Type = UserType + 4 };
+
+  FillItem(const QVector<QRectF> &rects, const QBrush &brush,
+           QGraphicsItem *parent = nullptr);
+
+  const QVector<QRectF> &rects() const;
+  QBrush brush() const;
+
+  // Paints the rectangles of rects that intersect clip with the painter's
+  // brush. Antialiasing is turned off so neighbouring rectangles meet
+  // without seams. Safe to call on any thread.
+  static void drawRects(QPainter *painter, const QVector<QRectF> &rects,
+                        const QRectF &clip);
+
+  QRectF boundingRect() const override;
+  QPainterPath shape() const override;
+  void paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
+             QWidget *widget = nullptr) override;
+  int type() const override;
+
+private:
+  QVector<QRectF> rectList;
+  QBrush fillBrush;
+  QRectF bounds;
+};
+
+#endif // FILL_ITEM_H
@@ -0,0 +1,410 @@
+// flood_filler.cpp
+#include "flood_filler.h"
+#include "raster_exporter.h"
+#include <QImage>
+#include <QPainter>
+#include <QRunnable>
+#include <QtMath>
+#include <cstring>
+
+namespace {
+const int tileSize = 256;
+
+// Fill mask values, one byte per pixel.
+const uchar blocked = 0;
+const uchar open = 1;
+const uchar filled = 2;
+
+// Tiles kept beyond those the last fill used, at 256 KiB each.
+const int maxCachedTiles = 192;
+
+void paintTile(QImage *tile, const QRectF &sceneRect, qreal scale,
+               const QColor &background, const QVector<DocumentItem> &items) {
+  tile->fill(background);
+  QPainter painter(tile);
+  painter.setRenderHint(QPainter::Antialiasing);
+  painter.scale(scale, scale);
+  painter.translate(-sceneRect.topLeft());
+  RasterExporter::paintItems(&painter, items, sceneRect);
+}
+
+// Marks the pixels of row whose channels all lie within tolerance of seed
+// as open. Free of branches, so compilers vectorize it.
+void matchRow(const QRgb *row, int width, QRgb seed, int tolerance,
+              uchar *out) {
+  const int red = qRed(seed);
+  const int green = qGreen(seed);
+  const int blue = qBlue(seed);
+  for (int x = 0; x < width; ++x) {
+    const QRgb pixel = row[x];
+    const int dr = qAbs(int((pixel >> 16) & 0xff) - red);
+    const int dg = qAbs(int((pixel >> 8) & 0xff) - green);
+    const int db = qAbs(int(pixel & 0xff) - blue);
+    out[x] = uchar(qMax(dr, qMax(dg, db)) <= tolerance);
+  }
+}
+
+// Paints one tile, unless it came from the cache or the driver already
+// did, and marks its pixels in the mask. Tiles never overlap, so they can
+// run side by side.
+class TileTask : public QRunnable {
+public:
+  TileTask(QImage *tile, uchar *mask, int maskStride, const QRectF &sceneRect,
+           qreal scale, const QColor &background,
+           const QVector<DocumentItem> &items, QRgb seed, int tolerance,
+           bool painted)
+      : tile(tile), mask(mask), maskStride(maskStride), sceneRect(sceneRect),
+        scale(scale), background(background), items(items), seed(seed),
+        tolerance(tolerance), painted(painted) {}
+
+  void run() override {
+    if (!painted)
+      paintTile(tile, sceneRect, scale, background, items);
+    // Cached tiles are shared with the filler; only read them.
+    const QImage &image = *tile;
+    for (int y = 0; y < image.height(); ++y) {
+      matchRow(reinterpret_cast<const QRgb *>(image.constScanLine(y)),
+               image.width(), seed, tolerance, mask + y * maskStride);
+    }
+  }
+
+private:
+  QImage *tile;
+  uchar *mask;
+  int maskStride;
+  QRectF sceneRect;
+  qreal scale;
+  QColor background;
+  const QVector<DocumentItem> &items;
+  QRgb seed;
+  int tolerance;
+  bool painted;
+};
+
+struct Span {
+  int y;
+  int left;
+  int right;
+};
+
+struct Box {
+  int left;
+  int top;
+  // exclusive
+  int right;
+  int bottom;
+};
+
+// Scanline fill of the open pixels connected to the seed; they become
+// filled. Returns the bounds of the filled pixels.
+Box fillMask(uchar *mask, int width, int height, int seedX, int seedY) {
+  Box bounds = {seedX, seedY, seedX + 1, seedY + 1};
+  QVector<Span> stack;
+  stack.append(Span{seedY, seedX, seedX});
+
+  while (!stack.isEmpty()) {
+    const Span span = stack.takeLast();
+    uchar *row = mask + qint64(span.y) * width;
+    int x = span.left;
+    while (x <= span.right) {
+      if (row[x] != open) {
+        ++x;
+        continue;
+      }
+      int left = x;
+      while (left > 0 && row[left - 1] == open) {
+        --left;
+      }
+      int right = x;
+      while (right + 1 < width && row[right + 1] == open) {
+        ++right;
+      }
+      std::memset(row + left, filled, size_t(right - left + 1));
+      bounds.left = qMin(bounds.left, left);
+      bounds.right = qMax(bounds.right, right + 1);
+      bounds.top = qMin(bounds.top, span.y);
+      bounds.bottom = qMax(bounds.bottom, span.y + 1);
+
+      if (span.y > 0)
+        stack.append(Span{span.y - 1, left, right});
+      if (span.y + 1 < height)
+        stack.append(Span{span.y + 1, left, right});
+      x = right + 2;
+    }
+  }
+  return bounds;
+}
+
+// Turns the filled pixels within bounds into rectangles, growing a
+// rectangle downwards while the rows below fill exactly the same span.
+QVector<Box> collectBoxes(const uchar *mask, int width, const Box &bounds) {
+  struct Run {
+    int left;
+    int right;
+    int box;
+  };
+
+  QVector<Box> boxes;
+  QVector<Run> previous;
+  QVector<Run> current;
+  for (int y = bounds.top; y < bounds.bottom; ++y) {
+    const uchar *row = mask + qint64(y) * width;
+    current.clear();
+    int above = 0;
+    int x = bounds.left;
+    while (x < bounds.right) {
+      if (row[x] != filled) {
+        ++x;
+        continue;
+      }
+      const int left = x;
+      while (x < bounds.right && row[x] == filled) {
+        ++x;
+      }
+      const int right = x;
+
+      while (above < previous.size() && previous.at(above).left < left) {
+        ++above;
+      }
+      int box;
+      if (above < previous.size() && previous.at(above).left == left &&
+          previous.at(above).right == right) {
+        box = previous.at(above).box;
+        boxes[box].bottom = y + 1;
+      } else {
+        box = boxes.size();
+        boxes.append(Box{left, y, right, y + 1});
+      }
+      current.append(Run{left, right, box});
+    }
+    previous.swap(current);
+  }
+  return boxes;
+}
+
+// Runs one fill and reports back to the filler on its own thread.
+class FillTask : public QRunnable {
+public:
+  typedef std::function<void(const QVector<QRectF> &,
+                             const QHash<quint64, QImage> &)>
+      Done;
+
+  FillTask(QThreadPool *tileThreads, const QRect &span,
+           const QHash<quint64, QImage> &cached,
+           const QVector<DocumentItem> &items, qreal scale,
+           const QColor &background, const QPointF &seed, int tolerance,
+           const Done &done)
+      : tileThreads(tileThreads), span(span), cached(cached), items(items),
+        scale(scale), background(background), seed(seed),
+        tolerance(tolerance), done(done) {}
+
+  void run() override {
+    QHash<quint64, QImage> rendered;
+    const QVector<QRectF> rects = fill(&rendered);
+    done(rects, rendered);
+  }
+
+  static quint64 key(int x, int y) {
+    return (quint64(quint32(x)) << 32) | quint64(quint32(y));
+  }
+
+private:
+  QVector<QRectF> fill(QHash<quint64, QImage> *rendered) {
+    const int width = span.width() * tileSize;
+    const int height = span.height() * tileSize;
+    const int seedX = qFloor(seed.x() * scale) - span.left() * tileSize;
+    const int seedY = qFloor(seed.y() * scale) - span.top() * tileSize;
+    if (seedX < 0 || seedX >= width || seedY < 0 || seedY >= height)
+      return QVector<QRectF>();
+
+    // Tiles in row order; missing ones are rendered into new images.
+    QVector<QImage> images;
+    QVector<bool> painted;
+    images.reserve(span.width() * span.height());
+    for (int y = span.top(); y <= span.bottom(); ++y) {
+      for (int x = span.left(); x <= span.right(); ++x) {
+        const auto found = cached.constFind(key(x, y));
+        const bool hit = found != cached.constEnd();
+        images.append(hit ? *found
+                          : QImage(tileSize, tileSize, QImage::Format_RGB32));
+        if (images.last().isNull())
+          return QVector<QRectF>();
+        painted.append(hit);
+      }
+    }
+    QVector<uchar> mask(width * height, blocked);
+
+    // The seed tile goes first: every tile compares against its color.
+    const int seedTile = seedY / tileSize * span.width() + seedX / tileSize;
+    if (!painted.at(seedTile)) {
+      paintTile(&images[seedTile], tileRect(seedTile), scale, background,
+                items);
+    }
+    const QRgb seedColor = reinterpret_cast<const QRgb *>(
+        images.at(seedTile).constScanLine(seedY % tileSize))[seedX % tileSize];
+
+    for (int i = 0; i < images.size(); ++i) {
+      const int left = i % span.width() * tileSize;
+      const int top = i / span.width() * tileSize;
+      tileThreads->start(new TileTask(
+          &images[i], mask.data() + qint64(top) * width + left, width,
+          tileRect(i), scale, background, items, seedColor, tolerance,
+          painted.at(i) || i == seedTile));
+    }
+    tileThreads->waitForDone();
+    for (int i = 0; i < images.size(); ++i) {
+      if (!painted.at(i)) {
+        rendered->insert(key(span.left() + i % span.width(),
+                             span.top() + i / span.width()),
+                         images.at(i));
+      }
+    }
+
+    const Box bounds = fillMask(mask.data(), width, height, seedX, seedY);
+    const QVector<Box> boxes = collectBoxes(mask.constData(), width, bounds);
+    const QPointF origin(span.left() * tileSize / scale,
+                         span.top() * tileSize / scale);
+    QVector<QRectF> rects;
+    rects.reserve(boxes.size());
+    for (const Box &box : boxes) {
+      rects.append(QRectF(origin.x() + box.left / scale,
+                          origin.y() + box.top / scale,
+                          (box.right - box.left) / scale,
+                          (box.bottom - box.top) / scale));
+    }
+    return rects;
+  }
+
+  // Scene rect of the tile at index in row order.
+  QRectF tileRect(int index) const {
+    const int x = span.left() + index % span.width();
+    const int y = span.top() + index / span.width();
+    return QRectF(x * tileSize / scale, y * tileSize / scale,
+                  tileSize / scale, tileSize / scale);
+  }
+
+  QThreadPool *tileThreads;
+  QRect span;
+  QHash<quint64, QImage> cached;
+  QVector<DocumentItem> items;
+  qreal scale;
+  QColor background;
+  QPointF seed;
+  int tolerance;
+  Done done;
+};
+} // namespace
+
+FloodFiller::FloodFiller(QObject *parent)
+    : QObject(parent), running(false), tileScale(0), allStale(false) {
+  driverThread.setMaxThreadCount(1);
+  connect(this, &FloodFiller::finished, this, [this]() { running = false; });
+}
+
+FloodFiller::~FloodFiller() { driverThread.waitForDone(); }
+
+FloodFiller::Key FloodFiller::key(int x, int y) { return FillTask::key(x, y); }
+
+QRect FloodFiller::tileSpan(const QRectF &rect) const {
+  const qreal size = tileSize / tileScale;
+  return QRect(QPoint(qFloor(rect.left() / size), qFloor(rect.top() / size)),
+               QPoint(qFloor(rect.right() / size),
+                      qFloor(rect.bottom() / size)));
+}
+
+bool FloodFiller::start(const QRectF &sourceRect, qreal scale,
+                        const QColor &background, const QPointF &seed,
+                        int tolerance, const Snapshot &snapshot) {
+  if (running || sourceRect.isEmpty() || scale <= 0)
+    return false;
+  if (scale != tileScale || background != tileBackground) {
+    tiles.clear();
+    tileScale = scale;
+    tileBackground = background;
+  }
+  const QRect span = tileSpan(sourceRect);
+
+  QHash<Key, QImage> cached;
+  QSet<Key> used;
+  QRectF missing;
+  const qreal size = tileSize / scale;
+  for (int y = span.top(); y <= span.bottom(); ++y) {
+    for (int x = span.left(); x <= span.right(); ++x) {
+      const Key tile = key(x, y);
+      used.insert(tile);
+      const auto found = tiles.constFind(tile);
+      if (found != tiles.constEnd())
+        cached.insert(tile, *found);
+      else
+        missing |= QRectF(x * size, y * size, size, size);
+    }
+  }
+
+  running = true;
+  staleTiles.clear();
+  allStale = false;
+  FloodFiller *target = this;
+  driverThread.start(new FillTask(
+      &tileThreads, span, cached,
+      missing.isEmpty() ? QVector<DocumentItem>() : snapshot(missing), scale,
+      background, seed, tolerance,
+      [target, used](const QVector<QRectF> &rects,
+                     const QHash<quint64, QImage> &rendered) {
+        QMetaObject::invokeMethod(
+            target,
+            [target, used, rects, rendered]() {
+              target->storeTiles(rendered, used);
+              emit target->finished(rects);
+            },
+            Qt::QueuedConnection);
+      }));
+  return true;
+}
+
+bool FloodFiller::isRunning() const { return running; }
+
+void FloodFiller::invalidate(const QRectF &rect) {
+  if ((tiles.isEmpty() && !running) || tileScale <= 0)
+    return;
+  // Antialiasing reaches a pixel past an item's bounds.
+  const qreal pixel = 1.0 / tileScale;
+  const QRect span = tileSpan(rect.adjusted(-pixel, -pixel, pixel, pixel));
+  if (qint64(span.width()) * span.height() > maxCachedTiles * 4) {
+    invalidateAll();
+    return;
+  }
+  for (int y = span.top(); y <= span.bottom(); ++y) {
+    for (int x = span.left(); x <= span.right(); ++x) {
+      tiles.remove(key(x, y));
+      if (running)
+        staleTiles.insert(key(x, y));
+    }
+  }
+}
+
+void FloodFiller::invalidateAll() {
+  tiles.clear();
+  if (running)
+    allStale = true;
+}
+
+void FloodFiller::storeTiles(const QHash<Key, QImage> &rendered,
+                             const QSet<Key> &used) {
+  if (!allStale) {
+    for (auto it = rendered.constBegin(); it != rendered.constEnd(); ++it) {
+      if (!staleTiles.contains(it.key()))
+        tiles.insert(it.key(), it.value());
+    }
+  }
+  staleTiles.clear();
+  allStale = false;
+  if (tiles.size() <= maxCachedTiles + used.size())
+    return;
+  // Keep what the view needs; anything else is drawn again when it is.
+  for (auto it = tiles.begin(); it != tiles.end();) {
+    if (used.contains(it.key()))
+      ++it;
+    else
+      it = tiles.erase(it);
+  }
+}
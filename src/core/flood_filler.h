@@ -0,0 +1,79 @@
+// flood_filler.h
+#ifndef FLOOD_FILLER_H
+#define FLOOD_FILLER_H
+
+#include "document.h"
+#include <QColor>
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QObject>
+#include <QPointF>
+#include <QRect>
+#include <QRectF>
+#include <QSet>
+#include <QThreadPool>
+#include <QVector>
+#include <functional>
+
+// Flood fills the board as it is painted. The board is kept as a raster of
+// 256 px tiles on a grid anchored at the scene origin, at the resolution of
+// the last fill; tiles are rendered on a pool of threads when a fill first
+// needs them and reused until the scene changes under them. The tiles mark
+// the pixels within tolerance of the seed pixel, and a scanline fill from
+// the seed collects the connected area as rectangles: one per run of rows
+// whose filled span is the same. Only snapshots of items under missing
+// tiles are taken on the GUI thread.
+class FloodFiller : public QObject {
+  Q_OBJECT
+
+public:
+  // Takes a DocumentWriter::snapshot() of the items as painted within a
+  // scene rect.
+  typedef std::function<QVector<DocumentItem>(const QRectF &)> Snapshot;
+
+  explicit FloodFiller(QObject *parent = nullptr);
+  ~FloodFiller();
+
+  // Fills from seed within the tiles covering sourceRect (both scene
+  // coordinates), at scale pixels per scene unit. tolerance is the largest
+  // difference from the seed color, 0-255 per channel, that still fills.
+  // snapshot is called once, right away, for the tiles that have to be
+  // rendered. Returns false when a fill is already running.
+  bool start(const QRectF &sourceRect, qreal scale, const QColor &background,
+             const QPointF &seed, int tolerance, const Snapshot &snapshot);
+  bool isRunning() const;
+
+  // Drops the tiles under rect, in scene coordinates, e.g. for every area
+  // QGraphicsScene::changed() reports.
+  void invalidate(const QRectF &rect);
+  void invalidateAll();
+
+signals:
+  // The filled area in scene coordinates; empty when seed was outside
+  // sourceRect.
+  void finished(const QVector<QRectF> &rects);
+
+private:
+  typedef quint64 Key;
+
+  static Key key(int x, int y);
+  // Tile coordinates covering rect at the cache's scale.
+  QRect tileSpan(const QRectF &rect) const;
+  // Takes tiles rendered by a fill, unless they went stale meanwhile.
+  void storeTiles(const QHash<Key, QImage> &rendered,
+                  const QSet<Key> &used);
+
+  QThreadPool driverThread;
+  QThreadPool tileThreads;
+  bool running;
+  // Tiles at tileScale over tileBackground; GUI thread only.
+  QHash<Key, QImage> tiles;
+  qreal tileScale;
+  QColor tileBackground;
+  // Invalidated while a fill was rendering them.
+  QSet<Key> staleTiles;
+  bool allStale;
+};
+
+#endif // FLOOD_FILLER_H
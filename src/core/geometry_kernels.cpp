@@ -0,0 +1,473 @@
+// geometry_kernels.cpp
+#include "geometry_kernels.h"
+#include <QByteArray>
+#include <cfloat>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GEOMETRY_KERNELS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC compiles AVX2 intrinsics anywhere; they only run where supported.
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define GEOMETRY_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+// The cubic as x0, y0, x1, y1, x2, y2, x3, y3.
+typedef void (*CubicKernel)(const float *controls, int steps, float *x,
+                            float *y);
+// Writes left, top, right and bottom to box.
+typedef void (*BoundsKernel)(const float *x, const float *y, int count,
+                             float *box);
+typedef void (*DistanceKernel)(const float *x, const float *y, int count,
+                               float px, float py, float *out);
+
+struct Kernels {
+  GeometryKernels::InstructionSet set;
+  CubicKernel cubic;
+  BoundsKernel bounds;
+  DistanceKernel distances;
+};
+
+// Scalar versions, also finishing what the vector loops leave over. The
+// vector versions use the same operations in the same order.
+
+void cubicFrom(const float *c, int steps, int first, float *x, float *y) {
+  const float step = 1.0f / float(steps);
+  for (int k = first; k < steps; ++k) {
+    const float t = float(k + 1) * step;
+    const float u = 1.0f - t;
+    const float uu = u * u;
+    const float tt = t * t;
+    const float b0 = uu * u;
+    const float b1 = 3.0f * uu * t;
+    const float b2 = 3.0f * u * tt;
+    const float b3 = tt * t;
+    x[k] = b0 * c[0] + b1 * c[2] + b2 * c[4] + b3 * c[6];
+    y[k] = b0 * c[1] + b1 * c[3] + b2 * c[5] + b3 * c[7];
+  }
+}
+
+void cubicScalar(const float *c, int steps, float *x, float *y) {
+  cubicFrom(c, steps, 0, x, y);
+}
+
+void boundsFrom(const float *x, const float *y, int count, int first,
+                float *box) {
+  for (int i = first; i < count; ++i) {
+    box[0] = x[i] < box[0] ? x[i] : box[0];
+    box[1] = y[i] < box[1] ? y[i] : box[1];
+    box[2] = x[i] > box[2] ? x[i] : box[2];
+    box[3] = y[i] > box[3] ? y[i] : box[3];
+  }
+}
+
+void boundsScalar(const float *x, const float *y, int count, float *box) {
+  box[0] = box[2] = x[0];
+  box[1] = box[3] = y[0];
+  boundsFrom(x, y, count, 1, box);
+}
+
+// The edge parameter of the closest point is clamped to [0, 1]; dividing
+// by at least FLT_MIN keeps degenerate edges at their first point without
+// a branch.
+void distancesFrom(const float *x, const float *y, int count, float px,
+                   float py, int first, float *out) {
+  for (int i = first; i < count; ++i) {
+    const float dx = x[i + 1] - x[i];
+    const float dy = y[i + 1] - y[i];
+    const float ox = px - x[i];
+    const float oy = py - y[i];
+    const float length = dx * dx + dy * dy;
+    float t = (ox * dx + oy * dy) / (length > FLT_MIN ? length : FLT_MIN);
+    t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+    const float ex = ox - t * dx;
+    const float ey = oy - t * dy;
+    out[i] = ex * ex + ey * ey;
+  }
+}
+
+void distancesScalar(const float *x, const float *y, int count, float px,
+                     float py, float *out) {
+  distancesFrom(x, y, count, px, py, 0, out);
+}
+
+#if defined(GEOMETRY_KERNELS_X86)
+void cubicSse2(const float *c, int steps, float *x, float *y) {
+  const __m128 step = _mm_set1_ps(1.0f / float(steps));
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 three = _mm_set1_ps(3.0f);
+  const __m128 lanes = _mm_set1_ps(4.0f);
+  __m128 index = _mm_setr_ps(1.0f, 2.0f, 3.0f, 4.0f);
+  int k = 0;
+  for (; k + 4 <= steps; k += 4) {
+    const __m128 t = _mm_mul_ps(index, step);
+    const __m128 u = _mm_sub_ps(one, t);
+    const __m128 uu = _mm_mul_ps(u, u);
+    const __m128 tt = _mm_mul_ps(t, t);
+    const __m128 b0 = _mm_mul_ps(uu, u);
+    const __m128 b1 = _mm_mul_ps(_mm_mul_ps(three, uu), t);
+    const __m128 b2 = _mm_mul_ps(_mm_mul_ps(three, u), tt);
+    const __m128 b3 = _mm_mul_ps(tt, t);
+    for (int axis = 0; axis < 2; ++axis) {
+      const __m128 sum = _mm_add_ps(
+          _mm_add_ps(
+              _mm_add_ps(_mm_mul_ps(b0, _mm_set1_ps(c[axis])),
+                         _mm_mul_ps(b1, _mm_set1_ps(c[2 + axis]))),
+              _mm_mul_ps(b2, _mm_set1_ps(c[4 + axis]))),
+          _mm_mul_ps(b3, _mm_set1_ps(c[6 + axis])));
+      _mm_storeu_ps((axis ? y : x) + k, sum);
+    }
+    index = _mm_add_ps(index, lanes);
+  }
+  cubicFrom(c, steps, k, x, y);
+}
+
+void boundsSse2(const float *x, const float *y, int count, float *box) {
+  if (count < 4) {
+    boundsScalar(x, y, count, box);
+    return;
+  }
+  __m128 left = _mm_loadu_ps(x);
+  __m128 right = left;
+  __m128 top = _mm_loadu_ps(y);
+  __m128 bottom = top;
+  int i = 4;
+  for (; i + 4 <= count; i += 4) {
+    const __m128 vx = _mm_loadu_ps(x + i);
+    const __m128 vy = _mm_loadu_ps(y + i);
+    left = _mm_min_ps(left, vx);
+    right = _mm_max_ps(right, vx);
+    top = _mm_min_ps(top, vy);
+    bottom = _mm_max_ps(bottom, vy);
+  }
+  float lanes[4][4];
+  _mm_storeu_ps(lanes[0], left);
+  _mm_storeu_ps(lanes[1], top);
+  _mm_storeu_ps(lanes[2], right);
+  _mm_storeu_ps(lanes[3], bottom);
+  for (int side = 0; side < 4; ++side) {
+    box[side] = lanes[side][0];
+    for (int lane = 1; lane < 4; ++lane) {
+      const float value = lanes[side][lane];
+      box[side] = side < 2 ? (value < box[side] ? value : box[side])
+                           : (value > box[side] ? value : box[side]);
+    }
+  }
+  boundsFrom(x, y, count, i, box);
+}
+
+void distancesSse2(const float *x, const float *y, int count, float px,
+                   float py, float *out) {
+  const __m128 qx = _mm_set1_ps(px);
+  const __m128 qy = _mm_set1_ps(py);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 tiny = _mm_set1_ps(FLT_MIN);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128 ax = _mm_loadu_ps(x + i);
+    const __m128 ay = _mm_loadu_ps(y + i);
+    const __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i + 1), ax);
+    const __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i + 1), ay);
+    const __m128 ox = _mm_sub_ps(qx, ax);
+    const __m128 oy = _mm_sub_ps(qy, ay);
+    const __m128 length =
+        _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+    __m128 t = _mm_div_ps(_mm_add_ps(_mm_mul_ps(ox, dx), _mm_mul_ps(oy, dy)),
+                          _mm_max_ps(length, tiny));
+    t = _mm_min_ps(_mm_max_ps(t, zero), one);
+    const __m128 ex = _mm_sub_ps(ox, _mm_mul_ps(t, dx));
+    const __m128 ey = _mm_sub_ps(oy, _mm_mul_ps(t, dy));
+    _mm_storeu_ps(out + i,
+                  _mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)));
+  }
+  distancesFrom(x, y, count, px, py, i, out);
+}
+
+AVX2_TARGET void cubicAvx2(const float *c, int steps, float *x, float *y) {
+  const __m256 step = _mm256_set1_ps(1.0f / float(steps));
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 three = _mm256_set1_ps(3.0f);
+  const __m256 lanes = _mm256_set1_ps(8.0f);
+  __m256 index =
+      _mm256_setr_ps(1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f);
+  int k = 0;
+  for (; k + 8 <= steps; k += 8) {
+    const __m256 t = _mm256_mul_ps(index, step);
+    const __m256 u = _mm256_sub_ps(one, t);
+    const __m256 uu = _mm256_mul_ps(u, u);
+    const __m256 tt = _mm256_mul_ps(t, t);
+    const __m256 b0 = _mm256_mul_ps(uu, u);
+    const __m256 b1 = _mm256_mul_ps(_mm256_mul_ps(three, uu), t);
+    const __m256 b2 = _mm256_mul_ps(_mm256_mul_ps(three, u), tt);
+    const __m256 b3 = _mm256_mul_ps(tt, t);
+    for (int axis = 0; axis < 2; ++axis) {
+      const __m256 sum = _mm256_add_ps(
+          _mm256_add_ps(
+              _mm256_add_ps(_mm256_mul_ps(b0, _mm256_set1_ps(c[axis])),
+                            _mm256_mul_ps(b1, _mm256_set1_ps(c[2 + axis]))),
+              _mm256_mul_ps(b2, _mm256_set1_ps(c[4 + axis]))),
+          _mm256_mul_ps(b3, _mm256_set1_ps(c[6 + axis])));
+      _mm256_storeu_ps((axis ? y : x) + k, sum);
+    }
+    index = _mm256_add_ps(index, lanes);
+  }
+  cubicFrom(c, steps, k, x, y);
+}
+
+AVX2_TARGET void boundsAvx2(const float *x, const float *y, int count,
+                            float *box) {
+  if (count < 8) {
+    boundsSse2(x, y, count, box);
+    return;
+  }
+  __m256 left = _mm256_loadu_ps(x);
+  __m256 right = left;
+  __m256 top = _mm256_loadu_ps(y);
+  __m256 bottom = top;
+  int i = 8;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 vx = _mm256_loadu_ps(x + i);
+    const __m256 vy = _mm256_loadu_ps(y + i);
+    left = _mm256_min_ps(left, vx);
+    right = _mm256_max_ps(right, vx);
+    top = _mm256_min_ps(top, vy);
+    bottom = _mm256_max_ps(bottom, vy);
+  }
+  float lanes[4][8];
+  _mm256_storeu_ps(lanes[0], left);
+  _mm256_storeu_ps(lanes[1], top);
+  _mm256_storeu_ps(lanes[2], right);
+  _mm256_storeu_ps(lanes[3], bottom);
+  for (int side = 0; side < 4; ++side) {
+    box[side] = lanes[side][0];
+    for (int lane = 1; lane < 8; ++lane) {
+      const float value = lanes[side][lane];
+      box[side] = side < 2 ? (value < box[side] ? value : box[side])
+                           : (value > box[side] ? value : box[side]);
+    }
+  }
+  boundsFrom(x, y, count, i, box);
+}
+
+AVX2_TARGET void distancesAvx2(const float *x, const float *y, int count,
+                               float px, float py, float *out) {
+  const __m256 qx = _mm256_set1_ps(px);
+  const __m256 qy = _mm256_set1_ps(py);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 tiny = _mm256_set1_ps(FLT_MIN);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256 ax = _mm256_loadu_ps(x + i);
+    const __m256 ay = _mm256_loadu_ps(y + i);
+    const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i + 1), ax);
+    const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i + 1), ay);
+    const __m256 ox = _mm256_sub_ps(qx, ax);
+    const __m256 oy = _mm256_sub_ps(qy, ay);
+    const __m256 length =
+        _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+    __m256 t = _mm256_div_ps(
+        _mm256_add_ps(_mm256_mul_ps(ox, dx), _mm256_mul_ps(oy, dy)),
+        _mm256_max_ps(length, tiny));
+    t = _mm256_min_ps(_mm256_max_ps(t, zero), one);
+    const __m256 ex = _mm256_sub_ps(ox, _mm256_mul_ps(t, dx));
+    const __m256 ey = _mm256_sub_ps(oy, _mm256_mul_ps(t, dy));
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(ex, ex),
+                                            _mm256_mul_ps(ey, ey)));
+  }
+  // An SSE2 pass takes four of the up to seven edges left.
+  if (i < count)
+    distancesSse2(x + i, y + i, count - i, px, py, out + i);
+}
+
+bool cpuHasAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  // The OS has to save the AVX registers too.
+  const bool osSavesAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+                          (_xgetbv(0) & 0x6) == 0x6;
+  __cpuidex(info, 7, 0);
+  return osSavesAvx && (info[1] & (1 << 5));
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#elif defined(GEOMETRY_KERNELS_NEON)
+void cubicNeon(const float *c, int steps, float *x, float *y) {
+  const float32x4_t step = vdupq_n_f32(1.0f / float(steps));
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  const float32x4_t three = vdupq_n_f32(3.0f);
+  const float32x4_t lanes = vdupq_n_f32(4.0f);
+  const float first[4] = {1.0f, 2.0f, 3.0f, 4.0f};
+  float32x4_t index = vld1q_f32(first);
+  int k = 0;
+  for (; k + 4 <= steps; k += 4) {
+    const float32x4_t t = vmulq_f32(index, step);
+    const float32x4_t u = vsubq_f32(one, t);
+    const float32x4_t uu = vmulq_f32(u, u);
+    const float32x4_t tt = vmulq_f32(t, t);
+    const float32x4_t b0 = vmulq_f32(uu, u);
+    const float32x4_t b1 = vmulq_f32(vmulq_f32(three, uu), t);
+    const float32x4_t b2 = vmulq_f32(vmulq_f32(three, u), tt);
+    const float32x4_t b3 = vmulq_f32(tt, t);
+    for (int axis = 0; axis < 2; ++axis) {
+      const float32x4_t sum = vaddq_f32(
+          vaddq_f32(vaddq_f32(vmulq_f32(b0, vdupq_n_f32(c[axis])),
+                              vmulq_f32(b1, vdupq_n_f32(c[2 + axis]))),
+                    vmulq_f32(b2, vdupq_n_f32(c[4 + axis]))),
+          vmulq_f32(b3, vdupq_n_f32(c[6 + axis])));
+      vst1q_f32((axis ? y : x) + k, sum);
+    }
+    index = vaddq_f32(index, lanes);
+  }
+  cubicFrom(c, steps, k, x, y);
+}
+
+void boundsNeon(const float *x, const float *y, int count, float *box) {
+  if (count < 4) {
+    boundsScalar(x, y, count, box);
+    return;
+  }
+  float32x4_t left = vld1q_f32(x);
+  float32x4_t right = left;
+  float32x4_t top = vld1q_f32(y);
+  float32x4_t bottom = top;
+  int i = 4;
+  for (; i + 4 <= count; i += 4) {
+    const float32x4_t vx = vld1q_f32(x + i);
+    const float32x4_t vy = vld1q_f32(y + i);
+    left = vminq_f32(left, vx);
+    right = vmaxq_f32(right, vx);
+    top = vminq_f32(top, vy);
+    bottom = vmaxq_f32(bottom, vy);
+  }
+  box[0] = vminvq_f32(left);
+  box[1] = vminvq_f32(top);
+  box[2] = vmaxvq_f32(right);
+  box[3] = vmaxvq_f32(bottom);
+  boundsFrom(x, y, count, i, box);
+}
+
+void distancesNeon(const float *x, const float *y, int count, float px,
+                   float py, float *out) {
+  const float32x4_t qx = vdupq_n_f32(px);
+  const float32x4_t qy = vdupq_n_f32(py);
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  const float32x4_t tiny = vdupq_n_f32(FLT_MIN);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const float32x4_t ax = vld1q_f32(x + i);
+    const float32x4_t ay = vld1q_f32(y + i);
+    const float32x4_t dx = vsubq_f32(vld1q_f32(x + i + 1), ax);
+    const float32x4_t dy = vsubq_f32(vld1q_f32(y + i + 1), ay);
+    const float32x4_t ox = vsubq_f32(qx, ax);
+    const float32x4_t oy = vsubq_f32(qy, ay);
+    const float32x4_t length =
+        vaddq_f32(vmulq_f32(dx, dx), vmulq_f32(dy, dy));
+    float32x4_t t =
+        vdivq_f32(vaddq_f32(vmulq_f32(ox, dx), vmulq_f32(oy, dy)),
+                  vmaxq_f32(length, tiny));
+    t = vminq_f32(vmaxq_f32(t, zero), one);
+    const float32x4_t ex = vsubq_f32(ox, vmulq_f32(t, dx));
+    const float32x4_t ey = vsubq_f32(oy, vmulq_f32(t, dy));
+    vst1q_f32(out + i, vaddq_f32(vmulq_f32(ex, ex), vmulq_f32(ey, ey)));
+  }
+  distancesFrom(x, y, count, px, py, i, out);
+}
+#endif
+
+const Kernels scalarKernels = {GeometryKernels::Scalar, cubicScalar,
+                               boundsScalar, distancesScalar};
+#if defined(GEOMETRY_KERNELS_X86)
+const Kernels sse2Kernels = {GeometryKernels::Sse2, cubicSse2, boundsSse2,
+                             distancesSse2};
+const Kernels avx2Kernels = {GeometryKernels::Avx2, cubicAvx2, boundsAvx2,
+                             distancesAvx2};
+#elif defined(GEOMETRY_KERNELS_NEON)
+const Kernels neonKernels = {GeometryKernels::Neon, cubicNeon, boundsNeon,
+                             distancesNeon};
+#endif
+
+// The widest set the CPU runs, within the PENCIL_DRAW_SIMD cap if any.
+const Kernels &pickKernels() {
+  const QByteArray cap = qgetenv("PENCIL_DRAW_SIMD").toLower();
+  if (cap == "scalar")
+    return scalarKernels;
+#if defined(GEOMETRY_KERNELS_X86)
+  if (cap != "sse2" && cpuHasAvx2())
+    return avx2Kernels;
+  return sse2Kernels;
+#elif defined(GEOMETRY_KERNELS_NEON)
+  return neonKernels;
+#else
+  return scalarKernels;
+#endif
+}
+
+const Kernels &kernels() {
+  // Thread-safe initialization of function-local statics.
+  static const Kernels &picked = pickKernels();
+  return picked;
+}
+} // namespace
+
+GeometryKernels::InstructionSet GeometryKernels::instructionSet() {
+  return kernels().set;
+}
+
+const char *GeometryKernels::instructionSetName() {
+  switch (instructionSet()) {
+  case Sse2:
+    return "sse2";
+  case Avx2:
+    return "avx2";
+  case Neon:
+    return "neon";
+  case Scalar:
+    break;
+  }
+  return "scalar";
+}
+
+void GeometryKernels::evaluateCubic(const QPointF &p0, const QPointF &p1,
+                                    const QPointF &p2, const QPointF &p3,
+                                    int steps, float *x, float *y) {
+  if (steps <= 0)
+    return;
+  const float controls[8] = {float(p0.x()), float(p0.y()), float(p1.x()),
+                             float(p1.y()), float(p2.x()), float(p2.y()),
+                             float(p3.x()), float(p3.y())};
+  kernels().cubic(controls, steps, x, y);
+  // t = steps * (1 / steps) need not round to exactly 1.
+  x[steps - 1] = controls[6];
+  y[steps - 1] = controls[7];
+}
+
+QRectF GeometryKernels::bounds(const float *x, const float *y, int count) {
+  float box[4];
+  kernels().bounds(x, y, count, box);
+  return QRectF(QPointF(box[0], box[1]), QPointF(box[2], box[3]));
+}
+
+void GeometryKernels::squaredDistances(const float *x, const float *y,
+                                       int count, const QPointF &point,
+                                       float *out) {
+  if (count > 0)
+    kernels().distances(x, y, count, float(point.x()), float(point.y()),
+                        out);
+}
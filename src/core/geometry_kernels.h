@@ -0,0 +1,35 @@
+// geometry_kernels.h
+#ifndef GEOMETRY_KERNELS_H
+#define GEOMETRY_KERNELS_H
+
+#include <QPointF>
+#include <QRectF>
+
+// Batch geometry over points kept as separate float arrays of x and y
+// coordinates, the layout the eraser's outlines use. Every kernel has a
+// scalar version and SSE2 and AVX2 versions on x86 or a NEON one on ARM64;
+// the widest the CPU supports is picked on first use. Setting
+// PENCIL_DRAW_SIMD to scalar, sse2, avx2 or neon caps the choice, e.g. to
+// compare timings. Results agree up to float rounding. Pure functions; safe
+// to call on any thread.
+class GeometryKernels {
+public:
+  enum InstructionSet { Scalar, Sse2, Avx2, Neon };
+
+  static InstructionSet instructionSet();
+  static const char *instructionSetName();
+
+  // Writes the points of the cubic Bezier p0..p3 at t = 1/steps, 2/steps,
+  // ..., 1 to x and y, steps entries each. The last one is exactly p3.
+  static void evaluateCubic(const QPointF &p0, const QPointF &p1,
+                            const QPointF &p2, const QPointF &p3,
+                            int steps, float *x, float *y);
+  // Bounding rect of count points; count must be positive.
+  static QRectF bounds(const float *x, const float *y, int count);
+  // Writes the squared distance from point to each of the count edges
+  // between consecutive points to out; reads count + 1 points.
+  static void squaredDistances(const float *x, const float *y, int count,
+                               const QPointF &point, float *out);
+};
+
+#endif // GEOMETRY_KERNELS_H
@@ -0,0 +1,207 @@
+// gl_stroke_renderer.cpp
+#include "gl_stroke_renderer.h"
+
+#ifdef HAVE_OPENGL
+
+#include "stroke_item.h"
+#include <QMatrix4x4>
+#include <QOpenGLFunctions>
+#include <QPaintEngine>
+#include <QtMath>
+
+namespace {
+// Largest distance, in item units, between the curve and its tessellation.
+const qreal flatness = 0.5;
+const int maxStepsPerSegment = 32;
+// Strips thinner than this vanish between pixel centres.
+const qreal minWidth = 1.0;
+
+const char *const vertexShader = "attribute highp vec2 position;\n"
+                                 "uniform highp mat4 matrix;\n"
+                                 "void main() {\n"
+                                 "  gl_Position = matrix * vec4(position, "
+                                 "0.0, 1.0);\n"
+                                 "}\n";
+
+const char *const fragmentShader = "uniform lowp vec4 color;\n"
+                                   "void main() {\n"
+                                   "  gl_FragColor = color;\n"
+                                   "}\n";
+
+qreal distance(const QPointF &a, const QPointF &b) {
+  return qSqrt(QPointF::dotProduct(b - a, b - a));
+}
+} // namespace
+
+GlStrokeRenderer::GlStrokeRenderer() : initialized(false), usable(false) {}
+
+GlStrokeRenderer::~GlStrokeRenderer() {
+  purge();
+  for (Mesh *mesh : meshes) {
+    mesh->buffer.destroy();
+    delete mesh;
+  }
+}
+
+QHash<QOpenGLContext *, GlStrokeRenderer *> &GlStrokeRenderer::renderers() {
+  static QHash<QOpenGLContext *, GlStrokeRenderer *> instances;
+  return instances;
+}
+
+bool GlStrokeRenderer::draw(QPainter *painter, const StrokeItem *stroke) {
+  QPaintEngine *engine = painter->paintEngine();
+  if (!engine || engine->type() != QPaintEngine::OpenGL2)
+    return false;
+  QOpenGLContext *context = QOpenGLContext::currentContext();
+  if (!context)
+    return false;
+
+  GlStrokeRenderer *&renderer = renderers()[context];
+  if (!renderer)
+    renderer = new GlStrokeRenderer();
+  return renderer->drawStroke(painter, stroke);
+}
+
+void GlStrokeRenderer::forget(const StrokeItem *stroke) {
+  for (GlStrokeRenderer *renderer : renderers()) {
+    Mesh *mesh = renderer->meshes.take(stroke);
+    if (mesh)
+      renderer->retired.append(mesh);
+  }
+}
+
+void GlStrokeRenderer::releaseCurrentContext() {
+  delete renderers().take(QOpenGLContext::currentContext());
+}
+
+bool GlStrokeRenderer::initialize() {
+  if (initialized)
+    return usable;
+  initialized = true;
+  usable = program.addShaderFromSourceCode(QOpenGLShader::Vertex,
+                                           vertexShader) &&
+           program.addShaderFromSourceCode(QOpenGLShader::Fragment,
+                                           fragmentShader);
+  if (usable) {
+    program.bindAttributeLocation("position", 0);
+    usable = program.link();
+  }
+  return usable;
+}
+
+bool GlStrokeRenderer::drawStroke(QPainter *painter,
+                                  const StrokeItem *stroke) {
+  // Dashes and patterns need the QPainter stroker.
+  if (stroke->pen().style() != Qt::SolidLine ||
+      stroke->pen().brush().style() != Qt::SolidPattern)
+    return false;
+  if (!initialize())
+    return false;
+  purge();
+
+  Mesh *&mesh = meshes[stroke];
+  if (!mesh)
+    mesh = new Mesh();
+  update(*mesh, stroke);
+  const int vertexCount = mesh->vertices.size() / 2;
+  if (vertexCount < 4)
+    return true;
+
+  QPaintDevice *device = painter->device();
+  QMatrix4x4 projection;
+  projection.ortho(0, device->width(), device->height(), 0, -1, 1);
+  const QMatrix4x4 matrix =
+      projection * QMatrix4x4(painter->combinedTransform());
+
+  painter->beginNativePainting();
+  QOpenGLFunctions *gl = QOpenGLContext::currentContext()->functions();
+  gl->glEnable(GL_BLEND);
+  gl->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  program.bind();
+  program.setUniformValue("matrix", matrix);
+  program.setUniformValue("color", stroke->pen().color());
+  mesh->buffer.bind();
+  program.enableAttributeArray(0);
+  program.setAttributeBuffer(0, GL_FLOAT, 0, 2);
+  gl->glDrawArrays(GL_TRIANGLE_STRIP, 0, vertexCount);
+  program.disableAttributeArray(0);
+  mesh->buffer.release();
+  program.release();
+  painter->endNativePainting();
+  return true;
+}
+
+void GlStrokeRenderer::update(Mesh &mesh, const StrokeItem *stroke) {
+  const QVector<StrokeItem::Segment> &segments = stroke->segments();
+  const qreal width = stroke->pen().widthF();
+  if (width != mesh.width || segments.size() < mesh.segments) {
+    mesh.vertices.clear();
+    mesh.segments = 0;
+    mesh.width = width;
+  }
+  if (mesh.segments == segments.size() && mesh.buffer.isCreated())
+    return;
+
+  // Each curve sample becomes a pair of vertices offset along the normal,
+  // so consecutive samples form a triangle strip.
+  const int uploaded = mesh.vertices.size();
+  QPointF normal(0, 1);
+  for (int i = mesh.segments; i < segments.size(); ++i) {
+    const StrokeItem::Segment &segment = segments.at(i);
+    const QPointF from = i == 0 ? stroke->startPoint() : segments.at(i - 1).end;
+    const qreal hull = distance(from, segment.control1) +
+                       distance(segment.control1, segment.control2) +
+                       distance(segment.control2, segment.end);
+    const int steps = qBound(1, qCeil(hull / flatness), maxStepsPerSegment);
+    const qreal half = qMax(width * segment.widthScale, minWidth) / 2;
+
+    for (int k = i == 0 ? 0 : 1; k <= steps; ++k) {
+      const qreal t = qreal(k) / steps;
+      const qreal u = 1 - t;
+      const QPointF point = u * u * u * from +
+                            3 * u * u * t * segment.control1 +
+                            3 * u * t * t * segment.control2 +
+                            t * t * t * segment.end;
+      const QPointF tangent = 3 * u * u * (segment.control1 - from) +
+                              6 * u * t *
+                                  (segment.control2 - segment.control1) +
+                              3 * t * t * (segment.end - segment.control2);
+      const qreal length = qSqrt(QPointF::dotProduct(tangent, tangent));
+      if (length > 1e-6)
+        normal = QPointF(-tangent.y() / length, tangent.x() / length);
+
+      mesh.vertices.append(float(point.x() + normal.x() * half));
+      mesh.vertices.append(float(point.y() + normal.y() * half));
+      mesh.vertices.append(float(point.x() - normal.x() * half));
+      mesh.vertices.append(float(point.y() - normal.y() * half));
+    }
+  }
+  mesh.segments = segments.size();
+
+  if (!mesh.buffer.isCreated()) {
+    mesh.buffer.create();
+    mesh.buffer.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+  }
+  mesh.buffer.bind();
+  const int bytes = mesh.vertices.size() * int(sizeof(float));
+  if (bytes > mesh.buffer.size()) {
+    // Grow geometrically so a stroke being drawn reallocates rarely.
+    mesh.buffer.allocate(qMax(bytes, mesh.buffer.size() * 2));
+    mesh.buffer.write(0, mesh.vertices.constData(), bytes);
+  } else {
+    const int offset = uploaded * int(sizeof(float));
+    mesh.buffer.write(offset, mesh.vertices.constData() + uploaded,
+                      bytes - offset);
+  }
+  mesh.buffer.release();
+}
+
+void GlStrokeRenderer::purge() {
+  for (Mesh *mesh : retired) {
+    mesh->buffer.destroy();
+    delete mesh;
+  }
+  retired.clear();
+}
+
+#endif // HAVE_OPENGL
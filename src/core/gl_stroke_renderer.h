@@ -0,0 +1,64 @@
+// gl_stroke_renderer.h
+#ifndef GL_STROKE_RENDERER_H
+#define GL_STROKE_RENDERER_H
+
+#ifdef HAVE_OPENGL
+
+#include <QHash>
+#include <QList>
+#include <QOpenGLBuffer>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QPainter>
+#include <QVector>
+
+class StrokeItem;
+
+// Draws strokes on an OpenGL paint engine from vertex buffers instead of
+// rasterizing their paths. Each stroke is tessellated once into a triangle
+// strip in item coordinates; segments added while it is drawn are appended
+// to its buffer, so a frame only uploads the new tail. There is one
+// renderer per GL context, used from the GUI thread only.
+class GlStrokeRenderer {
+public:
+  // Draws stroke with the painter's GL context. Returns false when the
+  // painter is not on a GL engine or the stroke needs the QPainter path
+  // (e.g. dashed pens); the caller then paints it as usual.
+  static bool draw(QPainter *painter, const StrokeItem *stroke);
+  // Drops the buffers of a stroke that is going away, in every context.
+  static void forget(const StrokeItem *stroke);
+  // Frees the renderer of the current context. Call while the context is
+  // still current, right before it is destroyed.
+  static void releaseCurrentContext();
+
+private:
+  struct Mesh {
+    Mesh() : buffer(QOpenGLBuffer::VertexBuffer), segments(0), width(-1) {}
+
+    QOpenGLBuffer buffer;
+    QVector<float> vertices;
+    int segments;
+    qreal width;
+  };
+
+  GlStrokeRenderer();
+  ~GlStrokeRenderer();
+
+  bool initialize();
+  bool drawStroke(QPainter *painter, const StrokeItem *stroke);
+  void update(Mesh &mesh, const StrokeItem *stroke);
+  void purge();
+
+  static QHash<QOpenGLContext *, GlStrokeRenderer *> &renderers();
+
+  QOpenGLShaderProgram program;
+  bool initialized;
+  bool usable;
+  QHash<const StrokeItem *, Mesh *> meshes;
+  // Buffers of deleted strokes, freed the next time the context is current.
+  QList<Mesh *> retired;
+};
+
+#endif // HAVE_OPENGL
+
+#endif // GL_STROKE_RENDERER_H
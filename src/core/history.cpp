@@ -0,0 +1,176 @@
+// history.cpp
+#include "history.h"
+
+History::History(int maxDepth, qint64 memoryBudget)
+    : depthLimit(maxDepth), byteBudget(memoryBudget), usedBytes(0) {}
+
+History::~History() { clear(); }
+
+void History::push(Action *action) { append(action, false); }
+
+void History::pushAttached(Action *action) { append(action, true); }
+
+void History::append(Action *action, bool attached) {
+  clearRedo();
+
+  Entry entry;
+  entry.action = action;
+  entry.bytes = action->memoryUsage();
+  entry.attached = attached;
+  undoStack.append(entry);
+  usedBytes += entry.bytes;
+
+  enforceLimits();
+}
+
+bool History::undo(QList<const Action *> *applied) {
+  if (undoStack.isEmpty())
+    return false;
+
+  // Attached entries sit above the one they belong to, so they go first.
+  bool attached = true;
+  while (attached && !undoStack.isEmpty()) {
+    Entry entry = undoStack.takeLast();
+    attached = entry.attached;
+    entry.action->undo();
+    remeasure(entry);
+    redoStack.append(entry);
+    if (applied)
+      applied->append(entry.action);
+  }
+  enforceLimits();
+  return true;
+}
+
+bool History::redo(QList<const Action *> *applied) {
+  if (redoStack.isEmpty())
+    return false;
+
+  do {
+    Entry entry = redoStack.takeLast();
+    entry.action->redo();
+    remeasure(entry);
+    undoStack.append(entry);
+    if (applied)
+      applied->append(entry.action);
+  } while (!redoStack.isEmpty() && redoStack.last().attached);
+  enforceLimits();
+  return true;
+}
+
+void History::clear() {
+  clearRedo();
+  for (const Entry &entry : undoStack)
+    release(entry);
+  undoStack.clear();
+  undoStack.squeeze();
+  usedBytes = 0;
+}
+
+void History::refresh(const QGraphicsItem *item) {
+  for (Entry &entry : undoStack) {
+    if (entry.action->referencedItems().contains(
+            const_cast<QGraphicsItem *>(item)))
+      remeasure(entry);
+  }
+  for (Entry &entry : redoStack) {
+    if (entry.action->referencedItems().contains(
+            const_cast<QGraphicsItem *>(item)))
+      remeasure(entry);
+  }
+  enforceLimits();
+}
+
+bool History::canUndo() const { return !undoStack.isEmpty(); }
+
+bool History::canRedo() const { return !redoStack.isEmpty(); }
+
+int History::undoCount() const { return int(undoStack.size()); }
+
+int History::redoCount() const { return int(redoStack.size()); }
+
+const Action *History::nextUndo() const {
+  return undoStack.isEmpty() ? nullptr : undoStack.last().action;
+}
+
+const Action *History::nextRedo() const {
+  return redoStack.isEmpty() ? nullptr : redoStack.last().action;
+}
+
+void History::setMaxDepth(int depth) {
+  depthLimit = depth;
+  enforceLimits();
+}
+
+int History::maxDepth() const { return depthLimit; }
+
+void History::setMemoryBudget(qint64 bytes) {
+  byteBudget = bytes;
+  enforceLimits();
+}
+
+qint64 History::memoryBudget() const { return byteBudget; }
+
+qint64 History::memoryUsage() const { return usedBytes; }
+
+QSet<QGraphicsItem *> History::referencedItems() const {
+  QSet<QGraphicsItem *> items;
+  for (const Entry &entry : undoStack) {
+    for (QGraphicsItem *item : entry.action->referencedItems())
+      items.insert(item);
+  }
+  for (const Entry &entry : redoStack) {
+    for (QGraphicsItem *item : entry.action->referencedItems())
+      items.insert(item);
+  }
+  return items;
+}
+
+void History::setItemReleaseHandler(
+    const std::function<void(QGraphicsItem *)> &f) {
+  itemReleaseHandler = f;
+}
+
+void History::release(const Entry &entry) {
+  usedBytes -= entry.bytes;
+  for (QGraphicsItem *item : entry.action->ownedItems()) {
+    if (itemReleaseHandler)
+      itemReleaseHandler(item);
+    delete item;
+  }
+  delete entry.action;
+}
+
+void History::remeasure(Entry &entry) {
+  const qint64 bytes = entry.action->memoryUsage();
+  usedBytes += bytes - entry.bytes;
+  entry.bytes = bytes;
+}
+
+void History::clearRedo() {
+  // At most one action owns an item at any time (the one that last took it
+  // out of the scene), so entries can be released in any order.
+  for (const Entry &entry : redoStack)
+    release(entry);
+  redoStack.clear();
+}
+
+void History::enforceLimits() {
+  // Evict oldest first, but always keep the newest entry, even if it alone
+  // exceeds the budget.
+  int evicted = 0;
+  while (undoStack.size() - evicted > 1 &&
+         ((depthLimit > 0 && undoStack.size() - evicted > depthLimit) ||
+          (byteBudget > 0 && usedBytes > byteBudget))) {
+    release(undoStack.at(evicted));
+    ++evicted;
+  }
+  // Entries attached to an evicted one go with it.
+  while (evicted > 0 && undoStack.size() - evicted > 1 &&
+         undoStack.at(evicted).attached) {
+    release(undoStack.at(evicted));
+    ++evicted;
+  }
+  if (evicted > 0)
+    undoStack.remove(0, evicted);
+}
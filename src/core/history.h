@@ -0,0 +1,87 @@
+// history.h
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "action.h"
+#include <QList>
+#include <QSet>
+#include <QVector>
+#include <functional>
+
+// Owns the undo and redo stacks. Actions pushed here are deleted by the
+// history, together with any items only they still reference, when they
+// fall off the redo stack, are evicted by the depth or memory limits, or the
+// history is cleared.
+class History {
+public:
+  static const int defaultMaxDepth = 1000;
+  static const qint64 defaultMemoryBudget = 256LL * 1024 * 1024;
+
+  explicit History(int maxDepth = defaultMaxDepth,
+                   qint64 memoryBudget = defaultMemoryBudget);
+  ~History();
+
+  // Takes ownership of an action whose effect has already been applied.
+  void push(Action *action);
+  // Like push(), for upkeep the user never asked for: undo() and redo()
+  // apply the action together with the entry below it.
+  void pushAttached(Action *action);
+  // Each step applies one entry and the ones attached to it; applied, if
+  // given, receives every action in the order they were applied.
+  bool undo(QList<const Action *> *applied = nullptr);
+  bool redo(QList<const Action *> *applied = nullptr);
+  void clear();
+
+  // Re-measures every entry referencing item, e.g. after a stroke has
+  // finished growing or was refitted, and enforces the limits again.
+  void refresh(const QGraphicsItem *item);
+
+  bool canUndo() const;
+  bool canRedo() const;
+  int undoCount() const;
+  int redoCount() const;
+  // The action undo() or redo() would apply next, or nullptr.
+  const Action *nextUndo() const;
+  const Action *nextRedo() const;
+
+  // Limits of zero or below disable that limit.
+  void setMaxDepth(int depth);
+  int maxDepth() const;
+  void setMemoryBudget(qint64 bytes);
+  qint64 memoryBudget() const;
+
+  // Estimated bytes held by both stacks, for display.
+  qint64 memoryUsage() const;
+
+  // Items some undo or redo entry points at; deleting any of these behind the
+  // history's back would leave it dangling.
+  QSet<QGraphicsItem *> referencedItems() const;
+
+  // Called for every item right before History deletes it.
+  void setItemReleaseHandler(const std::function<void(QGraphicsItem *)> &f);
+
+private:
+  struct Entry {
+    Action *action;
+    qint64 bytes;
+    // Undone and redone together with the entry below.
+    bool attached;
+  };
+
+  void append(Action *action, bool attached);
+
+  void release(const Entry &entry);
+  // Undoing or redoing an action changes which items it owns.
+  void remeasure(Entry &entry);
+  void clearRedo();
+  void enforceLimits();
+
+  QVector<Entry> undoStack;
+  QVector<Entry> redoStack;
+  int depthLimit;
+  qint64 byteBudget;
+  qint64 usedBytes;
+  std::function<void(QGraphicsItem *)> itemReleaseHandler;
+};
+
+#endif // HISTORY_H
@@ -0,0 +1,513 @@
+// input_trace.cpp
+#include "input_trace.h"
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QFile>
+#include <QMouseEvent>
+#include <QSaveFile>
+#include <QTabletEvent>
+#include <QTextStream>
+#include <QWheelEvent>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+const char magic[4] = {'F', 'S', 'P', 'T'};
+// Qt::KeyboardModifier bits start at Shift (0x02000000).
+const int modifierShift = 25;
+// Trace time one frame covers unless told otherwise: 60 Hz.
+const qint64 defaultFrameInterval = 16667;
+
+bool isMouse(InputTrace::Type type) {
+  return type >= InputTrace::MousePress && type <= InputTrace::MouseRelease;
+}
+
+bool isTablet(InputTrace::Type type) {
+  return type >= InputTrace::TabletPress && type <= InputTrace::TabletRelease;
+}
+
+bool isKnown(quint8 type) {
+  return (type >= InputTrace::MousePress && type <= InputTrace::Wheel) ||
+         (type >= InputTrace::SelectPen && type <= InputTrace::Paste);
+}
+
+quint8 modifierBits(Qt::KeyboardModifiers modifiers) {
+  return quint8(quint32(int(modifiers)) >> modifierShift);
+}
+
+Qt::KeyboardModifiers modifiersOf(quint8 bits) {
+  return Qt::KeyboardModifiers(QFlag(int(quint32(bits) << modifierShift)));
+}
+
+qint16 clampShort(int value) {
+  return qint16(qBound(-32768, value, 32767));
+}
+
+void writePosition(QDataStream &stream, const QPointF &pos) {
+  stream << float(pos.x()) << float(pos.y());
+}
+
+QPointF readPosition(QDataStream &stream) {
+  float x = 0;
+  float y = 0;
+  stream >> x >> y;
+  return QPointF(x, y);
+}
+
+qint64 microsSince(const QElapsedTimer &clock) {
+  return clock.nsecsElapsed() / 1000;
+}
+} // namespace
+
+bool InputTrace::save(const QString &fileName, QString *errorString) const {
+  QSaveFile file(fileName);
+  if (!file.open(QIODevice::WriteOnly)) {
+    if (errorString)
+      *errorString = file.errorString();
+    return false;
+  }
+
+  QDataStream stream(&file);
+  stream.setByteOrder(QDataStream::LittleEndian);
+  stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+  stream.writeRawData(magic, 4);
+  stream << version << quint16(0);
+  writePosition(stream, viewTopLeft);
+  stream << float(zoom) << quint16(viewportSize.width())
+         << quint16(viewportSize.height()) << quint32(events.size());
+
+  qint64 previous = 0;
+  for (const Event &event : events) {
+    // Deltas keep the stamps small; a pause longer than the field holds is
+    // shortened, which changes nothing for the canvas.
+    const qint64 delta = qBound<qint64>(0, event.time - previous, 0xffffffff);
+    previous = event.time;
+    stream << quint8(event.type) << quint32(delta);
+    if (event.type == Paste) {
+      stream << quint32(event.data.size());
+      stream.writeRawData(event.data.constData(), event.data.size());
+    } else if (event.isCommand()) {
+      stream << event.value;
+    } else if (isMouse(event.type)) {
+      writePosition(stream, event.pos);
+      stream << event.button << event.buttons << event.modifiers;
+    } else if (isTablet(event.type)) {
+      writePosition(stream, event.pos);
+      stream << quint16(qBound(0.0, event.pressure, 1.0) * 65535 + 0.5)
+             << event.xTilt << event.yTilt << event.buttons
+             << event.modifiers;
+    } else {
+      writePosition(stream, event.pos);
+      stream << clampShort(event.angleDelta.x())
+             << clampShort(event.angleDelta.y())
+             << clampShort(event.pixelDelta.x())
+             << clampShort(event.pixelDelta.y()) << event.buttons
+             << event.modifiers;
+    }
+  }
+
+  if (stream.status() != QDataStream::Ok || !file.commit()) {
+    if (errorString)
+      *errorString = file.errorString();
+    file.cancelWriting();
+    return false;
+  }
+  return true;
+}
+
+bool InputTrace::load(const QString &fileName, QString *errorString) {
+  QFile file(fileName);
+  if (!file.open(QIODevice::ReadOnly)) {
+    if (errorString)
+      *errorString = file.errorString();
+    return false;
+  }
+
+  QDataStream stream(&file);
+  stream.setByteOrder(QDataStream::LittleEndian);
+  stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+  char header[4];
+  quint16 fileVersion = 0;
+  quint16 reserved = 0;
+  if (stream.readRawData(header, 4) != 4 ||
+      std::memcmp(header, magic, 4) != 0) {
+    if (errorString)
+      *errorString = QString("Not an input trace");
+    return false;
+  }
+  stream >> fileVersion >> reserved;
+  if (fileVersion > version) {
+    if (errorString)
+      *errorString = QString("Trace was written by a newer version");
+    return false;
+  }
+
+  float fileZoom = 1;
+  quint16 width = 0;
+  quint16 height = 0;
+  quint32 count = 0;
+  const QPointF topLeft = readPosition(stream);
+  stream >> fileZoom >> width >> height >> count;
+
+  QVector<Event> read;
+  // The count comes from the file; let a damaged one run out of data
+  // rather than reserve memory for it.
+  read.reserve(int(qMin<quint32>(count, file.size() / 5)));
+  qint64 time = 0;
+  for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok;
+       ++i) {
+    quint8 type = 0;
+    quint32 delta = 0;
+    stream >> type >> delta;
+    if (!isKnown(type)) {
+      stream.setStatus(QDataStream::ReadCorruptData);
+      break;
+    }
+
+    Event event;
+    event.type = Type(type);
+    event.time = time += delta;
+    if (event.isCommand()) {
+      stream >> event.value;
+      if (event.type == Paste) {
+        // The size comes from the file as well.
+        if (event.value > quint64(file.size() - file.pos())) {
+          stream.setStatus(QDataStream::ReadCorruptData);
+          break;
+        }
+        event.data.resize(int(event.value));
+        if (stream.readRawData(event.data.data(), event.data.size()) !=
+            event.data.size()) {
+          stream.setStatus(QDataStream::ReadPastEnd);
+          break;
+        }
+      }
+    } else if (isMouse(event.type)) {
+      event.pos = readPosition(stream);
+      stream >> event.button >> event.buttons >> event.modifiers;
+    } else if (isTablet(event.type)) {
+      quint16 pressure = 0;
+      event.pos = readPosition(stream);
+      stream >> pressure >> event.xTilt >> event.yTilt >> event.buttons >>
+          event.modifiers;
+      event.pressure = pressure / 65535.0;
+    } else {
+      qint16 angleX = 0;
+      qint16 angleY = 0;
+      qint16 pixelX = 0;
+      qint16 pixelY = 0;
+      event.pos = readPosition(stream);
+      stream >> angleX >> angleY >> pixelX >> pixelY >> event.buttons >>
+          event.modifiers;
+      event.angleDelta = QPoint(angleX, angleY);
+      event.pixelDelta = QPoint(pixelX, pixelY);
+    }
+    read.append(event);
+  }
+
+  if (stream.status() != QDataStream::Ok) {
+    if (errorString)
+      *errorString = QString("Trace is damaged");
+    return false;
+  }
+  viewTopLeft = topLeft;
+  zoom = fileZoom > 0 ? fileZoom : 1.0;
+  viewportSize = QSize(width, height);
+  events = read;
+  return true;
+}
+
+InputRecorder::InputRecorder(QObject *parent) : QObject(parent) {
+  clock.start();
+}
+
+void InputRecorder::setTarget(QWidget *viewport) {
+  if (target)
+    target->removeEventFilter(this);
+  target = viewport;
+  if (target)
+    target->installEventFilter(this);
+}
+
+void InputRecorder::start(const QPointF &viewTopLeft, qreal zoom,
+                          const QSize &viewportSize) {
+  recorded = InputTrace();
+  recorded.viewTopLeft = viewTopLeft;
+  recorded.zoom = zoom;
+  recorded.viewportSize = viewportSize;
+  clock.restart();
+}
+
+const InputTrace &InputRecorder::trace() const { return recorded; }
+
+void InputRecorder::record(InputTrace::Type type, quint32 value) {
+  InputTrace::Event event;
+  event.type = type;
+  event.time = microsSince(clock);
+  event.value = value;
+  recorded.events.append(event);
+}
+
+void InputRecorder::recordPaste(const QByteArray &items) {
+  InputTrace::Event event;
+  event.type = InputTrace::Paste;
+  event.time = microsSince(clock);
+  event.value = quint32(items.size());
+  event.data = items;
+  recorded.events.append(event);
+}
+
+bool InputRecorder::eventFilter(QObject *watched, QEvent *event) {
+  if (watched != target)
+    return false;
+
+  InputTrace::Event entry;
+  switch (event->type()) {
+  case QEvent::MouseButtonPress:
+  case QEvent::MouseMove:
+  case QEvent::MouseButtonRelease: {
+    const QMouseEvent *mouse = static_cast<QMouseEvent *>(event);
+    entry.type = event->type() == QEvent::MouseButtonPress
+                     ? InputTrace::MousePress
+                 : event->type() == QEvent::MouseMove
+                     ? InputTrace::MouseMove
+                     : InputTrace::MouseRelease;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    entry.pos = mouse->position();
+#else
+    entry.pos = mouse->localPos();
+#endif
+    entry.button = quint8(mouse->button());
+    entry.buttons = quint8(int(mouse->buttons()));
+    entry.modifiers = modifierBits(mouse->modifiers());
+    break;
+  }
+  case QEvent::TabletPress:
+  case QEvent::TabletMove:
+  case QEvent::TabletRelease: {
+    const QTabletEvent *tablet = static_cast<QTabletEvent *>(event);
+    entry.type = event->type() == QEvent::TabletPress
+                     ? InputTrace::TabletPress
+                 : event->type() == QEvent::TabletMove
+                     ? InputTrace::TabletMove
+                     : InputTrace::TabletRelease;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    entry.pos = tablet->position();
+#else
+    entry.pos = tablet->posF();
+#endif
+    entry.pressure = tablet->pressure();
+    entry.xTilt = qint8(qBound(-128, int(tablet->xTilt()), 127));
+    entry.yTilt = qint8(qBound(-128, int(tablet->yTilt()), 127));
+    entry.button = quint8(tablet->button());
+    entry.buttons = quint8(int(tablet->buttons()));
+    entry.modifiers = modifierBits(tablet->modifiers());
+    break;
+  }
+  case QEvent::Wheel: {
+    const QWheelEvent *wheel = static_cast<QWheelEvent *>(event);
+    entry.type = InputTrace::Wheel;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    entry.pos = wheel->position();
+#else
+    entry.pos = wheel->posF();
+#endif
+    entry.angleDelta = wheel->angleDelta();
+    entry.pixelDelta = wheel->pixelDelta();
+    entry.buttons = quint8(int(wheel->buttons()));
+    entry.modifiers = modifierBits(wheel->modifiers());
+    break;
+  }
+  default:
+    return false;
+  }
+
+  entry.time = microsSince(clock);
+  recorded.events.append(entry);
+  // The view still handles the event as usual.
+  return false;
+}
+
+InputReplayer::InputReplayer(const InputTrace &trace, QObject *parent)
+    : QObject(parent), trace(trace), timer(new QTimer(this)),
+      frameInterval(defaultFrameInterval), frameStart(0), nextEvent(0),
+      realTime(false), running(false) {
+  timer->setSingleShot(true);
+  connect(timer, &QTimer::timeout, this, &InputReplayer::step);
+}
+
+void InputReplayer::setTarget(QWidget *viewport) { target = viewport; }
+
+void InputReplayer::setCommandHandler(
+    const std::function<void(const InputTrace::Event &)> &f) {
+  commandHandler = f;
+}
+
+void InputReplayer::setFrameHandler(const std::function<void()> &f) {
+  frameHandler = f;
+}
+
+void InputReplayer::setFrameInterval(qint64 micros) {
+  frameInterval = micros > 0 ? micros : defaultFrameInterval;
+}
+
+void InputReplayer::start(bool originalSpeed) {
+  realTime = originalSpeed;
+  running = true;
+  frameStart = 0;
+  nextEvent = 0;
+  timings.clear();
+  clock.start();
+  scheduleStep();
+}
+
+bool InputReplayer::isRunning() const { return running; }
+
+const QVector<InputReplayer::Frame> &InputReplayer::frames() const {
+  return timings;
+}
+
+qint64 InputReplayer::frameStartFor(qint64 time) const {
+  // Frames without events are skipped, idle stretches of the trace with
+  // them.
+  if (time < frameStart + frameInterval)
+    return frameStart;
+  return frameStart + (time - frameStart) / frameInterval * frameInterval;
+}
+
+void InputReplayer::scheduleStep() {
+  qint64 wait = 0;
+  if (realTime && nextEvent < trace.events.size()) {
+    // A frame goes out once all of its events would have happened.
+    const qint64 due =
+        frameStartFor(trace.events.at(nextEvent).time) + frameInterval;
+    wait = qMax<qint64>(0, (due - microsSince(clock)) / 1000);
+  }
+  timer->start(int(qMin<qint64>(wait, 1000000)));
+}
+
+void InputReplayer::step() {
+  if (!running)
+    return;
+  if (nextEvent >= trace.events.size() || !target) {
+    running = false;
+    emit finished();
+    return;
+  }
+
+  frameStart = frameStartFor(trace.events.at(nextEvent).time);
+  const qint64 frameEnd = frameStart + frameInterval;
+
+  Frame frame;
+  frame.traceTime = frameEnd;
+  frame.events = 0;
+  QElapsedTimer elapsed;
+  elapsed.start();
+  while (nextEvent < trace.events.size() &&
+         trace.events.at(nextEvent).time < frameEnd) {
+    deliver(trace.events.at(nextEvent++));
+    ++frame.events;
+  }
+  frame.inputNanos = elapsed.nsecsElapsed();
+  if (frameHandler)
+    frameHandler();
+  frame.frameNanos = elapsed.nsecsElapsed();
+  timings.append(frame);
+
+  frameStart = frameEnd;
+  scheduleStep();
+}
+
+void InputReplayer::deliver(const InputTrace::Event &event) {
+  if (event.isCommand()) {
+    if (commandHandler)
+      commandHandler(event);
+    return;
+  }
+  if (!target)
+    return;
+
+  const QPointF global = QPointF(target->mapToGlobal(QPoint(0, 0))) +
+                         event.pos;
+  const Qt::MouseButton button = Qt::MouseButton(event.button);
+  const Qt::MouseButtons buttons(QFlag(int(event.buttons)));
+  const Qt::KeyboardModifiers modifiers = modifiersOf(event.modifiers);
+
+  if (isMouse(event.type)) {
+    const QEvent::Type type =
+        event.type == InputTrace::MousePress  ? QEvent::MouseButtonPress
+        : event.type == InputTrace::MouseMove ? QEvent::MouseMove
+                                              : QEvent::MouseButtonRelease;
+    QMouseEvent mouse(type, event.pos, global, button, buttons, modifiers);
+    QCoreApplication::sendEvent(target, &mouse);
+  } else if (isTablet(event.type)) {
+    const QEvent::Type type =
+        event.type == InputTrace::TabletPress  ? QEvent::TabletPress
+        : event.type == InputTrace::TabletMove ? QEvent::TabletMove
+                                               : QEvent::TabletRelease;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    QTabletEvent tablet(type, QPointingDevice::primaryPointingDevice(),
+                        event.pos, global, event.pressure, event.xTilt,
+                        event.yTilt, 0, 0, 0, modifiers, button, buttons);
+#else
+    QTabletEvent tablet(type, event.pos, global, QTabletEvent::Stylus,
+                        QTabletEvent::Pen, event.pressure, event.xTilt,
+                        event.yTilt, 0, 0, 0, modifiers, 0, button, buttons);
+#endif
+    QCoreApplication::sendEvent(target, &tablet);
+  } else {
+    QWheelEvent wheel(event.pos, global, event.pixelDelta, event.angleDelta,
+                      buttons, modifiers, Qt::NoScrollPhase, false);
+    QCoreApplication::sendEvent(target, &wheel);
+  }
+}
+
+QString InputReplayer::summary() const {
+  if (timings.isEmpty())
+    return QString("Replayed 0 frames");
+
+  QVector<qint64> frameTimes;
+  frameTimes.reserve(timings.size());
+  qint64 total = 0;
+  for (const Frame &frame : timings) {
+    frameTimes.append(frame.frameNanos);
+    total += frame.frameNanos;
+  }
+  std::sort(frameTimes.begin(), frameTimes.end());
+  auto millis = [](qint64 nanos) {
+    return QString::number(nanos / 1e6, 'f', 2);
+  };
+  const int p95 = qMin(frameTimes.size() - 1, frameTimes.size() * 95 / 100);
+  return QString("Replayed %1 frames: mean %2 ms, p95 %3 ms, max %4 ms")
+      .arg(timings.size())
+      .arg(millis(total / timings.size()))
+      .arg(millis(frameTimes.at(p95)))
+      .arg(millis(frameTimes.last()));
+}
+
+bool InputReplayer::writeReport(const QString &fileName,
+                                QString *errorString) const {
+  QSaveFile file(fileName);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+    if (errorString)
+      *errorString = file.errorString();
+    return false;
+  }
+
+  QTextStream out(&file);
+  out << "frame,trace_ms,events,input_us,frame_us\n";
+  for (int i = 0; i < timings.size(); ++i) {
+    const Frame &frame = timings.at(i);
+    out << i << ',' << QString::number(frame.traceTime / 1000.0, 'f', 3)
+        << ',' << frame.events << ',' << frame.inputNanos / 1000 << ','
+        << frame.frameNanos / 1000 << '\n';
+  }
+  out.flush();
+
+  if (!file.commit()) {
+    if (errorString)
+      *errorString = file.errorString();
+    return false;
+  }
+  return true;
+}
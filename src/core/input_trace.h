@@ -0,0 +1,215 @@
+// input_trace.h
+#ifndef INPUT_TRACE_H
+#define INPUT_TRACE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QPoint>
+#include <QPointF>
+#include <QPointer>
+#include <QSize>
+#include <QString>
+#include <QTimer>
+#include <QVector>
+#include <QWidget>
+#include <functional>
+
+// Timestamped input as it reached the canvas viewport, plus the tool, brush
+// and color changes made in between, for reproducing a drawing session.
+//
+// File format (.fspt), little endian: magic "FSPT", u16 version, u16
+// reserved, float32 scene x/y at the viewport's top-left corner, float32
+// zoom, u16 viewport width and height, u32 event count, then per event a u8
+// type, u32 microseconds since the previous event and a payload fixed by
+// the type:
+//
+//   mouse    float32 x/y, u8 button, u8 buttons, u8 modifiers
+//   tablet   float32 x/y, u16 pressure in 1/65535, s8 x/y tilt, u8 buttons,
+//            u8 modifiers
+//   wheel    float32 x/y, s16 angle x/y, s16 pixel x/y, u8 buttons,
+//            u8 modifiers
+//   command  u32 value; a paste is followed by that many bytes of the
+//            pasted items as a CanvasMimeData::itemsFormat stream
+struct InputTrace {
+  enum Type : quint8 {
+    MousePress = 1,
+    MouseMove = 2,
+    MouseRelease = 3,
+    TabletPress = 4,
+    TabletMove = 5,
+    TabletRelease = 6,
+    Wheel = 7,
+    // Commands; value holds the argument, if any.
+    SelectPen = 32,
+    SelectEraser = 33,
+    SelectSelection = 34,
+    // value: DocumentItem kind of the shape
+    SelectShape = 35,
+    // value: ARGB
+    SetPenColor = 36,
+    IncreaseBrush = 37,
+    DecreaseBrush = 38,
+    ClearCanvas = 39,
+    Undo = 40,
+    // value: 0 or 1
+    SplitErase = 41,
+    SpatialIndex = 42,
+    GpuViewport = 43,
+    // value: frames per second
+    FrameRate = 44,
+    Flatten = 45,
+    // value: 0 or 1
+    AutoFlatten = 46,
+    AddLayer = 47,
+    RemoveLayer = 48,
+    // value: layer index, bottom first
+    SelectLayer = 49,
+    // value: 0 or 1
+    LayerHidden = 50,
+    LayerLocked = 51,
+    SelectFill = 52,
+    // value: tolerance per color channel
+    FillTolerance = 53,
+    Copy = 54,
+    Cut = 55,
+    // value: size of data, the pasted items
+    Paste = 56
+  };
+
+  struct Event {
+    Event()
+        : type(MouseMove), time(0), button(0), buttons(0), modifiers(0),
+          pressure(0), xTilt(0), yTilt(0), value(0) {}
+
+    bool isCommand() const { return type >= SelectPen; }
+
+    Type type;
+    // Microseconds since recording started.
+    qint64 time;
+    // Pointer events: position in viewport coordinates, mouse buttons
+    // (Qt::MouseButton bits) and Qt::KeyboardModifiers >> 25.
+    QPointF pos;
+    quint8 button;
+    quint8 buttons;
+    quint8 modifiers;
+    // Tablet events
+    qreal pressure;
+    qint8 xTilt;
+    qint8 yTilt;
+    // Wheel events
+    QPoint angleDelta;
+    QPoint pixelDelta;
+    quint32 value;
+    // Paste: the items stream, so a replay does not depend on the
+    // clipboard it runs with.
+    QByteArray data;
+  };
+
+  static const quint16 version = 2;
+
+  InputTrace() : zoom(1.0) {}
+
+  bool save(const QString &fileName, QString *errorString = nullptr) const;
+  bool load(const QString &fileName, QString *errorString = nullptr);
+
+  // View the recording started from.
+  QPointF viewTopLeft;
+  qreal zoom;
+  QSize viewportSize;
+  QVector<Event> events;
+};
+
+// Records every pointer event sent to a viewport, before the view handles
+// it, and the commands passed to record().
+class InputRecorder : public QObject {
+  Q_OBJECT
+
+public:
+  explicit InputRecorder(QObject *parent = nullptr);
+
+  // Follows a new viewport, e.g. after the canvas switched to OpenGL.
+  void setTarget(QWidget *viewport);
+  // Restarts the clock and the trace from the given view.
+  void start(const QPointF &viewTopLeft, qreal zoom,
+             const QSize &viewportSize);
+  const InputTrace &trace() const;
+
+public slots:
+  void record(InputTrace::Type type, quint32 value = 0);
+  // Records a paste of the given itemsFormat stream.
+  void recordPaste(const QByteArray &items);
+
+protected:
+  bool eventFilter(QObject *watched, QEvent *event) override;
+
+private:
+  QPointer<QWidget> target;
+  QElapsedTimer clock;
+  InputTrace recorded;
+};
+
+// Feeds a trace back into a viewport a frame at a time, at its original
+// pace or as fast as the events are handled, and times each frame.
+class InputReplayer : public QObject {
+  Q_OBJECT
+
+public:
+  struct Frame {
+    // Trace time the frame ends at, in microseconds.
+    qint64 traceTime;
+    int events;
+    // Spent delivering the frame's events, then in total including the
+    // frame handler.
+    qint64 inputNanos;
+    qint64 frameNanos;
+  };
+
+  explicit InputReplayer(const InputTrace &trace, QObject *parent = nullptr);
+
+  void setTarget(QWidget *viewport);
+  // Receives the trace's commands in place of the tool panel signals.
+  void setCommandHandler(
+      const std::function<void(const InputTrace::Event &)> &f);
+  // Runs after each frame's events, e.g. to apply queued input and paint.
+  void setFrameHandler(const std::function<void()> &f);
+  // Trace time covered by one frame.
+  void setFrameInterval(qint64 micros);
+  // Replays at the pace of the recording, or with no pause between frames.
+  void start(bool originalSpeed);
+
+  bool isRunning() const;
+  const QVector<Frame> &frames() const;
+  // One line with the frame count and frame time statistics.
+  QString summary() const;
+  // Per-frame timings as CSV.
+  bool writeReport(const QString &fileName,
+                   QString *errorString = nullptr) const;
+
+signals:
+  void finished();
+
+private slots:
+  void step();
+
+private:
+  // Start of the frame that holds an event at time.
+  qint64 frameStartFor(qint64 time) const;
+  void scheduleStep();
+  void deliver(const InputTrace::Event &event);
+
+  InputTrace trace;
+  QPointer<QWidget> target;
+  std::function<void(const InputTrace::Event &)> commandHandler;
+  std::function<void()> frameHandler;
+  QTimer *timer;
+  QElapsedTimer clock;
+  qint64 frameInterval;
+  qint64 frameStart;
+  int nextEvent;
+  bool realTime;
+  bool running;
+  QVector<Frame> timings;
+};
+
+#endif // INPUT_TRACE_H
@@ -0,0 +1,241 @@
+// item_importer.cpp
+#include "item_importer.h"
+#include "canvas_mime_data.h"
+#include <QMutexLocker>
+#include <QRunnable>
+
+namespace {
+// Records per worker task: enough to outweigh the hand-off, few enough that
+// the first items show up quickly and every thread gets a share.
+const int blockSize = 256;
+
+class PrepareBlockTask : public QRunnable {
+public:
+  typedef std::function<bool(int, DocumentItem *)> Reader;
+  typedef std::function<void(const QList<ItemImporter::Prepared> &)> Done;
+
+  PrepareBlockTask(const QAtomicInt *generation, int expected, int first,
+                   int last, const Reader &read, const Done &done)
+      : generation(generation), expected(expected), first(first),
+        last(last), read(read), done(done) {}
+
+  void run() override {
+    QList<ItemImporter::Prepared> items;
+    for (int i = first; i < last; ++i) {
+      if (generation->loadAcquire() != expected)
+        break;
+      ItemImporter::Prepared prepared;
+      DocumentItem record;
+      if (read(i, &record)) {
+        prepared.item = record.createGraphicsItem();
+        prepared.layer = record.layer;
+        if (prepared.item)
+          prepared.outline = EraserHitTester::prepare(prepared.item);
+      }
+      items.append(prepared);
+    }
+    done(items);
+  }
+
+private:
+  const QAtomicInt *generation;
+  int expected;
+  int first;
+  int last;
+  Reader read;
+  Done done;
+};
+
+class DecodeStreamTask : public QRunnable {
+public:
+  typedef std::function<void(const QVector<DocumentItem> &)> Done;
+
+  DecodeStreamTask(const QByteArray &data, const Done &done)
+      : data(data), done(done) {}
+
+  void run() override { done(CanvasMimeData::decodeItems(data)); }
+
+private:
+  QByteArray data;
+  Done done;
+};
+} // namespace
+
+ItemImporter::ItemImporter(QObject *parent)
+    : QObject(parent), generation(0), blockCount(0), nextBlock(0),
+      nextReady(0), active(false), reader(nullptr) {}
+
+ItemImporter::~ItemImporter() { cancel(); }
+
+void ItemImporter::begin() {
+  cancel();
+  active = true;
+}
+
+void ItemImporter::start(const QVector<DocumentItem> &items) {
+  begin();
+  startBlocks(generation.loadAcquire(), items.size(),
+              [items](int index, DocumentItem *item) {
+                *item = items.at(index);
+                return true;
+              });
+}
+
+void ItemImporter::start(const QByteArray &itemStream) {
+  begin();
+  const int current = generation.loadAcquire();
+  {
+    QMutexLocker locker(&mutex);
+    blockCount = -1;
+  }
+  // The stream has to be read front to back; only the items built from it
+  // are spread over the workers.
+  threads.start(new DecodeStreamTask(
+      itemStream, [this, current](const QVector<DocumentItem> &items) {
+        startBlocks(current, items.size(),
+                    [items](int index, DocumentItem *item) {
+                      *item = items.at(index);
+                      return true;
+                    });
+      }));
+}
+
+void ItemImporter::start(DocumentReader *documentReader) {
+  begin();
+  reader = documentReader;
+  // Records are decoded straight from the mapped file, which any number of
+  // threads can read at once.
+  const DocumentReader *source = reader;
+  startBlocks(generation.loadAcquire(), source->itemCount(),
+              [source](int index, DocumentItem *item) {
+                if (!source->readItem(index, item))
+                  return false;
+                if (!item->tag)
+                  item->tag = DocumentReader::untaggedBase + quint32(index);
+                return true;
+              });
+}
+
+void ItemImporter::startBlocks(int expected, int count, const Reader &read) {
+  {
+    QMutexLocker locker(&mutex);
+    if (generation.loadAcquire() != expected)
+      return;
+    blockCount = (count + blockSize - 1) / blockSize;
+  }
+  for (int block = 0; block * blockSize < count; ++block) {
+    const int first = block * blockSize;
+    threads.start(new PrepareBlockTask(
+        &generation, expected, first, qMin(first + blockSize, count), read,
+        [this, expected, block](const QList<Prepared> &items) {
+          storeBlock(expected, block, items);
+        }));
+  }
+  if (count == 0) {
+    // Nothing to build; let the caller see the import is over.
+    QMetaObject::invokeMethod(this, "collectBlocks", Qt::QueuedConnection);
+  }
+}
+
+void ItemImporter::storeBlock(int expected, int block,
+                              const QList<Prepared> &items) {
+  {
+    // Items of a dropped import are deleted on the GUI thread: destroying
+    // a stroke touches per-viewport caches (see GlStrokeRenderer::forget()).
+    QMutexLocker locker(&mutex);
+    if (generation.loadAcquire() == expected)
+      finishedBlocks.insert(block, items);
+    else
+      staleItems += items;
+  }
+  QMetaObject::invokeMethod(this, "collectBlocks", Qt::QueuedConnection);
+}
+
+void ItemImporter::collectBlocks() {
+  releaseStale();
+  if (!active)
+    return;
+  gatherBlocks();
+  emit itemsReady();
+}
+
+void ItemImporter::cancel() {
+  {
+    QMutexLocker locker(&mutex);
+    generation.ref();
+  }
+  // Queued blocks never start; running ones stop at their next record.
+  threads.clear();
+  threads.waitForDone();
+
+  QList<Prepared> untaken = ready.mid(nextReady);
+  {
+    QMutexLocker locker(&mutex);
+    for (const QList<Prepared> &block : finishedBlocks) {
+      untaken += block;
+    }
+    finishedBlocks.clear();
+    blockCount = 0;
+  }
+  release(untaken);
+  releaseStale();
+  ready.clear();
+  nextReady = 0;
+  nextBlock = 0;
+  active = false;
+  delete reader;
+  reader = nullptr;
+}
+
+void ItemImporter::waitForDone() {
+  if (!active)
+    return;
+  threads.waitForDone();
+  gatherBlocks();
+}
+
+bool ItemImporter::isActive() const {
+  if (!active)
+    return false;
+  QMutexLocker locker(&mutex);
+  return blockCount < 0 || nextBlock < blockCount ||
+         nextReady < ready.size();
+}
+
+bool ItemImporter::take(Prepared *prepared) {
+  if (nextReady == ready.size()) {
+    ready.clear();
+    nextReady = 0;
+    gatherBlocks();
+    if (ready.isEmpty())
+      return false;
+  }
+  *prepared = ready.at(nextReady++);
+  return true;
+}
+
+void ItemImporter::gatherBlocks() {
+  // Blocks finish in any order; only a run that continues the items handed
+  // out so far can be passed on.
+  QMutexLocker locker(&mutex);
+  while (finishedBlocks.contains(nextBlock)) {
+    ready += finishedBlocks.take(nextBlock);
+    ++nextBlock;
+  }
+}
+
+void ItemImporter::releaseStale() {
+  QList<Prepared> stale;
+  {
+    QMutexLocker locker(&mutex);
+    stale.swap(staleItems);
+  }
+  release(stale);
+}
+
+void ItemImporter::release(QList<Prepared> &items) {
+  for (const Prepared &prepared : items) {
+    delete prepared.item;
+  }
+  items.clear();
+}
@@ -0,0 +1,94 @@
+// item_importer.h
+#ifndef ITEM_IMPORTER_H
+#define ITEM_IMPORTER_H
+
+#include "document.h"
+#include "eraser_hit_tester.h"
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QGraphicsItem>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QThreadPool>
+#include <QVector>
+#include <functional>
+
+// Turns pasted or loaded records into ready-made items off the GUI thread.
+// Records are split into blocks that worker threads decode, build into
+// scene-less items and flatten for the eraser in parallel. Finished blocks
+// are handed back in source order, so the caller only has to add each item
+// to the scene, a time slice at a time.
+class ItemImporter : public QObject {
+  Q_OBJECT
+
+public:
+  struct Prepared {
+    Prepared() : item(nullptr), layer(0) {}
+
+    // Scene-less item, or nullptr when its record could not be decoded.
+    QGraphicsItem *item;
+    // DocumentItem::layer of the record
+    quint16 layer;
+    EraserHitTester::Entry outline;
+  };
+
+  explicit ItemImporter(QObject *parent = nullptr);
+  ~ItemImporter();
+
+  // Each start() drops the import still in progress, if any.
+  void start(const QVector<DocumentItem> &items);
+  // Decodes a CanvasMimeData::itemsFormat stream on a worker first.
+  void start(const QByteArray &itemStream);
+  // Takes ownership of an opened reader.
+  void start(DocumentReader *reader);
+  // Stops the workers and deletes every item not taken yet.
+  void cancel();
+  // Blocks until every remaining item is prepared.
+  void waitForDone();
+
+  // True from start() until the last item has been taken.
+  bool isActive() const;
+  // Moves the next item in source order to prepared, if it is ready; the
+  // caller owns the item from then on.
+  bool take(Prepared *prepared);
+
+signals:
+  // More items can be taken, or the import has nothing left.
+  void itemsReady();
+
+private slots:
+  void collectBlocks();
+
+private:
+  typedef std::function<bool(int, DocumentItem *)> Reader;
+
+  void begin();
+  // Queues blocks over records 0..count-1; may run on a worker.
+  void startBlocks(int generation, int count, const Reader &read);
+  void storeBlock(int generation, int block, const QList<Prepared> &items);
+  // Moves finished blocks that are next in order to ready.
+  void gatherBlocks();
+  // GUI thread: deletes the items of blocks that came in too late.
+  void releaseStale();
+  static void release(QList<Prepared> &items);
+
+  QThreadPool threads;
+  // Bumped by every start() and cancel(); workers of an older import stop
+  // and their results are dropped.
+  QAtomicInt generation;
+  mutable QMutex mutex;
+  // Guarded by mutex: -1 until a stream has been decoded.
+  int blockCount;
+  QMap<int, QList<Prepared>> finishedBlocks;
+  QList<Prepared> staleItems;
+  // GUI thread only.
+  int nextBlock;
+  QList<Prepared> ready;
+  int nextReady;
+  bool active;
+  DocumentReader *reader;
+};
+
+#endif // ITEM_IMPORTER_H
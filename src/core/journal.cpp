@@ -0,0 +1,431 @@
+// journal.cpp
+#include "journal.h"
+#include <QDir>
+#include <QHash>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QSet>
+#include <QtEndian>
+#include <cstring>
+#include <functional>
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+const char magic[4] = {'F', 'S', 'P', 'J'};
+const int headerSize = 8;
+// Type, payload size and hash around each payload.
+const int entryHeadSize = 5;
+const int entryTailSize = 4;
+// Tag and scene bounds ahead of the record of a Put.
+const int putHeadSize = 20;
+const int layerHeadSize = 6;
+const quint8 layerHiddenFlag = 0x01;
+const quint8 layerLockedFlag = 0x02;
+// Bytes copied at a time when a document becomes the snapshot.
+const qint64 copySize = 1 << 20;
+const char *const snapshotName = "board.fspd";
+const char *const journalName = "board.journal";
+
+enum EntryType : quint8 { Put = 1, Remove = 2, Layers = 3 };
+
+typedef std::function<void(quint8, const uchar *, quint32)> EntryVisitor;
+
+template <typename T> void putLittleEndian(QByteArray &out, T value) {
+  uchar bytes[sizeof(T)];
+  qToLittleEndian(value, bytes);
+  out.append(reinterpret_cast<const char *>(bytes), int(sizeof(T)));
+}
+
+void putF32(QByteArray &out, qreal value) {
+  const float f = float(value);
+  quint32 bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  putLittleEndian(out, bits);
+}
+
+qreal getF32(const uchar *p) {
+  const quint32 bits = qFromLittleEndian<quint32>(p);
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return qreal(f);
+}
+
+// FNV-1a over the entry type and payload.
+quint32 entryHash(quint8 type, const uchar *payload, quint32 size) {
+  quint32 h = (2166136261u ^ type) * 16777619u;
+  for (quint32 i = 0; i < size; ++i) {
+    h = (h ^ payload[i]) * 16777619u;
+  }
+  return h;
+}
+
+QByteArray header() {
+  QByteArray out(magic, 4);
+  putLittleEndian(out, Journal::version);
+  putLittleEndian(out, quint16(0));
+  return out;
+}
+
+// Appends one entry; payload goes in after its head so it is not copied.
+void appendEntry(QByteArray &out, quint8 type,
+                 const std::function<void(QByteArray &)> &payload) {
+  const int start = out.size();
+  out.append(char(type));
+  putLittleEndian(out, quint32(0));
+  payload(out);
+  const quint32 size = quint32(out.size() - start - entryHeadSize);
+  uchar *entry = reinterpret_cast<uchar *>(out.data() + start);
+  qToLittleEndian(size, entry + 1);
+  putLittleEndian(out, entryHash(type, entry + entryHeadSize, size));
+}
+
+// Visits the entries of a journal up to the first damaged one and returns
+// where that one starts, or -1 if the header is not a journal's.
+qint64 scanEntries(const QByteArray &bytes, const EntryVisitor &visit) {
+  if (bytes.size() < headerSize || std::memcmp(bytes.constData(), magic, 4))
+    return -1;
+  const uchar *data = reinterpret_cast<const uchar *>(bytes.constData());
+  if (qFromLittleEndian<quint16>(data + 4) > Journal::version)
+    return -1;
+
+  qint64 offset = headerSize;
+  while (bytes.size() - offset >= entryHeadSize + entryTailSize) {
+    const uchar *entry = data + offset;
+    const quint32 size = qFromLittleEndian<quint32>(entry + 1);
+    if (quint64(bytes.size() - offset - entryHeadSize - entryTailSize) <
+        size)
+      break;
+    if (qFromLittleEndian<quint32>(entry + entryHeadSize + size) !=
+        entryHash(entry[0], entry + entryHeadSize, size))
+      break;
+    if (visit)
+      visit(entry[0], entry + entryHeadSize, size);
+    offset += entryHeadSize + size + entryTailSize;
+  }
+  return offset;
+}
+
+bool readLayers(const uchar *p, quint32 size, QVector<DocumentLayer> *out) {
+  if (size < 4)
+    return false;
+  const uchar *end = p + size;
+  const quint32 count = qFromLittleEndian<quint32>(p);
+  p += 4;
+  QVector<DocumentLayer> layers;
+  for (quint32 i = 0; i < count; ++i) {
+    if (end - p < layerHeadSize)
+      return false;
+    const int nameSize = qFromLittleEndian<quint16>(p + 4);
+    if (end - p - layerHeadSize < nameSize)
+      return false;
+    DocumentLayer layer;
+    layer.id = qFromLittleEndian<quint16>(p);
+    layer.hidden = p[2] & layerHiddenFlag;
+    layer.locked = p[2] & layerLockedFlag;
+    layer.name = QString::fromUtf8(
+        reinterpret_cast<const char *>(p + layerHeadSize), nameSize);
+    layers.append(layer);
+    p += layerHeadSize + nameSize;
+  }
+  *out = layers;
+  return true;
+}
+
+bool syncFile(QFile &file) {
+  if (!file.flush())
+    return false;
+#if defined(Q_OS_WIN)
+  return _commit(file.handle()) == 0;
+#else
+  return ::fsync(file.handle()) == 0;
+#endif
+}
+
+void reportFailure(Journal *journal, const QString &error) {
+  QMetaObject::invokeMethod(
+      journal, [journal, error]() { emit journal->writeFailed(error); },
+      Qt::QueuedConnection);
+}
+
+// Copies a document over the snapshot in one atomic replace.
+bool copySnapshot(const QString &source, const QString &target,
+                  QString *errorString) {
+  QFile in(source);
+  QSaveFile out(target);
+  if (!in.open(QIODevice::ReadOnly)) {
+    *errorString = in.errorString();
+    return false;
+  }
+  if (!out.open(QIODevice::WriteOnly)) {
+    *errorString = out.errorString();
+    return false;
+  }
+  while (!in.atEnd()) {
+    const QByteArray chunk = in.read(copySize);
+    if (chunk.isEmpty() || out.write(chunk) != chunk.size()) {
+      *errorString = chunk.isEmpty() ? in.errorString() : out.errorString();
+      out.cancelWriting();
+      return false;
+    }
+  }
+  if (!out.commit()) {
+    *errorString = out.errorString();
+    return false;
+  }
+  return true;
+}
+
+bool storeSnapshot(const QByteArray &document, const QString &target,
+                   QString *errorString) {
+  QSaveFile out(target);
+  if (!out.open(QIODevice::WriteOnly) ||
+      out.write(document) != document.size() || !out.commit()) {
+    *errorString = out.errorString();
+    return false;
+  }
+  return true;
+}
+
+class AppendTask : public QRunnable {
+public:
+  AppendTask(Journal *journal, QFile *file, const QByteArray &entries)
+      : journal(journal), file(file), entries(entries) {}
+
+  void run() override {
+    if (file->write(entries) != entries.size() || !syncFile(*file))
+      reportFailure(journal, file->errorString());
+  }
+
+private:
+  Journal *journal;
+  QFile *file;
+  QByteArray entries;
+};
+
+// Writes the snapshot, then starts the journal over.
+class CompactTask : public QRunnable {
+public:
+  // Writes the snapshot to the path it is given.
+  typedef std::function<bool(const QString &, QString *)> Writer;
+
+  CompactTask(Journal *journal, QFile *file, const QString &snapshotPath,
+              const Writer &write)
+      : journal(journal), file(file), snapshotPath(snapshotPath),
+        write(write) {}
+
+  void run() override {
+    QString error;
+    const bool ok = write(snapshotPath, &error);
+    // Without a new snapshot the old one and the whole journal still
+    // describe the board.
+    if (!ok) {
+      reportFailure(journal, error);
+      return;
+    }
+    if (!file->resize(headerSize) || !file->seek(headerSize) ||
+        !syncFile(*file))
+      reportFailure(journal, file->errorString());
+  }
+
+private:
+  Journal *journal;
+  QFile *file;
+  QString snapshotPath;
+  Writer write;
+};
+} // namespace
+
+Journal::Journal(const QString &directory, QObject *parent)
+    : QObject(parent), directory(directory), written(0) {
+  // One thread keeps writes and compactions in the order they were queued.
+  writerThread.setMaxThreadCount(1);
+}
+
+Journal::~Journal() {
+  flush();
+  writerThread.waitForDone();
+}
+
+bool Journal::open(QString *errorString) {
+  const QDir dir(directory);
+  if (!dir.mkpath(".")) {
+    if (errorString)
+      *errorString = QString("Could not create %1").arg(directory);
+    return false;
+  }
+
+  file.setFileName(dir.filePath(journalName));
+  if (!file.open(QIODevice::ReadWrite)) {
+    if (errorString)
+      *errorString = file.errorString();
+    return false;
+  }
+  // Entries go after the last intact one; a damaged tail would hide them
+  // from replay.
+  const qint64 end = scanEntries(file.readAll(), EntryVisitor());
+  const bool ok =
+      end < 0 ? file.resize(0) && file.write(header()) == headerSize
+              : file.resize(end);
+  if (!ok || !file.seek(file.size()) || !syncFile(file)) {
+    if (errorString)
+      *errorString = file.errorString();
+    file.close();
+    return false;
+  }
+  written = file.size() - headerSize;
+  return true;
+}
+
+bool Journal::recover(const QString &directory, const QString &fileName,
+                      QString *errorString) {
+  const QDir dir(directory);
+  // Removed items keep their slot, so putting them back, e.g. by undo,
+  // restores their place in the stacking order.
+  QVector<DocumentItem> items;
+  QVector<bool> live;
+  QHash<quint32, int> slotOfTag;
+  QVector<DocumentLayer> layers;
+
+  auto put = [&items, &live, &slotOfTag](const DocumentItem &item) {
+    const auto slot = slotOfTag.constFind(item.tag);
+    if (slot != slotOfTag.constEnd()) {
+      items[*slot] = item;
+      live[*slot] = true;
+    } else {
+      slotOfTag.insert(item.tag, items.size());
+      items.append(item);
+      live.append(true);
+    }
+  };
+
+  const QString snapshotPath = dir.filePath(snapshotName);
+  if (QFile::exists(snapshotPath)) {
+    DocumentReader reader(snapshotPath);
+    if (!reader.open(errorString))
+      return false;
+    for (int i = 0; i < reader.itemCount(); ++i) {
+      DocumentItem item;
+      if (!reader.readItem(i, &item))
+        continue;
+      if (!item.tag)
+        item.tag = DocumentReader::untaggedBase + quint32(i);
+      put(item);
+    }
+    layers = reader.layers();
+  }
+
+  QFile journalFile(dir.filePath(journalName));
+  if (journalFile.open(QIODevice::ReadOnly)) {
+    scanEntries(journalFile.readAll(), [&](quint8 type, const uchar *p,
+                                           quint32 size) {
+      if (type == Put && size > quint32(putHeadSize)) {
+        DocumentItem item;
+        if (!DocumentReader::decodeRecord(p + putHeadSize,
+                                          size - putHeadSize, &item))
+          return;
+        item.tag = qFromLittleEndian<quint32>(p);
+        item.sceneBounds = QRectF(QPointF(getF32(p + 4), getF32(p + 8)),
+                                  QPointF(getF32(p + 12), getF32(p + 16)));
+        put(item);
+      } else if (type == Remove && size == 4) {
+        const auto slot = slotOfTag.constFind(qFromLittleEndian<quint32>(p));
+        if (slot != slotOfTag.constEnd())
+          live[*slot] = false;
+      } else if (type == Layers) {
+        readLayers(p, size, &layers);
+      }
+    });
+  }
+
+  // Items of deleted layers stay in the journal in case the deletion is
+  // undone; only the layers of the final table come back.
+  QSet<quint16> layerIds;
+  for (const DocumentLayer &layer : layers) {
+    layerIds.insert(layer.id);
+  }
+  QVector<DocumentItem> board;
+  for (int i = 0; i < items.size(); ++i) {
+    if (live.at(i) &&
+        (layers.isEmpty() || layerIds.contains(items.at(i).layer)))
+      board.append(items.at(i));
+  }
+  if (board.isEmpty())
+    return false;
+  return DocumentWriter::write(fileName, board, layers, errorString);
+}
+
+void Journal::put(const DocumentItem &item) {
+  appendEntry(pending, Put, [&item](QByteArray &out) {
+    putLittleEndian(out, item.tag);
+    putF32(out, item.sceneBounds.left());
+    putF32(out, item.sceneBounds.top());
+    putF32(out, item.sceneBounds.right());
+    putF32(out, item.sceneBounds.bottom());
+    DocumentWriter::encodeRecord(item, out);
+  });
+}
+
+void Journal::remove(quint32 tag) {
+  appendEntry(pending, Remove,
+              [tag](QByteArray &out) { putLittleEndian(out, tag); });
+}
+
+void Journal::setLayers(const QVector<DocumentLayer> &layers) {
+  appendEntry(pending, Layers, [&layers](QByteArray &out) {
+    putLittleEndian(out, quint32(layers.size()));
+    for (const DocumentLayer &layer : layers) {
+      const QByteArray name = layer.name.toUtf8().left(0xffff);
+      putLittleEndian(out, layer.id);
+      out.append(char((layer.hidden ? layerHiddenFlag : 0) |
+                      (layer.locked ? layerLockedFlag : 0)));
+      out.append(char(0));
+      putLittleEndian(out, quint16(name.size()));
+      out.append(name);
+    }
+  });
+}
+
+void Journal::flush() {
+  if (pending.isEmpty())
+    return;
+  written += pending.size();
+  writerThread.start(new AppendTask(this, &file, pending));
+  pending.clear();
+}
+
+void Journal::compact(const Board &board,
+                      const QVector<DocumentLayer> &layers) {
+  flush();
+  written = 0;
+  writerThread.start(new CompactTask(
+      this, &file, QDir(directory).filePath(snapshotName),
+      [board, layers](const QString &target, QString *error) {
+        return DocumentWriter::write(target, board(), layers, error);
+      }));
+}
+
+void Journal::compactFrom(const QString &fileName) {
+  flush();
+  written = 0;
+  writerThread.start(new CompactTask(
+      this, &file, QDir(directory).filePath(snapshotName),
+      [fileName](const QString &target, QString *error) {
+        return copySnapshot(fileName, target, error);
+      }));
+}
+
+void Journal::compactFrom(const QByteArray &document) {
+  flush();
+  written = 0;
+  writerThread.start(new CompactTask(
+      this, &file, QDir(directory).filePath(snapshotName),
+      [document](const QString &target, QString *error) {
+        return storeSnapshot(document, target, error);
+      }));
+}
+
+qint64 Journal::size() const { return written; }
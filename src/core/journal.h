@@ -0,0 +1,85 @@
+// journal.h
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "document.h"
+#include <QByteArray>
+#include <QFile>
+#include <QObject>
+#include <QString>
+#include <QThreadPool>
+#include <QVector>
+#include <functional>
+
+// Autosave as an append-only journal next to a snapshot document, both in
+// one directory. Entries state what an item, known by its DocumentItem::tag,
+// now is or that it is gone, and what the layer table now is, so replaying
+// an entry twice does no harm:
+//
+//   header   magic "FSPJ", u16 version, u16 reserved
+//   entries  u8 type, u32 payload size, the payload and a u32 FNV-1a hash
+//            of type and payload. Put: u32 tag, float32 scene bounds and a
+//            document record. Remove: u32 tag. Layers: the layer table as
+//            documents store it
+//
+// Entries are buffered on the GUI thread until flush(), which hands them to
+// the writer thread as one write and one sync. Compaction writes the whole
+// board as the snapshot and starts the journal over; a crash in between
+// only replays entries the snapshot already holds. Replay stops at the
+// first damaged entry, which is where a crash cut the journal short.
+class Journal : public QObject {
+  Q_OBJECT
+
+public:
+  static const quint16 version = 1;
+  // Builds the board to compact into; runs on the writer thread.
+  typedef std::function<QVector<DocumentItem>()> Board;
+
+  explicit Journal(const QString &directory, QObject *parent = nullptr);
+  // Writes what is buffered and waits for the writer.
+  ~Journal();
+
+  // Creates the directory and opens the journal for appending, keeping what
+  // it already holds. Must succeed before anything else is called.
+  bool open(QString *errorString = nullptr);
+
+  // Replays the snapshot and journal in directory into a document at
+  // fileName. False with errorString left empty when there is no board to
+  // restore.
+  static bool recover(const QString &directory, const QString &fileName,
+                      QString *errorString = nullptr);
+
+  // item.tag must be set; a later put of the same tag replaces the item in
+  // place.
+  void put(const DocumentItem &item);
+  void remove(quint32 tag);
+  void setLayers(const QVector<DocumentLayer> &layers);
+  // Queues what is buffered as one write and sync on the writer thread.
+  void flush();
+
+  // Flushes, then makes what board returns and layers the snapshot. board
+  // must only touch copies, such as those DocumentWriter::snapshot() takes.
+  // Should writing it fail, the old snapshot and the journal still hold the
+  // board.
+  void compact(const Board &board, const QVector<DocumentLayer> &layers);
+  // The same with the board of the document at fileName.
+  void compactFrom(const QString &fileName);
+  // The same with a document held in memory.
+  void compactFrom(const QByteArray &document);
+  // Bytes flushed since the last compaction.
+  qint64 size() const;
+
+signals:
+  // Journaling carries on; a later flush or compaction may succeed.
+  void writeFailed(const QString &error);
+
+private:
+  QString directory;
+  QThreadPool writerThread;
+  QByteArray pending;
+  qint64 written;
+  // Only touched on the writer thread once open() returned.
+  QFile file;
+};
+
+#endif // JOURNAL_H
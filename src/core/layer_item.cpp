@@ -0,0 +1,222 @@
+// layer_item.cpp
+#include "layer_item.h"
+#include <QGraphicsEffect>
+#include <QPainter>
+#include <QtMath>
+#include <algorithm>
+
+namespace {
+// Edge of one index cell in scene units.
+const int cellSize = 512;
+// Children spanning more cells than this are kept out of the grid.
+const int maxCellsPerChild = 64;
+
+// Draws the layer's subtree from the pixmap QGraphicsEffectSource keeps for
+// it. Qt drops that pixmap whenever an item of the layer changes, and
+// reuses it, shifted, when the view only scrolls.
+class LayerCacheEffect : public QGraphicsEffect {
+protected:
+  void draw(QPainter *painter) override {
+    QPoint offset;
+    const QPixmap pixmap = sourcePixmap(Qt::DeviceCoordinates, &offset,
+                                        QGraphicsEffect::NoPad);
+    if (pixmap.isNull())
+      return;
+    const QTransform transform = painter->worldTransform();
+    painter->setWorldTransform(QTransform());
+    painter->drawPixmap(offset, pixmap);
+    painter->setWorldTransform(transform);
+  }
+};
+} // namespace
+
+LayerItem::LayerItem(quint16 id, const QString &name)
+    : layerId(id), layerName(name), nextOrder(1), locked(false) {
+  setFlag(QGraphicsItem::ItemHasNoContents);
+  LayerCacheEffect *effect = new LayerCacheEffect();
+  effect->setEnabled(false);
+  setGraphicsEffect(effect);
+}
+
+quint16 LayerItem::id() const { return layerId; }
+
+QString LayerItem::name() const { return layerName; }
+
+void LayerItem::setName(const QString &name) { layerName = name; }
+
+bool LayerItem::isLocked() const { return locked; }
+
+void LayerItem::setLocked(bool locked) { this->locked = locked; }
+
+void LayerItem::setCached(bool cached) {
+  graphicsEffect()->setEnabled(cached);
+}
+
+bool LayerItem::isCached() const { return graphicsEffect()->isEnabled(); }
+
+QList<QGraphicsItem *> LayerItem::items(const QRectF &rect) {
+  indexPending();
+
+  QVector<QGraphicsItem *> found;
+  const int left = qFloor(rect.left() / cellSize);
+  const int right = qFloor(rect.right() / cellSize);
+  const int top = qFloor(rect.top() / cellSize);
+  const int bottom = qFloor(rect.bottom() / cellSize);
+  for (int x = left; x <= right; ++x) {
+    for (int y = top; y <= bottom; ++y) {
+      const auto cell = cells.constFind(key(x, y));
+      if (cell != cells.constEnd())
+        found += *cell;
+    }
+  }
+  for (QGraphicsItem *child : oversized) {
+    found.append(child);
+  }
+
+  // Children spanning several cells are listed in each of them.
+  if (left != right || top != bottom) {
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+  }
+  QList<QGraphicsItem *> result;
+  result.reserve(found.size());
+  for (QGraphicsItem *child : found) {
+    result.append(child);
+  }
+  return result;
+}
+
+void LayerItem::reindex(QGraphicsItem *child) {
+  if (child->parentItem() != this)
+    return;
+  remove(child);
+  pending.insert(child);
+}
+
+LayerItem *LayerItem::of(const QGraphicsItem *item) {
+  const QGraphicsItem *top = item->topLevelItem();
+  if (top == item || top->type() != Type)
+    return nullptr;
+  return static_cast<LayerItem *>(const_cast<QGraphicsItem *>(top));
+}
+
+quint64 LayerItem::stackOrder(const QGraphicsItem *child) {
+  return child->data(orderKey).toULongLong();
+}
+
+void LayerItem::setStackOrder(QGraphicsItem *child, quint64 order) {
+  child->setData(orderKey, order);
+  if (LayerItem *layer = of(child))
+    layer->nextOrder = qMax(layer->nextOrder, order + 1);
+}
+
+void LayerItem::restack(QList<QGraphicsItem *> children) {
+  QSet<QGraphicsItem *> moving;
+  for (QGraphicsItem *child : children) {
+    moving.insert(child);
+  }
+  QVector<QGraphicsItem *> siblings;
+  for (QGraphicsItem *child : childItems()) {
+    if (!moving.contains(child))
+      siblings.append(child);
+  }
+  std::sort(children.begin(), children.end(),
+            [](const QGraphicsItem *a, const QGraphicsItem *b) {
+              return stackOrder(a) < stackOrder(b);
+            });
+
+  // Siblings come bottom first, so those skipped for one child sit below
+  // every child after it as well.
+  int next = 0;
+  for (QGraphicsItem *child : children) {
+    const quint64 order = stackOrder(child);
+    while (next < siblings.size() && stackOrder(siblings.at(next)) < order)
+      ++next;
+    for (int i = next; i < siblings.size(); ++i) {
+      QGraphicsItem *sibling = siblings.at(i);
+      if (sibling->zValue() == child->zValue() &&
+          stackOrder(sibling) > order) {
+        child->stackBefore(sibling);
+        break;
+      }
+    }
+  }
+}
+
+QRectF LayerItem::boundingRect() const { return QRectF(); }
+
+void LayerItem::paint(QPainter *painter,
+                      const QStyleOptionGraphicsItem *option,
+                      QWidget *widget) {
+  Q_UNUSED(painter);
+  Q_UNUSED(option);
+  Q_UNUSED(widget);
+}
+
+int LayerItem::type() const { return Type; }
+
+QVariant LayerItem::itemChange(GraphicsItemChange change,
+                               const QVariant &value) {
+  if (change == ItemChildAddedChange) {
+    QGraphicsItem *child = qvariant_cast<QGraphicsItem *>(value);
+    pending.insert(child);
+    child->setData(orderKey, nextOrder++);
+  } else if (change == ItemChildRemovedChange) {
+    // May come from the child's destructor; only its address is used.
+    remove(qvariant_cast<QGraphicsItem *>(value));
+  }
+  return QGraphicsItem::itemChange(change, value);
+}
+
+LayerItem::Key LayerItem::key(int x, int y) {
+  return (Key(quint32(x)) << 32) | Key(quint32(y));
+}
+
+QRect LayerItem::cellSpan(const QGraphicsItem *child) {
+  const QRectF bounds = child->mapRectToParent(child->boundingRect());
+  return QRect(QPoint(qFloor(bounds.left() / cellSize),
+                      qFloor(bounds.top() / cellSize)),
+               QPoint(qFloor(bounds.right() / cellSize),
+                      qFloor(bounds.bottom() / cellSize)));
+}
+
+void LayerItem::indexPending() {
+  for (QGraphicsItem *child : pending) {
+    insert(child);
+  }
+  pending.clear();
+}
+
+void LayerItem::insert(QGraphicsItem *child) {
+  const QRect span = cellSpan(child);
+  if (qint64(span.width()) * span.height() > maxCellsPerChild) {
+    oversized.insert(child);
+    return;
+  }
+  spans.insert(child, span);
+  for (int x = span.left(); x <= span.right(); ++x) {
+    for (int y = span.top(); y <= span.bottom(); ++y) {
+      cells[key(x, y)].append(child);
+    }
+  }
+}
+
+void LayerItem::remove(QGraphicsItem *child) {
+  if (pending.remove(child) || oversized.remove(child))
+    return;
+  const auto found = spans.find(child);
+  if (found == spans.end())
+    return;
+  const QRect span = *found;
+  spans.erase(found);
+  for (int x = span.left(); x <= span.right(); ++x) {
+    for (int y = span.top(); y <= span.bottom(); ++y) {
+      const auto cell = cells.find(key(x, y));
+      if (cell == cells.end())
+        continue;
+      cell->removeOne(child);
+      if (cell->isEmpty())
+        cells.erase(cell);
+    }
+  }
+}
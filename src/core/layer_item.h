@@ -0,0 +1,99 @@
+// layer_item.h
+#ifndef LAYER_ITEM_H
+#define LAYER_ITEM_H
+
+#include <QGraphicsItem>
+#include <QHash>
+#include <QList>
+#include <QRect>
+#include <QRectF>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+// One layer of the board: a top-level item without contents of its own
+// whose children are the layer's items. Hiding the layer hides its whole
+// subtree, which the scene then skips when painting and in queries. Each
+// layer keeps a grid index of its children, so the eraser only ever looks
+// at the layer being edited, and can paint the whole layer from one raster
+// that Qt only redraws when something in the layer changes.
+//
+// Layers stay at the scene origin untransformed, so child coordinates are
+// scene coordinates.
+class LayerItem : public QGraphicsItem {
+public:
+  enum { Type = UserType + 3 };
+
+  LayerItem(quint16 id, const QString &name);
+
+  // Stable for the lifetime of a board; documents and paged-out chunks
+  // refer to layers by it.
+  quint16 id() const;
+  QString name() const;
+  void setName(const QString &name);
+  // A locked layer is not edited; Canvas keeps it disabled and cached.
+  bool isLocked() const;
+  void setLocked(bool locked);
+  // Paints the layer from a device-space raster of all of its children.
+  // Meant for layers not being edited: every change in the layer redraws
+  // the whole raster.
+  void setCached(bool cached);
+  bool isCached() const;
+
+  // Children whose bounds, as of when they were indexed, intersect rect.
+  // Unordered; callers test the exact bounds themselves.
+  QList<QGraphicsItem *> items(const QRectF &rect);
+  // Indexes child again after its geometry changed. Children are indexed
+  // when they are added, so only moves and growth need this.
+  void reindex(QGraphicsItem *child);
+
+  // Layer item belongs to, or nullptr if it is not in a layer.
+  static LayerItem *of(const QGraphicsItem *item);
+
+  // A child's place in the stacking order among siblings of equal z, kept
+  // under orderKey in its data(). A child added to a layer goes on top and
+  // gets the layer's next, highest order; items taking another's place set
+  // theirs explicitly. Orders outlive the item being in the scene, so items
+  // paged out and rebuilt can go back where they were.
+  static quint64 stackOrder(const QGraphicsItem *child);
+  static void setStackOrder(QGraphicsItem *child, quint64 order);
+  // Moves children, just added on top with their orders set, below every
+  // sibling of equal z whose order is higher.
+  void restack(QList<QGraphicsItem *> children);
+
+  QRectF boundingRect() const override;
+  void paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
+             QWidget *widget = nullptr) override;
+  int type() const override;
+
+protected:
+  QVariant itemChange(GraphicsItemChange change,
+                      const QVariant &value) override;
+
+private:
+  typedef quint64 Key;
+
+  static const int orderKey = 1;
+
+  static Key key(int x, int y);
+  // Grid cells covered by the current bounds of child.
+  static QRect cellSpan(const QGraphicsItem *child);
+  void indexPending();
+  void insert(QGraphicsItem *child);
+  void remove(QGraphicsItem *child);
+
+  quint16 layerId;
+  QString layerName;
+  quint64 nextOrder;
+  bool locked;
+  QHash<Key, QVector<QGraphicsItem *>> cells;
+  // Cells each indexed child is listed in.
+  QHash<QGraphicsItem *, QRect> spans;
+  // Children too large for the grid, tested on every query.
+  QSet<QGraphicsItem *> oversized;
+  // Children added since the last query. They are indexed on demand: a
+  // child may not be fully constructed yet when it is added.
+  QSet<QGraphicsItem *> pending;
+};
+
+#endif // LAYER_ITEM_H
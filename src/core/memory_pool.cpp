@@ -0,0 +1,101 @@
+// memory_pool.cpp
+#include "memory_pool.h"
+#include <QMutexLocker>
+#include <new>
+
+namespace {
+// Blocks carved from the heap at a time.
+const int blocksPerChunk = 64;
+
+struct Registry {
+  QMutex mutex;
+  QVector<const MemoryPool *> pools;
+};
+
+Registry &registry() {
+  static Registry *instance = new Registry();
+  return *instance;
+}
+} // namespace
+
+MemoryPool::MemoryPool(std::size_t blockSize)
+    // Every block has to be able to hold the free-list link, aligned for
+    // anything operator new would return.
+    : blockSize((qMax(blockSize, sizeof(FreeBlock)) +
+                 alignof(std::max_align_t) - 1) /
+                alignof(std::max_align_t) * alignof(std::max_align_t)),
+      freeList(nullptr) {
+  Registry &pools = registry();
+  QMutexLocker locker(&pools.mutex);
+  pools.pools.append(this);
+}
+
+MemoryPool::~MemoryPool() {
+  {
+    Registry &pools = registry();
+    QMutexLocker locker(&pools.mutex);
+    pools.pools.removeOne(this);
+  }
+  for (char *chunk : chunkList)
+    ::operator delete(chunk);
+}
+
+void *MemoryPool::allocate(std::size_t size) {
+  QMutexLocker locker(&mutex);
+  if (size > blockSize) {
+    // A subclass larger than the class the pool was made for.
+    ++counters.fallbacks;
+    return ::operator new(size);
+  }
+  if (!freeList)
+    grow();
+  FreeBlock *block = freeList;
+  freeList = block->next;
+  ++counters.allocations;
+  return block;
+}
+
+void MemoryPool::release(void *block, std::size_t size) {
+  if (!block)
+    return;
+  QMutexLocker locker(&mutex);
+  if (size > blockSize) {
+    ::operator delete(block);
+    return;
+  }
+  FreeBlock *freed = static_cast<FreeBlock *>(block);
+  freed->next = freeList;
+  freeList = freed;
+  ++counters.releases;
+}
+
+MemoryPool::Stats MemoryPool::stats() const {
+  QMutexLocker locker(&mutex);
+  return counters;
+}
+
+MemoryPool::Stats MemoryPool::totals() {
+  Registry &pools = registry();
+  QMutexLocker locker(&pools.mutex);
+  Stats sum;
+  for (const MemoryPool *pool : pools.pools) {
+    const Stats stats = pool->stats();
+    sum.allocations += stats.allocations;
+    sum.releases += stats.releases;
+    sum.fallbacks += stats.fallbacks;
+    sum.chunks += stats.chunks;
+  }
+  return sum;
+}
+
+void MemoryPool::grow() {
+  char *chunk =
+      static_cast<char *>(::operator new(blockSize * blocksPerChunk));
+  chunkList.append(chunk);
+  ++counters.chunks;
+  for (int i = blocksPerChunk - 1; i >= 0; --i) {
+    FreeBlock *block = reinterpret_cast<FreeBlock *>(chunk + i * blockSize);
+    block->next = freeList;
+    freeList = block;
+  }
+}
@@ -0,0 +1,184 @@
+// profiler.cpp
+#include "profiler.h"
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QSaveFile>
+#include <QVector>
+
+namespace {
+// About 24 MB of samples; a capture stops growing once it holds this many.
+const int maxCapturedEvents = 1 << 20;
+// JSON is written out in pieces of about this size.
+const int chunkSize = 1 << 20;
+
+const char *const zoneNames[Profiler::ZoneCount] = {
+    "addPoint", "eraseAt", "frame", "paint", "paste", "fill", "inputToPaint"};
+
+struct CapturedEvent {
+  // Zone or counter name
+  const char *name;
+  qint64 start;
+  // Duration in nanoseconds for zones, the value for counters.
+  qint64 value;
+  bool counter;
+};
+
+struct State {
+  State() : pendingInput(-1), capturing(false), dropped(0) { clock.start(); }
+
+  QElapsedTimer clock;
+  Profiler::Stats window[Profiler::ZoneCount];
+  // Start of the open InputToPaint sample, or -1.
+  qint64 pendingInput;
+  bool capturing;
+  QVector<CapturedEvent> captured;
+  int dropped;
+};
+
+State &state() {
+  static State instance;
+  return instance;
+}
+
+void capture(State &s, const char *name, qint64 start, qint64 value,
+             bool counter) {
+  if (s.captured.size() >= maxCapturedEvents) {
+    ++s.dropped;
+    return;
+  }
+  CapturedEvent event;
+  event.name = name;
+  event.start = start;
+  event.value = value;
+  event.counter = counter;
+  s.captured.append(event);
+}
+
+// Trace event timestamps are microseconds.
+QByteArray micros(qint64 nanos) {
+  return QByteArray::number(nanos / 1e3, 'f', 3);
+}
+} // namespace
+
+bool Profiler::isAvailable() {
+#ifdef PENCIL_DRAW_PROFILING
+  return true;
+#else
+  return false;
+#endif
+}
+
+const char *Profiler::zoneName(Zone zone) { return zoneNames[zone]; }
+
+qint64 Profiler::now() { return state().clock.nsecsElapsed(); }
+
+void Profiler::addSample(Zone zone, qint64 start, qint64 nanos) {
+  State &s = state();
+  Stats &stats = s.window[zone];
+  ++stats.calls;
+  stats.totalNanos += nanos;
+  stats.maxNanos = qMax(stats.maxNanos, nanos);
+  if (s.capturing)
+    capture(s, zoneNames[zone], start, nanos, false);
+}
+
+void Profiler::markInput() {
+  State &s = state();
+  if (s.pendingInput < 0)
+    s.pendingInput = s.clock.nsecsElapsed();
+}
+
+void Profiler::markPainted() {
+  State &s = state();
+  if (s.pendingInput < 0)
+    return;
+  const qint64 start = s.pendingInput;
+  s.pendingInput = -1;
+  addSample(InputToPaint, start, s.clock.nsecsElapsed() - start);
+}
+
+void Profiler::setCounter(const char *name, qint64 value) {
+  State &s = state();
+  if (s.capturing)
+    capture(s, name, s.clock.nsecsElapsed(), value, true);
+}
+
+Profiler::Stats Profiler::takeWindow(Zone zone) {
+  Stats &window = state().window[zone];
+  const Stats taken = window;
+  window = Stats();
+  return taken;
+}
+
+void Profiler::startCapture() {
+  State &s = state();
+  s.captured.clear();
+  s.captured.reserve(qMin(maxCapturedEvents, 64 * 1024));
+  s.dropped = 0;
+  s.capturing = true;
+}
+
+bool Profiler::isCapturing() { return state().capturing; }
+
+bool Profiler::writeChromeTrace(const QString &fileName,
+                                QString *errorString) {
+  State &s = state();
+  s.capturing = false;
+
+  QSaveFile file(fileName);
+  if (!file.open(QIODevice::WriteOnly)) {
+    if (errorString)
+      *errorString = file.errorString();
+    return false;
+  }
+
+  // Every zone runs on the GUI thread and nests in the ones it is called
+  // from, so they share a track; input latency spans overlap them and get
+  // their own.
+  QByteArray chunk;
+  chunk.reserve(chunkSize + 256);
+  chunk += "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":";
+  chunk += QByteArray::number(s.dropped);
+  chunk += "},\"traceEvents\":[";
+  chunk += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+           "\"args\":{\"name\":\"GUI\"}},\n";
+  chunk += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,"
+           "\"args\":{\"name\":\"Input latency\"}}";
+
+  bool ok = true;
+  for (const CapturedEvent &event : s.captured) {
+    chunk += ",\n{\"name\":\"";
+    chunk += event.name;
+    chunk += "\",\"ts\":";
+    chunk += micros(event.start);
+    if (event.counter) {
+      chunk += ",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"args\":{\"value\":";
+      chunk += QByteArray::number(event.value);
+      chunk += "}}";
+    } else {
+      chunk += ",\"dur\":";
+      chunk += micros(event.value);
+      chunk += ",\"ph\":\"X\",\"cat\":\"canvas\",\"pid\":1,\"tid\":";
+      chunk += event.name == zoneNames[Profiler::InputToPaint] ? "2}" : "1}";
+    }
+    if (chunk.size() >= chunkSize) {
+      ok = file.write(chunk) == chunk.size();
+      chunk.resize(0);
+      if (!ok)
+        break;
+    }
+  }
+  chunk += "]}\n";
+  if (ok)
+    ok = file.write(chunk) == chunk.size();
+
+  s.captured.clear();
+  s.captured.squeeze();
+  if (!ok || !file.commit()) {
+    if (errorString)
+      *errorString = file.errorString();
+    file.cancelWriting();
+    return false;
+  }
+  return true;
+}
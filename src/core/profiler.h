@@ -0,0 +1,90 @@
+// profiler.h
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <QString>
+#include <QtGlobal>
+
+// Timings of the canvas hot paths for the performance overlay, and captures
+// of them in the Chrome trace event format (chrome://tracing, Perfetto) for
+// profiling without a debugger. GUI thread only.
+//
+// A zone is timed by PROFILE_ZONE(Profiler::AddPoint) at the top of a scope.
+// The macros compile to nothing unless PENCIL_DRAW_PROFILING is defined.
+class Profiler {
+public:
+  enum Zone {
+    AddPoint,
+    EraseAt,
+    // Queued input applied to the scene once per frame
+    Frame,
+    Paint,
+    // Batches of pasted or loaded items added to the scene
+    Paste,
+    // From a fill click to the filled area on the canvas
+    Fill,
+    // From the first input event after a paint to the paint that shows it
+    InputToPaint,
+    ZoneCount
+  };
+
+  struct Stats {
+    Stats() : calls(0), totalNanos(0), maxNanos(0) {}
+
+    qint64 meanNanos() const { return calls ? totalNanos / calls : 0; }
+
+    int calls;
+    qint64 totalNanos;
+    qint64 maxNanos;
+  };
+
+  // Whether the zones were compiled in.
+  static bool isAvailable();
+  static const char *zoneName(Zone zone);
+  // Nanoseconds on the clock every zone is timed with.
+  static qint64 now();
+
+  static void addSample(Zone zone, qint64 start, qint64 nanos);
+  // Starts an InputToPaint sample unless one is open already.
+  static void markInput();
+  // Ends the open InputToPaint sample, if any.
+  static void markPainted();
+  // Counters such as the scene's item count only go into captures; name
+  // has to outlive the capture.
+  static void setCounter(const char *name, qint64 value);
+
+  // Stats of zone since the previous call.
+  static Stats takeWindow(Zone zone);
+
+  // Keeps every sample and counter from now on, up to a fixed limit.
+  static void startCapture();
+  static bool isCapturing();
+  // Writes the capture as Chrome trace JSON and ends it.
+  static bool writeChromeTrace(const QString &fileName,
+                               QString *errorString = nullptr);
+};
+
+class ProfileScope {
+public:
+  explicit ProfileScope(Profiler::Zone zone)
+      : zone(zone), start(Profiler::now()) {}
+  ~ProfileScope() { Profiler::addSample(zone, start, Profiler::now() - start); }
+
+private:
+  Q_DISABLE_COPY(ProfileScope)
+
+  Profiler::Zone zone;
+  qint64 start;
+};
+
+#ifdef PENCIL_DRAW_PROFILING
+#define PROFILE_ZONE(zone) ProfileScope profileScope(zone)
+#define PROFILE_INPUT() Profiler::markInput()
+#define PROFILE_PAINTED() Profiler::markPainted()
+#else
+#define PROFILE_ZONE(zone) (void)0
+#define PROFILE_INPUT() (void)0
+#define PROFILE_PAINTED() (void)0
+#endif
+
+#endif // PROFILER_H
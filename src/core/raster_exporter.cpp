@@ -0,0 +1,352 @@
+// raster_exporter.cpp
+#include "raster_exporter.h"
+#include "fill_item.h"
+#include "shape_registry.h"
+#include <QFileInfo>
+#include <QImage>
+#include <QImageWriter>
+#include <QPainterPath>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QtEndian>
+#include <QtMath>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+const int tileSize = 512;
+
+#ifdef HAVE_ZLIB
+// Minimal 8-bit RGB PNG encoder fed one strip of scanlines at a time. All
+// rows go through a single deflate stream, split into IDAT chunks as the
+// output buffer fills.
+class PngStream {
+public:
+  explicit PngStream(QIODevice *device)
+      : device(device), output(64 * 1024, Qt::Uninitialized), ok(true),
+        initialized(false) {}
+
+  ~PngStream() {
+    if (initialized)
+      deflateEnd(&stream);
+  }
+
+  bool begin(int width, int height) {
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+      return false;
+    initialized = true;
+    row.resize(1 + width * 3);
+
+    ok = device->write("\x89PNG\r\n\x1a\n", 8) == 8;
+    QByteArray header(13, '\0');
+    qToBigEndian(quint32(width), header.data());
+    qToBigEndian(quint32(height), header.data() + 4);
+    header[8] = 8; // bit depth
+    header[9] = 2; // truecolor
+    writeChunk("IHDR", header.constData(), header.size());
+    return ok;
+  }
+
+  // Encodes rows of an RGB32 image with the Sub filter.
+  bool writeRows(const QImage &image, int firstRow, int rows) {
+    uchar *out = reinterpret_cast<uchar *>(row.data());
+    const int width = (row.size() - 1) / 3;
+    for (int y = firstRow; ok && y < firstRow + rows; ++y) {
+      const QRgb *pixels =
+          reinterpret_cast<const QRgb *>(image.constScanLine(y));
+      out[0] = 1;
+      uchar previous[3] = {0, 0, 0};
+      for (int x = 0; x < width; ++x) {
+        const uchar rgb[3] = {uchar(qRed(pixels[x])),
+                              uchar(qGreen(pixels[x])),
+                              uchar(qBlue(pixels[x]))};
+        for (int c = 0; c < 3; ++c) {
+          out[1 + x * 3 + c] = uchar(rgb[c] - previous[c]);
+          previous[c] = rgb[c];
+        }
+      }
+      compress(out, row.size(), Z_NO_FLUSH);
+    }
+    return ok;
+  }
+
+  bool finish() {
+    compress(nullptr, 0, Z_FINISH);
+    writeChunk("IEND", nullptr, 0);
+    return ok;
+  }
+
+private:
+  void compress(const uchar *data, int size, int flush) {
+    stream.next_in = const_cast<Bytef *>(data);
+    stream.avail_in = uInt(size);
+    do {
+      stream.next_out = reinterpret_cast<Bytef *>(output.data());
+      stream.avail_out = uInt(output.size());
+      if (deflate(&stream, flush) == Z_STREAM_ERROR) {
+        ok = false;
+        return;
+      }
+      const int produced = output.size() - int(stream.avail_out);
+      if (produced > 0)
+        writeChunk("IDAT", output.constData(), produced);
+    } while (ok && stream.avail_out == 0);
+  }
+
+  void writeChunk(const char *type, const char *data, int size) {
+    if (!ok)
+      return;
+    uchar length[4];
+    qToBigEndian(quint32(size), length);
+    uLong crc = crc32(0L, reinterpret_cast<const Bytef *>(type), 4);
+    if (size > 0)
+      crc = crc32(crc, reinterpret_cast<const Bytef *>(data), uInt(size));
+    uchar checksum[4];
+    qToBigEndian(quint32(crc), checksum);
+
+    ok = device->write(reinterpret_cast<const char *>(length), 4) == 4 &&
+         device->write(type, 4) == 4 &&
+         (size == 0 || device->write(data, size) == size) &&
+         device->write(reinterpret_cast<const char *>(checksum), 4) == 4;
+  }
+
+  QIODevice *device;
+  z_stream stream;
+  QByteArray row;
+  QByteArray output;
+  bool ok;
+  bool initialized;
+};
+#endif
+
+// Paints one tile straight into its part of the strip (or full image)
+// buffer. Tiles of a strip never overlap, so they can run side by side.
+class TileTask : public QRunnable {
+public:
+  TileTask(uchar *bits, int bytesPerLine, const QSize &size,
+           const QRectF &sceneRect, qreal scale, const QColor &background,
+           const QVector<DocumentItem> &items)
+      : bits(bits), bytesPerLine(bytesPerLine), size(size),
+        sceneRect(sceneRect), scale(scale), background(background),
+        items(items) {}
+
+  void run() override {
+    QImage tile(bits, size.width(), size.height(), bytesPerLine,
+                QImage::Format_RGB32);
+    tile.fill(background);
+    QPainter painter(&tile);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.scale(scale, scale);
+    painter.translate(-sceneRect.topLeft());
+    RasterExporter::paintItems(&painter, items, sceneRect);
+  }
+
+private:
+  uchar *bits;
+  int bytesPerLine;
+  QSize size;
+  QRectF sceneRect;
+  qreal scale;
+  QColor background;
+  const QVector<DocumentItem> &items;
+};
+
+// Drives one export: queues the tiles of each strip on the tile pool, waits
+// for them, hands the finished rows to the encoder, and reports back to the
+// exporter on its own thread.
+class ExportTask : public QRunnable {
+public:
+  ExportTask(RasterExporter *exporter, QThreadPool *tileThreads,
+             std::atomic<bool> *cancelled, const QString &fileName,
+             const QVector<DocumentItem> &items, const QRectF &sourceRect,
+             qreal scale, const QColor &background)
+      : exporter(exporter), tileThreads(tileThreads), cancelled(cancelled),
+        fileName(fileName), items(items), sourceRect(sourceRect),
+        scale(scale), background(background) {}
+
+  void run() override {
+    QString error;
+    const bool ok = exportImage(error);
+    RasterExporter *target = exporter;
+    const QString name = fileName;
+    QMetaObject::invokeMethod(
+        target,
+        [target, name, ok, error]() { emit target->finished(name, ok, error); },
+        Qt::QueuedConnection);
+  }
+
+private:
+  bool exportImage(QString &error) {
+    const int width = qCeil(sourceRect.width() * scale);
+    const int height = qCeil(sourceRect.height() * scale);
+    if (width <= 0 || height <= 0) {
+      error = "Nothing to export";
+      return false;
+    }
+
+    const QString suffix = QFileInfo(fileName).suffix().toLower();
+    const bool jpeg = suffix == "jpg" || suffix == "jpeg";
+#ifdef HAVE_ZLIB
+    const bool streaming = !jpeg;
+#else
+    const bool streaming = false;
+#endif
+
+    // Streaming keeps one strip of tiles; otherwise the tiles are painted
+    // into their place in the full image.
+    QImage buffer(width, streaming ? qMin(tileSize, height) : height,
+                  QImage::Format_RGB32);
+    if (buffer.isNull()) {
+      error = "Export is too large to fit in memory";
+      return false;
+    }
+    uchar *bits = buffer.bits();
+    const int bytesPerLine = buffer.bytesPerLine();
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+      error = file.errorString();
+      return false;
+    }
+#ifdef HAVE_ZLIB
+    PngStream png(&file);
+    if (streaming && !png.begin(width, height)) {
+      error = file.errorString();
+      return false;
+    }
+#endif
+
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (height + tileSize - 1) / tileSize;
+    reportProgress(0, tilesX * tilesY);
+
+    for (int ty = 0; ty < tilesY; ++ty) {
+      const int top = ty * tileSize;
+      const int rows = qMin(tileSize, height - top);
+      uchar *stripBits = streaming ? bits : bits + qint64(top) * bytesPerLine;
+
+      for (int tx = 0; tx < tilesX; ++tx) {
+        const int left = tx * tileSize;
+        const QSize size(qMin(tileSize, width - left), rows);
+        const QRectF tileRect(sourceRect.left() + left / scale,
+                              sourceRect.top() + top / scale,
+                              size.width() / scale, size.height() / scale);
+        tileThreads->start(new TileTask(stripBits + left * 4, bytesPerLine,
+                                        size, tileRect, scale, background,
+                                        items));
+      }
+      tileThreads->waitForDone();
+
+      if (cancelled->load()) {
+        file.cancelWriting();
+        error = "Export cancelled";
+        return false;
+      }
+#ifdef HAVE_ZLIB
+      if (streaming && !png.writeRows(buffer, 0, rows)) {
+        file.cancelWriting();
+        error = file.errorString();
+        return false;
+      }
+#endif
+      reportProgress((ty + 1) * tilesX, tilesX * tilesY);
+    }
+
+    bool ok;
+#ifdef HAVE_ZLIB
+    if (streaming) {
+      ok = png.finish();
+    } else
+#endif
+    {
+      QImageWriter writer(&file, jpeg ? "jpg" : "png");
+      if (jpeg)
+        writer.setQuality(95);
+      ok = writer.write(buffer);
+      if (!ok)
+        error = writer.errorString();
+    }
+
+    if (!ok || !file.commit()) {
+      if (error.isEmpty())
+        error = file.errorString();
+      file.cancelWriting();
+      return false;
+    }
+    return true;
+  }
+
+  void reportProgress(int done, int total) {
+    RasterExporter *target = exporter;
+    QMetaObject::invokeMethod(
+        target, [target, done, total]() { emit target->progress(done, total); },
+        Qt::QueuedConnection);
+  }
+
+  RasterExporter *exporter;
+  QThreadPool *tileThreads;
+  std::atomic<bool> *cancelled;
+  QString fileName;
+  QVector<DocumentItem> items;
+  QRectF sourceRect;
+  qreal scale;
+  QColor background;
+};
+} // namespace
+
+RasterExporter::RasterExporter(QObject *parent)
+    : QObject(parent), cancelled(false), running(false) {
+  driverThread.setMaxThreadCount(1);
+  connect(this, &RasterExporter::finished, this, [this]() { running = false; });
+}
+
+RasterExporter::~RasterExporter() {
+  cancel();
+  driverThread.waitForDone();
+}
+
+bool RasterExporter::start(const QString &fileName,
+                           const QVector<DocumentItem> &items,
+                           const QRectF &sourceRect, qreal scale,
+                           const QColor &background) {
+  if (running)
+    return false;
+  running = true;
+  cancelled = false;
+  driverThread.start(new ExportTask(this, &tileThreads, &cancelled, fileName,
+                                    items, sourceRect, scale, background));
+  return true;
+}
+
+void RasterExporter::cancel() { cancelled = true; }
+
+bool RasterExporter::isRunning() const { return running; }
+
+void RasterExporter::paintItems(QPainter *painter,
+                                const QVector<DocumentItem> &items,
+                                const QRectF &clip) {
+  for (const DocumentItem &item : items) {
+    if (!item.sceneBounds.intersects(clip))
+      continue;
+
+    painter->save();
+    painter->translate(item.pos);
+    painter->setPen(item.pen);
+    painter->setBrush(item.brush);
+    if (item.kind == DocumentItem::Path) {
+      painter->setBrush(Qt::NoBrush);
+      StrokeItem::drawSegments(painter, item.pen, item.start, item.segments, 0,
+                               int(item.segments.size()));
+    } else if (item.kind == DocumentItem::Fill) {
+      FillItem::drawRects(painter, item.rects, clip.translated(-item.pos));
+    } else if (const ShapeTool *shape = ShapeRegistry::forKind(item.kind)) {
+      shape->paint(painter, item);
+    }
+    painter->restore();
+  }
+}
@@ -0,0 +1,51 @@
+// raster_exporter.h
+#ifndef RASTER_EXPORTER_H
+#define RASTER_EXPORTER_H
+
+#include "document.h"
+#include <QColor>
+#include <QObject>
+#include <QPainter>
+#include <QRectF>
+#include <QString>
+#include <QThreadPool>
+#include <QVector>
+#include <atomic>
+
+// Renders a snapshot of the board to a PNG or JPG file at a multiple of its
+// scene resolution. The image is cut into fixed-size tiles that are painted
+// in parallel, one strip of tiles at a time. PNG strips are deflated into
+// the file as they are finished (when built with zlib), so memory stays at
+// one strip no matter how large the export; JPG is assembled in full first.
+class RasterExporter : public QObject {
+  Q_OBJECT
+
+public:
+  explicit RasterExporter(QObject *parent = nullptr);
+  ~RasterExporter();
+
+  // Starts an export of sourceRect (scene coordinates) scaled by scale.
+  // items must have been taken with DocumentWriter::snapshot(). Returns
+  // false when an export is already running.
+  bool start(const QString &fileName, const QVector<DocumentItem> &items,
+             const QRectF &sourceRect, qreal scale, const QColor &background);
+  void cancel();
+  bool isRunning() const;
+
+  // Paints the items that intersect clip, in order. Safe on any thread.
+  static void paintItems(QPainter *painter,
+                         const QVector<DocumentItem> &items,
+                         const QRectF &clip);
+
+signals:
+  void progress(int done, int total);
+  void finished(const QString &fileName, bool ok, const QString &error);
+
+private:
+  QThreadPool driverThread;
+  QThreadPool tileThreads;
+  std::atomic<bool> cancelled;
+  bool running;
+};
+
+#endif // RASTER_EXPORTER_H
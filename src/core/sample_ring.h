@@ -0,0 +1,54 @@
+// sample_ring.h
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <atomic>
+
+// Fixed-capacity, single-producer single-consumer queue. push() and pop()
+// never block or allocate, and the producer and consumer may live on
+// different threads. Capacity must be a power of two.
+template <typename T, unsigned Capacity> class SampleRing {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "SampleRing capacity must be a power of two");
+
+public:
+  SampleRing() : head(0), tail(0) {}
+
+  // Producer side. Returns false, dropping nothing, when the ring is full.
+  bool push(const T &value) {
+    const unsigned h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == Capacity)
+      return false;
+    buffer[h & (Capacity - 1)] = value;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false when there is nothing to take.
+  bool pop(T &value) {
+    const unsigned t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+      return false;
+    value = buffer[t & (Capacity - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool isEmpty() const {
+    return tail.load(std::memory_order_acquire) ==
+           head.load(std::memory_order_acquire);
+  }
+
+  // Consumer side: discards everything queued so far.
+  void clear() {
+    tail.store(head.load(std::memory_order_acquire),
+               std::memory_order_release);
+  }
+
+private:
+  T buffer[Capacity];
+  std::atomic<unsigned> head;
+  std::atomic<unsigned> tail;
+};
+
+#endif // SAMPLE_RING_H
@@ -0,0 +1,84 @@
+// selection_proxy.cpp
+#include "selection_proxy.h"
+#include "raster_exporter.h"
+#include <QRunnable>
+#include <QtMath>
+
+namespace {
+const int tileSize = 256;
+
+// Paints one tile into its place in the image. Tiles never overlap, so
+// they can run side by side.
+class TileTask : public QRunnable {
+public:
+  TileTask(uchar *bits, int bytesPerLine, const QSize &size,
+           const QRectF &sceneRect, qreal scale,
+           const QVector<DocumentItem> &items)
+      : bits(bits), bytesPerLine(bytesPerLine), size(size),
+        sceneRect(sceneRect), scale(scale), items(items) {}
+
+  void run() override {
+    QImage tile(bits, size.width(), size.height(), bytesPerLine,
+                QImage::Format_ARGB32_Premultiplied);
+    QPainter painter(&tile);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.scale(scale, scale);
+    painter.translate(-sceneRect.topLeft());
+    RasterExporter::paintItems(&painter, items, sceneRect);
+  }
+
+private:
+  uchar *bits;
+  int bytesPerLine;
+  QSize size;
+  QRectF sceneRect;
+  qreal scale;
+  const QVector<DocumentItem> &items;
+};
+} // namespace
+
+SelectionProxy::SelectionProxy() {}
+
+void SelectionProxy::render(const QVector<DocumentItem> &items,
+                            const QRectF &clip, qreal scale) {
+  clear();
+  const int width = qCeil(clip.width() * scale);
+  const int height = qCeil(clip.height() * scale);
+  if (width <= 0 || height <= 0)
+    return;
+  image = QImage(width, height, QImage::Format_ARGB32_Premultiplied);
+  if (image.isNull())
+    return;
+  image.fill(Qt::transparent);
+  sceneRect = QRectF(clip.topLeft(), QSizeF(width / scale, height / scale));
+
+  uchar *bits = image.bits();
+  const int bytesPerLine = image.bytesPerLine();
+  for (int top = 0; top < height; top += tileSize) {
+    for (int left = 0; left < width; left += tileSize) {
+      const QSize size(qMin(tileSize, width - left),
+                       qMin(tileSize, height - top));
+      const QRectF tileRect(sceneRect.left() + left / scale,
+                            sceneRect.top() + top / scale,
+                            size.width() / scale, size.height() / scale);
+      threads.start(new TileTask(bits + qint64(top) * bytesPerLine + left * 4,
+                                 bytesPerLine, size, tileRect, scale, items));
+    }
+  }
+  threads.waitForDone();
+}
+
+void SelectionProxy::clear() {
+  image = QImage();
+  sceneRect = QRectF();
+}
+
+bool SelectionProxy::isNull() const { return image.isNull(); }
+
+QRectF SelectionProxy::rect() const { return sceneRect; }
+
+void SelectionProxy::paint(QPainter *painter, const QPointF &offset) const {
+  if (image.isNull())
+    return;
+  painter->drawImage(sceneRect.translated(offset), image);
+}
@@ -0,0 +1,38 @@
+// selection_proxy.h
+#ifndef SELECTION_PROXY_H
+#define SELECTION_PROXY_H
+
+#include "document.h"
+#include <QImage>
+#include <QPainter>
+#include <QPointF>
+#include <QRectF>
+#include <QThreadPool>
+#include <QVector>
+
+// Stand-in for a dragged selection: the items painted once into one image,
+// tile by tile on worker threads, which the view then draws under the
+// drag's offset instead of moving every item on every mouse move.
+class SelectionProxy {
+public:
+  SelectionProxy();
+
+  // Paints items, which must have been taken with DocumentWriter::snapshot(),
+  // as far as they intersect clip, at scale device pixels per scene unit.
+  // Blocks until every tile is done.
+  void render(const QVector<DocumentItem> &items, const QRectF &clip,
+              qreal scale);
+  void clear();
+  bool isNull() const;
+  // Scene rect the image covers where the items were.
+  QRectF rect() const;
+  // Draws the image moved by offset; painter is in scene coordinates.
+  void paint(QPainter *painter, const QPointF &offset) const;
+
+private:
+  QThreadPool threads;
+  QImage image;
+  QRectF sceneRect;
+};
+
+#endif // SELECTION_PROXY_H
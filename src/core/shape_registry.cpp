@@ -0,0 +1,127 @@
+// shape_registry.cpp
+#include "shape_registry.h"
+#include <QPainterPath>
+
+namespace {
+// Highest record kind a document can hold.
+const int maxKind = 255;
+
+QString svgNumber(qreal value) { return QString::number(value, 'g', 6); }
+
+// Adds each shape of a compile-time list to a table.
+template <typename... Shapes> struct ShapeList;
+
+template <> struct ShapeList<> {
+  template <typename Table> static void addTo(Table &) {}
+};
+
+template <typename First, typename... Rest>
+struct ShapeList<First, Rest...> {
+  template <typename Table> static void addTo(Table &table) {
+    table.insert(ShapeRegistry::tool<First>());
+    ShapeList<Rest...>::addTo(table);
+  }
+};
+
+// In tool panel order.
+typedef ShapeList<RectangleShape, EllipseShape, LineShape> BuiltinShapes;
+} // namespace
+
+struct ShapeRegistry::Table {
+  Table() {
+    for (int i = 0; i <= maxKind; ++i) {
+      byKind[i] = nullptr;
+    }
+    BuiltinShapes::addTo(*this);
+  }
+
+  bool insert(const ShapeTool *tool) {
+    const int kind = tool->kind();
+    const QString tag = QString::fromLatin1(tool->streamTag());
+    if (kind == DocumentItem::Path || kind == DocumentItem::Fill || kind < 0 ||
+        kind > maxKind || byKind[kind] || byType.contains(tool->itemType()) ||
+        byTag.contains(tag))
+      return false;
+    byKind[kind] = tool;
+    byType.insert(tool->itemType(), tool);
+    byTag.insert(tag, tool);
+    ordered.append(tool);
+    return true;
+  }
+
+  const ShapeTool *byKind[maxKind + 1];
+  QHash<int, const ShapeTool *> byType;
+  QHash<QString, const ShapeTool *> byTag;
+  QList<const ShapeTool *> ordered;
+};
+
+ShapeRegistry::Table &ShapeRegistry::table() {
+  static Table instance;
+  return instance;
+}
+
+bool ShapeRegistry::add(const ShapeTool *tool) {
+  return table().insert(tool);
+}
+
+const QList<const ShapeTool *> &ShapeRegistry::tools() {
+  return table().ordered;
+}
+
+const ShapeTool *ShapeRegistry::forKind(int kind) {
+  return kind >= 0 && kind <= maxKind ? table().byKind[kind] : nullptr;
+}
+
+const ShapeTool *ShapeRegistry::forItemType(int type) {
+  return table().byType.value(type, nullptr);
+}
+
+const ShapeTool *ShapeRegistry::forStreamTag(const QString &tag) {
+  return table().byTag.value(tag, nullptr);
+}
+
+QString RectangleShape::svgElement(const QLineF &extent) {
+  const QRectF rect = box(extent);
+  return QString("<rect x=\"%1\" y=\"%2\" width=\"%3\" height=\"%4\"")
+      .arg(svgNumber(rect.x()))
+      .arg(svgNumber(rect.y()))
+      .arg(svgNumber(rect.width()))
+      .arg(svgNumber(rect.height()));
+}
+
+QList<QPolygonF> RectangleShape::outline(const QLineF &extent) {
+  const QRectF rect = box(extent);
+  QPolygonF polygon;
+  polygon << rect.topLeft() << rect.topRight() << rect.bottomRight()
+          << rect.bottomLeft() << rect.topLeft();
+  return QList<QPolygonF>() << polygon;
+}
+
+QString EllipseShape::svgElement(const QLineF &extent) {
+  const QRectF rect = box(extent);
+  return QString("<ellipse cx=\"%1\" cy=\"%2\" rx=\"%3\" ry=\"%4\"")
+      .arg(svgNumber(rect.center().x()))
+      .arg(svgNumber(rect.center().y()))
+      .arg(svgNumber(rect.width() / 2))
+      .arg(svgNumber(rect.height() / 2));
+}
+
+QList<QPolygonF> EllipseShape::outline(const QLineF &extent) {
+  QPainterPath path;
+  path.addEllipse(box(extent));
+  return path.toSubpathPolygons();
+}
+
+QString LineShape::svgElement(const QLineF &extent) {
+  return QString("<line x1=\"%1\" y1=\"%2\" x2=\"%3\" y2=\"%4\"")
+      .arg(svgNumber(extent.x1()))
+      .arg(svgNumber(extent.y1()))
+      .arg(svgNumber(extent.x2()))
+      .arg(svgNumber(extent.y2()));
+}
+
+QList<QPolygonF> LineShape::outline(const QLineF &extent) {
+  QPolygonF polygon;
+  polygon << extent.p1() << extent.p2();
+  return QList<QPolygonF>() << polygon;
+}
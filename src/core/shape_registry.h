@@ -0,0 +1,271 @@
+// shape_registry.h
+#ifndef SHAPE_REGISTRY_H
+#define SHAPE_REGISTRY_H
+
+#include "document.h"
+#include <QAbstractGraphicsShapeItem>
+#include <QDataStream>
+#include <QGraphicsEllipseItem>
+#include <QGraphicsItem>
+#include <QGraphicsLineItem>
+#include <QGraphicsRectItem>
+#include <QHash>
+#include <QLineF>
+#include <QList>
+#include <QPainter>
+#include <QPen>
+#include <QPolygonF>
+#include <QString>
+#include <type_traits>
+
+// A shape that is dragged out between two points: how it is drawn on the
+// canvas, stored in documents and on the clipboard, rendered for export and
+// outlined for the eraser. Freehand strokes are not shapes; they have their
+// own item and record kind.
+class ShapeTool {
+public:
+  virtual ~ShapeTool() {}
+
+  // Label for the tool panel.
+  virtual const char *name() const = 0;
+  // Record kind in documents; each shape has its own.
+  virtual DocumentItem::Kind kind() const = 0;
+  // QGraphicsItem::type() of the items the shape makes.
+  virtual int itemType() const = 0;
+  // Type tag in the clipboard item stream.
+  virtual const char *streamTag() const = 0;
+
+  // New scene-less item collapsed onto point.
+  virtual QGraphicsItem *begin(const QPointF &point,
+                               const QPen &pen) const = 0;
+  // Reshapes an item made by begin() to span from..to.
+  virtual void drag(QGraphicsItem *item, const QPointF &from,
+                    const QPointF &to) const = 0;
+
+  // Fills in the extent, pen and brush of record from item.
+  virtual void snapshot(const QGraphicsItem *item,
+                        DocumentItem &record) const = 0;
+  // New scene-less item from the extent, pen and brush of record.
+  virtual QGraphicsItem *create(const DocumentItem &record) const = 0;
+  // Paints record in item coordinates with its pen and brush already set.
+  // Safe to call on any thread.
+  virtual void paint(QPainter *painter, const DocumentItem &record) const = 0;
+  // Opening SVG element for record, without attributes for the style.
+  virtual QString svgElement(const DocumentItem &record) const = 0;
+  // Clipboard stream encoding of everything in record but its tag.
+  virtual void write(QDataStream &stream,
+                     const DocumentItem &record) const = 0;
+  virtual bool read(QDataStream &stream, DocumentItem &record) const = 0;
+
+  virtual QPen itemPen(const QGraphicsItem *item) const = 0;
+  // Painted outline of item in item coordinates, for hit testing.
+  virtual QList<QPolygonF> outline(const QGraphicsItem *item) const = 0;
+};
+
+namespace shape_detail {
+inline QBrush brushOf(const QAbstractGraphicsShapeItem *item) {
+  return item->brush();
+}
+inline QBrush brushOf(const QGraphicsItem *) { return QBrush(); }
+inline void setBrushOf(QAbstractGraphicsShapeItem *item,
+                       const QBrush &brush) {
+  item->setBrush(brush);
+}
+inline void setBrushOf(QGraphicsItem *, const QBrush &) {}
+} // namespace shape_detail
+
+// Implements ShapeTool from a shape description with static members:
+//
+//   typedef ... Item;                 // QGraphicsItem subclass with a pen
+//   static const DocumentItem::Kind kind;
+//   static const char *name();
+//   static const char *streamTag();
+//   static QLineF extent(const Item *item);
+//   static void setExtent(Item *item, const QLineF &extent);
+//   static void paint(QPainter *painter, const QLineF &extent);
+//   static QString svgElement(const QLineF &extent);
+//   static void writeExtent(QDataStream &stream, const QLineF &extent);
+//   static QLineF readExtent(QDataStream &stream);
+//   static QList<QPolygonF> outline(const QLineF &extent);
+//
+// Every call is resolved at compile time, so each virtual above costs one
+// indirect call into code specialized for the shape. Items with a brush
+// (QAbstractGraphicsShapeItem subclasses) store and stream it as well.
+template <typename Shape> class ShapeToolFor : public ShapeTool {
+public:
+  typedef typename Shape::Item Item;
+  static const bool filled =
+      std::is_base_of<QAbstractGraphicsShapeItem, Item>::value;
+
+  const char *name() const override { return Shape::name(); }
+  DocumentItem::Kind kind() const override { return Shape::kind; }
+  int itemType() const override { return Item::Type; }
+  const char *streamTag() const override { return Shape::streamTag(); }
+
+  QGraphicsItem *begin(const QPointF &point,
+                       const QPen &pen) const override {
+    Item *item = new Item();
+    Shape::setExtent(item, QLineF(point, point));
+    item->setPen(pen);
+    return item;
+  }
+
+  void drag(QGraphicsItem *item, const QPointF &from,
+            const QPointF &to) const override {
+    Shape::setExtent(static_cast<Item *>(item), QLineF(from, to));
+  }
+
+  void snapshot(const QGraphicsItem *item,
+                DocumentItem &record) const override {
+    const Item *shapeItem = static_cast<const Item *>(item);
+    record.extent = Shape::extent(shapeItem);
+    record.pen = shapeItem->pen();
+    record.brush = shape_detail::brushOf(shapeItem);
+  }
+
+  QGraphicsItem *create(const DocumentItem &record) const override {
+    Item *item = new Item();
+    Shape::setExtent(item, record.extent);
+    item->setPen(record.pen);
+    shape_detail::setBrushOf(item, record.brush);
+    return item;
+  }
+
+  void paint(QPainter *painter, const DocumentItem &record) const override {
+    Shape::paint(painter, record.extent);
+  }
+
+  QString svgElement(const DocumentItem &record) const override {
+    return Shape::svgElement(record.extent);
+  }
+
+  void write(QDataStream &stream,
+             const DocumentItem &record) const override {
+    Shape::writeExtent(stream, record.extent);
+    stream << record.pos << record.pen;
+    if (filled)
+      stream << record.brush;
+  }
+
+  bool read(QDataStream &stream, DocumentItem &record) const override {
+    record.kind = Shape::kind;
+    record.extent = Shape::readExtent(stream);
+    stream >> record.pos >> record.pen;
+    if (filled)
+      stream >> record.brush;
+    return stream.status() == QDataStream::Ok;
+  }
+
+  QPen itemPen(const QGraphicsItem *item) const override {
+    return static_cast<const Item *>(item)->pen();
+  }
+
+  QList<QPolygonF> outline(const QGraphicsItem *item) const override {
+    return Shape::outline(Shape::extent(static_cast<const Item *>(item)));
+  }
+};
+
+// The extent of a box shape is its rect's top-left and bottom-right corner.
+struct BoxShape {
+  static QRectF box(const QLineF &extent) {
+    return QRectF(extent.p1(), extent.p2()).normalized();
+  }
+  static QLineF extentOf(const QRectF &rect) {
+    return QLineF(rect.topLeft(), rect.bottomRight());
+  }
+  static void writeExtent(QDataStream &stream, const QLineF &extent) {
+    stream << box(extent);
+  }
+  static QLineF readExtent(QDataStream &stream) {
+    QRectF rect;
+    stream >> rect;
+    return extentOf(rect);
+  }
+};
+
+struct RectangleShape : BoxShape {
+  typedef QGraphicsRectItem Item;
+  static const DocumentItem::Kind kind = DocumentItem::Rectangle;
+  static const char *name() { return "Rectangle"; }
+  static const char *streamTag() { return "Rectangle"; }
+  static QLineF extent(const Item *item) { return extentOf(item->rect()); }
+  static void setExtent(Item *item, const QLineF &extent) {
+    item->setRect(box(extent));
+  }
+  static void paint(QPainter *painter, const QLineF &extent) {
+    painter->drawRect(box(extent));
+  }
+  static QString svgElement(const QLineF &extent);
+  static QList<QPolygonF> outline(const QLineF &extent);
+};
+
+struct EllipseShape : BoxShape {
+  typedef QGraphicsEllipseItem Item;
+  static const DocumentItem::Kind kind = DocumentItem::Ellipse;
+  static const char *name() { return "Circle"; }
+  static const char *streamTag() { return "Ellipse"; }
+  static QLineF extent(const Item *item) { return extentOf(item->rect()); }
+  static void setExtent(Item *item, const QLineF &extent) {
+    item->setRect(box(extent));
+  }
+  static void paint(QPainter *painter, const QLineF &extent) {
+    painter->drawEllipse(box(extent));
+  }
+  static QString svgElement(const QLineF &extent);
+  static QList<QPolygonF> outline(const QLineF &extent);
+};
+
+struct LineShape {
+  typedef QGraphicsLineItem Item;
+  static const DocumentItem::Kind kind = DocumentItem::Line;
+  static const char *name() { return "Line"; }
+  static const char *streamTag() { return "Line"; }
+  static QLineF extent(const Item *item) { return item->line(); }
+  static void setExtent(Item *item, const QLineF &extent) {
+    item->setLine(extent);
+  }
+  static void paint(QPainter *painter, const QLineF &extent) {
+    painter->drawLine(extent);
+  }
+  static QString svgElement(const QLineF &extent);
+  static void writeExtent(QDataStream &stream, const QLineF &extent) {
+    stream << extent;
+  }
+  static QLineF readExtent(QDataStream &stream) {
+    QLineF extent;
+    stream >> extent;
+    return extent;
+  }
+  static QList<QPolygonF> outline(const QLineF &extent);
+};
+
+// Every shape the canvas can draw. The built-in shapes are listed at
+// compile time; add-ons register theirs with add() during startup, before
+// the first canvas is made or document opened. Lookups take no lock and do
+// no string work, except forStreamTag() when decoding the clipboard.
+class ShapeRegistry {
+public:
+  // The one ShapeTool for a shape description.
+  template <typename Shape> static const ShapeTool *tool() {
+    static const ShapeToolFor<Shape> instance;
+    return &instance;
+  }
+
+  // Adds an add-on shape. Returns false, leaving the registry unchanged,
+  // when its kind, item type or stream tag is already taken.
+  template <typename Shape> static bool add() { return add(tool<Shape>()); }
+
+  // Built-in shapes first, then add-ons in the order they were added.
+  static const QList<const ShapeTool *> &tools();
+  static const ShapeTool *forKind(int kind);
+  static const ShapeTool *forItemType(int type);
+  static const ShapeTool *forStreamTag(const QString &tag);
+
+private:
+  struct Table;
+
+  static Table &table();
+  static bool add(const ShapeTool *tool);
+};
+
+#endif // SHAPE_REGISTRY_H
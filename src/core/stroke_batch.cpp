@@ -0,0 +1,80 @@
+// stroke_batch.cpp
+#include "stroke_batch.h"
+#include "document.h"
+#include "layer_item.h"
+#include <QPainter>
+#include <QStyleOptionGraphicsItem>
+
+StrokeBatchItem::StrokeBatchItem(const QVector<Member> &members,
+                                 QGraphicsItem *parent)
+    : QGraphicsItem(parent), memberList(members) {
+  setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+  for (const Member &member : memberList) {
+    bounds |= member.bounds;
+  }
+}
+
+bool StrokeBatchItem::canHold(const StrokeItem *stroke) {
+  const QGraphicsItem *parent = stroke->parentItem();
+  return (!parent || parent->type() == LayerItem::Type) &&
+         stroke->childItems().isEmpty() &&
+         !stroke->isSelected() &&
+         stroke->transform().type() == QTransform::TxNone &&
+         !stroke->segments().isEmpty();
+}
+
+StrokeBatchItem::Member StrokeBatchItem::memberFor(const StrokeItem *stroke) {
+  const QPointF offset = stroke->pos();
+  Member member;
+  member.start = stroke->startPoint() + offset;
+  member.segments = stroke->segments();
+  if (!offset.isNull()) {
+    for (StrokeItem::Segment &segment : member.segments) {
+      segment.control1 += offset;
+      segment.control2 += offset;
+      segment.end += offset;
+    }
+  }
+  member.pen = stroke->pen();
+  member.widthScale = stroke->maxWidthScale();
+  member.bounds = stroke->sceneBoundingRect();
+  member.tag = stroke->data(DocumentItem::tagKey).toUInt();
+  member.order = LayerItem::stackOrder(stroke);
+  return member;
+}
+
+const QVector<StrokeBatchItem::Member> &StrokeBatchItem::members() const {
+  return memberList;
+}
+
+QList<StrokeItem *> StrokeBatchItem::createStrokes() const {
+  QList<StrokeItem *> strokes;
+  strokes.reserve(memberList.size());
+  for (const Member &member : memberList) {
+    StrokeItem *stroke =
+        new StrokeItem(member.start, member.segments, member.pen);
+    if (member.tag)
+      stroke->setData(DocumentItem::tagKey, member.tag);
+    strokes.append(stroke);
+  }
+  return strokes;
+}
+
+QRectF StrokeBatchItem::boundingRect() const { return bounds; }
+
+void StrokeBatchItem::paint(QPainter *painter,
+                            const QStyleOptionGraphicsItem *option,
+                            QWidget *widget) {
+  Q_UNUSED(widget);
+
+  const QRectF exposed = option->exposedRect;
+  painter->setBrush(Qt::NoBrush);
+  for (const Member &member : memberList) {
+    if (!member.bounds.intersects(exposed))
+      continue;
+    StrokeItem::drawSegments(painter, member.pen, member.start,
+                             member.segments, 0, int(member.segments.size()));
+  }
+}
+
+int StrokeBatchItem::type() const { return Type; }
@@ -0,0 +1,67 @@
+// stroke_batch.h
+#ifndef STROKE_BATCH_H
+#define STROKE_BATCH_H
+
+#include "stroke_item.h"
+#include <QGraphicsItem>
+#include <QList>
+#include <QPen>
+#include <QRectF>
+#include <QVector>
+
+// Finished strokes flattened into one item, so a board of thousands of
+// gestures keeps a few hundred items in the scene index instead. Members
+// keep their own geometry and pen in scene coordinates and are painted in
+// order; the batch itself is neither selectable nor movable. Erasing turns
+// the batch back into separate strokes first (see createStrokes()).
+class StrokeBatchItem : public QGraphicsItem {
+public:
+  enum { Type = UserType + 2 };
+
+  // A batch stops growing at this many members or once its members span
+  // more than maxExtent scene units either way, which keeps it well inside
+  // one ChunkStore chunk and cheap to repaint.
+  static const int maxMembers = 256;
+  static const int maxExtent = 1024;
+
+  struct Member {
+    Member() : widthScale(1.0), tag(0), order(0) {}
+
+    QPointF start;
+    QVector<StrokeItem::Segment> segments;
+    QPen pen;
+    // StrokeItem::maxWidthScale() of the stroke
+    qreal widthScale;
+    QRectF bounds;
+    // DocumentItem::tag of the stroke
+    quint32 tag;
+    // LayerItem::stackOrder() of the stroke
+    quint64 order;
+  };
+
+  explicit StrokeBatchItem(const QVector<Member> &members,
+                           QGraphicsItem *parent = nullptr);
+
+  // Whether stroke can be flattened: a finished stroke directly in a layer
+  // (or at the top level) that is only translated.
+  static bool canHold(const StrokeItem *stroke);
+  // The stroke's geometry moved into scene coordinates; segments are shared
+  // unless the stroke has been moved.
+  static Member memberFor(const StrokeItem *stroke);
+
+  const QVector<Member> &members() const;
+  // New scene-less strokes, one per member and tagged like it, in painting
+  // order.
+  QList<StrokeItem *> createStrokes() const;
+
+  QRectF boundingRect() const override;
+  void paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
+             QWidget *widget = nullptr) override;
+  int type() const override;
+
+private:
+  QVector<Member> memberList;
+  QRectF bounds;
+};
+
+#endif // STROKE_BATCH_H
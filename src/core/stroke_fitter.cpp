@@ -0,0 +1,262 @@
+// stroke_fitter.cpp
+#include "stroke_fitter.h"
+#include <QtMath>
+
+namespace {
+typedef StrokeItem::Segment Segment;
+
+// Points taken along each input segment; the fit is checked against these.
+const int samplesPerSegment = 3;
+// Reparameterization rounds tried before a piece is split.
+const int maxIterations = 4;
+// A piece whose error is within this multiple of the tolerance is worth
+// reparameterizing rather than splitting straight away.
+const qreal iterationFactor = 4.0;
+// Same width split as StrokeItem::drawSegments().
+const qreal widthStep = 0.05;
+
+struct Cubic {
+  QPointF p0, p1, p2, p3;
+};
+
+struct Piece {
+  int first;
+  int last;
+  QPointF leftTangent;
+  QPointF rightTangent;
+};
+
+qreal dot(const QPointF &a, const QPointF &b) {
+  return QPointF::dotProduct(a, b);
+}
+
+QPointF normalized(const QPointF &v) {
+  const qreal length = qSqrt(dot(v, v));
+  return length > 1e-12 ? v / length : QPointF();
+}
+
+QPointF pointAt(const Cubic &c, qreal t) {
+  const qreal u = 1 - t;
+  return u * u * u * c.p0 + 3 * u * u * t * c.p1 + 3 * u * t * t * c.p2 +
+         t * t * t * c.p3;
+}
+
+QPointF firstDerivative(const Cubic &c, qreal t) {
+  const qreal u = 1 - t;
+  return 3 * u * u * (c.p1 - c.p0) + 6 * u * t * (c.p2 - c.p1) +
+         3 * t * t * (c.p3 - c.p2);
+}
+
+QPointF secondDerivative(const Cubic &c, qreal t) {
+  return 6 * (1 - t) * (c.p2 - 2 * c.p1 + c.p0) +
+         6 * t * (c.p3 - 2 * c.p2 + c.p1);
+}
+
+// Normalized chord length of each point from the first.
+QVector<qreal> chordLengths(const QVector<QPointF> &points, int first,
+                            int last) {
+  QVector<qreal> u(last - first + 1);
+  u[0] = 0;
+  for (int i = first + 1; i <= last; ++i) {
+    const QPointF step = points.at(i) - points.at(i - 1);
+    u[i - first] = u[i - first - 1] + qSqrt(dot(step, step));
+  }
+  const qreal total = u.last();
+  for (int i = 1; i < u.size(); ++i) {
+    u[i] = total > 0 ? u.at(i) / total : qreal(i) / (u.size() - 1);
+  }
+  return u;
+}
+
+// Least-squares control points for the given parameters and end tangents.
+Cubic generate(const QVector<QPointF> &points, int first, int last,
+               const QVector<qreal> &u, const QPointF &leftTangent,
+               const QPointF &rightTangent) {
+  const QPointF p0 = points.at(first);
+  const QPointF p3 = points.at(last);
+  qreal c00 = 0, c01 = 0, c11 = 0, x0 = 0, x1 = 0;
+  for (int i = 0; i < u.size(); ++i) {
+    const qreal t = u.at(i);
+    const qreal s = 1 - t;
+    const qreal b0 = s * s * s, b1 = 3 * s * s * t, b2 = 3 * s * t * t,
+                b3 = t * t * t;
+    const QPointF a0 = leftTangent * b1;
+    const QPointF a1 = rightTangent * b2;
+    c00 += dot(a0, a0);
+    c01 += dot(a0, a1);
+    c11 += dot(a1, a1);
+    const QPointF rest = points.at(first + i) - (p0 * (b0 + b1) +
+                                                 p3 * (b2 + b3));
+    x0 += dot(a0, rest);
+    x1 += dot(a1, rest);
+  }
+
+  const qreal det = c00 * c11 - c01 * c01;
+  const qreal alphaLeft = det != 0 ? (x0 * c11 - x1 * c01) / det : 0;
+  const qreal alphaRight = det != 0 ? (c00 * x1 - c01 * x0) / det : 0;
+
+  Cubic c;
+  c.p0 = p0;
+  c.p3 = p3;
+  const QPointF chord = p3 - p0;
+  const qreal length = qSqrt(dot(chord, chord));
+  const qreal epsilon = 1e-6 * length;
+  if (alphaLeft < epsilon || alphaRight < epsilon) {
+    // The solve failed or the tangents point the wrong way; fall back to
+    // Wu and Barsky's heuristic.
+    c.p1 = p0 + leftTangent * (length / 3);
+    c.p2 = p3 + rightTangent * (length / 3);
+  } else {
+    c.p1 = p0 + leftTangent * alphaLeft;
+    c.p2 = p3 + rightTangent * alphaRight;
+  }
+  return c;
+}
+
+// Largest squared distance of an inner point from the curve, and where.
+qreal maxError(const QVector<QPointF> &points, int first, int last,
+               const Cubic &c, const QVector<qreal> &u, int *split) {
+  qreal worst = 0;
+  *split = (first + last) / 2;
+  for (int i = first + 1; i < last; ++i) {
+    const QPointF offset = pointAt(c, u.at(i - first)) - points.at(i);
+    const qreal error = dot(offset, offset);
+    if (error >= worst) {
+      worst = error;
+      *split = i;
+    }
+  }
+  return worst;
+}
+
+// One Newton-Raphson step per point towards its closest curve parameter.
+void reparameterize(const QVector<QPointF> &points, int first,
+                    const Cubic &c, QVector<qreal> &u) {
+  for (int i = 0; i < u.size(); ++i) {
+    const qreal t = u.at(i);
+    const QPointF offset = pointAt(c, t) - points.at(first + i);
+    const QPointF d1 = firstDerivative(c, t);
+    const QPointF d2 = secondDerivative(c, t);
+    const qreal denominator = dot(d1, d1) + dot(offset, d2);
+    if (qAbs(denominator) > 1e-12)
+      u[i] = qBound<qreal>(0.0, t - dot(offset, d1) / denominator, 1.0);
+  }
+}
+
+// Fits all of points and appends the segments, each carrying scale.
+void fitRun(const QVector<QPointF> &points, qreal tolerance, qreal scale,
+            QVector<Segment> &out) {
+  const int end = int(points.size()) - 1;
+  if (end < 1)
+    return;
+
+  const qreal squaredTolerance = tolerance * tolerance;
+  // Pieces are handled left to right; the stack keeps the right halves.
+  QVector<Piece> stack;
+  Piece whole;
+  whole.first = 0;
+  whole.last = end;
+  whole.leftTangent = normalized(points.at(1) - points.at(0));
+  whole.rightTangent = normalized(points.at(end - 1) - points.at(end));
+  stack.append(whole);
+
+  while (!stack.isEmpty()) {
+    const Piece piece = stack.takeLast();
+    Cubic c;
+    bool fitted = false;
+    int split = 0;
+
+    if (piece.last - piece.first == 1) {
+      const QPointF chord = points.at(piece.last) - points.at(piece.first);
+      const qreal third = qSqrt(dot(chord, chord)) / 3;
+      c.p0 = points.at(piece.first);
+      c.p3 = points.at(piece.last);
+      c.p1 = c.p0 + piece.leftTangent * third;
+      c.p2 = c.p3 + piece.rightTangent * third;
+      fitted = true;
+    } else {
+      QVector<qreal> u = chordLengths(points, piece.first, piece.last);
+      c = generate(points, piece.first, piece.last, u, piece.leftTangent,
+                   piece.rightTangent);
+      qreal error = maxError(points, piece.first, piece.last, c, u, &split);
+      if (error < squaredTolerance * iterationFactor * iterationFactor) {
+        for (int i = 0; i < maxIterations && error >= squaredTolerance;
+             ++i) {
+          reparameterize(points, piece.first, c, u);
+          c = generate(points, piece.first, piece.last, u,
+                       piece.leftTangent, piece.rightTangent);
+          error = maxError(points, piece.first, piece.last, c, u, &split);
+        }
+      }
+      fitted = error < squaredTolerance;
+    }
+
+    if (fitted) {
+      Segment segment;
+      segment.control1 = c.p1;
+      segment.control2 = c.p2;
+      segment.end = c.p3;
+      segment.widthScale = scale;
+      out.append(segment);
+      continue;
+    }
+
+    const QPointF center =
+        normalized(points.at(split - 1) - points.at(split + 1));
+    Piece left = piece;
+    left.last = split;
+    left.rightTangent = center;
+    Piece right = piece;
+    right.first = split;
+    right.leftTangent = -center;
+    stack.append(right);
+    stack.append(left);
+  }
+}
+} // namespace
+
+QVector<Segment> StrokeFitter::fit(const QPointF &start,
+                                   const QVector<Segment> &segments,
+                                   qreal tolerance) {
+  if (segments.size() < 2 || tolerance <= 0)
+    return segments;
+
+  QVector<Segment> result;
+  QPointF from = start;
+  int i = 0;
+  while (i < segments.size()) {
+    // Sample one run of similar width along the existing curve, skipping
+    // repeated points that would give the fit zero-length tangents.
+    const qreal scale = segments.at(i).widthScale;
+    QVector<QPointF> points;
+    points.append(from);
+    for (; i < segments.size() &&
+           qAbs(segments.at(i).widthScale - scale) < widthStep;
+         ++i) {
+      const Segment &segment = segments.at(i);
+      Cubic c;
+      c.p0 = from;
+      c.p1 = segment.control1;
+      c.p2 = segment.control2;
+      c.p3 = segment.end;
+      for (int k = 1; k <= samplesPerSegment; ++k) {
+        const QPointF point = pointAt(c, qreal(k) / samplesPerSegment);
+        const QPointF step = point - points.last();
+        if (dot(step, step) > 1e-12)
+          points.append(point);
+      }
+      from = segment.end;
+    }
+    if (points.size() < 2) {
+      // A run that never moved; keep it as the original did.
+      Segment still;
+      still.control1 = still.control2 = still.end = from;
+      still.widthScale = scale;
+      result.append(still);
+      continue;
+    }
+    fitRun(points, tolerance, scale, result);
+  }
+
+  return result.size() < segments.size() ? result : segments;
+}
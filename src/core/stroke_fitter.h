@@ -0,0 +1,23 @@
+// stroke_fitter.h
+#ifndef STROKE_FITTER_H
+#define STROKE_FITTER_H
+
+#include "stroke_item.h"
+#include <QPointF>
+#include <QVector>
+
+// Refits a finished stroke with as few cubic segments as stay within a
+// tolerance of it, after Schneider's "An Algorithm for Automatically Fitting
+// Digitized Curves" (Graphics Gems, 1990). Runs of similar width are fitted
+// separately so pressure strokes keep their shape. Pure geometry; safe to
+// call on any thread.
+class StrokeFitter {
+public:
+  // Returns the refitted segments for a stroke starting at start, or the
+  // input unchanged when fitting would not make it any smaller.
+  static QVector<StrokeItem::Segment>
+  fit(const QPointF &start, const QVector<StrokeItem::Segment> &segments,
+      qreal tolerance);
+};
+
+#endif // STROKE_FITTER_H
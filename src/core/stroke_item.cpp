@@ -0,0 +1,451 @@
+// stroke_item.cpp
+#include "stroke_item.h"
+#include "gl_stroke_renderer.h"
+#include <QPainter>
+#include <QPainterPathStroker>
+#include <QPair>
+#include <QStyle>
+#include <QStyleOptionGraphicsItem>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+
+namespace {
+const int segmentsPerChunk = 32;
+// Extra room added whenever the bounding rect has to grow, so a stroke being
+// drawn only calls prepareGeometryChange() once every few dozen pixels.
+const qreal growthSlack = 64.0;
+// Variable-width runs are split once the width drifts this far (relative
+// to the pen width) from the start of the run.
+const qreal widthStep = 0.05;
+// Outlines are simplified to within this many device pixels of the curve.
+const qreal outlinePixelTolerance = 0.5;
+// Tolerance of the finest outline in item units; each following level
+// doubles it.
+const qreal outlineBaseTolerance = 1.0;
+const int outlineLevels = 5;
+// Shorter strokes are cheap enough to paint in full at any scale.
+const int minOutlineSegments = 16;
+
+QPointF bezierPoint(const QPointF &from, const StrokeItem::Segment &segment,
+                    qreal t) {
+  const qreal u = 1 - t;
+  return u * u * u * from + 3 * u * u * t * segment.control1 +
+         3 * u * t * t * segment.control2 + t * t * t * segment.end;
+}
+
+qreal distanceToChord(const QPointF &point, const QPointF &a,
+                      const QPointF &b) {
+  const QPointF chord = b - a;
+  const qreal length = qSqrt(QPointF::dotProduct(chord, chord));
+  const QPointF offset = point - a;
+  if (length < 1e-9)
+    return qSqrt(QPointF::dotProduct(offset, offset));
+  return qAbs(chord.x() * offset.y() - chord.y() * offset.x()) / length;
+}
+
+// Ramer-Douglas-Peucker over points, with an explicit stack so long strokes
+// cannot overflow the call stack. Returns the indices to keep, in order.
+QVector<int> simplify(const QVector<QPointF> &points, qreal tolerance) {
+  QVector<int> kept;
+  if (points.isEmpty())
+    return kept;
+  kept.append(0);
+  kept.append(int(points.size()) - 1);
+
+  QVector<QPair<int, int>> ranges;
+  ranges.append(qMakePair(0, int(points.size()) - 1));
+  while (!ranges.isEmpty()) {
+    const QPair<int, int> range = ranges.takeLast();
+    qreal farthest = 0;
+    int split = -1;
+    for (int i = range.first + 1; i < range.second; ++i) {
+      const qreal d = distanceToChord(points.at(i), points.at(range.first),
+                                      points.at(range.second));
+      if (d > farthest) {
+        farthest = d;
+        split = i;
+      }
+    }
+    if (split < 0 || farthest <= tolerance)
+      continue;
+    kept.append(split);
+    ranges.append(qMakePair(range.first, split));
+    ranges.append(qMakePair(split, range.second));
+  }
+  std::sort(kept.begin(), kept.end());
+  return kept;
+}
+} // namespace
+
+StrokeItem::StrokeItem(const QPointF &start, const QPen &pen,
+                       qreal widthScale, QGraphicsItem *parent)
+    : QGraphicsItem(parent), start(start), sampleCount(1),
+      acceptingInput(true), strokePen(pen), geometryRevision(0),
+      widestScale(1.0), variableWidth(false), shapeDirty(true) {
+  setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+  recentPoints[0] = start;
+  recentScales[0] = widthScale;
+  rebuildBounds();
+}
+
+StrokeItem::StrokeItem(const QPointF &start, const QVector<Segment> &segments,
+                       const QPen &pen, QGraphicsItem *parent)
+    : QGraphicsItem(parent), start(start), segmentList(segments),
+      sampleCount(0), acceptingInput(false), strokePen(pen),
+      geometryRevision(0), widestScale(1.0), variableWidth(false),
+      shapeDirty(true) {
+  setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+  rebuildBounds();
+  bounds = contentRect;
+}
+
+StrokeItem::~StrokeItem() {
+#ifdef HAVE_OPENGL
+  GlStrokeRenderer::forget(this);
+#endif
+}
+
+void StrokeItem::addPoint(const QPointF &point, qreal widthScale) {
+  if (!acceptingInput)
+    return;
+  recentPoints[sampleCount % smoothingWindow] = point;
+  recentScales[sampleCount % smoothingWindow] = widthScale;
+  ++sampleCount;
+
+  if (sampleCount >= smoothingWindow) {
+    // Oldest to newest, p3 being the sample just added.
+    const int oldest = sampleCount - smoothingWindow;
+    QPointF p0 = recentPoints[oldest % smoothingWindow];
+    QPointF p1 = recentPoints[(oldest + 1) % smoothingWindow];
+    QPointF p2 = recentPoints[(oldest + 2) % smoothingWindow];
+    QPointF p3 = recentPoints[(oldest + 3) % smoothingWindow];
+
+    Segment segment;
+    segment.control1 = p1 + (p2 - p0) / 6.0;
+    segment.control2 = p2 - (p3 - p1) / 6.0;
+    segment.end = p2;
+    segment.widthScale = recentScales[(oldest + 2) % smoothingWindow];
+    appendSegment(segment);
+  }
+}
+
+void StrokeItem::appendSegment(const Segment &segment) {
+  segmentList.append(segment);
+  shapeDirty = true;
+  outlines.clear();
+  ++geometryRevision;
+  if (segmentList.size() == 1)
+    widestScale = segment.widthScale;
+  widestScale = qMax(widestScale, segment.widthScale);
+  variableWidth = variableWidth || segment.widthScale != 1.0;
+
+  const int index = segmentList.size() - 1;
+  const QRectF dirty = segmentBounds(index);
+
+  if (index % segmentsPerChunk == 0) {
+    chunkBounds.append(dirty);
+  } else {
+    chunkBounds.last() = chunkBounds.last().united(dirty);
+  }
+  contentRect = contentRect.united(dirty);
+
+  if (!bounds.contains(dirty)) {
+    prepareGeometryChange();
+    bounds = contentRect.adjusted(-growthSlack, -growthSlack, growthSlack,
+                                  growthSlack);
+  } else {
+    update(dirty);
+  }
+}
+
+void StrokeItem::finishStroke() {
+  acceptingInput = false;
+  if (bounds != contentRect) {
+    prepareGeometryChange();
+    bounds = contentRect;
+  }
+}
+
+bool StrokeItem::replaceSegments(const QVector<Segment> &segments,
+                                 quint64 expectedRevision) {
+  if (geometryRevision != expectedRevision || acceptingInput)
+    return false;
+  prepareGeometryChange();
+  segmentList = segments;
+  shapeDirty = true;
+  outlines.clear();
+  ++geometryRevision;
+  rebuildBounds();
+  bounds = contentRect;
+  return true;
+}
+
+QPointF StrokeItem::startPoint() const { return start; }
+
+int StrokeItem::pointCount() const { return sampleCount; }
+
+const QVector<StrokeItem::Segment> &StrokeItem::segments() const {
+  return segmentList;
+}
+
+QPainterPath StrokeItem::path() const {
+  QPainterPath result(start);
+  result.reserve(segmentList.size() * 3 + 1);
+  for (const Segment &segment : segmentList) {
+    result.cubicTo(segment.control1, segment.control2, segment.end);
+  }
+  return result;
+}
+
+quint64 StrokeItem::revision() const { return geometryRevision; }
+
+qreal StrokeItem::maxWidthScale() const { return widestScale; }
+
+bool StrokeItem::hasVariableWidth() const { return variableWidth; }
+
+QPen StrokeItem::pen() const { return strokePen; }
+
+void StrokeItem::setPen(const QPen &pen) {
+  if (strokePen == pen)
+    return;
+  prepareGeometryChange();
+  strokePen = pen;
+  shapeDirty = true;
+  ++geometryRevision;
+  rebuildBounds();
+  bounds = contentRect;
+}
+
+QRectF StrokeItem::boundingRect() const { return bounds; }
+
+QPainterPath StrokeItem::shape() const {
+  if (shapeDirty) {
+    QPen outline = strokePen;
+    outline.setWidthF(strokePen.widthF() * widestScale);
+    QPainterPathStroker stroker(outline);
+    cachedShape = stroker.createStroke(path());
+    shapeDirty = false;
+  }
+  return cachedShape;
+}
+
+void StrokeItem::paint(QPainter *painter,
+                       const QStyleOptionGraphicsItem *option,
+                       QWidget *widget) {
+  Q_UNUSED(widget);
+
+  bool drawn = false;
+#ifdef HAVE_OPENGL
+  // On a GL viewport the stroke comes from its vertex buffer.
+  drawn = GlStrokeRenderer::draw(painter, this);
+#endif
+  // A stroke still being drawn changes every frame; simplifying it would
+  // cost more than it saves.
+  if (!drawn && !acceptingInput) {
+    drawn = paintOutline(painter,
+                         QStyleOptionGraphicsItem::levelOfDetailFromTransform(
+                             painter->worldTransform()));
+  }
+
+  const QRectF exposed = option->exposedRect;
+  int runStart = -1;
+  int runEnd = -1;
+
+  painter->setBrush(Qt::NoBrush);
+  for (int chunk = 0; !drawn && chunk < chunkBounds.size(); ++chunk) {
+    if (!chunkBounds.at(chunk).intersects(exposed))
+      continue;
+
+    const int first = chunk * segmentsPerChunk;
+    const int last = qMin(first + segmentsPerChunk, int(segmentList.size()));
+    if (first != runEnd) {
+      if (runStart >= 0) {
+        drawSegments(painter, strokePen, segmentStart(runStart), segmentList,
+                     runStart, runEnd);
+      }
+      runStart = first;
+    }
+    runEnd = last;
+  }
+  if (runStart >= 0) {
+    drawSegments(painter, strokePen, segmentStart(runStart), segmentList,
+                 runStart, runEnd);
+  }
+
+  if (option->state & QStyle::State_Selected) {
+    const QColor fgcolor = option->palette.windowText().color();
+    const QColor bgcolor(fgcolor.red() > 127 ? 0 : 255,
+                         fgcolor.green() > 127 ? 0 : 255,
+                         fgcolor.blue() > 127 ? 0 : 255);
+    painter->setPen(QPen(bgcolor, 0, Qt::SolidLine));
+    painter->drawRect(contentRect);
+    painter->setPen(QPen(fgcolor, 0, Qt::DashLine));
+    painter->drawRect(contentRect);
+  }
+}
+
+int StrokeItem::type() const { return Type; }
+
+void StrokeItem::drawSegments(QPainter *painter, const QPen &pen,
+                              const QPointF &from,
+                              const QVector<Segment> &segments, int first,
+                              int last) {
+  bool uniform = true;
+  for (int i = first; i < last && uniform; ++i) {
+    uniform = segments.at(i).widthScale == 1.0;
+  }
+
+  if (uniform) {
+    QPainterPath path(from);
+    for (int i = first; i < last; ++i) {
+      const Segment &segment = segments.at(i);
+      path.cubicTo(segment.control1, segment.control2, segment.end);
+    }
+    painter->setPen(pen);
+    painter->drawPath(path);
+    return;
+  }
+
+  QPen runPen = pen;
+  runPen.setCapStyle(Qt::RoundCap);
+  runPen.setJoinStyle(Qt::RoundJoin);
+  QPointF runFrom = from;
+  int i = first;
+  while (i < last) {
+    const qreal scale = segments.at(i).widthScale;
+    QPainterPath path(runFrom);
+    for (; i < last && qAbs(segments.at(i).widthScale - scale) < widthStep;
+         ++i) {
+      const Segment &segment = segments.at(i);
+      path.cubicTo(segment.control1, segment.control2, segment.end);
+    }
+    runFrom = segments.at(i - 1).end;
+    runPen.setWidthF(pen.widthF() * scale);
+    painter->setPen(runPen);
+    painter->drawPath(path);
+  }
+}
+
+bool StrokeItem::paintOutline(QPainter *painter, qreal levelOfDetail) {
+  if (segmentList.size() < minOutlineSegments || levelOfDetail <= 0)
+    return false;
+  const qreal tolerance = outlinePixelTolerance / levelOfDetail;
+  if (tolerance < outlineBaseTolerance)
+    return false;
+
+  // The coarsest level that still stays within the tolerance on screen.
+  const int level =
+      qMin(outlineLevels - 1,
+           qFloor(std::log2(tolerance / outlineBaseTolerance)));
+  const Outline &simplified = outline(level);
+
+  painter->setBrush(Qt::NoBrush);
+  if (!variableWidth) {
+    painter->setPen(strokePen);
+    painter->drawPolyline(simplified.points.constData(),
+                          simplified.points.size());
+    return true;
+  }
+
+  // Same width runs as drawSegments(), over the polyline.
+  QPen runPen = strokePen;
+  runPen.setCapStyle(Qt::RoundCap);
+  runPen.setJoinStyle(Qt::RoundJoin);
+  int i = 0;
+  while (i + 1 < simplified.points.size()) {
+    const qreal scale = simplified.scales.at(i + 1);
+    int j = i + 1;
+    while (j + 1 < simplified.points.size() &&
+           qAbs(simplified.scales.at(j + 1) - scale) < widthStep)
+      ++j;
+    runPen.setWidthF(strokePen.widthF() * scale);
+    painter->setPen(runPen);
+    painter->drawPolyline(simplified.points.constData() + i, j - i + 1);
+    i = j;
+  }
+  return true;
+}
+
+const StrokeItem::Outline &StrokeItem::outline(int level) {
+  if (outlines.isEmpty())
+    outlines.resize(outlineLevels);
+  Outline &result = outlines[level];
+  if (!result.points.isEmpty())
+    return result;
+
+  // Sample each segment at its middle as well as its end, so a coarse
+  // chord never cuts across a bulging curve unnoticed.
+  QVector<QPointF> samples;
+  QVector<qreal> sampleScales;
+  samples.reserve(segmentList.size() * 2 + 1);
+  sampleScales.reserve(segmentList.size() * 2 + 1);
+  samples.append(start);
+  sampleScales.append(segmentList.first().widthScale);
+  for (int i = 0; i < segmentList.size(); ++i) {
+    const Segment &segment = segmentList.at(i);
+    samples.append(bezierPoint(segmentStart(i), segment, 0.5));
+    samples.append(segment.end);
+    sampleScales.append(segment.widthScale);
+    sampleScales.append(segment.widthScale);
+  }
+
+  const QVector<int> kept =
+      simplify(samples, outlineBaseTolerance * qreal(1 << level));
+  result.points.reserve(kept.size());
+  for (int i : kept) {
+    result.points.append(samples.at(i));
+    if (variableWidth)
+      result.scales.append(sampleScales.at(i));
+  }
+  return result;
+}
+
+QPointF StrokeItem::segmentStart(int index) const {
+  return index == 0 ? start : segmentList.at(index - 1).end;
+}
+
+QRectF StrokeItem::segmentBounds(int index) const {
+  // A cubic Bezier lies inside the convex hull of its control points.
+  const Segment &segment = segmentList.at(index);
+  const QPointF from = segmentStart(index);
+  const qreal left = qMin(qMin(from.x(), segment.control1.x()),
+                          qMin(segment.control2.x(), segment.end.x()));
+  const qreal right = qMax(qMax(from.x(), segment.control1.x()),
+                           qMax(segment.control2.x(), segment.end.x()));
+  const qreal top = qMin(qMin(from.y(), segment.control1.y()),
+                         qMin(segment.control2.y(), segment.end.y()));
+  const qreal bottom = qMax(qMax(from.y(), segment.control1.y()),
+                            qMax(segment.control2.y(), segment.end.y()));
+  const qreal pad = penPadding(segment.widthScale);
+  return QRectF(QPointF(left - pad, top - pad),
+                QPointF(right + pad, bottom + pad));
+}
+
+qreal StrokeItem::penPadding(qreal widthScale) const {
+  // Square caps reach out by half the diagonal of the pen square; keep at
+  // least half a pixel so horizontal and vertical runs never have empty
+  // bounds.
+  return qMax<qreal>(strokePen.widthF() * widthScale * 0.75, 0.5);
+}
+
+void StrokeItem::rebuildBounds() {
+  const qreal pad = penPadding();
+  contentRect = QRectF(start.x() - pad, start.y() - pad, pad * 2, pad * 2);
+  chunkBounds.clear();
+  widestScale = segmentList.isEmpty() ? 1.0 : segmentList.first().widthScale;
+  variableWidth = false;
+  for (int i = 0; i < segmentList.size(); ++i) {
+    widestScale = qMax(widestScale, segmentList.at(i).widthScale);
+    variableWidth = variableWidth || segmentList.at(i).widthScale != 1.0;
+    const QRectF segmentRect = segmentBounds(i);
+    if (i % segmentsPerChunk == 0) {
+      chunkBounds.append(segmentRect);
+    } else {
+      chunkBounds.last() = chunkBounds.last().united(segmentRect);
+    }
+    contentRect = contentRect.united(segmentRect);
+  }
+  bounds = contentRect.adjusted(-growthSlack, -growthSlack, growthSlack,
+                                growthSlack);
+}
@@ -0,0 +1,122 @@
+// stroke_item.h
+#ifndef STROKE_ITEM_H
+#define STROKE_ITEM_H
+
+#include "memory_pool.h"
+#include <QGraphicsItem>
+#include <QPainterPath>
+#include <QPen>
+#include <QRectF>
+#include <QVector>
+
+// Freehand stroke that grows one cubic segment at a time. Segments are kept
+// in an append-only buffer and grouped into fixed-size chunks with their own
+// bounds, so adding a sample only repaints the tail chunk and painting a
+// partially exposed stroke only walks the visible chunks. Zoomed out, a
+// finished stroke paints a simplified polyline that matches the view scale
+// instead of its full set of curves.
+class StrokeItem : public QGraphicsItem,
+                   public PoolAllocated<StrokeItem> {
+public:
+  enum { Type = UserType + 1 };
+
+  struct Segment {
+    Segment() : widthScale(1.0) {}
+
+    QPointF control1;
+    QPointF control2;
+    QPointF end;
+    // Pen width multiplier for this segment, e.g. from stylus pressure.
+    qreal widthScale;
+  };
+
+  // A stroke to be drawn; widthScale is that of the start sample.
+  StrokeItem(const QPointF &start, const QPen &pen, qreal widthScale = 1.0,
+             QGraphicsItem *parent = nullptr);
+  StrokeItem(const QPointF &start, const QVector<Segment> &segments,
+             const QPen &pen, QGraphicsItem *parent = nullptr);
+  ~StrokeItem();
+
+  // Feeds a raw input sample through the Catmull-Rom smoother; emits a new
+  // Bezier segment once enough samples are buffered. widthScale multiplies
+  // the pen width at this sample.
+  void addPoint(const QPointF &point, qreal widthScale = 1.0);
+  void appendSegment(const Segment &segment);
+  // Drops the growth slack from the bounding rect once input has ended.
+  void finishStroke();
+  // Swaps in new geometry for a finished stroke, e.g. a compacted refit.
+  // Does nothing and returns false if the stroke has changed since
+  // revision() returned expectedRevision.
+  bool replaceSegments(const QVector<Segment> &segments,
+                       quint64 expectedRevision);
+
+  QPointF startPoint() const;
+  // Input samples fed in so far, the start point included.
+  int pointCount() const;
+  const QVector<Segment> &segments() const;
+  QPainterPath path() const;
+  // Bumped on every geometry change so caches keyed on the item can tell
+  // when they are stale.
+  quint64 revision() const;
+  // Largest widthScale of any segment, at least 1 when the stroke has a
+  // uniform width.
+  qreal maxWidthScale() const;
+  bool hasVariableWidth() const;
+
+  QPen pen() const;
+  void setPen(const QPen &pen);
+
+  QRectF boundingRect() const override;
+  QPainterPath shape() const override;
+  void paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
+             QWidget *widget = nullptr) override;
+  int type() const override;
+
+  // Strokes segments [first, last) of a stroke starting at from. Segments
+  // with a uniform width go out as one path; variable-width runs are split
+  // wherever the width changes noticeably and drawn with round caps so the
+  // pieces join up. Safe to call on any thread.
+  static void drawSegments(QPainter *painter, const QPen &pen,
+                           const QPointF &from,
+                           const QVector<Segment> &segments, int first,
+                           int last);
+
+private:
+  // The stroke sampled along its curve and thinned out with Ramer-Douglas-
+  // Peucker at one tolerance.
+  struct Outline {
+    QVector<QPointF> points;
+    // Width multiplier of the curve at each point.
+    QVector<qreal> scales;
+  };
+
+  QPointF segmentStart(int index) const;
+  bool paintOutline(QPainter *painter, qreal levelOfDetail);
+  const Outline &outline(int level);
+  QRectF segmentBounds(int index) const;
+  qreal penPadding(qreal widthScale = 1.0) const;
+  void rebuildBounds();
+
+  QPointF start;
+  QVector<Segment> segmentList;
+  QVector<QRectF> chunkBounds;
+  // The newest input samples in a fixed ring; the smoother never looks
+  // further back than this.
+  enum { smoothingWindow = 4 };
+  QPointF recentPoints[smoothingWindow];
+  qreal recentScales[smoothingWindow];
+  int sampleCount;
+  bool acceptingInput;
+  QPen strokePen;
+  quint64 geometryRevision;
+  qreal widestScale;
+  bool variableWidth;
+  QRectF contentRect;
+  // Simplified outlines by level, built on first use.
+  QVector<Outline> outlines;
+  QRectF bounds;
+  mutable QPainterPath cachedShape;
+  mutable bool shapeDirty;
+};
+
+#endif // STROKE_ITEM_H
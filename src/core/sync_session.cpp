@@ -0,0 +1,793 @@
+// sync_session.cpp
+#include "sync_session.h"
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QList>
+#include <QMessageAuthenticationCode>
+#include <QMutexLocker>
+#include <QRandomGenerator>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtEndian>
+#include <cstring>
+#include <functional>
+
+namespace {
+enum FrameType : quint8 {
+  Begin = 1,
+  Points = 2,
+  End = 3,
+  Board = 4,
+  Challenge = 5,
+  Hello = 6,
+  Welcome = 7
+};
+
+const int frameHeadSize = 7;
+const int beginSize = 20;
+const int pointsHeadSize = 6;
+const int endSize = 4;
+const int nonceSize = 16;
+const int proofSize = 32;
+// Every frame but the host's board fits in this; a larger size means the
+// stream is broken.
+const quint32 maxFrameSize = 64 * 1024;
+const quint32 maxBoardSize = 256u << 20;
+// What Qt buffers per socket before it stops reading, which leaves slowing
+// a fast sender down to TCP.
+const qint64 readBufferSize = 1 << 20;
+// Bytes that may wait to go out to a peer, on top of a board still being
+// sent; a peer further behind has stopped reading and is dropped.
+const qint64 maxQueuedBytes = 16 << 20;
+// Time a connection has to prove it knows the secret.
+const int handshakeMillis = 10000;
+// Points per Points frame, so catching up after a stall still goes out in
+// pieces.
+const int maxBatchPoints = 1024;
+const qreal positionUnit = 16.0;
+const qreal widthScaleUnit = 100.0;
+// Keeps deltas between quantized coordinates within 32 bits.
+const qreal coordinateLimit = qreal(1 << 30);
+// Widest pen a peer's stroke may ask for.
+const qreal maxPenWidth = 1024.0;
+
+template <typename T> void putLittleEndian(QByteArray &out, T value) {
+  uchar bytes[sizeof(T)];
+  qToLittleEndian(value, bytes);
+  out.append(reinterpret_cast<const char *>(bytes), int(sizeof(T)));
+}
+
+void putF32(QByteArray &out, qreal value) {
+  const float f = float(value);
+  quint32 bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  putLittleEndian(out, bits);
+}
+
+qreal getF32(const uchar *p) {
+  const quint32 bits = qFromLittleEndian<quint32>(p);
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return qreal(f);
+}
+
+void putVarint(QByteArray &out, qint32 value) {
+  quint32 zigzag = (quint32(value) << 1) ^ quint32(value >> 31);
+  while (zigzag >= 0x80) {
+    out.append(char(zigzag | 0x80));
+    zigzag >>= 7;
+  }
+  out.append(char(zigzag));
+}
+
+// False past end or on a varint longer than 32 bits need.
+bool getVarint(const uchar *&p, const uchar *end, qint32 *value) {
+  quint32 zigzag = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (p == end)
+      return false;
+    const uchar byte = *p++;
+    zigzag |= quint32(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = qint32(zigzag >> 1) ^ -qint32(zigzag & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+qint32 quantize(qreal value, qreal unit) {
+  return qint32(
+      qRound64(qBound(-coordinateLimit, value * unit, coordinateLimit)));
+}
+
+// Moves a received coordinate by a peer's delta. The sum is taken in 64
+// bits and kept within what quantize() sends, whatever the stream says.
+qint32 advance(qint32 value, qint32 delta) {
+  const qint64 limit = qint64(coordinateLimit);
+  return qint32(qBound(-limit, qint64(value) + delta, limit));
+}
+
+// Width scales stay within 0 and 1: pressure only ever thins a stroke.
+qint32 advanceScale(qint32 scale, qint32 delta) {
+  return qint32(
+      qBound(qint64(0), qint64(scale) + delta, qint64(widthScaleUnit)));
+}
+
+// Appends one frame; payload goes in after its head so it is not copied.
+void appendFrame(QByteArray &out, quint8 type,
+                 const std::function<void(QByteArray &)> &payload) {
+  const int start = out.size();
+  out.append(char(type));
+  putLittleEndian(out, quint16(0));
+  putLittleEndian(out, quint32(0));
+  payload(out);
+  qToLittleEndian(quint32(out.size() - start - frameHeadSize),
+                  reinterpret_cast<uchar *>(out.data() + start + 3));
+}
+
+QByteArray randomNonce() {
+  QByteArray nonce(nonceSize, Qt::Uninitialized);
+  QRandomGenerator *random = QRandomGenerator::system();
+  for (int i = 0; i < nonceSize; ++i) {
+    nonce[i] = char(random->bounded(256));
+  }
+  return nonce;
+}
+
+// Shows the secret is known without sending it; role keeps the host's and
+// a peer's proofs of the same nonce apart.
+QByteArray proof(const QByteArray &secret, char role,
+                 const QByteArray &nonce) {
+  return QMessageAuthenticationCode::hash(role + nonce, secret,
+                                          QCryptographicHash::Sha256);
+}
+
+// Takes as long whichever byte differs.
+bool sameProof(const QByteArray &a, const QByteArray &b) {
+  if (a.size() != b.size())
+    return false;
+  char difference = 0;
+  for (int i = 0; i < a.size(); ++i) {
+    difference |= char(a.at(i) ^ b.at(i));
+  }
+  return difference == 0;
+}
+
+bool isHandshake(quint8 type) {
+  return type == Challenge || type == Hello || type == Welcome;
+}
+
+quint64 strokeKey(quint16 peer, quint32 stroke) {
+  return (quint64(peer) << 32) | stroke;
+}
+
+typedef QVector<SyncSession::StrokeUpdate> Updates;
+
+SyncSession::StrokeUpdate &updateFor(Updates &updates,
+                                     QHash<quint64, int> &index,
+                                     quint64 key) {
+  QHash<quint64, int>::const_iterator it = index.constFind(key);
+  if (it != index.constEnd())
+    return updates[it.value()];
+  index.insert(key, updates.size());
+  updates.append(SyncSession::StrokeUpdate());
+  updates.last().key = key;
+  return updates.last();
+}
+} // namespace
+
+// Owns the sockets; every member is only touched on the network thread,
+// apart from secret, which is set before the thread starts.
+class SyncSession::Link : public QObject {
+public:
+  Link(SyncSession *session, const QByteArray &secret)
+      : session(session), secret(secret), server(nullptr), nextPeer(1) {}
+
+  bool listen(const QHostAddress &address, quint16 port,
+              QString *errorString) {
+    // Anyone who can reach the port could draw on every board otherwise.
+    if (secret.isEmpty() && !address.isLoopback()) {
+      if (errorString)
+        *errorString = QString("Hosting on %1 needs a session secret")
+                           .arg(address.toString());
+      return false;
+    }
+    server = new QTcpServer(this);
+    if (!server->listen(address, port)) {
+      if (errorString)
+        *errorString = server->errorString();
+      delete server;
+      server = nullptr;
+      return false;
+    }
+    connect(server, &QTcpServer::newConnection, this, [this]() { accept(); });
+    return true;
+  }
+
+  void connectTo(const QString &hostName, quint16 port) {
+    QTcpSocket *socket = new QTcpSocket(this);
+    // The host is the only peer of a joined instance; the board comes
+    // first on its stream once the handshake is done.
+    Peer *peer = addPeer(socket, 0);
+    peer->nonce = randomNonce();
+    connect(socket, &QTcpSocket::connected, this, [this, socket]() {
+      socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+      expireHandshake(socket);
+    });
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    connect(socket, &QAbstractSocket::errorOccurred, this,
+            [this, peer](QAbstractSocket::SocketError) { drop(peer); });
+#else
+    connect(socket,
+            QOverload<QAbstractSocket::SocketError>::of(
+                &QAbstractSocket::error),
+            this, [this, peer](QAbstractSocket::SocketError) { drop(peer); });
+#endif
+    socket->connectToHost(hostName, port);
+  }
+
+  // Frames of local strokes.
+  void sendLocal(const QByteArray &frames) {
+    for (Peer *peer : peers) {
+      if (peer->ready &&
+          peer->socket->state() == QAbstractSocket::ConnectedState)
+        write(peer, frames);
+    }
+  }
+
+  void sendBoard(int id, const QVector<DocumentItem> &items,
+                 const QVector<DocumentLayer> &layers) {
+    Peer *peer = nullptr;
+    for (Peer *candidate : peers) {
+      if (candidate->id == id)
+        peer = candidate;
+    }
+    if (!peer)
+      return;
+
+    // The document is encoded straight into the frame.
+    QByteArray frame;
+    QString error;
+    bool ok = false;
+    appendFrame(frame, Board, [&](QByteArray &out) {
+      QBuffer buffer(&out);
+      ok = buffer.open(QIODevice::WriteOnly | QIODevice::Append) &&
+           DocumentWriter::write(&buffer, items, layers, &error);
+    });
+    if (ok && quint32(frame.size() - frameHeadSize) > maxBoardSize) {
+      ok = false;
+      error = QString("The board is larger than %1 bytes").arg(maxBoardSize);
+    }
+    if (ok) {
+      peer->boardLeft += frame.size();
+      peer->socket->write(frame);
+    } else {
+      qWarning("Could not send the board to peer %d: %s", id,
+               qPrintable(error));
+    }
+    peer->ready = true;
+  }
+
+  void close() {
+    for (Peer *peer : peers) {
+      QObject::disconnect(peer->socket, nullptr, this, nullptr);
+      delete peer->socket;
+      delete peer;
+    }
+    peers.clear();
+    delete server;
+    server = nullptr;
+  }
+
+private:
+  struct Peer {
+    QTcpSocket *socket;
+    quint16 id;
+    // Received bytes not making up a whole frame yet.
+    QByteArray buffer;
+    // Whether it proved it knows the secret; until then only handshake
+    // frames are taken from it.
+    bool trusted;
+    // The nonce this side asked the other to prove the secret with.
+    QByteArray nonce;
+    // Whether frames are sent to it; a joining peer waits for its board.
+    bool ready;
+    // Bytes of the board still queued ahead of everything else.
+    qint64 boardLeft;
+    // Fell too far behind; it goes once the event loop gets to it.
+    bool closing;
+    // Why this side gave up on the connection, if it did.
+    QString failure;
+  };
+
+  Peer *addPeer(QTcpSocket *socket, quint16 id) {
+    Peer *peer = new Peer();
+    peer->socket = socket;
+    peer->id = id;
+    peer->trusted = false;
+    peer->ready = false;
+    peer->boardLeft = 0;
+    peer->closing = false;
+    peers.append(peer);
+    socket->setReadBufferSize(readBufferSize);
+    connect(socket, &QTcpSocket::readyRead, this,
+            [this, peer]() { read(peer); });
+    connect(socket, &QTcpSocket::disconnected, this,
+            [this, peer]() { drop(peer); });
+    connect(socket, &QTcpSocket::bytesWritten, this,
+            [peer](qint64 bytes) {
+              peer->boardLeft = qMax<qint64>(0, peer->boardLeft - bytes);
+            });
+    return peer;
+  }
+
+  void accept() {
+    while (QTcpSocket *socket = server->nextPendingConnection()) {
+      socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+      const quint16 id = nextPeer;
+      nextPeer = nextPeer == 0xffff ? 1 : nextPeer + 1;
+      Peer *peer = addPeer(socket, id);
+      // peerJoined() waits for the answer.
+      peer->nonce = randomNonce();
+      QByteArray frame;
+      appendFrame(frame, Challenge,
+                  [peer](QByteArray &out) { out.append(peer->nonce); });
+      socket->write(frame);
+      expireHandshake(socket);
+    }
+  }
+
+  void expireHandshake(QTcpSocket *socket) {
+    QTimer::singleShot(handshakeMillis, socket, [this, socket]() {
+      for (const Peer *peer : peers) {
+        if (peer->socket == socket && !peer->trusted)
+          socket->abort();
+      }
+    });
+  }
+
+  // Takes one handshake frame from a peer not trusted yet; false if the
+  // connection has to go.
+  bool shakeHands(Peer *peer, quint8 type, const uchar *payload,
+                  quint32 size) {
+    const QByteArray data(reinterpret_cast<const char *>(payload), int(size));
+    if (server) {
+      // Hello: the peer's nonce, then its proof for ours.
+      if (type != Hello || size != quint32(nonceSize + proofSize) ||
+          !sameProof(data.mid(nonceSize), proof(secret, 'p', peer->nonce)))
+        return false;
+      peer->trusted = true;
+      const QByteArray answer = proof(secret, 'h', data.left(nonceSize));
+      QByteArray frame;
+      appendFrame(frame, Welcome,
+                  [&answer](QByteArray &out) { out.append(answer); });
+      peer->socket->write(frame);
+      const quint16 id = peer->id;
+      SyncSession *target = session;
+      QMetaObject::invokeMethod(
+          target, [target, id]() { emit target->peerJoined(id); },
+          Qt::QueuedConnection);
+      return true;
+    }
+
+    if (type == Challenge && size == quint32(nonceSize)) {
+      QByteArray frame;
+      appendFrame(frame, Hello, [&](QByteArray &out) {
+        out.append(peer->nonce);
+        out.append(proof(secret, 'p', data));
+      });
+      peer->socket->write(frame);
+      return true;
+    }
+    if (type == Welcome &&
+        sameProof(data, proof(secret, 'h', peer->nonce))) {
+      peer->trusted = true;
+      peer->ready = true;
+      return true;
+    }
+    peer->failure = "The host does not know the session secret";
+    return false;
+  }
+
+  // Queues frames for a peer, and drops one that has stopped reading.
+  void write(Peer *peer, const QByteArray &frames) {
+    if (peer->closing)
+      return;
+    if (peer->socket->bytesToWrite() - peer->boardLeft + frames.size() >
+        maxQueuedBytes) {
+      qWarning("Dropping peer %d, which fell behind", int(peer->id));
+      // Dropping right here would change peers while it is iterated.
+      peer->closing = true;
+      peer->failure = "The host stopped reading the stream";
+      QTcpSocket *socket = peer->socket;
+      QMetaObject::invokeMethod(
+          socket, [socket]() { socket->abort(); }, Qt::QueuedConnection);
+      return;
+    }
+    peer->socket->write(frames);
+  }
+
+  // Ends the strokes the peer left open, and tells the host's other peers.
+  void drop(Peer *peer) {
+    if (!peers.removeOne(peer))
+      return;
+
+    Updates updates;
+    QHash<quint64, int> index;
+    QByteArray ends;
+    QHash<quint64, Cursor>::iterator it = cursors.begin();
+    while (it != cursors.end()) {
+      if (server && quint16(it.key() >> 32) != peer->id) {
+        ++it;
+        continue;
+      }
+      updateFor(updates, index, it.key()).ended = true;
+      if (server) {
+        const quint32 stroke = quint32(it.key());
+        QByteArray frame;
+        appendFrame(frame, End, [stroke](QByteArray &out) {
+          putLittleEndian(out, stroke);
+        });
+        qToLittleEndian(peer->id, reinterpret_cast<uchar *>(frame.data() + 1));
+        ends += frame;
+      }
+      it = cursors.erase(it);
+    }
+    if (!ends.isEmpty())
+      relay(peer, ends);
+    if (!updates.isEmpty())
+      session->deliver(updates);
+
+    if (!server) {
+      const QString error = peer->failure.isEmpty()
+                                ? peer->socket->errorString()
+                                : peer->failure;
+      SyncSession *target = session;
+      QMetaObject::invokeMethod(
+          target, [target, error]() { emit target->connectionLost(error); },
+          Qt::QueuedConnection);
+    }
+    QObject::disconnect(peer->socket, nullptr, this, nullptr);
+    peer->socket->deleteLater();
+    delete peer;
+  }
+
+  void read(Peer *peer) {
+    peer->buffer += peer->socket->readAll();
+    const uchar *data =
+        reinterpret_cast<const uchar *>(peer->buffer.constData());
+    const qint64 available = peer->buffer.size();
+
+    Updates updates;
+    QHash<quint64, int> index;
+    QByteArray relayed;
+    qint64 offset = 0;
+    bool broken = false;
+    while (available - offset >= frameHeadSize) {
+      const uchar *frame = data + offset;
+      const quint8 type = frame[0];
+      const quint32 size = qFromLittleEndian<quint32>(frame + 3);
+      // Sizes are checked before waiting for the rest, so an untrusted or
+      // broken peer cannot make this side buffer a large frame.
+      const quint32 limit =
+          !server && peer->trusted && type == Board ? maxBoardSize
+                                                    : maxFrameSize;
+      if (size > limit || (!peer->trusted && !isHandshake(type))) {
+        broken = true;
+        break;
+      }
+      if (quint64(available - offset - frameHeadSize) < size)
+        break;
+
+      if (!peer->trusted) {
+        if (!shakeHands(peer, type, frame + frameHeadSize, size)) {
+          broken = true;
+          break;
+        }
+        offset += frameHeadSize + size;
+        continue;
+      }
+      // The host knows who sent a frame; a joined peer takes the host's
+      // word for it.
+      const quint16 from =
+          server ? peer->id : qFromLittleEndian<quint16>(frame + 1);
+      handle(type, from, frame + frameHeadSize, size, updates, index);
+      if (server && type != Board && !isHandshake(type)) {
+        const int start = relayed.size();
+        relayed.append(reinterpret_cast<const char *>(frame),
+                       int(frameHeadSize + size));
+        qToLittleEndian(from,
+                        reinterpret_cast<uchar *>(relayed.data() + start + 1));
+      }
+      offset += frameHeadSize + size;
+    }
+    peer->buffer.remove(0, int(offset));
+
+    if (!relayed.isEmpty())
+      relay(peer, relayed);
+    if (!updates.isEmpty())
+      session->deliver(updates);
+    if (broken)
+      peer->socket->abort();
+  }
+
+  void handle(quint8 type, quint16 from, const uchar *payload, quint32 size,
+              Updates &updates, QHash<quint64, int> &index) {
+    switch (type) {
+    case Begin: {
+      if (size < quint32(beginSize))
+        return;
+      const quint64 key =
+          strokeKey(from, qFromLittleEndian<quint32>(payload));
+      Cursor cursor;
+      cursor.x = advance(0, qFromLittleEndian<qint32>(payload + 12));
+      cursor.y = advance(0, qFromLittleEndian<qint32>(payload + 16));
+      cursor.scale = qint32(widthScaleUnit);
+      cursors.insert(key, cursor);
+
+      StrokeUpdate &update = updateFor(updates, index, key);
+      update.begun = true;
+      update.color = QColor::fromRgba(qFromLittleEndian<quint32>(payload + 4));
+      const qreal width = getF32(payload + 8);
+      update.width = qIsFinite(width) ? qBound(qreal(0), width, maxPenWidth)
+                                      : qreal(1);
+      update.points.append(
+          QPointF(cursor.x / positionUnit, cursor.y / positionUnit));
+      update.widthScales.append(1.0);
+      break;
+    }
+    case Points: {
+      if (size < quint32(pointsHeadSize))
+        return;
+      const quint64 key =
+          strokeKey(from, qFromLittleEndian<quint32>(payload));
+      QHash<quint64, Cursor>::iterator cursor = cursors.find(key);
+      // Begun before this peer got the board, or already ended.
+      if (cursor == cursors.end())
+        return;
+
+      StrokeUpdate &update = updateFor(updates, index, key);
+      const int count = qFromLittleEndian<quint16>(payload + 4);
+      const uchar *p = payload + pointsHeadSize;
+      const uchar *end = payload + size;
+      for (int i = 0; i < count; ++i) {
+        qint32 dx;
+        qint32 dy;
+        qint32 dscale;
+        if (!getVarint(p, end, &dx) || !getVarint(p, end, &dy) ||
+            !getVarint(p, end, &dscale))
+          break;
+        cursor->x = advance(cursor->x, dx);
+        cursor->y = advance(cursor->y, dy);
+        cursor->scale = advanceScale(cursor->scale, dscale);
+        update.points.append(
+            QPointF(cursor->x / positionUnit, cursor->y / positionUnit));
+        update.widthScales.append(cursor->scale / widthScaleUnit);
+      }
+      break;
+    }
+    case End: {
+      if (size < quint32(endSize))
+        return;
+      const quint64 key =
+          strokeKey(from, qFromLittleEndian<quint32>(payload));
+      if (cursors.remove(key))
+        updateFor(updates, index, key).ended = true;
+      break;
+    }
+    case Board:
+      if (!server)
+        receiveBoard(payload, size);
+      break;
+    default:
+      // From a newer version; skipped.
+      break;
+    }
+  }
+
+  // The board never touches the disk; the canvas decodes it from memory.
+  void receiveBoard(const uchar *document, quint32 size) {
+    const QByteArray board(reinterpret_cast<const char *>(document),
+                           int(size));
+    SyncSession *target = session;
+    QMetaObject::invokeMethod(
+        target, [target, board]() { emit target->boardReceived(board); },
+        Qt::QueuedConnection);
+  }
+
+  void relay(const Peer *source, const QByteArray &frames) {
+    for (Peer *peer : peers) {
+      if (peer != source && peer->ready)
+        write(peer, frames);
+    }
+  }
+
+  SyncSession *session;
+  const QByteArray secret;
+  QTcpServer *server;
+  // Host: every peer that joined. Joined: the host.
+  QList<Peer *> peers;
+  // Where each remote stroke still being drawn has got to.
+  QHash<quint64, Cursor> cursors;
+  quint16 nextPeer;
+};
+
+SyncSession::SyncSession(const QByteArray &secret, QObject *parent)
+    : QObject(parent), link(new Link(this, secret)), hosting(false),
+      nextStroke(1), sendTimer(new QTimer(this)), notified(false) {
+  link->moveToThread(&networkThread);
+  networkThread.start();
+  sendTimer->setSingleShot(true);
+  sendTimer->setInterval(sendInterval);
+  connect(sendTimer, &QTimer::timeout, this, &SyncSession::send);
+}
+
+SyncSession::~SyncSession() {
+  send();
+  Link *target = link;
+  QMetaObject::invokeMethod(
+      target, [target]() { target->close(); }, Qt::BlockingQueuedConnection);
+  networkThread.quit();
+  networkThread.wait();
+  delete link;
+}
+
+bool SyncSession::host(const QHostAddress &address, quint16 port,
+                       QString *errorString) {
+  Link *target = link;
+  bool ok = false;
+  QString error;
+  QMetaObject::invokeMethod(
+      target,
+      [target, &address, port, &ok, &error]() {
+        ok = target->listen(address, port, &error);
+      },
+      Qt::BlockingQueuedConnection);
+  if (!ok && errorString)
+    *errorString = error;
+  hosting = ok;
+  return ok;
+}
+
+void SyncSession::join(const QString &hostName, quint16 port) {
+  Link *target = link;
+  QMetaObject::invokeMethod(
+      target, [target, hostName, port]() { target->connectTo(hostName, port); },
+      Qt::QueuedConnection);
+}
+
+bool SyncSession::isHost() const { return hosting; }
+
+quint32 SyncSession::beginStroke(const QPointF &point, const QColor &color,
+                                 qreal width) {
+  const quint32 stroke = nextStroke++;
+  Outgoing stream;
+  stream.cursor.x = quantize(point.x(), positionUnit);
+  stream.cursor.y = quantize(point.y(), positionUnit);
+  stream.cursor.scale = qint32(widthScaleUnit);
+  stream.count = 0;
+  appendFrame(pending, Begin, [&](QByteArray &out) {
+    putLittleEndian(out, stroke);
+    putLittleEndian(out, quint32(color.rgba()));
+    putF32(out, width);
+    putLittleEndian(out, stream.cursor.x);
+    putLittleEndian(out, stream.cursor.y);
+  });
+  outgoing.insert(stroke, stream);
+  scheduleSend();
+  return stroke;
+}
+
+void SyncSession::addPoint(quint32 stroke, const QPointF &point,
+                           qreal widthScale) {
+  QHash<quint32, Outgoing>::iterator it = outgoing.find(stroke);
+  if (it == outgoing.end())
+    return;
+
+  Cursor &cursor = it->cursor;
+  const qint32 x = quantize(point.x(), positionUnit);
+  const qint32 y = quantize(point.y(), positionUnit);
+  const qint32 scale = quantize(widthScale, widthScaleUnit);
+  putVarint(it->points, x - cursor.x);
+  putVarint(it->points, y - cursor.y);
+  putVarint(it->points, scale - cursor.scale);
+  cursor.x = x;
+  cursor.y = y;
+  cursor.scale = scale;
+  if (++it->count == maxBatchPoints)
+    closeBatch(stroke, *it);
+  scheduleSend();
+}
+
+void SyncSession::endStroke(quint32 stroke) {
+  QHash<quint32, Outgoing>::iterator it = outgoing.find(stroke);
+  if (it == outgoing.end())
+    return;
+
+  closeBatch(stroke, *it);
+  outgoing.erase(it);
+  appendFrame(pending, End,
+              [stroke](QByteArray &out) { putLittleEndian(out, stroke); });
+  scheduleSend();
+}
+
+void SyncSession::sendBoard(int peer, const QVector<DocumentItem> &items,
+                            const QVector<DocumentLayer> &layers) {
+  // Strokes begun before the board was taken are in it; keep their frames
+  // from overtaking it.
+  send();
+  Link *target = link;
+  QMetaObject::invokeMethod(
+      target,
+      [target, peer, items, layers]() {
+        target->sendBoard(peer, items, layers);
+      },
+      Qt::QueuedConnection);
+}
+
+QVector<SyncSession::StrokeUpdate> SyncSession::takeStrokes() {
+  QMutexLocker locker(&mutex);
+  QVector<StrokeUpdate> updates;
+  updates.swap(received);
+  receivedIndex.clear();
+  notified = false;
+  return updates;
+}
+
+void SyncSession::closeBatch(quint32 stroke, Outgoing &stream) {
+  if (stream.count == 0)
+    return;
+  appendFrame(pending, Points, [&](QByteArray &out) {
+    putLittleEndian(out, stroke);
+    putLittleEndian(out, quint16(stream.count));
+    out.append(stream.points);
+  });
+  stream.points.clear();
+  stream.count = 0;
+}
+
+void SyncSession::scheduleSend() {
+  if (!sendTimer->isActive())
+    sendTimer->start();
+}
+
+void SyncSession::send() {
+  sendTimer->stop();
+  for (QHash<quint32, Outgoing>::iterator it = outgoing.begin();
+       it != outgoing.end(); ++it) {
+    closeBatch(it.key(), *it);
+  }
+  if (pending.isEmpty())
+    return;
+
+  QByteArray frames;
+  frames.swap(pending);
+  Link *target = link;
+  QMetaObject::invokeMethod(
+      target, [target, frames]() { target->sendLocal(frames); },
+      Qt::QueuedConnection);
+}
+
+void SyncSession::deliver(const QVector<StrokeUpdate> &updates) {
+  QMutexLocker locker(&mutex);
+  for (const StrokeUpdate &update : updates) {
+    StrokeUpdate &merged =
+        updateFor(received, receivedIndex, update.key);
+    if (update.begun) {
+      merged.begun = true;
+      merged.color = update.color;
+      merged.width = update.width;
+    }
+    merged.points += update.points;
+    merged.widthScales += update.widthScales;
+    merged.ended |= update.ended;
+  }
+  if (notified)
+    return;
+  notified = true;
+  SyncSession *target = this;
+  QMetaObject::invokeMethod(
+      target, [target]() { emit target->strokesReady(); },
+      Qt::QueuedConnection);
+}
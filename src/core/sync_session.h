@@ -0,0 +1,145 @@
+// sync_session.h
+#ifndef SYNC_SESSION_H
+#define SYNC_SESSION_H
+
+#include "document.h"
+#include <QByteArray>
+#include <QColor>
+#include <QHash>
+#include <QHostAddress>
+#include <QMutex>
+#include <QObject>
+#include <QPointF>
+#include <QString>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+
+// Shares strokes live between instances over TCP. One instance hosts, the
+// others join it; the host relays what each peer sends to all the others
+// and sends every peer that joins the board as it is. A stroke goes out in
+// small batches while it is being drawn:
+//
+//   frame   u8 type, u16 peer, u32 payload size, payload. Peers send 0; the
+//           host stamps the peer a frame came from as it relays it
+//   Begin   u32 stroke, u32 ARGB color, float32 pen width, i32 x, i32 y
+//   Points  u32 stroke, u16 count, then for each point the change in x, y
+//           and width scale since the one before as zigzag varints
+//   End     u32 stroke
+//   Board   the host's board as a document
+//
+// Before anything else both sides prove they know the session secret,
+// without sending it, as HMAC-SHA256 over a random nonce of the other side:
+//
+//   Challenge  host: 16-byte nonce
+//   Hello      peer: its own 16-byte nonce, then the HMAC of "p" and the
+//              host's nonce
+//   Welcome    host: the HMAC of "h" and the peer's nonce
+//
+// A peer that fails, takes too long, sends a frame too large for its type
+// or lets too much pile up unsent is dropped.
+//
+// Coordinates are sent in 1/16 scene units and width scales in hundredths,
+// so a point mostly fits in three to five bytes. Local points are batched
+// for up to sendInterval; sockets, decoding and relaying live on a network
+// thread, and decoded points are handed to the GUI thread in one go per
+// strokesReady().
+class SyncSession : public QObject {
+  Q_OBJECT
+
+public:
+  static const int sendInterval = 16;
+
+  // What a remote stroke did since the last takeStrokes().
+  struct StrokeUpdate {
+    StrokeUpdate() : key(0), begun(false), width(0), ended(false) {}
+
+    // Tells strokes of all peers apart.
+    quint64 key;
+    // The stroke started meanwhile: color and width are set, and the first
+    // point is where it starts.
+    bool begun;
+    QColor color;
+    qreal width;
+    QVector<QPointF> points;
+    QVector<qreal> widthScales;
+    bool ended;
+  };
+
+  // Peers must share secret; an empty one only allows hosting on a
+  // loopback address.
+  explicit SyncSession(const QByteArray &secret = QByteArray(),
+                       QObject *parent = nullptr);
+  // Closes every connection.
+  ~SyncSession();
+
+  // Accepts peers on address and port from now on.
+  bool host(const QHostAddress &address, quint16 port,
+            QString *errorString = nullptr);
+  // Connects in the background; connectionLost() reports a failure.
+  void join(const QString &hostName, quint16 port);
+  bool isHost() const;
+
+  // Streams a local stroke; the returned id names it in the calls after.
+  quint32 beginStroke(const QPointF &point, const QColor &color,
+                      qreal width);
+  void addPoint(quint32 stroke, const QPointF &point, qreal widthScale);
+  void endStroke(quint32 stroke);
+  // Host only: sends the board, which must have been taken with
+  // DocumentWriter::snapshot(), to a peer that joined. Until then strokes
+  // are not relayed to it.
+  void sendBoard(int peer, const QVector<DocumentItem> &items,
+                 const QVector<DocumentLayer> &layers);
+
+  QVector<StrokeUpdate> takeStrokes();
+
+signals:
+  // Emitted once until takeStrokes() has been called.
+  void strokesReady();
+  // Host: peer connected and waits for sendBoard().
+  void peerJoined(int peer);
+  // The host's board arrived as a document, ready to load.
+  void boardReceived(const QByteArray &document);
+  // The connection to the host is gone or could not be made.
+  void connectionLost(const QString &error);
+
+private:
+  class Link;
+
+  struct Cursor {
+    qint32 x;
+    qint32 y;
+    qint32 scale;
+  };
+
+  // A local stroke with the points not sent yet.
+  struct Outgoing {
+    Cursor cursor;
+    QByteArray points;
+    int count;
+  };
+
+  // Moves a stroke's batch into pending as a Points frame.
+  void closeBatch(quint32 stroke, Outgoing &outgoing);
+  void scheduleSend();
+  void send();
+  // Network thread: merges decoded points into what takeStrokes() returns.
+  void deliver(const QVector<StrokeUpdate> &updates);
+
+  QThread networkThread;
+  // Lives on the network thread.
+  Link *link;
+  bool hosting;
+  // Frames waiting for the next send, and the strokes a batch is open for.
+  QByteArray pending;
+  QHash<quint32, Outgoing> outgoing;
+  quint32 nextStroke;
+  QTimer *sendTimer;
+  QMutex mutex;
+  // Guarded by mutex.
+  QVector<StrokeUpdate> received;
+  QHash<quint64, int> receivedIndex;
+  bool notified;
+};
+
+#endif // SYNC_SESSION_H
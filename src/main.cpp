@@ -1,9 +1,130 @@
+#include "core/profiler.h"
 #include "windows/main_window.h"
 #include <QApplication>
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QHostAddress>
 
 int main(int argc, char *argv[]) {
   QApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.addHelpOption();
+  QCommandLineOption recordOption(
+      "record", "Record canvas input into <file> until the window closes.",
+      "file");
+  QCommandLineOption replayOption(
+      "replay", "Replay the input recorded in <file>.", "file");
+  QCommandLineOption speedOption(
+      "replay-speed",
+      "Replay at the recorded pace (original) or as fast as possible (max).",
+      "speed", "original");
+  QCommandLineOption reportOption(
+      "replay-report",
+      "Write per-frame replay timings to <file> as CSV, then quit.", "file");
+  QCommandLineOption profileOption(
+      "profile",
+      "Write hot-path timings to <file> as Chrome trace JSON on exit.",
+      "file");
+  QCommandLineOption autosaveOption(
+      "autosave",
+      "Journal the board into <directory> and restore it from there on "
+      "start.",
+      "directory");
+  QCommandLineOption hostOption(
+      "host", "Share strokes live with instances that join on <port>.",
+      "port");
+  QCommandLineOption joinOption(
+      "join", "Join the session hosted at <host:port> and take its board.",
+      "host:port");
+  QCommandLineOption hostAddressOption(
+      "host-address",
+      "Accept session peers on <address> only; other addresses than "
+      "localhost need a secret.",
+      "address", "127.0.0.1");
+  QCommandLineOption secretOption(
+      "secret",
+      "Share the session only with instances given the same <secret>. "
+      "PENCIL_DRAW_SECRET is used when this is not set.",
+      "secret");
+  parser.addOption(recordOption);
+  parser.addOption(replayOption);
+  parser.addOption(speedOption);
+  parser.addOption(reportOption);
+  parser.addOption(profileOption);
+  parser.addOption(autosaveOption);
+  parser.addOption(hostOption);
+  parser.addOption(joinOption);
+  parser.addOption(hostAddressOption);
+  parser.addOption(secretOption);
+  parser.process(app);
+
+  const QString speed = parser.value(speedOption);
+  if (speed != "original" && speed != "max") {
+    qWarning("Unknown replay speed %s; use original or max",
+             qPrintable(speed));
+    return 1;
+  }
+
+  bool portOk = true;
+  const quint16 hostPort =
+      parser.isSet(hostOption) ? parser.value(hostOption).toUShort(&portOk)
+                               : 0;
+  if (!portOk) {
+    qWarning("Invalid port %s", qPrintable(parser.value(hostOption)));
+    return 1;
+  }
+  const QHostAddress hostAddress(parser.value(hostAddressOption));
+  if (hostAddress.isNull()) {
+    qWarning("Invalid address %s",
+             qPrintable(parser.value(hostAddressOption)));
+    return 1;
+  }
+  // The environment keeps the secret out of the process list.
+  const QByteArray secret = parser.isSet(secretOption)
+                                ? parser.value(secretOption).toUtf8()
+                                : qgetenv("PENCIL_DRAW_SECRET");
+  const QString joinAddress = parser.value(joinOption);
+  const int separator = joinAddress.lastIndexOf(':');
+  const quint16 joinPort =
+      separator > 0 ? joinAddress.mid(separator + 1).toUShort(&portOk) : 0;
+  if (parser.isSet(joinOption) && (separator <= 0 || !portOk)) {
+    qWarning("Invalid session address %s; use host:port",
+             qPrintable(joinAddress));
+    return 1;
+  }
+
+  const QString profileFile = parser.value(profileOption);
+  if (!profileFile.isEmpty()) {
+    if (Profiler::isAvailable())
+      Profiler::startCapture();
+    else
+      qWarning("This build has no profiling zones; --profile is ignored");
+  }
+
   MainWindow window;
+  if (parser.isSet(autosaveOption) &&
+      !window.startAutosave(parser.value(autosaveOption)))
+    return 1;
+  if (parser.isSet(hostOption) &&
+      !window.hostSession(hostAddress, hostPort, secret))
+    return 1;
+  if (parser.isSet(joinOption))
+    window.joinSession(joinAddress.left(separator), joinPort, secret);
+  if (parser.isSet(recordOption))
+    window.startRecording(parser.value(recordOption));
+  if (parser.isSet(replayOption) &&
+      !window.startReplay(parser.value(replayOption), speed == "original",
+                          parser.value(reportOption)))
+    return 1;
   window.showFullScreen(); // or window.showMaximized();
-  return app.exec();
+  const int status = app.exec();
+
+  if (Profiler::isCapturing()) {
+    QString error;
+    if (!Profiler::writeChromeTrace(profileFile, &error))
+      qWarning("Could not write profile %s: %s", qPrintable(profileFile),
+               qPrintable(error));
+  }
+  return status;
 }
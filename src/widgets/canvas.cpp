@@ -1,24 +1,186 @@
 // canvas.cpp
 #include "canvas.h"
+#include "../core/geometry_kernels.h"
+#include "../core/gl_stroke_renderer.h"
+#include "../core/stroke_fitter.h"
 #include <QApplication>
 #include <QClipboard>
 #include <QColorDialog>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFont>
+#include <QGuiApplication>
 #include <QGraphicsEllipseItem>
 #include <QGraphicsItem>
 #include <QGraphicsLineItem>
 #include <QGraphicsRectItem>
 #include <QMimeData>
 #include <QMouseEvent>
+#ifdef HAVE_OPENGL
+#include <QOpenGLContext>
+#include <QOpenGLWidget>
+#include <QSurfaceFormat>
+#endif
+#include <QPalette>
+#include <QPixmapCache>
+#include <QResizeEvent>
+#include <QRunnable>
+#include <QScreen>
+#include <QScrollBar>
+#include <QDir>
+#include <QStringList>
+#include <QWheelEvent>
+#include <QtMath>
+#include <functional>
+
+namespace {
+// Time spent adding loaded items per event-loop turn, so the board stays
+// responsive and paints while a large document streams in.
+const int loadBatchMillis = 8;
+// Room for the device caches of finished items; Qt's default of 10 MiB only
+// holds a handful of full-viewport strokes.
+const int pixmapCacheKiB = 128 * 1024;
+// Multisampling for the GL viewport, standing in for QPainter antialiasing
+// on strokes drawn from vertex buffers.
+const int gpuSamples = 4;
+// How long the view has to settle before chunks are paged in or out.
+const int chunkSettleMillis = 150;
+// How long the board has to be left alone before strokes are flattened.
+const int autoFlattenMillis = 5000;
+// Keeps the eraser outline above every layer.
+const qreal eraserPreviewZ = 1e9;
+// Zoom range, in screen pixels per scene unit.
+const qreal minZoom = 0.05;
+const qreal maxZoom = 32.0;
+// Zoom factor per degree of wheel rotation with Ctrl held.
+const qreal zoomPerDegree = 1.01;
+// Finished strokes are refitted to within this many screen pixels.
+const qreal fitPixelTolerance = 0.5;
+// Strokes with fewer segments are already compact.
+const int minFitSegments = 8;
+// Frame rate used when the screen does not report one.
+const int defaultFrameRate = 60;
+// Stylus samples closer than this (in scene units) to the last one used are
+// merged into it.
+const qreal minSampleDistance = 0.75;
+// Width multiplier at zero pressure; full pressure draws at the pen width.
+const qreal minPressureScale = 0.2;
+
+qreal pressureScale(qreal pressure) {
+  return minPressureScale +
+         (1.0 - minPressureScale) * qBound<qreal>(0.0, pressure, 1.0);
+}
+// Tolerance of the fill tool until one is set, per color channel.
+const int defaultFillTolerance = 32;
+// How often the performance overlay refreshes, and the window its timings
+// cover.
+const int perfHudMillis = 500;
+// Changes reach the autosave journal this long after they were made, at
+// most, once no gesture holds them back.
+const int journalFlushMillis = 500;
+// Journal size past which the board is compacted into a fresh snapshot,
+// once nothing has changed for the idle time.
+const qint64 journalCompactBytes = 8LL * 1024 * 1024;
+const int journalCompactIdleMillis = 5000;
+// Where startJournal() rebuilds the board an earlier session left.
+const char *const recoveredFileName = "recovered.fspd";
+
+class SaveDocumentTask : public QRunnable {
+public:
+  SaveDocumentTask(Canvas *canvas, const QString &fileName,
+                   const QVector<DocumentItem> &resident,
+                   const ChunkStore::Pages &stored,
+                   const QVector<DocumentLayer> &layers)
+      : canvas(canvas), fileName(fileName), resident(resident),
+        stored(stored), layers(layers) {}
+
+  void run() override {
+    QString error;
+    const QVector<DocumentItem> items =
+        ChunkStore::interleave(stored.read(), resident, layers);
+    const bool ok = DocumentWriter::write(fileName, items, layers, &error);
+    Canvas *target = canvas;
+    const QString name = fileName;
+    QMetaObject::invokeMethod(
+        target,
+        [target, name, ok, error]() {
+          emit target->documentSaved(name, ok, error);
+        },
+        Qt::QueuedConnection);
+  }
+
+private:
+  Canvas *canvas;
+  QString fileName;
+  QVector<DocumentItem> resident;
+  ChunkStore::Pages stored;
+  QVector<DocumentLayer> layers;
+};
+class FitStrokeTask : public QRunnable {
+public:
+  typedef std::function<void(const QVector<StrokeItem::Segment> &)> Done;
+
+  FitStrokeTask(QObject *context, const QPointF &start,
+                const QVector<StrokeItem::Segment> &segments, qreal tolerance,
+                const Done &done)
+      : context(context), start(start), segments(segments),
+        tolerance(tolerance), done(done) {}
+
+  void run() override {
+    const QVector<StrokeItem::Segment> fitted =
+        StrokeFitter::fit(start, segments, tolerance);
+    const Done callback = done;
+    QMetaObject::invokeMethod(
+        context, [callback, fitted]() { callback(fitted); },
+        Qt::QueuedConnection);
+  }
+
+private:
+  QObject *context;
+  QPointF start;
+  QVector<StrokeItem::Segment> segments;
+  qreal tolerance;
+  Done done;
+};
+} // namespace
 
 Canvas::Canvas(QWidget *parent)
     : QGraphicsView(parent), scene(new QGraphicsScene(this)),
-      tempShapeItem(nullptr), currentShape(Line), currentPen(Qt::white, 3),
+      tempShapeItem(nullptr), dragPressItem(nullptr), currentTool(DrawShape),
+      currentShape(ShapeRegistry::tool<LineShape>()), currentPen(Qt::white, 3),
       eraserPen(Qt::black, 10), currentPath(nullptr),
-      backgroundColor(Qt::black), eraserPreview(nullptr) {
+      backgroundColor(Qt::black), eraserPreview(nullptr),
+      splitEraseEnabled(false), eraseGesture(nullptr),
+      eraseSplits(nullptr), nextFitJob(0), importer(new ItemImporter(this)),
+      importKind(NoImport), pasteAction(nullptr), loadTimer(new QTimer(this)),
+      skippedRecords(0),
+      exporter(new RasterExporter(this)), filler(new FloodFiller(this)),
+      tolerance(defaultFillTolerance), fillLayer(nullptr), fillStart(0),
+      tabletDrawing(false),
+      shapePending(false), previewPending(false), frameTimer(new QTimer(this)),
+      frameRate(0), gpuViewport(false), chunks(new ChunkStore(scene, this)),
+      chunkTimer(new QTimer(this)), autoFlatten(false),
+      flattenTimer(new QTimer(this)), panning(false), perfHud(new QLabel(this)),
+      perfTimer(new QTimer(this)), currentLayer(nullptr), nextLayerId(0),
+      journal(nullptr), journalTimer(new QTimer(this)),
+      compactTimer(new QTimer(this)), journalLayersDirty(false), nextTag(1),
+      session(nullptr), sessionStroke(0) {
 
   this->setScene(scene);
   this->setRenderHint(QPainter::Antialiasing);
+  // Items repaint only the regions they dirty; Smart mode falls back to one
+  // bounding rect when a frame dirties many small areas.
+  this->setViewportUpdateMode(QGraphicsView::SmartViewportUpdate);
+  if (QPixmapCache::cacheLimit() < pixmapCacheKiB)
+    QPixmapCache::setCacheLimit(pixmapCacheKiB);
+  // The board has no edges: the scene rect only bounds scrolling and grows
+  // whenever the view gets near it. Navigation is by wheel and middle-button
+  // drag, so the scroll bars stay hidden.
   scene->setSceneRect(0, 0, 800, 600);
+  setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+  setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+  setTransformationAnchor(QGraphicsView::NoAnchor);
+  setResizeAnchor(QGraphicsView::NoAnchor);
 
   scene->setBackgroundBrush(backgroundColor);
 
@@ -26,46 +188,136 @@ Canvas::Canvas(QWidget *parent)
 
   eraserPreview = scene->addEllipse(0, 0, eraserPen.width(), eraserPen.width(),
                                     QPen(Qt::gray), QBrush(Qt::NoBrush));
-  eraserPreview->setZValue(1);
+  eraserPreview->setZValue(eraserPreviewZ);
   eraserPreview->hide();
 
   this->setMouseTracking(true);
 
-  scene->setItemIndexMethod(QGraphicsScene::NoIndex);
+  setSpatialIndexEnabled(true);
+  resetLayers(QVector<DocumentLayer>());
+
+  history.setItemReleaseHandler(
+      [this](QGraphicsItem *item) { forgetItem(item); });
+  chunks->setItemReleaseHandler(
+      [this](QGraphicsItem *item) { forgetItem(item); });
+  chunks->setItemLoadHandler([this](QGraphicsItem *item, quint16 layer) {
+    // A layer that is gone for good took its paged-out items with it.
+    LayerItem *target = layerWithId(layer);
+    if (target)
+      addLoadedItem(item, target);
+    else
+      delete item;
+    return target != nullptr;
+  });
+  chunkTimer->setSingleShot(true);
+  chunkTimer->setInterval(chunkSettleMillis);
+  connect(chunkTimer, &QTimer::timeout, this, &Canvas::updateChunks);
+  flattenTimer->setSingleShot(true);
+  flattenTimer->setInterval(autoFlattenMillis);
+  connect(flattenTimer, &QTimer::timeout, this, &Canvas::flattenIdleStrokes);
+  journalTimer->setSingleShot(true);
+  journalTimer->setInterval(journalFlushMillis);
+  connect(journalTimer, &QTimer::timeout, this, &Canvas::flushJournal);
+  compactTimer->setSingleShot(true);
+  compactTimer->setInterval(journalCompactIdleMillis);
+  connect(compactTimer, &QTimer::timeout, this, &Canvas::compactIdleJournal);
+  // Every edit goes through the history, so its changes restart the idle
+  // countdown.
+  connect(this, &Canvas::historyChanged, this, [this]() {
+    if (autoFlatten)
+      flattenTimer->start();
+  });
+
+  // Saves run one at a time, in the order they were requested.
+  saveThreads.setMaxThreadCount(1);
+  loadTimer->setSingleShot(true);
+  loadTimer->setInterval(0);
+  connect(loadTimer, &QTimer::timeout, this, &Canvas::addImportedBatch);
+  connect(importer, &ItemImporter::itemsReady, this, [this]() {
+    if (importKind != NoImport && !loadTimer->isActive())
+      loadTimer->start();
+  });
+  connect(exporter, &RasterExporter::progress, this, &Canvas::exportProgress);
+  frameTimer->setTimerType(Qt::PreciseTimer);
+  connect(frameTimer, &QTimer::timeout, this, &Canvas::onFrame);
+  const QScreen *screen = QGuiApplication::primaryScreen();
+  const int refreshRate = screen ? qRound(screen->refreshRate()) : 0;
+  setTargetFrameRate(refreshRate > 0 ? refreshRate : defaultFrameRate);
+  connect(exporter, &RasterExporter::finished, this, &Canvas::exportFinished);
+  connect(filler, &FloodFiller::finished, this, &Canvas::finishFill);
+  // The fill keeps the board rendered; whatever repaints goes stale there.
+  connect(scene, &QGraphicsScene::changed, this,
+          [this](const QList<QRectF> &region) {
+            for (const QRectF &rect : region) {
+              filler->invalidate(rect);
+            }
+          });
 
   connect(scene, &QGraphicsScene::selectionChanged, this, [this]() {});
+
+  // The overlay sits over the viewport without taking its input; an opaque
+  // background keeps its refreshes from repainting the scene below.
+  perfHud->setAttribute(Qt::WA_TransparentForMouseEvents);
+  perfHud->setAutoFillBackground(true);
+  QPalette hudPalette = perfHud->palette();
+  hudPalette.setColor(QPalette::Window, QColor(32, 32, 32));
+  hudPalette.setColor(QPalette::WindowText, QColor(Qt::green));
+  perfHud->setPalette(hudPalette);
+  QFont hudFont("monospace");
+  hudFont.setStyleHint(QFont::Monospace);
+  perfHud->setFont(hudFont);
+  perfHud->setMargin(6);
+  perfHud->move(8, 8);
+  perfHud->hide();
+  perfTimer->setInterval(perfHudMillis);
+  connect(perfTimer, &QTimer::timeout, this, &Canvas::updatePerfHud);
+  // A capture started on the command line also wants the size counters.
+  if (Profiler::isCapturing())
+    perfTimer->start();
 }
 
-Canvas::~Canvas() {}
+Canvas::~Canvas() {
+  // What the last half second changed still goes into the journal.
+  if (journal)
+    writeJournal();
+  // The writer may still be reading paged-out chunks, which go with the
+  // chunk store.
+  delete journal;
+  journal = nullptr;
+  saveThreads.waitForDone();
+  fitThreads.waitForDone();
+  cancelImport();
+}
 
-void Canvas::setShape(const QString &shapeType) {
-  if (shapeType == "Line") {
-    currentShape = Line;
-    this->setDragMode(QGraphicsView::NoDrag);
-  } else if (shapeType == "Rectangle") {
-    currentShape = Rectangle;
-    this->setDragMode(QGraphicsView::NoDrag);
-  } else if (shapeType == "Circle") {
-    currentShape = Circle;
-    this->setDragMode(QGraphicsView::NoDrag);
-  } else if (shapeType == "Selection") {
-    currentShape = Selection;
-    this->setDragMode(QGraphicsView::RubberBandDrag);
-  }
-  tempShapeItem = nullptr;
+void Canvas::setShape(const ShapeTool *shape) {
+  if (!shape)
+    return;
+  endSelectionDrag();
+  endShape();
+  currentTool = DrawShape;
+  currentShape = shape;
 
-  if (currentShape != Eraser) {
-    hideEraserPreview();
-  }
+  this->setDragMode(QGraphicsView::NoDrag);
 
-  if (currentShape != Selection) {
-    scene->clearSelection();
-  }
+  hideEraserPreview();
+
+  scene->clearSelection();
+}
+
+void Canvas::setSelectionTool() {
+  currentTool = Selection;
+  endSelectionDrag();
+  endShape();
+
+  this->setDragMode(QGraphicsView::RubberBandDrag);
+
+  hideEraserPreview();
 }
 
 void Canvas::setPenTool() {
-  currentShape = Pen;
-  tempShapeItem = nullptr;
+  currentTool = Pen;
+  endSelectionDrag();
+  endShape();
 
   this->setDragMode(QGraphicsView::NoDrag);
 
@@ -75,8 +327,9 @@ void Canvas::setPenTool() {
 }
 
 void Canvas::setEraserTool() {
-  currentShape = Eraser;
-  tempShapeItem = nullptr;
+  currentTool = Eraser;
+  endSelectionDrag();
+  endShape();
 
   eraserPen.setColor(backgroundColor);
 
@@ -87,6 +340,489 @@ void Canvas::setEraserTool() {
   scene->clearSelection();
 }
 
+void Canvas::setFillTool() {
+  currentTool = Fill;
+  endSelectionDrag();
+  endShape();
+
+  this->setDragMode(QGraphicsView::NoDrag);
+
+  hideEraserPreview();
+
+  scene->clearSelection();
+}
+
+void Canvas::setFillTolerance(int tolerance) {
+  this->tolerance = qBound(0, tolerance, 255);
+}
+
+int Canvas::fillTolerance() const { return tolerance; }
+
+void Canvas::setSpatialIndexEnabled(bool enabled) {
+  // The BSP tree keeps item lookups at O(log n + k) for the eraser and the
+  // rubber band. Items that grow (strokes being drawn, shapes being dragged)
+  // go through prepareGeometryChange(), which moves them to the tree's
+  // unindexed list until the next query, so results stay exact while drawing.
+  scene->setItemIndexMethod(enabled ? QGraphicsScene::BspTreeIndex
+                                    : QGraphicsScene::NoIndex);
+}
+
+bool Canvas::isSpatialIndexEnabled() const {
+  return scene->itemIndexMethod() == QGraphicsScene::BspTreeIndex;
+}
+
+void Canvas::setSplitEraseEnabled(bool enabled) {
+  splitEraseEnabled = enabled;
+}
+
+bool Canvas::isSplitEraseEnabled() const { return splitEraseEnabled; }
+
+void Canvas::setAutoFlattenEnabled(bool enabled) {
+  autoFlatten = enabled;
+  if (enabled)
+    flattenTimer->start();
+  else
+    flattenTimer->stop();
+}
+
+bool Canvas::isAutoFlattenEnabled() const { return autoFlatten; }
+
+void Canvas::flattenStrokes() {
+  if (finishGestures())
+    flattenRuns(true);
+}
+
+bool Canvas::finishGestures() {
+  finishImport();
+  applyPendingInput();
+  finishEraseGesture();
+  endSelectionDrag();
+  return !currentPath && !tempShapeItem;
+}
+
+int Canvas::layerCount() const { return sceneLayers().size(); }
+
+int Canvas::activeLayerIndex() const {
+  return sceneLayers().indexOf(currentLayer);
+}
+
+QString Canvas::layerName(int index) const {
+  const LayerItem *layer = sceneLayers().value(index);
+  return layer ? layer->name() : QString();
+}
+
+bool Canvas::isLayerHidden(int index) const {
+  const LayerItem *layer = sceneLayers().value(index);
+  return layer && !layer->isVisible();
+}
+
+bool Canvas::isLayerLocked(int index) const {
+  const LayerItem *layer = sceneLayers().value(index);
+  return layer && layer->isLocked();
+}
+
+void Canvas::addLayer() {
+  if (!finishGestures())
+    return;
+  scene->clearSelection();
+  currentLayer =
+      createLayer(nextLayerId, QString("Layer %1").arg(nextLayerId + 1));
+  pushAction(new DrawAction(currentLayer));
+  updateLayerStates();
+  emit layersChanged();
+}
+
+void Canvas::removeActiveLayer() {
+  if (layerCount() < 2 || !finishGestures())
+    return;
+  scene->clearSelection();
+  LayerItem *layer = currentLayer;
+  DeleteAction *action = new DeleteAction(layer);
+  scene->removeItem(layer);
+  pushAction(action);
+  syncLayers();
+}
+
+void Canvas::setActiveLayer(int index) {
+  LayerItem *layer = sceneLayers().value(index);
+  if (!layer || layer == currentLayer || !finishGestures())
+    return;
+  scene->clearSelection();
+  currentLayer = layer;
+  updateLayerStates();
+  emit layersChanged();
+}
+
+void Canvas::setActiveLayerHidden(bool hidden) {
+  if (!currentLayer || hidden == !currentLayer->isVisible() ||
+      !finishGestures())
+    return;
+  if (hidden)
+    scene->clearSelection();
+  currentLayer->setVisible(!hidden);
+  markJournalLayers();
+  emit layersChanged();
+}
+
+void Canvas::setActiveLayerLocked(bool locked) {
+  if (!currentLayer || locked == currentLayer->isLocked() ||
+      !finishGestures())
+    return;
+  if (locked)
+    scene->clearSelection();
+  currentLayer->setLocked(locked);
+  updateLayerStates();
+  markJournalLayers();
+  emit layersChanged();
+}
+
+LayerItem *Canvas::createLayer(quint16 id, const QString &name) {
+  LayerItem *layer = new LayerItem(id, name);
+  layer->setZValue(layers.isEmpty() ? 0 : layers.last()->zValue() + 1);
+  scene->addItem(layer);
+  layers.append(layer);
+  nextLayerId = qMax<int>(nextLayerId, id + 1);
+  return layer;
+}
+
+void Canvas::resetLayers(const QVector<DocumentLayer> &table) {
+  const QList<LayerItem *> old = layers;
+  for (LayerItem *layer : old) {
+    forgetItem(layer);
+    scene->removeItem(layer);
+    delete layer;
+  }
+  currentLayer = nullptr;
+  nextLayerId = 0;
+
+  for (const DocumentLayer &entry : table) {
+    if (layerWithId(entry.id))
+      continue;
+    LayerItem *layer = createLayer(entry.id, entry.name);
+    layer->setVisible(!entry.hidden);
+    layer->setLocked(entry.locked);
+  }
+  if (layers.isEmpty())
+    createLayer(0, QString("Layer 1"));
+  currentLayer = layers.last();
+  updateLayerStates();
+  emit layersChanged();
+}
+
+QList<LayerItem *> Canvas::sceneLayers() const {
+  QList<LayerItem *> result;
+  for (LayerItem *layer : layers) {
+    if (layer->scene() == scene)
+      result.append(layer);
+  }
+  return result;
+}
+
+LayerItem *Canvas::layerWithId(quint16 id) const {
+  for (LayerItem *layer : layers) {
+    if (layer->id() == id)
+      return layer;
+  }
+  return nullptr;
+}
+
+QVector<DocumentLayer> Canvas::layerTable() const {
+  QVector<DocumentLayer> table;
+  for (const LayerItem *layer : sceneLayers()) {
+    DocumentLayer entry;
+    entry.id = layer->id();
+    entry.name = layer->name();
+    entry.hidden = !layer->isVisible();
+    entry.locked = layer->isLocked();
+    table.append(entry);
+  }
+  return table;
+}
+
+QVector<DocumentItem> Canvas::residentSnapshot() const {
+  QList<QGraphicsItem *> items = scene->items(Qt::AscendingOrder);
+  items.removeOne(eraserPreview);
+  return DocumentWriter::snapshot(items);
+}
+
+QVector<DocumentItem> Canvas::boardSnapshot() const {
+  return ChunkStore::interleave(chunks->storedItems(), residentSnapshot(),
+                                layerTable());
+}
+
+void Canvas::syncLayers() {
+  if (!currentLayer || currentLayer->scene() != scene) {
+    const QList<LayerItem *> live = sceneLayers();
+    currentLayer = live.isEmpty() ? nullptr : live.last();
+  }
+  updateLayerStates();
+  emit layersChanged();
+}
+
+void Canvas::updateLayerStates() {
+  for (LayerItem *layer : sceneLayers()) {
+    const bool editing = layer == currentLayer && !layer->isLocked();
+    // Disabled items cannot be selected or dragged, so the rubber band
+    // leaves the other layers alone.
+    layer->setEnabled(editing);
+    layer->setCached(!editing);
+  }
+}
+
+bool Canvas::canEditLayer() const {
+  return currentLayer && currentLayer->isVisible() &&
+         !currentLayer->isLocked();
+}
+
+void Canvas::reindexItem(QGraphicsItem *item) {
+  if (LayerItem *layer = LayerItem::of(item))
+    layer->reindex(item);
+}
+
+bool Canvas::startJournal(const QString &directory, QString *errorString) {
+  if (journal)
+    return true;
+  const QString recovered = QDir(directory).filePath(recoveredFileName);
+  QString error;
+  const bool restore = Journal::recover(directory, recovered, &error);
+  // An autosave that cannot be read is left alone rather than overwritten.
+  if (!error.isEmpty()) {
+    if (errorString)
+      *errorString = error;
+    return false;
+  }
+
+  Journal *opened = new Journal(directory, this);
+  if (!opened->open(errorString)) {
+    delete opened;
+    return false;
+  }
+  journal = opened;
+  connect(journal, &Journal::writeFailed, this, &Canvas::autosaveFailed);
+  if (restore)
+    loadDocument(recovered);
+  else
+    compactJournal();
+  return true;
+}
+
+bool Canvas::hostSession(const QHostAddress &address, quint16 port,
+                         const QByteArray &secret, QString *errorString) {
+  if (session)
+    return true;
+  SyncSession *hosted = new SyncSession(secret, this);
+  if (!hosted->host(address, port, errorString)) {
+    delete hosted;
+    return false;
+  }
+  startSession(hosted);
+  return true;
+}
+
+void Canvas::joinSession(const QString &hostName, quint16 port,
+                         const QByteArray &secret) {
+  if (session)
+    return;
+  startSession(new SyncSession(secret, this));
+  session->join(hostName, port);
+}
+
+void Canvas::startSession(SyncSession *started) {
+  session = started;
+  connect(session, &SyncSession::strokesReady, this,
+          &Canvas::applyRemoteStrokes);
+  connect(session, &SyncSession::peerJoined, this, [this](int peer) {
+    finishImport();
+    session->sendBoard(peer, boardSnapshot(), layerTable());
+  });
+  connect(session, &SyncSession::boardReceived, this, &Canvas::loadBoard);
+  connect(session, &SyncSession::connectionLost, this, &Canvas::sessionLost);
+}
+
+LayerItem *Canvas::remoteStrokeLayer() const {
+  if (canEditLayer())
+    return currentLayer;
+  // The active layer is locked or hidden; the topmost one that is neither
+  // takes the stroke instead.
+  const QList<LayerItem *> live = sceneLayers();
+  for (int i = live.size() - 1; i >= 0; --i) {
+    if (live.at(i)->isVisible() && !live.at(i)->isLocked())
+      return live.at(i);
+  }
+  return nullptr;
+}
+
+QSet<QGraphicsItem *> Canvas::remoteStrokeItems() const {
+  QSet<QGraphicsItem *> items;
+  for (StrokeItem *stroke : remoteStrokes) {
+    items.insert(stroke);
+  }
+  return items;
+}
+
+void Canvas::applyRemoteStrokes() {
+  const QVector<SyncSession::StrokeUpdate> updates = session->takeStrokes();
+  for (const SyncSession::StrokeUpdate &update : updates) {
+    StrokeItem *stroke = remoteStrokes.value(update.key);
+    LayerItem *layer = update.begun && !stroke ? remoteStrokeLayer() : nullptr;
+    if (layer) {
+      // Remote strokes land outside the history: only the peer that drew
+      // one could sensibly undo it.
+      QPen pen = currentPen;
+      pen.setColor(update.color);
+      pen.setWidthF(update.width);
+      stroke = new StrokeItem(update.points.first(), pen);
+      stroke->setFlags(stroke->flags() | QGraphicsItem::ItemIsSelectable |
+                       QGraphicsItem::ItemIsMovable);
+      stroke->setParentItem(layer);
+      remoteStrokes.insert(update.key, stroke);
+    }
+    if (!stroke)
+      continue;
+    if (stroke->scene() != scene) {
+      // Erased or cleared away while it was still arriving.
+      remoteStrokes.remove(update.key);
+      continue;
+    }
+
+    for (int i = update.begun ? 1 : 0; i < update.points.size(); ++i) {
+      stroke->addPoint(update.points.at(i), update.widthScales.at(i));
+    }
+    if (update.ended) {
+      remoteStrokes.remove(update.key);
+      stroke->finishStroke();
+      cacheFinishedItem(stroke);
+      compactStroke(stroke);
+      markJournal(stroke);
+    }
+  }
+}
+
+void Canvas::markJournal(QGraphicsItem *item) {
+  if (!journal || item == eraserPreview)
+    return;
+  if (!journalDirty.contains(item)) {
+    journalDirty.insert(item);
+    journalQueue.append(item);
+  }
+  if (!journalTimer->isActive())
+    journalTimer->start();
+}
+
+void Canvas::markJournal(const Action *action) {
+  if (!journal || !action)
+    return;
+  for (QGraphicsItem *item : action->referencedItems()) {
+    markJournal(item);
+  }
+}
+
+void Canvas::markJournalLayers() {
+  if (!journal)
+    return;
+  journalLayersDirty = true;
+  if (!journalTimer->isActive())
+    journalTimer->start();
+}
+
+void Canvas::tagItem(QGraphicsItem *item) {
+  if (item->type() == StrokeBatchItem::Type ||
+      item->type() == LayerItem::Type ||
+      item->data(DocumentItem::tagKey).toUInt())
+    return;
+  item->setData(DocumentItem::tagKey, nextTag++);
+}
+
+void Canvas::journalRemove(const QGraphicsItem *item) {
+  if (item->type() == StrokeBatchItem::Type) {
+    const StrokeBatchItem *batch = static_cast<const StrokeBatchItem *>(item);
+    for (const StrokeBatchItem::Member &member : batch->members()) {
+      if (member.tag)
+        journal->remove(member.tag);
+    }
+    return;
+  }
+  if (const quint32 tag = item->data(DocumentItem::tagKey).toUInt())
+    journal->remove(tag);
+}
+
+void Canvas::flushJournal() {
+  // Items of a gesture are still changing; they are written once it ends.
+  if (currentPath || tempShapeItem || eraseGesture || dragPressItem) {
+    journalTimer->start();
+    return;
+  }
+  writeJournal();
+}
+
+void Canvas::writeJournal() {
+  // Only the snapshot of the changed items happens here; the writer thread
+  // does the writing and syncing.
+  QList<QGraphicsItem *> changed;
+  for (QGraphicsItem *item : journalQueue) {
+    // Deleted since it was queued.
+    if (!journalDirty.remove(item))
+      continue;
+    if (item->type() == LayerItem::Type)
+      journalLayersDirty = true;
+    else if (item->scene() == scene)
+      changed.append(item);
+    else
+      journalRemove(item);
+  }
+  journalQueue.clear();
+
+  // Removals go first: erasing hands the tags of a batch on to its strokes.
+  for (QGraphicsItem *item : changed) {
+    tagItem(item);
+  }
+  for (const DocumentItem &record : DocumentWriter::snapshot(changed)) {
+    journal->put(record);
+  }
+  if (journalLayersDirty) {
+    journal->setLayers(layerTable());
+    journalLayersDirty = false;
+  }
+  journal->flush();
+
+  // Every write restarts the countdown, so compaction waits for a pause.
+  if (journal->size() >= journalCompactBytes)
+    compactTimer->start();
+}
+
+void Canvas::compactIdleJournal() {
+  if (!journal || journal->size() < journalCompactBytes)
+    return;
+  if (importKind != NoImport || currentPath || tempShapeItem ||
+      eraseGesture || dragPressItem || !journalQueue.isEmpty()) {
+    compactTimer->start();
+    return;
+  }
+  compactJournal();
+}
+
+void Canvas::compactJournal() {
+  compactTimer->stop();
+  QList<QGraphicsItem *> items = scene->items(Qt::AscendingOrder);
+  items.removeOne(eraserPreview);
+  for (QGraphicsItem *item : items) {
+    tagItem(item);
+  }
+  journalQueue.clear();
+  journalDirty.clear();
+  journalLayersDirty = false;
+  // Only the items in the scene are copied here; the chunk files are read
+  // and merged in on the writer thread.
+  const QVector<DocumentItem> resident = DocumentWriter::snapshot(items);
+  const ChunkStore::Pages stored = chunks->pages();
+  const QVector<DocumentLayer> table = layerTable();
+  journal->compact(
+      [resident, stored, table]() {
+        return ChunkStore::interleave(stored.read(), resident, table);
+      },
+      table);
+}
+
 void Canvas::setPenColor(const QColor &color) { currentPen.setColor(color); }
 
 void Canvas::increaseBrushSize() {
@@ -94,7 +830,7 @@ void Canvas::increaseBrushSize() {
   if (size < MAX_BRUSH_SIZE) {
     currentPen.setWidth(size + 2);
     eraserPen.setWidth(eraserPen.width() + 2);
-    if (currentShape == Eraser) {
+    if (currentTool == Eraser) {
       eraserPreview->setRect(eraserPreview->rect().x(),
                              eraserPreview->rect().y(), eraserPen.width(),
                              eraserPen.width());
@@ -107,7 +843,7 @@ void Canvas::decreaseBrushSize() {
   if (size > MIN_BRUSH_SIZE) {
     currentPen.setWidth(size - 2);
     eraserPen.setWidth(eraserPen.width() - 2);
-    if (currentShape == Eraser) {
+    if (currentTool == Eraser) {
       eraserPreview->setRect(eraserPreview->rect().x(),
                              eraserPreview->rect().y(), eraserPen.width(),
                              eraserPen.width());
@@ -116,107 +852,152 @@ void Canvas::decreaseBrushSize() {
 }
 
 void Canvas::clearCanvas() {
+  resetBoard();
+  if (journal)
+    compactJournal();
+}
+
+void Canvas::resetBoard() {
+  // The history has to go first: it frees the items only it still holds,
+  // and the scene then deletes everything that is left on the canvas.
+  cancelImport();
+  tabletSamples.clear();
+  tabletDrawing = false;
+  pendingStrokePoints.clear();
+  pendingErasePoints.clear();
+  shapePending = false;
+  previewPending = false;
+  finishEraseGesture();
+  history.clear();
   scene->clear();
-  undoStack.clear();
-  redoStack.clear();
+  chunks->clear();
+  hitTester.clear();
+  fitJobs.clear();
+  remoteStrokes.clear();
+  journalQueue.clear();
+  journalDirty.clear();
+  journalLayersDirty = false;
+  compactTimer->stop();
+  // The scene deleted the layers along with everything else.
+  layers.clear();
+  currentLayer = nullptr;
+  fillLayer = nullptr;
+  if (currentPath && session)
+    session->endStroke(sessionStroke);
+  currentPath = nullptr;
+  // Never in the scene, so not deleted with it.
+  delete tempShapeItem;
+  tempShapeItem = nullptr;
+  dragPressItem = nullptr;
+  dragItems.clear();
+  selectionProxy.clear();
+  emit historyChanged();
 
   scene->setBackgroundBrush(backgroundColor);
 
   eraserPreview = scene->addEllipse(0, 0, eraserPen.width(), eraserPen.width(),
                                     QPen(Qt::gray), QBrush(Qt::NoBrush));
-  eraserPreview->setZValue(1);
+  eraserPreview->setZValue(eraserPreviewZ);
   eraserPreview->hide();
+  resetLayers(QVector<DocumentLayer>());
 }
 
 void Canvas::undoLastAction() {
-  if (!undoStack.isEmpty()) {
-    Action *lastAction = undoStack.takeLast();
-    lastAction->undo();
-    redoStack.append(lastAction);
+  finishPaste();
+  applyPendingInput();
+  // A stroke's DrawAction is pushed when it begins; undoing it mid-stroke
+  // would let the next push delete the item still being drawn.
+  endStroke();
+  finishEraseGesture();
+  endSelectionDrag();
+  QList<const Action *> applied;
+  if (history.undo(&applied)) {
+    for (const Action *action : applied) {
+      markJournal(action);
+    }
+    syncLayers();
+    emit historyChanged();
   }
 }
 
 void Canvas::redoLastAction() {
-  if (!redoStack.isEmpty()) {
-    Action *nextAction = redoStack.takeLast();
-    nextAction->redo();
-    undoStack.append(nextAction);
+  finishPaste();
+  applyPendingInput();
+  endStroke();
+  finishEraseGesture();
+  endSelectionDrag();
+  QList<const Action *> applied;
+  if (history.redo(&applied)) {
+    for (const Action *action : applied) {
+      markJournal(action);
+    }
+    syncLayers();
+    emit historyChanged();
   }
 }
 
+const History &Canvas::undoHistory() const { return history; }
+
+void Canvas::setHistoryLimits(int maxDepth, qint64 memoryBudget) {
+  history.setMaxDepth(maxDepth);
+  history.setMemoryBudget(memoryBudget);
+  emit historyChanged();
+}
+
+void Canvas::pushAction(Action *action) {
+  finishPaste();
+  markJournal(action);
+  history.push(action);
+  emit historyChanged();
+}
+
 void Canvas::mousePressEvent(QMouseEvent *event) {
+  if (event->button() == Qt::MiddleButton) {
+    panning = true;
+    lastPanPoint = event->pos();
+    viewport()->setCursor(Qt::ClosedHandCursor);
+    return;
+  }
+
   QPointF scenePos = mapToScene(event->pos());
 
-  if (currentShape == Selection) {
+  if (currentTool == Selection) {
     QGraphicsView::mousePressEvent(event);
+    // Pressing a selected item grabs it for a drag of the selection.
+    QGraphicsItem *grabber = scene->mouseGrabberItem();
+    if (event->button() == Qt::LeftButton && grabber &&
+        grabber->isSelected())
+      beginSelectionDrag(grabber, scenePos);
     return;
   }
 
+  if (!canEditLayer())
+    return;
+
+  // Whatever the previous gesture or paste left queued belongs before this
+  // one.
+  PROFILE_INPUT();
+  finishPaste();
+  applyPendingInput();
   startPoint = scenePos;
 
-  switch (currentShape) {
+  switch (currentTool) {
   case Eraser: {
     eraseAt(scenePos);
     break;
   }
   case Pen: {
-    currentPath = new QGraphicsPathItem();
-    currentPath->setPen(currentPen);
-    currentPath->setFlags(QGraphicsItem::ItemIsSelectable |
-                          QGraphicsItem::ItemIsMovable);
-    QPainterPath p;
-    p.moveTo(scenePos);
-    currentPath->setPath(p);
-    scene->addItem(currentPath);
-
-    pointBuffer.clear();
-    pointBuffer.append(scenePos);
-
-    DrawAction *action = new DrawAction(currentPath);
-    undoStack.append(action);
-    redoStack.clear();
+    beginStroke(scenePos);
     break;
   }
-  case Rectangle: {
-    QGraphicsRectItem *rectItem =
-        new QGraphicsRectItem(QRectF(startPoint, startPoint));
-    rectItem->setPen(currentPen);
-    rectItem->setFlags(QGraphicsItem::ItemIsSelectable |
-                       QGraphicsItem::ItemIsMovable);
-    scene->addItem(rectItem);
-    tempShapeItem = rectItem;
-
-    DrawAction *action = new DrawAction(rectItem);
-    undoStack.append(action);
-    redoStack.clear();
+  case Fill: {
+    startFill(scenePos);
     break;
   }
-  case Circle: {
-    QGraphicsEllipseItem *ellipseItem =
-        new QGraphicsEllipseItem(QRectF(startPoint, startPoint));
-    ellipseItem->setPen(currentPen);
-    ellipseItem->setFlags(QGraphicsItem::ItemIsSelectable |
-                          QGraphicsItem::ItemIsMovable);
-    scene->addItem(ellipseItem);
-    tempShapeItem = ellipseItem;
-
-    DrawAction *action = new DrawAction(ellipseItem);
-    undoStack.append(action);
-    redoStack.clear();
-    break;
-  }
-  case Line: {
-    QGraphicsLineItem *lineItem =
-        new QGraphicsLineItem(QLineF(startPoint, startPoint));
-    lineItem->setPen(currentPen);
-    lineItem->setFlags(QGraphicsItem::ItemIsSelectable |
-                       QGraphicsItem::ItemIsMovable);
-    scene->addItem(lineItem);
-    tempShapeItem = lineItem;
-
-    DrawAction *action = new DrawAction(lineItem);
-    undoStack.append(action);
-    redoStack.clear();
+  case DrawShape: {
+    // Dragged out outside the scene; see drawForeground().
+    tempShapeItem = currentShape->begin(startPoint, currentPen);
+    updateShapePreview(QRectF());
     break;
   }
   default:
@@ -226,61 +1007,730 @@ void Canvas::mousePressEvent(QMouseEvent *event) {
 }
 
 void Canvas::mouseMoveEvent(QMouseEvent *event) {
+  if (panning) {
+    panBy(lastPanPoint - event->pos());
+    lastPanPoint = event->pos();
+    return;
+  }
+
   QPointF currentPoint = mapToScene(event->pos());
 
-  if (currentShape == Selection) {
-    QGraphicsView::mouseMoveEvent(event);
+  if (currentTool == Selection) {
+    if (dragPressItem) {
+      PROFILE_INPUT();
+      moveSelectionDrag(currentPoint);
+    } else {
+      QGraphicsView::mouseMoveEvent(event);
+    }
     return;
   }
 
-  switch (currentShape) {
+  // Moves are only recorded here; the scene is changed once per frame in
+  // applyPendingInput().
+  switch (currentTool) {
   case Pen:
-    addPoint(currentPoint);
+    if (currentPath)
+      pendingStrokePoints.append(currentPoint);
     break;
-  case Rectangle:
+  case DrawShape:
     if (tempShapeItem) {
-      QGraphicsRectItem *rectItem =
-          static_cast<QGraphicsRectItem *>(tempShapeItem);
-      rectItem->setRect(QRectF(startPoint, currentPoint).normalized());
+      pendingShapePoint = currentPoint;
+      shapePending = true;
     }
     break;
-  case Circle:
-    if (tempShapeItem) {
-      QGraphicsEllipseItem *ellipseItem =
-          static_cast<QGraphicsEllipseItem *>(tempShapeItem);
-      ellipseItem->setRect(QRectF(startPoint, currentPoint).normalized());
+  case Eraser:
+    if (event->buttons() & Qt::LeftButton) {
+      // Dabs closer than a quarter of the eraser apart add nothing.
+      const qreal spacing = eraserPen.width() / 4.0;
+      if (pendingErasePoints.isEmpty() ||
+          (currentPoint - pendingErasePoints.last()).manhattanLength() >
+              spacing) {
+        pendingErasePoints.append(currentPoint);
+      }
     }
+    pendingPreviewPoint = currentPoint;
+    previewPending = true;
     break;
-  case Line:
-    if (tempShapeItem) {
-      QGraphicsLineItem *lineItem =
-          static_cast<QGraphicsLineItem *>(tempShapeItem);
-      lineItem->setLine(QLineF(startPoint, currentPoint));
+  default:
+    QGraphicsView::mouseMoveEvent(event);
+    return;
+  }
+  // Hovering paints nothing, so only drags count towards input latency.
+  if (event->buttons() & Qt::LeftButton)
+    PROFILE_INPUT();
+  scheduleFrame();
+}
+
+void Canvas::mouseReleaseEvent(QMouseEvent *event) {
+  if (panning && event->button() == Qt::MiddleButton) {
+    panning = false;
+    viewport()->unsetCursor();
+    return;
+  }
+
+  if (currentTool == Selection) {
+    if (dragPressItem && event->button() == Qt::LeftButton)
+      endSelectionDrag(event);
+    else
+      QGraphicsView::mouseReleaseEvent(event);
+    return;
+  }
+
+  Q_UNUSED(event);
+  applyPendingInput();
+  if (currentTool == Eraser) {
+    finishEraseGesture();
+  } else if (currentTool != Pen && tempShapeItem) {
+    endShape();
+  } else if (currentTool == Pen && currentPath) {
+    endStroke();
+  }
+}
+
+void Canvas::tabletEvent(QTabletEvent *event) {
+  // Only the pen uses pressure; everything else keeps working from the
+  // mouse events Qt synthesizes for ignored tablet events.
+  if (currentTool != Pen) {
+    event->ignore();
+    return;
+  }
+
+  // Tablet positions are sub-pixel; map them without rounding to the
+  // viewport's integer grid.
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+  const QPointF globalPos = event->globalPosition();
+#else
+  const QPointF globalPos = event->globalPosF();
+#endif
+  const QPointF viewportPos =
+      globalPos - QPointF(viewport()->mapToGlobal(QPoint(0, 0)));
+
+  TabletSample sample;
+  sample.scenePos = viewportTransform().inverted().map(viewportPos);
+  sample.pressure = event->pressure();
+  sample.xTilt = event->xTilt();
+  sample.yTilt = event->yTilt();
+
+  switch (event->type()) {
+  case QEvent::TabletPress:
+    if (!tabletDrawing && canEditLayer()) {
+      finishPaste();
+      tabletDrawing = true;
+      tabletSamples.clear();
+      beginStroke(sample.scenePos, pressureScale(sample.pressure));
+      lastTabletPoint = sample.scenePos;
+    }
+    break;
+  case QEvent::TabletMove:
+    if (tabletDrawing)
+      queueTabletSample(sample);
+    break;
+  case QEvent::TabletRelease:
+    if (tabletDrawing) {
+      queueTabletSample(sample);
+      consumeTabletSamples();
+      tabletDrawing = false;
+      endStroke();
     }
     break;
   default:
-    QGraphicsView::mouseMoveEvent(event);
     break;
   }
+  event->accept();
+}
 
-  if (currentShape == Eraser) {
-    QPointF scenePos = mapToScene(event->pos());
-    updateEraserPreview(scenePos);
+void Canvas::wheelEvent(QWheelEvent *event) {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+  const QPointF position = event->position();
+#else
+  const QPointF position = event->posF();
+#endif
+  if (event->modifiers() & Qt::ControlModifier) {
+    zoomBy(qPow(zoomPerDegree, event->angleDelta().y() / 8.0), position);
+  } else {
+    // Touchpads report exact pixels; wheels report angles.
+    const QPoint pixels = event->pixelDelta();
+    panBy(pixels.isNull() ? -event->angleDelta() : -pixels);
   }
+  event->accept();
 }
 
-void Canvas::mouseReleaseEvent(QMouseEvent *event) {
-  if (currentShape == Selection) {
-    QGraphicsView::mouseReleaseEvent(event);
+void Canvas::resizeEvent(QResizeEvent *event) {
+  QGraphicsView::resizeEvent(event);
+  growSceneRect(visibleSceneRect());
+  chunkTimer->start();
+}
+
+void Canvas::scrollContentsBy(int dx, int dy) {
+  QGraphicsView::scrollContentsBy(dx, dy);
+  chunkTimer->start();
+}
+
+void Canvas::drawForeground(QPainter *painter, const QRectF &rect) {
+  QGraphicsView::drawForeground(painter, rect);
+  if (!dragItems.isEmpty()) {
+    selectionProxy.paint(painter, dragOffset);
+    // One frame around the whole selection stands in for the item outlines.
+    QPen outline(Qt::gray);
+    outline.setStyle(Qt::DashLine);
+    outline.setCosmetic(true);
+    painter->save();
+    painter->setPen(outline);
+    painter->setBrush(Qt::NoBrush);
+    painter->drawRect(dragBounds.translated(dragOffset));
+    painter->restore();
+  }
+  if (!tempShapeItem || !tempShapeItem->boundingRect().intersects(rect))
     return;
+
+  // Painted the way exports paint the finished shape, over every layer
+  // until it joins its own on release.
+  DocumentItem record;
+  currentShape->snapshot(tempShapeItem, record);
+  painter->save();
+  painter->setPen(record.pen);
+  painter->setBrush(record.brush);
+  currentShape->paint(painter, record);
+  painter->restore();
+}
+
+void Canvas::updateShapePreview(const QRectF &before) {
+  // A couple of pixels on top of the pen for antialiasing.
+  const QRectF dirty = before | tempShapeItem->boundingRect();
+  viewport()->update(
+      mapFromScene(dirty).boundingRect().adjusted(-2, -2, 2, 2));
+}
+
+void Canvas::endShape() {
+  if (!tempShapeItem)
+    return;
+  // Tool changes end the drag too, possibly with its last move queued.
+  applyPendingInput();
+  QGraphicsItem *item = tempShapeItem;
+  tempShapeItem = nullptr;
+  item->setFlags(QGraphicsItem::ItemIsSelectable |
+                 QGraphicsItem::ItemIsMovable);
+  item->setParentItem(currentLayer);
+  cacheFinishedItem(item);
+  pushAction(new DrawAction(item));
+}
+
+void Canvas::beginSelectionDrag(QGraphicsItem *pressed, const QPointF &point) {
+  // Qt would move every selected item on every mouse move; the canvas
+  // takes the drag over instead.
+  pressed->ungrabMouse();
+  dragPressItem = pressed;
+  dragOrigin = point;
+  dragOffset = QPointF();
+}
+
+void Canvas::moveSelectionDrag(const QPointF &point) {
+  if (dragItems.isEmpty()) {
+    if (point == dragOrigin)
+      return;
+    startSelectionProxy();
   }
+  const QRect before = selectionDragViewRect();
+  dragOffset = point - dragOrigin;
+  viewport()->update(before | selectionDragViewRect());
+}
 
-  Q_UNUSED(event);
-  if (currentShape != Pen && currentShape != Eraser && tempShapeItem) {
-    tempShapeItem = nullptr;
-  } else if (currentShape == Pen) {
-    currentPath = nullptr;
-    pointBuffer.clear();
+void Canvas::startSelectionProxy() {
+  QRectF bounds;
+  for (QGraphicsItem *item : scene->selectedItems()) {
+    bounds |= item->sceneBoundingRect();
+  }
+  // Stacking order, which is also the order the proxy paints in.
+  const QList<QGraphicsItem *> candidates = scene->items(
+      bounds, Qt::IntersectsItemBoundingRect, Qt::AscendingOrder);
+  for (QGraphicsItem *item : candidates) {
+    if (item->isSelected() && (item->flags() & QGraphicsItem::ItemIsMovable))
+      dragItems.append(item);
+  }
+  dragBounds = bounds;
+
+  // Only what is in or near the view is painted; the rest of a huge
+  // selection moves unseen until the release.
+  const QRectF visible = visibleSceneRect();
+  const QRectF reach =
+      visible.adjusted(-visible.width() / 4, -visible.height() / 4,
+                       visible.width() / 4, visible.height() / 4);
+  selectionProxy.render(DocumentWriter::snapshot(dragItems), bounds & reach,
+                        zoom() * viewport()->devicePixelRatioF());
+  // Transparent rather than hidden: hiding would drop the selection.
+  for (QGraphicsItem *item : dragItems) {
+    item->setOpacity(0.0);
+  }
+}
+
+void Canvas::endSelectionDrag(const QMouseEvent *release) {
+  QGraphicsItem *pressed = dragPressItem;
+  if (!pressed)
+    return;
+  dragPressItem = nullptr;
+
+  if (dragItems.isEmpty()) {
+    if (!release)
+      return;
+    if (release->modifiers() & Qt::ControlModifier) {
+      pressed->setSelected(false);
+    } else {
+      scene->clearSelection();
+      pressed->setSelected(true);
+    }
+    return;
+  }
+
+  viewport()->update(selectionDragViewRect());
+  const QList<QGraphicsItem *> moved = dragItems;
+  dragItems.clear();
+  selectionProxy.clear();
+  for (QGraphicsItem *item : moved) {
+    item->moveBy(dragOffset.x(), dragOffset.y());
+    item->setOpacity(1.0);
+    reindexItem(item);
+  }
+  if (!dragOffset.isNull())
+    pushAction(new MoveAction(moved, dragOffset));
+}
+
+QRect Canvas::selectionDragViewRect() const {
+  const QRectF moved =
+      (dragBounds | selectionProxy.rect()).translated(dragOffset);
+  return mapFromScene(moved).boundingRect().adjusted(-2, -2, 2, 2);
+}
+
+void Canvas::paintEvent(QPaintEvent *event) {
+  {
+    PROFILE_ZONE(Profiler::Paint);
+    QGraphicsView::paintEvent(event);
+  }
+  PROFILE_PAINTED();
+}
+
+bool Canvas::isPerfHudVisible() const { return !perfHud->isHidden(); }
+
+void Canvas::setPerfHudVisible(bool visible) {
+  if (visible == isPerfHudVisible())
+    return;
+  if (visible) {
+    // Start with a clean window rather than whatever piled up while hidden.
+    for (int zone = 0; zone < Profiler::ZoneCount; ++zone) {
+      Profiler::takeWindow(Profiler::Zone(zone));
+    }
+    perfWindow.start();
+    perfHud->setText("Collecting...");
+    perfHud->adjustSize();
+    perfHud->show();
+    perfHud->raise();
+    perfTimer->start();
+  } else {
+    perfHud->hide();
+    if (!Profiler::isCapturing())
+      perfTimer->stop();
+  }
+}
+
+void Canvas::updatePerfHud() {
+  const int itemCount = scene->items().size();
+  const int strokePoints = currentPath ? currentPath->pointCount() : 0;
+  const qint64 historyKiB = history.memoryUsage() / 1024;
+  Profiler::setCounter("sceneItems", itemCount);
+  Profiler::setCounter("strokePoints", strokePoints);
+  Profiler::setCounter("historyKiB", historyKiB);
+  if (perfHud->isHidden())
+    return;
+
+  Profiler::Stats stats[Profiler::ZoneCount];
+  for (int zone = 0; zone < Profiler::ZoneCount; ++zone) {
+    stats[zone] = Profiler::takeWindow(Profiler::Zone(zone));
+  }
+  const qreal seconds = qMax<qint64>(1, perfWindow.restart()) / 1000.0;
+  auto millis = [](qint64 nanos) {
+    return QString::number(nanos / 1e6, 'f', 2);
+  };
+
+  QStringList lines;
+  const Profiler::Stats &paint = stats[Profiler::Paint];
+  const Profiler::Stats &latency = stats[Profiler::InputToPaint];
+  if (Profiler::isAvailable()) {
+    const QString frameTime =
+        paint.calls ? QString::number(1000.0 * seconds / paint.calls, 'f', 1)
+                    : QString("-");
+    lines << QString("Frame   %1 ms  %2 fps")
+                 .arg(frameTime)
+                 .arg(qRound(paint.calls / seconds));
+    lines << QString("Latency %1 ms  max %2 ms")
+                 .arg(millis(latency.meanNanos()))
+                 .arg(millis(latency.maxNanos));
+  }
+  lines << QString("Items   %1  stroke points %2")
+               .arg(itemCount)
+               .arg(strokePoints);
+  lines << QString("History %1 KB").arg(historyKiB);
+  lines << QString("SIMD    %1")
+               .arg(QString(GeometryKernels::instructionSetName()));
+
+  if (Profiler::isAvailable()) {
+    const Profiler::Zone zones[] = {Profiler::AddPoint, Profiler::EraseAt,
+                                    Profiler::Paint, Profiler::Paste,
+                                    Profiler::Fill};
+    for (Profiler::Zone zone : zones) {
+      const Profiler::Stats &zoneStats = stats[zone];
+      lines << QString("%1 %2 calls  %3 ms avg  %4 ms max")
+                   .arg(QString(Profiler::zoneName(zone)), -8)
+                   .arg(zoneStats.calls, 5)
+                   .arg(QString::number(zoneStats.meanNanos() / 1e6, 'f', 3))
+                   .arg(QString::number(zoneStats.maxNanos / 1e6, 'f', 3));
+    }
+  } else {
+    lines << QString("Timings not compiled in");
+  }
+  perfHud->setText(lines.join('\n'));
+  perfHud->adjustSize();
+  // A new viewport widget may have been stacked on top since.
+  perfHud->raise();
+}
+
+QRectF Canvas::visibleSceneRect() const {
+  return mapToScene(viewport()->rect()).boundingRect();
+}
+
+void Canvas::growSceneRect(const QRectF &visible) {
+  const QRectF current = scene->sceneRect();
+  const QRectF margin = visible.adjusted(-visible.width(), -visible.height(),
+                                         visible.width(), visible.height());
+  if (current.contains(margin))
+    return;
+
+  // Grow by a couple of screens at once: the scene index is rebuilt on
+  // every change, so growing rarely matters more than growing tightly.
+  const QPointF center = visibleSceneRect().center();
+  scene->setSceneRect(current.united(
+      margin.adjusted(-visible.width(), -visible.height(), visible.width(),
+                      visible.height())));
+  centerOn(center);
+}
+
+void Canvas::panBy(const QPoint &delta) {
+  const qreal scale = transform().m11();
+  growSceneRect(visibleSceneRect().translated(QPointF(delta) / scale));
+  horizontalScrollBar()->setValue(horizontalScrollBar()->value() + delta.x());
+  verticalScrollBar()->setValue(verticalScrollBar()->value() + delta.y());
+}
+
+void Canvas::zoomBy(qreal factor, const QPointF &anchor) {
+  const qreal current = transform().m11();
+  const qreal target = qBound(minZoom, current * factor, maxZoom);
+  if (qFuzzyCompare(target, current))
+    return;
+  factor = target / current;
+
+  // Room for the zoomed-out view has to exist before scaling, or Qt clamps
+  // the scroll position to the old scene rect.
+  const QPointF scenePoint = mapToScene(anchor.toPoint());
+  const QRectF visible = visibleSceneRect();
+  growSceneRect(QRectF(scenePoint + (visible.topLeft() - scenePoint) / factor,
+                       visible.size() / factor));
+  scale(factor, factor);
+  const QPointF drift = mapFromScene(scenePoint) - anchor;
+  panBy(drift.toPoint());
+}
+
+QPointF Canvas::viewTopLeft() const { return mapToScene(QPoint(0, 0)); }
+
+qreal Canvas::zoom() const { return transform().m11(); }
+
+void Canvas::setView(const QPointF &topLeft, qreal zoom) {
+  const qreal factor = qBound(minZoom, zoom, maxZoom);
+  setTransform(QTransform::fromScale(factor, factor));
+  const QRectF visible(topLeft, QSizeF(viewport()->size()) / factor);
+  growSceneRect(visible);
+  centerOn(visible.center());
+}
+
+void Canvas::updateChunks() {
+  // Paging waits for gestures to end: their items are not in the history
+  // yet, and a half-built erase may point at any of them.
+  if (currentPath || tempShapeItem || eraseGesture || dragPressItem ||
+      importKind != NoImport) {
+    chunkTimer->start();
+    return;
+  }
+  // Undo entries point at their items, so whatever the history still
+  // reaches stays in memory: with the default depth that is the last
+  // thousand edits, and paging mostly applies to older parts of the board
+  // and to loaded documents. Items still queued for the journal stay too,
+  // as it snapshots them, and so do remote strokes still arriving.
+  const QSet<QGraphicsItem *> referenced = history.referencedItems();
+  const QSet<QGraphicsItem *> arriving = remoteStrokeItems();
+  chunks->update(visibleSceneRect(), [&](QGraphicsItem *item) {
+    return item != eraserPreview && !referenced.contains(item) &&
+           !journalDirty.contains(item) && !arriving.contains(item);
+  });
+}
+
+void Canvas::flattenIdleStrokes() {
+  // Same conditions as paging: gestures and imports keep their items loose.
+  if (currentPath || tempShapeItem || eraseGesture || dragPressItem ||
+      importKind != NoImport) {
+    flattenTimer->start();
+    return;
+  }
+  flattenRuns(false);
+}
+
+void Canvas::flattenRuns(bool undoable) {
+  const QSet<QGraphicsItem *> referenced =
+      undoable ? QSet<QGraphicsItem *>() : history.referencedItems();
+  // Redoing would bring back items the batches replace.
+  const bool attachable = !undoable && !history.canRedo();
+  // Strokes still growing, like the one being drawn, stay loose.
+  const QSet<QGraphicsItem *> arriving = remoteStrokeItems();
+  // What was merged, per layer. Items come in stacking order, which keeps
+  // each layer's items together.
+  struct Replacement {
+    QGraphicsItem *layer;
+    QList<QGraphicsItem *> removed;
+    QList<QGraphicsItem *> added;
+  };
+  // Runs that become an undo step, and runs deleted right away.
+  QVector<Replacement> steps;
+  QVector<Replacement> dropped;
+
+  // Only neighbours in the stacking order are merged, so painting order
+  // never changes.
+  QList<QGraphicsItem *> run;
+  QRectF runBounds;
+  int runMembers = 0;
+  bool runReferenced = false;
+  auto closeRun = [&]() {
+    if (run.size() >= 2) {
+      QVector<Replacement> &replacements =
+          undoable || runReferenced ? steps : dropped;
+      QVector<StrokeBatchItem::Member> members;
+      members.reserve(runMembers);
+      for (QGraphicsItem *item : run) {
+        if (item->type() == StrokeBatchItem::Type)
+          members += static_cast<StrokeBatchItem *>(item)->members();
+        else {
+          // The member keeps the stroke's tag for the journal.
+          tagItem(item);
+          members.append(StrokeBatchItem::memberFor(
+              static_cast<StrokeItem *>(item)));
+        }
+      }
+      QGraphicsItem *layer = run.first()->parentItem();
+      if (replacements.isEmpty() || replacements.last().layer != layer) {
+        Replacement replacement;
+        replacement.layer = layer;
+        replacements.append(replacement);
+      }
+      Replacement &replacement = replacements.last();
+
+      StrokeBatchItem *batch = new StrokeBatchItem(members);
+      batch->setZValue(run.first()->zValue());
+      cacheFinishedItem(batch);
+      if (layer)
+        batch->setParentItem(layer);
+      else
+        scene->addItem(batch);
+      batch->stackBefore(run.first());
+      LayerItem::setStackOrder(batch, LayerItem::stackOrder(run.first()));
+      for (QGraphicsItem *item : run) {
+        scene->removeItem(item);
+        replacement.removed.append(item);
+      }
+      replacement.added.append(batch);
+    }
+    run.clear();
+    runBounds = QRectF();
+    runMembers = 0;
+    runReferenced = false;
+  };
+
+  for (QGraphicsItem *item : scene->items(Qt::AscendingOrder)) {
+    int count = 0;
+    if (item->type() == StrokeBatchItem::Type) {
+      count = static_cast<StrokeBatchItem *>(item)->members().size();
+    } else if (item->type() == StrokeItem::Type) {
+      StrokeItem *stroke = static_cast<StrokeItem *>(item);
+      if (stroke != currentPath && !arriving.contains(stroke) &&
+          !fitJobs.contains(stroke) && StrokeBatchItem::canHold(stroke))
+        count = 1;
+    }
+    QGraphicsItem *parent = item->parentItem();
+    const bool isReferenced = referenced.contains(item);
+    if (count && ((parent && parent->type() != LayerItem::Type) ||
+                  (isReferenced && !attachable)))
+      count = 0;
+    if (!count) {
+      closeRun();
+      continue;
+    }
+
+    const QRectF bounds = item->sceneBoundingRect();
+    const QRectF united = runBounds | bounds;
+    if (!run.isEmpty() &&
+        (runMembers + count > StrokeBatchItem::maxMembers ||
+         united.width() > StrokeBatchItem::maxExtent ||
+         united.height() > StrokeBatchItem::maxExtent ||
+         parent != run.first()->parentItem() ||
+         item->zValue() != run.first()->zValue())) {
+      closeRun();
+      runBounds = bounds;
+    } else {
+      runBounds = united;
+    }
+    run.append(item);
+    runMembers += count;
+    runReferenced = runReferenced || isReferenced;
+  }
+  closeRun();
+
+  if (!steps.isEmpty()) {
+    CompoundAction *action = new CompoundAction();
+    for (const Replacement &replacement : steps) {
+      action->add(new ReplaceAction(scene, replacement.layer,
+                                    replacement.removed, replacement.added));
+    }
+    if (undoable) {
+      pushAction(action);
+    } else {
+      markJournal(action);
+      history.pushAttached(action);
+      emit historyChanged();
+    }
+  }
+  for (const Replacement &replacement : dropped) {
+    // The batches hold the same strokes under the same tags; only changes
+    // still queued for the journal move on to them.
+    bool queued = false;
+    for (QGraphicsItem *item : replacement.removed) {
+      queued |= journalDirty.remove(item);
+      forgetItem(item);
+      delete item;
+    }
+    if (queued) {
+      for (QGraphicsItem *batch : replacement.added) {
+        markJournal(batch);
+      }
+    }
+  }
+}
+
+void Canvas::beginStroke(const QPointF &point, qreal widthScale) {
+  currentPath = new StrokeItem(point, currentPen, widthScale);
+  currentPath->setFlags(currentPath->flags() | QGraphicsItem::ItemIsSelectable |
+                        QGraphicsItem::ItemIsMovable);
+  currentPath->setParentItem(currentLayer);
+  if (session) {
+    sessionStroke = session->beginStroke(point, currentPen.color(),
+                                         currentPen.widthF());
+  }
+
+  DrawAction *action = new DrawAction(currentPath);
+  pushAction(action);
+}
+
+void Canvas::endStroke() {
+  if (!currentPath)
+    return;
+
+  currentPath->finishStroke();
+  if (session)
+    session->endStroke(sessionStroke);
+  cacheFinishedItem(currentPath);
+  compactStroke(currentPath);
+  currentPath = nullptr;
+  emit historyChanged();
+}
+
+void Canvas::queueTabletSample(const TabletSample &sample) {
+  if (!tabletSamples.push(sample)) {
+    // A stalled frame filled the ring; catch up now rather than drop input.
+    consumeTabletSamples();
+    tabletSamples.push(sample);
+  }
+  PROFILE_INPUT();
+  scheduleFrame();
+}
+
+void Canvas::consumeTabletSamples() {
+  TabletSample sample;
+  while (tabletSamples.pop(sample)) {
+    if (!currentPath)
+      continue;
+    const QPointF delta = sample.scenePos - lastTabletPoint;
+    if (QPointF::dotProduct(delta, delta) <
+        minSampleDistance * minSampleDistance)
+      continue;
+
+    addPoint(sample.scenePos, pressureScale(sample.pressure));
+    lastTabletPoint = sample.scenePos;
+  }
+}
+
+void Canvas::setTargetFrameRate(int framesPerSecond) {
+  frameRate = qMax(0, framesPerSecond);
+  if (frameRate > 0) {
+    frameTimer->setInterval(qMax(1, qRound(1000.0 / frameRate)));
+  } else {
+    frameTimer->stop();
+    onFrame();
+  }
+}
+
+int Canvas::targetFrameRate() const { return frameRate; }
+
+void Canvas::scheduleFrame() {
+  if (frameRate == 0) {
+    onFrame();
+  } else if (!frameTimer->isActive()) {
+    frameTimer->start();
+  }
+}
+
+void Canvas::onFrame() {
+  const bool idle = tabletSamples.isEmpty() && pendingStrokePoints.isEmpty() &&
+                    pendingErasePoints.isEmpty() && !shapePending &&
+                    !previewPending;
+  if (idle) {
+    // Nothing arrived during a whole frame: stop ticking until input does.
+    frameTimer->stop();
+    return;
+  }
+  consumeTabletSamples();
+  applyPendingInput();
+}
+
+void Canvas::flushInput() {
+  consumeTabletSamples();
+  applyPendingInput();
+}
+
+void Canvas::applyPendingInput() {
+  PROFILE_ZONE(Profiler::Frame);
+  for (const QPointF &point : pendingStrokePoints) {
+    addPoint(point);
+  }
+  pendingStrokePoints.clear();
+
+  if (shapePending && tempShapeItem) {
+    const QRectF before = tempShapeItem->boundingRect();
+    currentShape->drag(tempShapeItem, startPoint, pendingShapePoint);
+    updateShapePreview(before);
+  }
+  shapePending = false;
+
+  for (const QPointF &point : pendingErasePoints) {
+    eraseAt(point);
+  }
+  pendingErasePoints.clear();
+
+  if (previewPending) {
+    updateEraserPreview(pendingPreviewPoint);
+    previewPending = false;
   }
 }
 
@@ -308,45 +1758,11 @@ void Canvas::copySelectedItems() {
   if (selectedItems.isEmpty())
     return;
 
-  QMimeData *mimeData = new QMimeData();
-
-  QByteArray byteArray;
-  QDataStream dataStream(&byteArray, QIODevice::WriteOnly);
-
-  for (QGraphicsItem *item : selectedItems) {
-    if (auto rectItem = dynamic_cast<QGraphicsRectItem *>(item)) {
-      dataStream << QString("Rectangle");
-      QRectF rect = rectItem->rect();
-      QPointF pos = rectItem->pos();
-      QPen pen = rectItem->pen();
-      QBrush brush = rectItem->brush();
-      dataStream << rect << pos << pen << brush;
-    } else if (auto ellipseItem = dynamic_cast<QGraphicsEllipseItem *>(item)) {
-      dataStream << QString("Ellipse");
-      QRectF rect = ellipseItem->rect();
-      QPointF pos = ellipseItem->pos();
-      QPen pen = ellipseItem->pen();
-      QBrush brush = ellipseItem->brush();
-      dataStream << rect << pos << pen << brush;
-    } else if (auto lineItem = dynamic_cast<QGraphicsLineItem *>(item)) {
-      dataStream << QString("Line");
-      QLineF line = lineItem->line();
-      QPointF pos = lineItem->pos();
-      QPen pen = lineItem->pen();
-      dataStream << line << pos << pen;
-    } else if (auto pathItem = dynamic_cast<QGraphicsPathItem *>(item)) {
-      dataStream << QString("Path");
-      QPainterPath path = pathItem->path();
-      QPointF pos = pathItem->pos();
-      QPen pen = pathItem->pen();
-      dataStream << path << pos << pen;
-    }
-  }
-
-  mimeData->setData("application/x-canvas-items", byteArray);
-
+  // Nothing is serialized here; the clipboard encodes the snapshot only for
+  // consumers that actually ask for it.
   QClipboard *clipboard = QApplication::clipboard();
-  clipboard->setMimeData(mimeData);
+  clipboard->setMimeData(
+      new CanvasMimeData(DocumentWriter::snapshot(selectedItems)));
 }
 
 void Canvas::cutSelectedItems() {
@@ -354,163 +1770,529 @@ void Canvas::cutSelectedItems() {
   if (selectedItems.isEmpty())
     return;
 
+  endSelectionDrag();
   copySelectedItems();
 
+  CompoundAction *cutAction = new CompoundAction();
   for (QGraphicsItem *item : selectedItems) {
-    DeleteAction *action = new DeleteAction(item);
-    undoStack.append(action);
-    redoStack.clear();
+    cutAction->add(new DeleteAction(item));
     scene->removeItem(item);
   }
+  pushAction(cutAction);
 }
 
 void Canvas::pasteItems() {
   QClipboard *clipboard = QApplication::clipboard();
   const QMimeData *mimeData = clipboard->mimeData();
+  if (!mimeData)
+    return;
+
+  // Whatever is still arriving from an earlier paste goes first.
+  finishImport();
+
+  // Copied in this process: build the items straight from the snapshot.
+  // Otherwise decode the item stream of another instance. Either way the
+  // items are built on worker threads and arrive over the next frames.
+  if (const CanvasMimeData *canvasData =
+          qobject_cast<const CanvasMimeData *>(mimeData)) {
+    importer->start(canvasData->items());
+  } else if (mimeData->hasFormat(CanvasMimeData::itemsFormat)) {
+    importer->start(mimeData->data(CanvasMimeData::itemsFormat));
+  } else {
+    return;
+  }
+  importKind = PasteImport;
+  pasteAction = new CompoundAction();
+  skippedRecords = 0;
+}
+
+void Canvas::pasteItems(const QByteArray &itemStream) {
+  if (itemStream.isEmpty())
+    return;
+
+  finishImport();
+  importer->start(itemStream);
+  importKind = PasteImport;
+  pasteAction = new CompoundAction();
+  skippedRecords = 0;
+  // The input recorded after the paste expects the items to be there.
+  finishImport();
+}
+
+QByteArray Canvas::clipboardItems() const {
+  const QMimeData *mimeData = QApplication::clipboard()->mimeData();
+  if (!mimeData || !mimeData->hasFormat(CanvasMimeData::itemsFormat))
+    return QByteArray();
+  return mimeData->data(CanvasMimeData::itemsFormat);
+}
+
+void Canvas::addPoint(const QPointF &point, qreal widthScale) {
+  PROFILE_ZONE(Profiler::AddPoint);
+  if (!currentPath)
+    return;
 
-  if (mimeData->hasFormat("application/x-canvas-items")) {
-    QByteArray byteArray = mimeData->data("application/x-canvas-items");
-    QDataStream dataStream(&byteArray, QIODevice::ReadOnly);
-
-    QList<QGraphicsItem *> pastedItems;
-
-    while (!dataStream.atEnd()) {
-      QString itemType;
-      dataStream >> itemType;
-
-      if (itemType == "Rectangle") {
-        QRectF rect;
-        QPointF pos;
-        QPen pen;
-        QBrush brush;
-        dataStream >> rect >> pos >> pen >> brush;
-
-        QGraphicsRectItem *newRect = new QGraphicsRectItem(rect);
-        newRect->setPen(pen);
-        newRect->setBrush(brush);
-        newRect->setPos(pos + QPointF(10, 10));
-        newRect->setFlags(QGraphicsItem::ItemIsSelectable |
-                          QGraphicsItem::ItemIsMovable);
-        scene->addItem(newRect);
-        pastedItems.append(newRect);
-
-        DrawAction *action = new DrawAction(newRect);
-        undoStack.append(action);
-        redoStack.clear();
-      } else if (itemType == "Ellipse") {
-        QRectF rect;
-        QPointF pos;
-        QPen pen;
-        QBrush brush;
-        dataStream >> rect >> pos >> pen >> brush;
-
-        QGraphicsEllipseItem *newEllipse = new QGraphicsEllipseItem(rect);
-        newEllipse->setPen(pen);
-        newEllipse->setBrush(brush);
-        newEllipse->setPos(pos + QPointF(10, 10));
-        newEllipse->setFlags(QGraphicsItem::ItemIsSelectable |
-                             QGraphicsItem::ItemIsMovable);
-        scene->addItem(newEllipse);
-        pastedItems.append(newEllipse);
-
-        DrawAction *action = new DrawAction(newEllipse);
-        undoStack.append(action);
-        redoStack.clear();
-      } else if (itemType == "Line") {
-        QLineF line;
-        QPointF pos;
-        QPen pen;
-        dataStream >> line >> pos >> pen;
-
-        QGraphicsLineItem *newLine = new QGraphicsLineItem(line);
-        newLine->setPen(pen);
-        newLine->setPos(pos + QPointF(10, 10));
-        newLine->setFlags(QGraphicsItem::ItemIsSelectable |
-                          QGraphicsItem::ItemIsMovable);
-        scene->addItem(newLine);
-        pastedItems.append(newLine);
-
-        DrawAction *action = new DrawAction(newLine);
-        undoStack.append(action);
-        redoStack.clear();
-      } else if (itemType == "Path") {
-        QPainterPath path;
-        QPointF pos;
-        QPen pen;
-        dataStream >> path >> pos >> pen;
-
-        QGraphicsPathItem *newPath = new QGraphicsPathItem(path);
-        newPath->setPen(pen);
-        newPath->setPos(pos + QPointF(10, 10));
-        newPath->setFlags(QGraphicsItem::ItemIsSelectable |
-                          QGraphicsItem::ItemIsMovable);
-        scene->addItem(newPath);
-        pastedItems.append(newPath);
-
-        DrawAction *action = new DrawAction(newPath);
-        undoStack.append(action);
-        redoStack.clear();
+  currentPath->addPoint(point, widthScale);
+  if (session)
+    session->addPoint(sessionStroke, point, widthScale);
+}
+
+void Canvas::eraseAt(const QPointF &point) {
+  PROFILE_ZONE(Profiler::EraseAt);
+  if (!canEditLayer())
+    return;
+  qreal eraserSize = eraserPen.width();
+  QRectF eraserRect(point.x() - eraserSize / 2, point.y() - eraserSize / 2,
+                    eraserSize, eraserSize);
+
+  // Only the coarse lookup goes through the active layer's index, so other
+  // layers cost nothing; the precise test against each candidate happens
+  // below.
+  QList<QGraphicsItem *> itemsToErase = currentLayer->items(eraserRect);
+
+  for (QGraphicsItem *item : itemsToErase) {
+    if (!item->sceneBoundingRect().intersects(eraserRect))
+      continue;
+
+    if (item->type() == StrokeBatchItem::Type) {
+      // A batch is only broken up where the eraser actually touches one of
+      // its strokes; then the strokes under the eraser are erased as usual.
+      if (!hitTester.hits(item, point, eraserSize / 2))
+        continue;
+      const QList<StrokeItem *> members =
+          expandBatch(static_cast<StrokeBatchItem *>(item));
+      for (StrokeItem *member : members) {
+        if (member->sceneBoundingRect().intersects(eraserRect))
+          eraseItem(member, point, eraserSize / 2);
       }
+    } else {
+      eraseItem(item, point, eraserSize / 2);
+    }
+  }
+}
+
+void Canvas::eraseItem(QGraphicsItem *item, const QPointF &point,
+                       qreal radius) {
+  StrokeItem *strokeItem =
+      splitEraseEnabled ? dynamic_cast<StrokeItem *>(item) : nullptr;
+  if (strokeItem) {
+    QList<StrokeItem *> pieces;
+    if (!hitTester.splitStroke(strokeItem, point, radius, pieces))
+      return;
+
+    if (!eraseGesture)
+      eraseGesture = new CompoundAction();
+    if (!eraseSplits) {
+      eraseSplits = new ReplaceAction(scene, currentLayer,
+                                      QList<QGraphicsItem *>(),
+                                      QList<QGraphicsItem *>());
+      eraseGesture->add(eraseSplits);
     }
 
-    for (QGraphicsItem *item : pastedItems) {
-      item->setSelected(true);
+    // The pieces take the stroke's place in the stacking order, so cutting
+    // an old stroke does not lift what is left of it over newer ones.
+    for (StrokeItem *piece : pieces) {
+      piece->setZValue(strokeItem->zValue());
+      cacheFinishedItem(piece);
+      piece->setParentItem(currentLayer);
+      piece->stackBefore(strokeItem);
+      LayerItem::setStackOrder(piece, LayerItem::stackOrder(strokeItem));
+      eraseSplits->addAddedItem(piece);
     }
+    scene->removeItem(strokeItem);
+    if (eraseSplits->takeAddedItem(strokeItem)) {
+      // A piece cut earlier in this same gesture: undo goes straight back
+      // to the original stroke, so the intermediate piece can go now.
+      forgetItem(strokeItem);
+      delete strokeItem;
+    } else {
+      eraseSplits->addRemovedItem(strokeItem);
+    }
+  } else if (hitTester.hits(item, point, radius)) {
+    if (!eraseGesture)
+      eraseGesture = new CompoundAction();
+    eraseGesture->add(new DeleteAction(item));
+    scene->removeItem(item);
   }
 }
 
-void Canvas::addPoint(const QPointF &point) {
-  if (!currentPath)
+void Canvas::startFill(const QPointF &point) {
+  if (filler->isRunning())
     return;
 
-  pointBuffer.append(point);
+  // The scene reports changes from the event loop; take any still pending
+  // before the filler decides which of its tiles are current.
+  QCoreApplication::sendPostedEvents(scene, QEvent::MetaCall);
+
+  // The fill sees the board as it is painted, out to the tiles around the
+  // edges of the view, at the resolution it is shown at. Only the tiles it
+  // does not have yet need a snapshot.
+  fillLayer = currentLayer;
+  fillColor = currentPen.color();
+  fillStart = Profiler::now();
+  filler->start(visibleSceneRect(), zoom() * devicePixelRatioF(),
+                backgroundColor, point, tolerance, [this](const QRectF &rect) {
+                  QList<QGraphicsItem *> items;
+                  for (QGraphicsItem *item :
+                       scene->items(rect, Qt::IntersectsItemBoundingRect,
+                                    Qt::AscendingOrder)) {
+                    if (item != eraserPreview && item->isVisible())
+                      items.append(item);
+                  }
+                  return DocumentWriter::snapshot(items);
+                });
+}
 
-  const int minPointsRequired = 4;
+void Canvas::finishFill(const QVector<QRectF> &rects) {
+  if (Profiler::isAvailable())
+    Profiler::addSample(Profiler::Fill, fillStart,
+                        Profiler::now() - fillStart);
+  LayerItem *layer = fillLayer;
+  fillLayer = nullptr;
+  if (!layer || layer->scene() != scene || rects.isEmpty())
+    return;
 
-  if (pointBuffer.size() >= minPointsRequired) {
-    QPointF p0 = pointBuffer.at(pointBuffer.size() - minPointsRequired);
-    QPointF p1 = pointBuffer.at(pointBuffer.size() - minPointsRequired + 1);
-    QPointF p2 = pointBuffer.at(pointBuffer.size() - minPointsRequired + 2);
-    QPointF p3 = pointBuffer.at(pointBuffer.size() - minPointsRequired + 3);
+  FillItem *fill = new FillItem(rects, QBrush(fillColor));
+  fill->setFlags(QGraphicsItem::ItemIsSelectable |
+                 QGraphicsItem::ItemIsMovable);
+  fill->setParentItem(layer);
+  cacheFinishedItem(fill);
+  pushAction(new DrawAction(fill));
+}
 
-    QPointF controlPoint1 = p1 + (p2 - p0) / 6.0;
-    QPointF controlPoint2 = p2 - (p3 - p1) / 6.0;
+QList<StrokeItem *> Canvas::expandBatch(StrokeBatchItem *batch) {
+  if (!eraseGesture)
+    eraseGesture = new CompoundAction();
+  if (!eraseSplits) {
+    eraseSplits = new ReplaceAction(scene, currentLayer,
+                                    QList<QGraphicsItem *>(),
+                                    QList<QGraphicsItem *>());
+    eraseGesture->add(eraseSplits);
+  }
 
-    QPainterPath path = currentPath->path();
-    path.cubicTo(controlPoint1, controlPoint2, p2);
-    currentPath->setPath(path);
+  // The strokes take the batch's place in the stacking order, so nothing
+  // drawn over it ends up underneath.
+  const QList<StrokeItem *> members = batch->createStrokes();
+  int index = 0;
+  for (StrokeItem *member : members) {
+    member->setFlags(member->flags() | QGraphicsItem::ItemIsSelectable |
+                     QGraphicsItem::ItemIsMovable);
+    member->setZValue(batch->zValue());
+    cacheFinishedItem(member);
+    member->setParentItem(currentLayer);
+    member->stackBefore(batch);
+    LayerItem::setStackOrder(member, batch->members().at(index++).order);
+    eraseSplits->addAddedItem(member);
   }
+  scene->removeItem(batch);
+  eraseSplits->addRemovedItem(batch);
+  return members;
+}
+
+void Canvas::finishEraseGesture() {
+  if (!eraseGesture)
+    return;
 
-  if (pointBuffer.size() > minPointsRequired) {
-    pointBuffer.removeFirst();
+  // Everything erased between press and release is one undo step.
+  CompoundAction *action = eraseGesture;
+  eraseGesture = nullptr;
+  eraseSplits = nullptr;
+  if (action->isEmpty()) {
+    delete action;
+  } else {
+    pushAction(action);
   }
 }
-void Canvas::eraseAt(const QPointF &point) {
-  qreal eraserSize = eraserPen.width();
-  QRectF eraserRect(point.x() - eraserSize / 2, point.y() - eraserSize / 2,
-                    eraserSize, eraserSize);
 
-  QPainterPath eraserPath;
-  eraserPath.addEllipse(eraserRect);
+void Canvas::saveDocument(const QString &fileName) {
+  finishImport();
 
-  QList<QGraphicsItem *> itemsToErase = scene->items(eraserRect);
+  // Only the snapshot touches live items; reading paged-out chunks,
+  // encoding and writing happen on the save thread with a copy that shares
+  // the stroke geometry.
+  saveThreads.start(new SaveDocumentTask(
+      this, fileName, residentSnapshot(), chunks->pages(), layerTable()));
+}
 
-  for (QGraphicsItem *item : itemsToErase) {
-    if (item == eraserPreview)
-      continue; // Ignore the eraser preview itself
+void Canvas::loadDocument(const QString &fileName) {
+  if (!startLoading(new DocumentReader(fileName), fileName))
+    return;
+  // The file already holds the board being loaded: it becomes the
+  // snapshot, and what happens to the board from here goes on top.
+  if (journal)
+    journal->compactFrom(fileName);
+}
 
-    // Get the item's shape and use QPainterPathStroker for strokes
-    QPainterPath itemPath = item->shape();
-    QPainterPathStroker stroker;
-    stroker.setWidth(1); // Use the pen width of the item
-    QPainterPath strokedPath = stroker.createStroke(itemPath);
+void Canvas::loadBoard(const QByteArray &document) {
+  if (!startLoading(new DocumentReader(document), "the session board"))
+    return;
+  if (journal)
+    journal->compactFrom(document);
+}
+
+bool Canvas::startLoading(DocumentReader *reader, const QString &name) {
+  QString error;
+  if (!reader->open(&error)) {
+    delete reader;
+    emit documentLoaded(name, false, error);
+    return false;
+  }
 
-    // Check for intersection with the eraser path
-    if (eraserPath.intersects(strokedPath)) {
-      DeleteAction *action = new DeleteAction(item);
-      undoStack.append(action);
-      redoStack.clear();
-      scene->removeItem(item);
+  resetBoard();
+  resetLayers(reader->layers());
+  // Items drawn while the import runs must not take a tag the file holds.
+  nextTag = qMax(nextTag, reader->maxTag() + 1);
+  importer->start(reader);
+  importKind = DocumentImport;
+  documentFileName = name;
+  skippedRecords = 0;
+  return true;
+}
+
+void Canvas::addLoadedItem(QGraphicsItem *item, LayerItem *layer) {
+  if (!item) {
+    ++skippedRecords;
+    return;
+  }
+  item->setFlags(item->flags() | QGraphicsItem::ItemIsSelectable |
+                 QGraphicsItem::ItemIsMovable);
+  cacheFinishedItem(item);
+  item->setParentItem(layer ? layer : currentLayer);
+}
+
+void Canvas::addImportedItem(const ItemImporter::Prepared &prepared) {
+  QGraphicsItem *item = prepared.item;
+  LayerItem *layer = nullptr;
+  if (item) {
+    hitTester.adopt(item, prepared.outline);
+    if (importKind == PasteImport) {
+      item->moveBy(10, 10);
+      // A copy is a new item; it is tagged once it is journaled.
+      item->setData(DocumentItem::tagKey, QVariant());
     }
   }
+  // Pastes land on the active layer; loaded records on their own, or on
+  // the bottom one if the file has no such layer.
+  if (importKind == DocumentImport) {
+    layer = layerWithId(prepared.layer);
+    if (!layer)
+      layer = sceneLayers().value(0);
+  }
+  addLoadedItem(item, layer);
+  if (item && importKind == PasteImport) {
+    pasteAction->add(new DrawAction(item));
+    item->setSelected(true);
+  }
+}
+
+void Canvas::forgetItem(QGraphicsItem *item) {
+  hitTester.forget(item);
+  // A deleted item still queued was taken off the board by an edit.
+  // Paged-out items are never queued.
+  if (journalDirty.remove(item) && item->scene() != scene)
+    journalRemove(item);
+  if (item->type() == StrokeItem::Type) {
+    StrokeItem *stroke = static_cast<StrokeItem *>(item);
+    fitJobs.remove(stroke);
+    // Stroke ids start at 1, so key 0 never names a remote stroke.
+    remoteStrokes.remove(remoteStrokes.key(stroke));
+  } else if (item->type() == LayerItem::Type) {
+    // A layer deletes its items along with it.
+    layers.removeOne(static_cast<LayerItem *>(item));
+    if (item == fillLayer)
+      fillLayer = nullptr;
+    for (QGraphicsItem *child : item->childItems()) {
+      forgetItem(child);
+    }
+  }
+}
+
+void Canvas::compactStroke(StrokeItem *stroke) {
+  if (stroke->segments().size() < minFitSegments)
+    return;
+
+  // Input arrives one segment per sample; the refit keeps the look within a
+  // fraction of a screen pixel at the zoom it was drawn at, with far fewer
+  // segments. The worker only sees a shared copy of the geometry, and the
+  // result is swapped in on this thread only if nothing changed meanwhile.
+  const int job = nextFitJob++;
+  fitJobs.insert(stroke, job);
+  const quint64 revision = stroke->revision();
+  const qreal tolerance = fitPixelTolerance / transform().m11();
+  fitThreads.start(new FitStrokeTask(
+      this, stroke->startPoint(), stroke->segments(), tolerance,
+      [this, stroke, job,
+       revision](const QVector<StrokeItem::Segment> &fitted) {
+        if (fitJobs.value(stroke, -1) != job)
+          return;
+        fitJobs.remove(stroke);
+        if (fitted.size() >= stroke->segments().size() ||
+            !stroke->replaceSegments(fitted, revision))
+          return;
+        reindexItem(stroke);
+        markJournal(stroke);
+        // Entries only charge strokes they own, which are out of the
+        // scene; those shrink with it.
+        if (stroke->scene() != scene)
+          history.refresh(stroke);
+        emit historyChanged();
+      }));
+}
+
+void Canvas::cacheFinishedItem(QGraphicsItem *item) {
+  // Finished items are drawn once into a device-space pixmap and blitted
+  // from then on, so a new segment only costs the live stroke plus a copy
+  // of the cached pixels beneath it. Qt clips the cache of items larger than
+  // the viewport to the visible part. Items still being drawn stay uncached:
+  // growing a cached item would re-render its whole pixmap every frame.
+  // On the GL viewport strokes draw from their vertex buffers instead, which
+  // a raster cache would bypass.
+  const bool gpuStroke = gpuViewport && item->type() == StrokeItem::Type;
+  item->setCacheMode(gpuStroke ? QGraphicsItem::NoCache
+                               : QGraphicsItem::DeviceCoordinateCache);
+  // Finished items are also the ones that may be paged out later.
+  chunks->track(item);
+  // Items already in a layer may have grown since they were indexed.
+  reindexItem(item);
 }
+
+bool Canvas::isGpuViewportAvailable() {
+#ifdef HAVE_OPENGL
+  static const bool available = []() {
+    QOpenGLContext context;
+    return context.create();
+  }();
+  return available;
+#else
+  return false;
+#endif
+}
+
+bool Canvas::isGpuViewportEnabled() const { return gpuViewport; }
+
+bool Canvas::setGpuViewportEnabled(bool enabled) {
+  if (enabled == gpuViewport)
+    return true;
+  if (enabled && !isGpuViewportAvailable())
+    return false;
+
+#ifdef HAVE_OPENGL
+  if (enabled) {
+    QOpenGLWidget *glViewport = new QOpenGLWidget();
+    QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+    format.setSamples(gpuSamples);
+    glViewport->setFormat(format);
+    // Stroke buffers live in the widget's context and go with it.
+    connect(glViewport, &QOpenGLWidget::aboutToBeDestroyed, glViewport,
+            []() { GlStrokeRenderer::releaseCurrentContext(); });
+    setViewport(glViewport);
+    // A GL frame is redrawn in one pass anyway; tracking dirty regions
+    // would only add CPU work.
+    setViewportUpdateMode(QGraphicsView::FullViewportUpdate);
+  } else {
+    setViewport(new QWidget());
+    setViewportUpdateMode(QGraphicsView::SmartViewportUpdate);
+  }
+#endif
+  viewport()->setMouseTracking(true);
+  gpuViewport = enabled;
+
+  for (QGraphicsItem *item : scene->items()) {
+    if (item != currentPath && item != eraserPreview)
+      cacheFinishedItem(item);
+  }
+  return true;
+}
+
+void Canvas::addImportedBatch() {
+  if (importKind == NoImport)
+    return;
+  PROFILE_ZONE(Profiler::Paste);
+
+  // Items come ready-made from the importer; only adding them to the scene
+  // happens here, a time slice at a time, so the board stays responsive and
+  // paints while a large paste or document streams in.
+  QElapsedTimer timer;
+  timer.start();
+  ItemImporter::Prepared prepared;
+  int added = 0;
+  while (importer->take(&prepared)) {
+    addImportedItem(prepared);
+    if (++added % 64 == 0 && timer.elapsed() >= loadBatchMillis) {
+      loadTimer->start();
+      return;
+    }
+  }
+  // Otherwise the importer signals once more items are ready.
+  if (!importer->isActive())
+    endImport();
+}
+
+void Canvas::finishImport() {
+  if (importKind == NoImport)
+    return;
+
+  importer->waitForDone();
+  ItemImporter::Prepared prepared;
+  while (importer->take(&prepared)) {
+    addImportedItem(prepared);
+  }
+  endImport();
+}
+
+void Canvas::finishPaste() {
+  if (importKind == PasteImport)
+    finishImport();
+}
+
+void Canvas::endImport() {
+  const ImportKind kind = importKind;
+  CompoundAction *action = pasteAction;
+  importKind = NoImport;
+  pasteAction = nullptr;
+  loadTimer->stop();
+  importer->cancel();
+
+  if (kind == PasteImport) {
+    // The whole paste is one undo step.
+    if (action->isEmpty()) {
+      delete action;
+    } else {
+      pushAction(action);
+    }
+  } else if (kind == DocumentImport) {
+    const QString error =
+        skippedRecords > 0
+            ? QString("Skipped %1 damaged items").arg(skippedRecords)
+            : QString();
+    emit documentLoaded(documentFileName, true, error);
+  }
+  // Everything is in the scene now; page out what is far from the view.
+  chunkTimer->start();
+}
+
+void Canvas::cancelImport() {
+  loadTimer->stop();
+  importer->cancel();
+  importKind = NoImport;
+  // Its items are still in the scene, which deletes them.
+  delete pasteAction;
+  pasteAction = nullptr;
+}
+
+bool Canvas::exportImage(const QString &fileName, qreal scale) {
+  finishImport();
+
+  const QVector<DocumentItem> snapshot = boardSnapshot();
+
+  // The scene rect only bounds scrolling; the image covers the drawing, or
+  // the view when the board is empty.
+  QRectF bounds;
+  for (const DocumentItem &item : snapshot) {
+    bounds = bounds.united(item.sceneBounds);
+  }
+  if (bounds.isEmpty())
+    bounds = visibleSceneRect();
+  return exporter->start(fileName, snapshot, bounds, scale, backgroundColor);
+}
+
+void Canvas::cancelExport() { exporter->cancel(); }
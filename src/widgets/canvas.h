@@ -3,6 +3,24 @@
 #define CANVAS_H
 
 #include "../core/action.h"
+#include "../core/canvas_mime_data.h"
+#include "../core/chunk_store.h"
+#include "../core/document.h"
+#include "../core/eraser_hit_tester.h"
+#include "../core/fill_item.h"
+#include "../core/flood_filler.h"
+#include "../core/history.h"
+#include "../core/item_importer.h"
+#include "../core/journal.h"
+#include "../core/layer_item.h"
+#include "../core/profiler.h"
+#include "../core/raster_exporter.h"
+#include "../core/sample_ring.h"
+#include "../core/selection_proxy.h"
+#include "../core/shape_registry.h"
+#include "../core/stroke_batch.h"
+#include "../core/stroke_item.h"
+#include "../core/sync_session.h"
 #include <QApplication>
 #include <QClipboard>
 #include <QGraphicsEllipseItem>
@@ -12,10 +30,17 @@
 #include <QGraphicsRectItem>
 #include <QGraphicsScene>
 #include <QGraphicsView>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QLabel>
 #include <QList>
 #include <QMimeData>
 #include <QMouseEvent>
 #include <QPen>
+#include <QSet>
+#include <QTabletEvent>
+#include <QThreadPool>
+#include <QTimer>
 #include <QVector>
 
 class Canvas : public QGraphicsView {
@@ -25,10 +50,78 @@ public:
   explicit Canvas(QWidget *parent = nullptr);
   ~Canvas();
 
+  bool isSpatialIndexEnabled() const;
+  bool isSplitEraseEnabled() const;
+  bool isAutoFlattenEnabled() const;
+  int fillTolerance() const;
+  const History &undoHistory() const;
+  int targetFrameRate() const;
+  bool isGpuViewportEnabled() const;
+  // Whether this build and machine can run the OpenGL viewport.
+  static bool isGpuViewportAvailable();
+  bool isPerfHudVisible() const;
+  void setHistoryLimits(int maxDepth, qint64 memoryBudget);
+  // Scene point at the viewport's top-left corner, and the current scale.
+  QPointF viewTopLeft() const;
+  qreal zoom() const;
+  void setView(const QPointF &topLeft, qreal zoom);
+  // Applies input queued for the next frame right away.
+  void flushInput();
+  // Layers in the scene, bottom first. Drawing, erasing and selection only
+  // touch the active one.
+  int layerCount() const;
+  int activeLayerIndex() const;
+  QString layerName(int index) const;
+  bool isLayerHidden(int index) const;
+  bool isLayerLocked(int index) const;
+  // Journals every change to the board into directory from now on, after
+  // restoring the board an earlier session left there. False if the
+  // directory cannot be used; nothing is journaled then.
+  bool startJournal(const QString &directory,
+                    QString *errorString = nullptr);
+  // Shares strokes live with other instances while they are drawn: hosts a
+  // session on address and port, or joins the one at hostName and takes
+  // over its board. Every instance needs the same secret. Other edits stay
+  // local.
+  bool hostSession(const QHostAddress &address, quint16 port,
+                   const QByteArray &secret,
+                   QString *errorString = nullptr);
+  void joinSession(const QString &hostName, quint16 port,
+                   const QByteArray &secret);
+
+signals:
+  // Emitted whenever the undo history changes, e.g. to refresh its memory
+  // usage on a status bar.
+  void historyChanged();
+  // Emitted once a background save has been written (or has failed).
+  void documentSaved(const QString &fileName, bool ok, const QString &error);
+  // Emitted once every record of a loaded document is on the canvas, or
+  // straight away when the file could not be opened.
+  void documentLoaded(const QString &fileName, bool ok, const QString &error);
+  void exportProgress(int done, int total);
+  void exportFinished(const QString &fileName, bool ok, const QString &error);
+  // Emitted when layers are added, removed, shown, hidden, locked or
+  // unlocked, or another one becomes active.
+  void layersChanged();
+  // Emitted when the autosave journal could not be written; it keeps
+  // trying with later changes.
+  void autosaveFailed(const QString &error);
+  // Emitted when the host of a joined session cannot be reached.
+  void sessionLost(const QString &error);
+
 public slots:
-  void setShape(const QString &shapeType);
+  // Drags out shape with the next presses, e.g.
+  // setShape(ShapeRegistry::tool<RectangleShape>()).
+  void setShape(const ShapeTool *shape);
+  void setSelectionTool();
   void setPenTool();
   void setEraserTool();
+  // Clicks fill the connected area of similar color under the cursor, as
+  // far as the view reaches, with the pen color on the active layer.
+  void setFillTool();
+  // Largest difference per color channel, 0-255, that the fill still
+  // spreads into.
+  void setFillTolerance(int tolerance);
   void setPenColor(const QColor &color);
   void increaseBrushSize();
   void decreaseBrushSize();
@@ -38,35 +131,286 @@ public slots:
   void copySelectedItems();
   void cutSelectedItems();
   void pasteItems();
+  // Pastes an itemsFormat stream and waits until all of it is on the
+  // canvas, for replaying a recorded paste.
+  void pasteItems(const QByteArray &itemStream);
+  // What pasteItems() would paste, as an itemsFormat stream; empty if the
+  // clipboard holds no items.
+  QByteArray clipboardItems() const;
+  void setSpatialIndexEnabled(bool enabled);
+  void setSplitEraseEnabled(bool enabled);
+  // Merges runs of finished strokes into StrokeBatchItems as one undo step.
+  void flattenStrokes();
+  // Flattens strokes the history no longer refers to whenever the board
+  // has been idle for a few seconds; off by default.
+  void setAutoFlattenEnabled(bool enabled);
+  // Adds an empty layer on top and makes it active; undoable.
+  void addLayer();
+  // Deletes the active layer with everything on it; undoable. The last
+  // layer stays.
+  void removeActiveLayer();
+  void setActiveLayer(int index);
+  // Hidden layers are not painted, locked ones are not edited; neither can
+  // be drawn on or erased while active.
+  void setActiveLayerHidden(bool hidden);
+  void setActiveLayerLocked(bool locked);
+  // Caps how often input is applied to the scene while drawing. Moves
+  // between ticks are only queued; 0 applies every event immediately.
+  void setTargetFrameRate(int framesPerSecond);
+  // Moves the canvas onto an OpenGL viewport, or back to the raster one.
+  // Returns false, leaving the raster viewport in place, when the GPU path
+  // is unavailable.
+  bool setGpuViewportEnabled(bool enabled);
+  // Overlay with frame and input-to-paint times, scene and history sizes
+  // and the hot-path timings of the last half second.
+  void setPerfHudVisible(bool visible);
+  void saveDocument(const QString &fileName);
+  void loadDocument(const QString &fileName);
+  // Loads a document held in memory, such as a session's board.
+  void loadBoard(const QByteArray &document);
+  // Renders the board at scale times its scene resolution in the background;
+  // returns false while another export is still running.
+  bool exportImage(const QString &fileName, qreal scale);
+  void cancelExport();
+  // Multiplies the zoom, keeping the scene point under anchor (viewport
+  // coordinates) in place.
+  void zoomBy(qreal factor, const QPointF &anchor);
 
 protected:
   void mousePressEvent(QMouseEvent *event) override;
   void mouseMoveEvent(QMouseEvent *event) override;
   void mouseReleaseEvent(QMouseEvent *event) override;
+  void tabletEvent(QTabletEvent *event) override;
+  void wheelEvent(QWheelEvent *event) override;
+  void resizeEvent(QResizeEvent *event) override;
+  void scrollContentsBy(int dx, int dy) override;
+  void paintEvent(QPaintEvent *event) override;
+  void drawForeground(QPainter *painter, const QRectF &rect) override;
 
 private:
-  enum ShapeType { Line, Rectangle, Circle, Pen, Eraser, Selection };
+  enum ToolMode { DrawShape, Pen, Eraser, Selection, Fill };
+
+  struct TabletSample {
+    QPointF scenePos;
+    qreal pressure;
+    qreal xTilt;
+    qreal yTilt;
+  };
 
   QGraphicsScene *scene;
   QPen currentPen;
   QPen eraserPen;
-  ShapeType currentShape;
+  ToolMode currentTool;
+  // Shape dragged out in DrawShape mode.
+  const ShapeTool *currentShape;
   QPointF startPoint;
+  // The shape being dragged. It stays out of the scene, and so out of its
+  // index, selection and change tracking, until the drag ends.
   QGraphicsItem *tempShapeItem;
-  QGraphicsPathItem *currentPath;
+  // Selection drag: armed by a press on a selected item, running once the
+  // cursor moves. Meanwhile the items are transparent and the proxy is
+  // drawn in their place, moved by dragOffset.
+  QGraphicsItem *dragPressItem;
+  QList<QGraphicsItem *> dragItems;
+  QPointF dragOrigin;
+  QPointF dragOffset;
+  // Scene bounds of the dragged items where they were.
+  QRectF dragBounds;
+  SelectionProxy selectionProxy;
+  StrokeItem *currentPath;
   QColor backgroundColor;
   QGraphicsEllipseItem *eraserPreview;
+  bool splitEraseEnabled;
   const int MAX_BRUSH_SIZE = 150;
   const int MIN_BRUSH_SIZE = 1;
-  QVector<QPointF> pointBuffer;
   const int smoothingFactor = 5;
   QPointF previousPoint;
   void updateEraserPreview(const QPointF &position);
   void hideEraserPreview();
-  void addPoint(const QPointF &point);
+  void addPoint(const QPointF &point, qreal widthScale = 1.0);
+  void beginStroke(const QPointF &point, qreal widthScale = 1.0);
+  void endStroke();
+  void queueTabletSample(const TabletSample &sample);
+  void consumeTabletSamples();
+  void scheduleFrame();
+  void onFrame();
+  void applyPendingInput();
   void eraseAt(const QPointF &point);
-  QList<Action *> undoStack;
-  QList<Action *> redoStack;
+  void eraseItem(QGraphicsItem *item, const QPointF &point, qreal radius);
+  // Swaps batch for its member strokes within the current erase gesture.
+  QList<StrokeItem *> expandBatch(StrokeBatchItem *batch);
+  void finishEraseGesture();
+  // Repaints the dragged shape where it was (before) and where it is now.
+  void updateShapePreview(const QRectF &before);
+  // Moves the dragged shape into the active layer as one undo step.
+  void endShape();
+  void beginSelectionDrag(QGraphicsItem *pressed, const QPointF &point);
+  void moveSelectionDrag(const QPointF &point);
+  // Renders the proxy and makes the items transparent.
+  void startSelectionProxy();
+  // Moves the items to where the proxy is as one undo step. A release that
+  // ends a drag which never moved selects like Qt would for a click.
+  void endSelectionDrag(const QMouseEvent *release = nullptr);
+  QRect selectionDragViewRect() const;
+  void startFill(const QPointF &point);
+  void finishFill(const QVector<QRectF> &rects);
+  void pushAction(Action *action);
+  // Adds item to layer, or to the active layer.
+  void addLoadedItem(QGraphicsItem *item, LayerItem *layer = nullptr);
+  void addImportedItem(const ItemImporter::Prepared &prepared);
+  // Drops per-item state kept outside the scene, right before the item is
+  // deleted.
+  void forgetItem(QGraphicsItem *item);
+  void compactStroke(StrokeItem *stroke);
+  void cacheFinishedItem(QGraphicsItem *item);
+  void addImportedBatch();
+  // Adds whatever is left of the current paste or load right away.
+  void finishImport();
+  // Called before anything that touches the history; a paste only becomes
+  // an undo step once all of it is on the canvas.
+  void finishPaste();
+  void endImport();
+  void cancelImport();
+  QRectF visibleSceneRect() const;
+  void growSceneRect(const QRectF &visible);
+  void panBy(const QPoint &delta);
+  void updateChunks();
+  // Applies queued input and ends an erase gesture and any import; false
+  // while a stroke or shape is still being drawn.
+  bool finishGestures();
+  void flattenIdleStrokes();
+  // Replaces each run of adjacent flattenable items with one batch. With
+  // undoable, all of it is one undo step. Without, runs no action refers to
+  // are deleted right away, and the others become one step attached to the
+  // newest entry, so undo passes through it; with anything to redo, those
+  // stay as they are.
+  void flattenRuns(bool undoable);
+  // Refreshes the overlay and feeds the size counters to a profile capture.
+  void updatePerfHud();
+  // Empties the board and the history, leaving one empty layer.
+  void resetBoard();
+  LayerItem *createLayer(quint16 id, const QString &name);
+  // Replaces every layer with those in table, or with one empty layer.
+  // Only valid while the history is empty.
+  void resetLayers(const QVector<DocumentLayer> &table);
+  // Layers in the scene, bottom first.
+  QList<LayerItem *> sceneLayers() const;
+  // Any layer still alive, in the scene or held by the history.
+  LayerItem *layerWithId(quint16 id) const;
+  QVector<DocumentLayer> layerTable() const;
+  // Replaces the board with what reader holds, in the background; takes
+  // ownership of reader. name is what documentLoaded() reports.
+  bool startLoading(DocumentReader *reader, const QString &name);
+  // Items in the scene, bottom first.
+  QVector<DocumentItem> residentSnapshot() const;
+  // The whole board, paged-out chunks included, in stacking order.
+  QVector<DocumentItem> boardSnapshot() const;
+  // Picks a new active layer if undo or redo took the active one away.
+  void syncLayers();
+  // Only the active layer takes input and paints item by item; the others
+  // are disabled and paint from their layer raster.
+  void updateLayerStates();
+  bool canEditLayer() const;
+  // Moves item's entry in its layer index after its geometry changed.
+  void reindexItem(QGraphicsItem *item);
+  // Queues what an item or every item an action refers to now is for the
+  // journal.
+  void markJournal(QGraphicsItem *item);
+  void markJournal(const Action *action);
+  void markJournalLayers();
+  // Gives item a DocumentItem::tag unless it has one; batches carry the
+  // tags of their members and layers have none.
+  void tagItem(QGraphicsItem *item);
+  void journalRemove(const QGraphicsItem *item);
+  // Writes the queued changes once no gesture is under way.
+  void flushJournal();
+  void writeJournal();
+  // Compacts a journal grown past its limit once the board has been left
+  // alone for a while.
+  void compactIdleJournal();
+  // Makes the whole board the journal's snapshot; paged-out chunks are read
+  // on the writer thread.
+  void compactJournal();
+  void startSession(SyncSession *started);
+  // Where a remote stroke goes: the active layer, or the topmost one that is
+  // shown and not locked, if any.
+  LayerItem *remoteStrokeLayer() const;
+  // Remote strokes still arriving; they must stay in the scene, unmerged.
+  QSet<QGraphicsItem *> remoteStrokeItems() const;
+  // Grows the remote strokes by what arrived since the last call.
+  void applyRemoteStrokes();
+  EraserHitTester hitTester;
+  History history;
+  CompoundAction *eraseGesture;
+  ReplaceAction *eraseSplits;
+  QThreadPool saveThreads;
+  QThreadPool fitThreads;
+  // Strokes with a refit on the way, by job; a stroke that is deleted or
+  // refitted again in the meantime no longer matches its job.
+  QHash<StrokeItem *, int> fitJobs;
+  int nextFitJob;
+  enum ImportKind { NoImport, PasteImport, DocumentImport };
+
+  // Pastes and loads are built into items on worker threads and added to
+  // the scene here a time slice at a time.
+  ItemImporter *importer;
+  ImportKind importKind;
+  CompoundAction *pasteAction;
+  QString documentFileName;
+  QTimer *loadTimer;
+  int skippedRecords;
+  RasterExporter *exporter;
+  FloodFiller *filler;
+  int tolerance;
+  // Layer and color of the fill being computed; the layer is cleared when
+  // it is deleted meanwhile.
+  LayerItem *fillLayer;
+  QColor fillColor;
+  qint64 fillStart;
+  // Stylus samples arrive far more often than the screen refreshes; they
+  // are queued here and folded into the stroke once per frame.
+  SampleRing<TabletSample, 1024> tabletSamples;
+  bool tabletDrawing;
+  QPointF lastTabletPoint;
+  // Mouse input queued since the last frame.
+  QVector<QPointF> pendingStrokePoints;
+  QVector<QPointF> pendingErasePoints;
+  QPointF pendingShapePoint;
+  QPointF pendingPreviewPoint;
+  bool shapePending;
+  bool previewPending;
+  QTimer *frameTimer;
+  int frameRate;
+  bool gpuViewport;
+  // Finished items far from the view are paged out to disk.
+  ChunkStore *chunks;
+  QTimer *chunkTimer;
+  bool autoFlatten;
+  QTimer *flattenTimer;
+  bool panning;
+  QPoint lastPanPoint;
+  QLabel *perfHud;
+  QTimer *perfTimer;
+  QElapsedTimer perfWindow;
+  // Every live layer, in the scene or not, in stacking order.
+  QList<LayerItem *> layers;
+  LayerItem *currentLayer;
+  quint16 nextLayerId;
+  // Autosave, once started. Changed items are queued, each once, and put
+  // into the journal or removed from it when the timer fires.
+  Journal *journal;
+  QTimer *journalTimer;
+  QTimer *compactTimer;
+  QVector<QGraphicsItem *> journalQueue;
+  QSet<QGraphicsItem *> journalDirty;
+  bool journalLayersDirty;
+  // Next tag handed out; loading a document moves it past the file's tags.
+  quint32 nextTag;
+  // Live sharing, once started: the id the stroke being drawn goes out
+  // under, and the remote strokes still arriving.
+  SyncSession *session;
+  quint32 sessionStroke;
+  QHash<quint64, StrokeItem *> remoteStrokes;
 };
 
 #endif // CANVAS_H
@@ -1,5 +1,8 @@
 #include "tool_panel.h"
+#include "../core/shape_registry.h"
 #include <QColorDialog>
+#include <QComboBox>
+#include <QSignalBlocker>
 
 ToolPanel::ToolPanel(QWidget *parent) : QToolBar(parent) {
   // Pen action
@@ -12,26 +15,34 @@ ToolPanel::ToolPanel(QWidget *parent) : QToolBar(parent) {
   connect(actionEraser, &QAction::triggered, this, &ToolPanel::onActionEraser);
   addAction(actionEraser);
 
+  // Split erase toggle: the eraser cuts strokes instead of deleting them
+  actionSplitErase = new QAction("Split Erase", this);
+  actionSplitErase->setCheckable(true);
+  connect(actionSplitErase, &QAction::toggled, this,
+          &ToolPanel::splitEraseToggled);
+  addAction(actionSplitErase);
+
+  // Fill: clicks flood the area under the cursor with the pen color
+  QAction *actionFill = new QAction("Fill", this);
+  connect(actionFill, &QAction::triggered, this, &ToolPanel::fillSelected);
+  addAction(actionFill);
+  QAction *actionFillTolerance = new QAction("Fill Tolerance", this);
+  connect(actionFillTolerance, &QAction::triggered, this,
+          &ToolPanel::fillToleranceAction);
+  addAction(actionFillTolerance);
+
   // Color picker action
   actionColor = new QAction("Color", this);
   connect(actionColor, &QAction::triggered, this, &ToolPanel::onActionColor);
   addAction(actionColor);
 
-  // Rectangle action
-  actionRectangle = new QAction("Rectangle", this);
-  connect(actionRectangle, &QAction::triggered, this,
-          &ToolPanel::onActionRectangle);
-  addAction(actionRectangle);
-
-  // Circle action
-  actionCircle = new QAction("Circle", this);
-  connect(actionCircle, &QAction::triggered, this, &ToolPanel::onActionCircle);
-  addAction(actionCircle);
-
-  // Line action
-  actionLine = new QAction("Line", this);
-  connect(actionLine, &QAction::triggered, this, &ToolPanel::onActionLine);
-  addAction(actionLine);
+  // One action per registered shape, add-ons included
+  for (const ShapeTool *shape : ShapeRegistry::tools()) {
+    QAction *actionShape = new QAction(shape->name(), this);
+    connect(actionShape, &QAction::triggered, this,
+            [this, shape]() { emit shapeSelected(shape); });
+    addAction(actionShape);
+  }
 
   // Selection action (New)
   actionSelection = new QAction("Selection", this);
@@ -75,6 +86,102 @@ ToolPanel::ToolPanel(QWidget *parent) : QToolBar(parent) {
   QAction *actionPaste = new QAction("Paste", this);
   connect(actionPaste, &QAction::triggered, this, &ToolPanel::pasteAction);
   addAction(actionPaste);
+
+  // Save action
+  QAction *actionSave = new QAction("Save", this);
+  connect(actionSave, &QAction::triggered, this, &ToolPanel::saveAction);
+  addAction(actionSave);
+
+  // Open action
+  QAction *actionOpen = new QAction("Open", this);
+  connect(actionOpen, &QAction::triggered, this, &ToolPanel::openAction);
+  addAction(actionOpen);
+
+  // Export action
+  QAction *actionExport = new QAction("Export", this);
+  connect(actionExport, &QAction::triggered, this, &ToolPanel::exportAction);
+  addAction(actionExport);
+
+  // Spatial index toggle
+  actionSpatialIndex = new QAction("Spatial Index", this);
+  actionSpatialIndex->setCheckable(true);
+  actionSpatialIndex->setChecked(true);
+  connect(actionSpatialIndex, &QAction::toggled, this,
+          &ToolPanel::spatialIndexToggled);
+  addAction(actionSpatialIndex);
+
+  // Flatten strokes into batches now, or automatically when idle
+  QAction *actionFlatten = new QAction("Flatten", this);
+  connect(actionFlatten, &QAction::triggered, this, &ToolPanel::flattenAction);
+  addAction(actionFlatten);
+  QAction *actionAutoFlatten = new QAction("Auto Flatten", this);
+  actionAutoFlatten->setCheckable(true);
+  connect(actionAutoFlatten, &QAction::toggled, this,
+          &ToolPanel::autoFlattenToggled);
+  addAction(actionAutoFlatten);
+
+  // Layers: pick the layer being edited, add or delete layers, and hide or
+  // lock the active one
+  layerBox = new QComboBox(this);
+  connect(layerBox, QOverload<int>::of(&QComboBox::activated), this,
+          &ToolPanel::layerSelected);
+  addWidget(layerBox);
+  QAction *actionAddLayer = new QAction("New Layer", this);
+  connect(actionAddLayer, &QAction::triggered, this,
+          &ToolPanel::addLayerAction);
+  addAction(actionAddLayer);
+  actionRemoveLayer = new QAction("Delete Layer", this);
+  connect(actionRemoveLayer, &QAction::triggered, this,
+          &ToolPanel::removeLayerAction);
+  addAction(actionRemoveLayer);
+  actionLayerHidden = new QAction("Hide Layer", this);
+  actionLayerHidden->setCheckable(true);
+  connect(actionLayerHidden, &QAction::toggled, this,
+          &ToolPanel::layerHiddenToggled);
+  addAction(actionLayerHidden);
+  actionLayerLocked = new QAction("Lock Layer", this);
+  actionLayerLocked->setCheckable(true);
+  connect(actionLayerLocked, &QAction::toggled, this,
+          &ToolPanel::layerLockedToggled);
+  addAction(actionLayerLocked);
+
+  // Frame rate setting: how often drawing input reaches the scene
+  QAction *actionFrameRate = new QAction("Frame Rate", this);
+  connect(actionFrameRate, &QAction::triggered, this,
+          &ToolPanel::frameRateAction);
+  addAction(actionFrameRate);
+
+  // OpenGL viewport toggle, off by default
+  actionGpuViewport = new QAction("GPU Viewport", this);
+  actionGpuViewport->setCheckable(true);
+  connect(actionGpuViewport, &QAction::toggled, this,
+          &ToolPanel::gpuViewportToggled);
+  addAction(actionGpuViewport);
+
+  // Performance overlay toggle
+  QAction *actionPerfHud = new QAction("Perf HUD", this);
+  actionPerfHud->setCheckable(true);
+  connect(actionPerfHud, &QAction::toggled, this, &ToolPanel::perfHudToggled);
+  addAction(actionPerfHud);
+}
+
+void ToolPanel::setGpuViewportChecked(bool checked) {
+  QSignalBlocker blocker(actionGpuViewport);
+  actionGpuViewport->setChecked(checked);
+}
+
+void ToolPanel::setLayers(const QStringList &names, int active, bool hidden,
+                          bool locked) {
+  QSignalBlocker boxBlocker(layerBox);
+  layerBox->clear();
+  layerBox->addItems(names);
+  layerBox->setCurrentIndex(active);
+  actionRemoveLayer->setEnabled(names.size() > 1);
+
+  QSignalBlocker hiddenBlocker(actionLayerHidden);
+  actionLayerHidden->setChecked(hidden);
+  QSignalBlocker lockedBlocker(actionLayerLocked);
+  actionLayerLocked->setChecked(locked);
 }
 
 void ToolPanel::onActionPen() { emit penSelected(); }
@@ -88,25 +195,7 @@ void ToolPanel::onActionColor() {
   }
 }
 
-void ToolPanel::onActionRectangle() {
-  emit shapeSelected("Rectangle");
-  emit rectangleSelected();
-}
-
-void ToolPanel::onActionCircle() {
-  emit shapeSelected("Circle");
-  emit circleSelected();
-}
-
-void ToolPanel::onActionLine() {
-  emit shapeSelected("Line");
-  emit lineSelected();
-}
-
-void ToolPanel::onActionSelection() { // New slot implementation
-  emit shapeSelected("Selection");
-  emit selectionSelected();
-}
+void ToolPanel::onActionSelection() { emit selectionSelected(); }
 
 void ToolPanel::onActionIncreaseBrush() { emit increaseBrushSize(); }
 
@@ -3,25 +3,35 @@
 
 #include <QAction>
 #include <QColor>
+#include <QStringList>
 #include <QToolBar>
 
+class QComboBox;
+class ShapeTool;
+
 class ToolPanel : public QToolBar {
   Q_OBJECT
 
 public:
   explicit ToolPanel(QWidget *parent = nullptr);
 
+  // Updates the GPU viewport toggle without emitting gpuViewportToggled.
+  void setGpuViewportChecked(bool checked);
+  // Fills the layer list, bottom first, and the state of the active layer,
+  // without emitting any of the layer signals.
+  void setLayers(const QStringList &names, int active, bool hidden,
+                 bool locked);
+
 signals:
   // Signals for shape selections
-  void shapeSelected(const QString &shapeType);
-  void rectangleSelected();
-  void circleSelected();
-  void lineSelected();
+  void shapeSelected(const ShapeTool *shape);
   void selectionSelected(); // New signal for selection
 
   // Other tool signals
   void penSelected();
   void eraserSelected();
+  void fillSelected();
+  void fillToleranceAction();
   void colorSelected(const QColor &color);
   void increaseBrushSize();
   void decreaseBrushSize();
@@ -30,12 +40,24 @@ signals:
   void copyAction();
   void cutAction();
   void pasteAction();
+  void saveAction();
+  void openAction();
+  void exportAction();
+  void spatialIndexToggled(bool enabled);
+  void flattenAction();
+  void autoFlattenToggled(bool enabled);
+  void layerSelected(int index);
+  void addLayerAction();
+  void removeLayerAction();
+  void layerHiddenToggled(bool hidden);
+  void layerLockedToggled(bool locked);
+  void splitEraseToggled(bool enabled);
+  void frameRateAction();
+  void gpuViewportToggled(bool enabled);
+  void perfHudToggled(bool visible);
 
 private:
   // Actions for shapes
-  QAction *actionRectangle;
-  QAction *actionCircle;
-  QAction *actionLine;
   QAction *actionSelection; // New QAction for selection
 
   // Actions for other tools
@@ -46,12 +68,16 @@ private:
   QAction *actionDecreaseBrush;
   QAction *actionClear;
   QAction *actionUndo;
+  QAction *actionSpatialIndex;
+  QAction *actionSplitErase;
+  QAction *actionGpuViewport;
+  QComboBox *layerBox;
+  QAction *actionRemoveLayer;
+  QAction *actionLayerHidden;
+  QAction *actionLayerLocked;
 
 private slots:
   // Slots for shape actions
-  void onActionRectangle();
-  void onActionCircle();
-  void onActionLine();
   void onActionSelection(); // New slot for selection
 
   // Slots for other tools
@@ -1,14 +1,33 @@
 // main_window.cpp
 #include "main_window.h"
 #include "../widgets/canvas.h"
+#include "../core/input_trace.h"
+#include "../core/memory_pool.h"
 #include "../widgets/tool_panel.h"
 #include <QApplication>
+#include <QFileDialog>
+#include <QInputDialog>
 #include <QKeyEvent>
+#include <QLabel>
+#include <QProgressBar>
+#include <QStatusBar>
+#include <QTimer>
 #include <QVBoxLayout>
 
+namespace {
+// Trace time a replayed frame covers at the canvas frame rate; 0 lets the
+// replayer pick its default.
+qint64 frameIntervalFor(int framesPerSecond) {
+  return framesPerSecond > 0 ? 1000000 / framesPerSecond : 0;
+}
+} // namespace
+
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent), _canvas(new Canvas(this)),
-      _toolPanel(new ToolPanel(this)) {
+      _toolPanel(new ToolPanel(this)), _historyLabel(new QLabel(this)),
+      _allocationLabel(new QLabel(this)), _lastAllocations(0),
+      _exportProgress(new QProgressBar(this)), _recorder(nullptr),
+      _replayer(nullptr) {
 
   // Set up the layout for the main window
   QWidget *centralWidget = new QWidget(this);
@@ -21,6 +40,38 @@ MainWindow::MainWindow(QWidget *parent)
   // Add the ToolPanel to the left side as a toolbar
   this->addToolBar(Qt::LeftToolBarArea, _toolPanel);
 
+  // Show undo history size on the status bar
+  statusBar()->addPermanentWidget(_historyLabel);
+  connect(_canvas, &Canvas::historyChanged, this,
+          &MainWindow::updateHistoryStatus);
+  updateHistoryStatus();
+
+  // Pooled allocations of items and actions, refreshed once a second
+  statusBar()->addPermanentWidget(_allocationLabel);
+  QTimer *allocationTimer = new QTimer(this);
+  connect(allocationTimer, &QTimer::timeout, this,
+          &MainWindow::updateAllocationStatus);
+  allocationTimer->start(1000);
+  updateAllocationStatus();
+
+  // Export progress, only shown while an export runs
+  _exportProgress->setMaximumWidth(160);
+  _exportProgress->hide();
+  statusBar()->addPermanentWidget(_exportProgress);
+  connect(_canvas, &Canvas::exportProgress, this, [this](int done, int total) {
+    _exportProgress->setRange(0, total);
+    _exportProgress->setValue(done);
+    _exportProgress->show();
+  });
+  connect(_canvas, &Canvas::exportFinished, this,
+          [this](const QString &fileName, bool ok, const QString &error) {
+            _exportProgress->hide();
+            statusBar()->showMessage(
+                ok ? QString("Exported %1").arg(fileName)
+                   : QString("Could not export %1: %2").arg(fileName, error),
+                5000);
+          });
+
   // Set main window properties
   this->setWindowTitle("Pencil Draw");
   // Optionally, remove or comment out the resize if you are setting full screen
@@ -30,24 +81,49 @@ MainWindow::MainWindow(QWidget *parent)
   connect(_toolPanel, &ToolPanel::penSelected, _canvas, &Canvas::setPenTool);
   connect(_toolPanel, &ToolPanel::eraserSelected, _canvas,
           &Canvas::setEraserTool);
+  connect(_toolPanel, &ToolPanel::fillSelected, _canvas, &Canvas::setFillTool);
+  connect(_toolPanel, &ToolPanel::fillToleranceAction, this,
+          &MainWindow::chooseFillTolerance);
   connect(_toolPanel, &ToolPanel::colorSelected, _canvas, &Canvas::setPenColor);
+  connect(_toolPanel, &ToolPanel::splitEraseToggled, _canvas,
+          &Canvas::setSplitEraseEnabled);
 
-  // Use setShape instead of drawRectangle, drawCircle, and drawLine
-  connect(_toolPanel, &ToolPanel::rectangleSelected, _canvas,
-          [this]() { _canvas->setShape("Rectangle"); });
-  connect(_toolPanel, &ToolPanel::circleSelected, _canvas,
-          [this]() { _canvas->setShape("Circle"); });
-  connect(_toolPanel, &ToolPanel::lineSelected, _canvas,
-          [this]() { _canvas->setShape("Line"); });
+  connect(_toolPanel, &ToolPanel::shapeSelected, _canvas, &Canvas::setShape);
   connect(_toolPanel, &ToolPanel::selectionSelected, _canvas,
-          [this]() { _canvas->setShape("Selection"); });
+          &Canvas::setSelectionTool);
 
   // Connect Copy, Cut, Paste signals
-  connect(_toolPanel, &ToolPanel::copyAction, _canvas,
-          &Canvas::copySelectedItems);
-  connect(_toolPanel, &ToolPanel::cutAction, _canvas,
-          &Canvas::cutSelectedItems);
-  connect(_toolPanel, &ToolPanel::pasteAction, _canvas, &Canvas::pasteItems);
+  connect(_toolPanel, &ToolPanel::copyAction, this, &MainWindow::copyItems);
+  connect(_toolPanel, &ToolPanel::cutAction, this, &MainWindow::cutItems);
+  connect(_toolPanel, &ToolPanel::pasteAction, this, &MainWindow::pasteItems);
+
+  // Save and open boards
+  connect(_toolPanel, &ToolPanel::saveAction, this, &MainWindow::saveDocument);
+  connect(_toolPanel, &ToolPanel::openAction, this, &MainWindow::openDocument);
+  connect(_toolPanel, &ToolPanel::exportAction, this, &MainWindow::exportImage);
+  connect(_canvas, &Canvas::documentSaved, this,
+          [this](const QString &fileName, bool ok, const QString &error) {
+            statusBar()->showMessage(
+                ok ? QString("Saved %1").arg(fileName)
+                   : QString("Could not save %1: %2").arg(fileName, error),
+                5000);
+          });
+  connect(_canvas, &Canvas::documentLoaded, this,
+          [this](const QString &fileName, bool ok, const QString &error) {
+            QString message = ok ? QString("Opened %1").arg(fileName)
+                                 : QString("Could not open %1").arg(fileName);
+            if (!error.isEmpty())
+              message += QString(": %1").arg(error);
+            statusBar()->showMessage(message, 5000);
+          });
+  connect(_canvas, &Canvas::autosaveFailed, this, [this](const QString &error) {
+    statusBar()->showMessage(QString("Could not autosave: %1").arg(error),
+                             5000);
+  });
+  connect(_canvas, &Canvas::sessionLost, this, [this](const QString &error) {
+    statusBar()->showMessage(QString("Session host lost: %1").arg(error),
+                             5000);
+  });
 
   // Other connections
   connect(_toolPanel, &ToolPanel::increaseBrushSize, _canvas,
@@ -56,6 +132,32 @@ MainWindow::MainWindow(QWidget *parent)
           &Canvas::decreaseBrushSize);
   connect(_toolPanel, &ToolPanel::clearCanvas, _canvas, &Canvas::clearCanvas);
   connect(_toolPanel, &ToolPanel::undoAction, _canvas, &Canvas::undoLastAction);
+  connect(_toolPanel, &ToolPanel::spatialIndexToggled, _canvas,
+          &Canvas::setSpatialIndexEnabled);
+  connect(_toolPanel, &ToolPanel::flattenAction, _canvas,
+          &Canvas::flattenStrokes);
+  connect(_toolPanel, &ToolPanel::autoFlattenToggled, _canvas,
+          &Canvas::setAutoFlattenEnabled);
+
+  // Layers
+  connect(_toolPanel, &ToolPanel::layerSelected, _canvas,
+          &Canvas::setActiveLayer);
+  connect(_toolPanel, &ToolPanel::addLayerAction, _canvas, &Canvas::addLayer);
+  connect(_toolPanel, &ToolPanel::removeLayerAction, _canvas,
+          &Canvas::removeActiveLayer);
+  connect(_toolPanel, &ToolPanel::layerHiddenToggled, _canvas,
+          &Canvas::setActiveLayerHidden);
+  connect(_toolPanel, &ToolPanel::layerLockedToggled, _canvas,
+          &Canvas::setActiveLayerLocked);
+  connect(_canvas, &Canvas::layersChanged, this, &MainWindow::updateLayers);
+  updateLayers();
+
+  connect(_toolPanel, &ToolPanel::frameRateAction, this,
+          &MainWindow::chooseFrameRate);
+  connect(_toolPanel, &ToolPanel::gpuViewportToggled, this,
+          &MainWindow::setGpuViewport);
+  connect(_toolPanel, &ToolPanel::perfHudToggled, _canvas,
+          &Canvas::setPerfHudVisible);
 
   // Optionally set the window to full screen or maximized
   // Uncomment one of the following lines based on your preference:
@@ -66,16 +168,371 @@ MainWindow::MainWindow(QWidget *parent)
 MainWindow::~MainWindow() {
   // No need to manually delete _canvas or _toolPanel as Qt handles child widget
   // memory
+  if (_recorder) {
+    QString error;
+    if (!_recorder->trace().save(_traceFileName, &error))
+      qWarning("Could not save input trace %s: %s",
+               qPrintable(_traceFileName), qPrintable(error));
+  }
+}
+
+void MainWindow::startRecording(const QString &fileName) {
+  _traceFileName = fileName;
+  _recorder = new InputRecorder(this);
+  _recorder->setTarget(_canvas->viewport());
+
+  InputRecorder *recorder = _recorder;
+  connect(_toolPanel, &ToolPanel::penSelected, recorder,
+          [recorder]() { recorder->record(InputTrace::SelectPen); });
+  connect(_toolPanel, &ToolPanel::eraserSelected, recorder,
+          [recorder]() { recorder->record(InputTrace::SelectEraser); });
+  connect(_toolPanel, &ToolPanel::fillSelected, recorder,
+          [recorder]() { recorder->record(InputTrace::SelectFill); });
+  connect(_toolPanel, &ToolPanel::selectionSelected, recorder,
+          [recorder]() { recorder->record(InputTrace::SelectSelection); });
+  connect(_toolPanel, &ToolPanel::shapeSelected, recorder,
+          [recorder](const ShapeTool *shape) {
+            recorder->record(InputTrace::SelectShape, shape->kind());
+          });
+  connect(_toolPanel, &ToolPanel::colorSelected, recorder,
+          [recorder](const QColor &color) {
+            recorder->record(InputTrace::SetPenColor, color.rgba());
+          });
+  connect(_toolPanel, &ToolPanel::increaseBrushSize, recorder,
+          [recorder]() { recorder->record(InputTrace::IncreaseBrush); });
+  connect(_toolPanel, &ToolPanel::decreaseBrushSize, recorder,
+          [recorder]() { recorder->record(InputTrace::DecreaseBrush); });
+  connect(_toolPanel, &ToolPanel::clearCanvas, recorder,
+          [recorder]() { recorder->record(InputTrace::ClearCanvas); });
+  connect(_toolPanel, &ToolPanel::undoAction, recorder,
+          [recorder]() { recorder->record(InputTrace::Undo); });
+  connect(_toolPanel, &ToolPanel::splitEraseToggled, recorder,
+          [recorder](bool enabled) {
+            recorder->record(InputTrace::SplitErase, enabled);
+          });
+  connect(_toolPanel, &ToolPanel::spatialIndexToggled, recorder,
+          [recorder](bool enabled) {
+            recorder->record(InputTrace::SpatialIndex, enabled);
+          });
+  connect(_toolPanel, &ToolPanel::flattenAction, recorder,
+          [recorder]() { recorder->record(InputTrace::Flatten); });
+  connect(_toolPanel, &ToolPanel::autoFlattenToggled, recorder,
+          [recorder](bool enabled) {
+            recorder->record(InputTrace::AutoFlatten, enabled);
+          });
+  connect(_toolPanel, &ToolPanel::layerSelected, recorder,
+          [recorder](int index) {
+            recorder->record(InputTrace::SelectLayer, quint32(index));
+          });
+  connect(_toolPanel, &ToolPanel::addLayerAction, recorder,
+          [recorder]() { recorder->record(InputTrace::AddLayer); });
+  connect(_toolPanel, &ToolPanel::removeLayerAction, recorder,
+          [recorder]() { recorder->record(InputTrace::RemoveLayer); });
+  connect(_toolPanel, &ToolPanel::layerHiddenToggled, recorder,
+          [recorder](bool hidden) {
+            recorder->record(InputTrace::LayerHidden, hidden);
+          });
+  connect(_toolPanel, &ToolPanel::layerLockedToggled, recorder,
+          [recorder](bool locked) {
+            recorder->record(InputTrace::LayerLocked, locked);
+          });
+
+  // Once the window has its final size, so the recorded view is the one
+  // the first event lands in.
+  QTimer::singleShot(0, this, [this]() {
+    _recorder->start(_canvas->viewTopLeft(), _canvas->zoom(),
+                     _canvas->viewport()->size());
+    _recorder->record(InputTrace::FrameRate,
+                      quint32(_canvas->targetFrameRate()));
+  });
+}
+
+bool MainWindow::startAutosave(const QString &directory) {
+  QString error;
+  if (!_canvas->startJournal(directory, &error)) {
+    qWarning("Could not autosave into %s: %s", qPrintable(directory),
+             qPrintable(error));
+    return false;
+  }
+  return true;
+}
+
+bool MainWindow::hostSession(const QHostAddress &address, quint16 port,
+                             const QByteArray &secret) {
+  QString error;
+  if (!_canvas->hostSession(address, port, secret, &error)) {
+    qWarning("Could not host a session on %s port %d: %s",
+             qPrintable(address.toString()), int(port), qPrintable(error));
+    return false;
+  }
+  return true;
+}
+
+void MainWindow::joinSession(const QString &hostName, quint16 port,
+                             const QByteArray &secret) {
+  _canvas->joinSession(hostName, port, secret);
+}
+
+bool MainWindow::startReplay(const QString &fileName, bool originalSpeed,
+                             const QString &reportFile) {
+  InputTrace trace;
+  QString error;
+  if (!trace.load(fileName, &error)) {
+    qWarning("Could not read input trace %s: %s", qPrintable(fileName),
+             qPrintable(error));
+    return false;
+  }
+
+  _replayer = new InputReplayer(trace, this);
+  _replayer->setTarget(_canvas->viewport());
+  _replayer->setCommandHandler([this](const InputTrace::Event &event) {
+    switch (event.type) {
+    case InputTrace::SelectPen:
+      _canvas->setPenTool();
+      break;
+    case InputTrace::SelectEraser:
+      _canvas->setEraserTool();
+      break;
+    case InputTrace::SelectFill:
+      _canvas->setFillTool();
+      break;
+    case InputTrace::FillTolerance:
+      _canvas->setFillTolerance(int(event.value));
+      break;
+    case InputTrace::SelectSelection:
+      _canvas->setSelectionTool();
+      break;
+    case InputTrace::SelectShape:
+      if (const ShapeTool *shape = ShapeRegistry::forKind(int(event.value)))
+        _canvas->setShape(shape);
+      break;
+    case InputTrace::SetPenColor:
+      _canvas->setPenColor(QColor::fromRgba(event.value));
+      break;
+    case InputTrace::IncreaseBrush:
+      _canvas->increaseBrushSize();
+      break;
+    case InputTrace::DecreaseBrush:
+      _canvas->decreaseBrushSize();
+      break;
+    case InputTrace::ClearCanvas:
+      _canvas->clearCanvas();
+      break;
+    case InputTrace::Undo:
+      _canvas->undoLastAction();
+      break;
+    case InputTrace::SplitErase:
+      _canvas->setSplitEraseEnabled(event.value != 0);
+      break;
+    case InputTrace::SpatialIndex:
+      _canvas->setSpatialIndexEnabled(event.value != 0);
+      break;
+    case InputTrace::GpuViewport:
+      _toolPanel->setGpuViewportChecked(event.value != 0);
+      setGpuViewport(event.value != 0);
+      break;
+    case InputTrace::Flatten:
+      _canvas->flattenStrokes();
+      break;
+    case InputTrace::AutoFlatten:
+      _canvas->setAutoFlattenEnabled(event.value != 0);
+      break;
+    case InputTrace::AddLayer:
+      _canvas->addLayer();
+      break;
+    case InputTrace::RemoveLayer:
+      _canvas->removeActiveLayer();
+      break;
+    case InputTrace::SelectLayer:
+      _canvas->setActiveLayer(int(event.value));
+      break;
+    case InputTrace::LayerHidden:
+      _canvas->setActiveLayerHidden(event.value != 0);
+      break;
+    case InputTrace::LayerLocked:
+      _canvas->setActiveLayerLocked(event.value != 0);
+      break;
+    case InputTrace::Copy:
+      _canvas->copySelectedItems();
+      break;
+    case InputTrace::Cut:
+      _canvas->cutSelectedItems();
+      break;
+    case InputTrace::Paste:
+      _canvas->pasteItems(event.data);
+      break;
+    case InputTrace::FrameRate:
+      _canvas->setTargetFrameRate(int(event.value));
+      _replayer->setFrameInterval(frameIntervalFor(int(event.value)));
+      break;
+    default:
+      break;
+    }
+  });
+  // Whatever the canvas would do on its next frame tick happens at the end
+  // of each replayed frame, painted synchronously so the timing includes
+  // it.
+  _replayer->setFrameHandler([this]() {
+    _canvas->flushInput();
+    _canvas->viewport()->repaint();
+  });
+  _replayer->setFrameInterval(frameIntervalFor(_canvas->targetFrameRate()));
+  connect(_replayer, &InputReplayer::finished, this, [this, reportFile]() {
+    const QString summary = _replayer->summary();
+    qInfo("%s", qPrintable(summary));
+    statusBar()->showMessage(summary);
+    if (reportFile.isEmpty())
+      return;
+    QString error;
+    if (!_replayer->writeReport(reportFile, &error))
+      qWarning("Could not write replay report %s: %s",
+               qPrintable(reportFile), qPrintable(error));
+    QApplication::quit();
+  });
+
+  const QPointF topLeft = trace.viewTopLeft;
+  const qreal zoom = trace.zoom;
+  QTimer::singleShot(0, this, [this, topLeft, zoom, originalSpeed]() {
+    _canvas->setView(topLeft, zoom);
+    _replayer->start(originalSpeed);
+  });
+  return true;
+}
+
+void MainWindow::updateHistoryStatus() {
+  const History &history = _canvas->undoHistory();
+  _historyLabel->setText(QString("Undo: %1  Redo: %2  History: %3 KB")
+                             .arg(history.undoCount())
+                             .arg(history.redoCount())
+                             .arg(history.memoryUsage() / 1024));
+}
+
+void MainWindow::updateLayers() {
+  QStringList names;
+  for (int i = 0; i < _canvas->layerCount(); ++i) {
+    names.append(_canvas->layerName(i));
+  }
+  const int active = _canvas->activeLayerIndex();
+  _toolPanel->setLayers(names, active, _canvas->isLayerHidden(active),
+                        _canvas->isLayerLocked(active));
+}
+
+void MainWindow::updateAllocationStatus() {
+  const MemoryPool::Stats stats = MemoryPool::totals();
+  const quint64 allocations = stats.allocations + stats.fallbacks;
+  _allocationLabel->setText(
+      QString("Allocs: %1/s  Live: %2  Heap: %3")
+          .arg(allocations - _lastAllocations)
+          .arg(stats.allocations - stats.releases)
+          .arg(stats.fallbacks));
+  _lastAllocations = allocations;
+}
+
+void MainWindow::saveDocument() {
+  const QString fileName = QFileDialog::getSaveFileName(
+      this, "Save Board", QString(), "Pencil Draw boards (*.fspd)");
+  if (!fileName.isEmpty()) {
+    _canvas->saveDocument(fileName);
+  }
+}
+
+void MainWindow::openDocument() {
+  const QString fileName = QFileDialog::getOpenFileName(
+      this, "Open Board", QString(), "Pencil Draw boards (*.fspd)");
+  if (!fileName.isEmpty()) {
+    _canvas->loadDocument(fileName);
+  }
+}
+
+void MainWindow::exportImage() {
+  const QString fileName = QFileDialog::getSaveFileName(
+      this, "Export Image", QString(), "PNG (*.png);;JPEG (*.jpg *.jpeg)");
+  if (fileName.isEmpty())
+    return;
+
+  bool ok = false;
+  const int scale = QInputDialog::getInt(
+      this, "Export Image", "Resolution (times screen size):", 4, 1, 8, 1, &ok);
+  if (ok && !_canvas->exportImage(fileName, scale)) {
+    statusBar()->showMessage("An export is already running", 5000);
+  }
+}
+
+void MainWindow::chooseFrameRate() {
+  bool ok = false;
+  const int rate = QInputDialog::getInt(
+      this, "Frame Rate", "Drawing updates per second (0 = every event):",
+      _canvas->targetFrameRate(), 0, 480, 1, &ok);
+  if (ok) {
+    _canvas->setTargetFrameRate(rate);
+    if (_recorder)
+      _recorder->record(InputTrace::FrameRate, quint32(rate));
+  }
+}
+
+void MainWindow::chooseFillTolerance() {
+  bool ok = false;
+  const int tolerance = QInputDialog::getInt(
+      this, "Fill Tolerance",
+      "Largest color difference the fill spreads into (0-255):",
+      _canvas->fillTolerance(), 0, 255, 1, &ok);
+  if (ok) {
+    _canvas->setFillTolerance(tolerance);
+    if (_recorder)
+      _recorder->record(InputTrace::FillTolerance, quint32(tolerance));
+  }
+}
+
+void MainWindow::setGpuViewport(bool enabled) {
+  if (!_canvas->setGpuViewportEnabled(enabled)) {
+    _toolPanel->setGpuViewportChecked(false);
+    statusBar()->showMessage(
+        "GPU viewport unavailable; using the raster viewport", 5000);
+  }
+  // The canvas has a new viewport widget either way it went.
+  if (_recorder) {
+    _recorder->setTarget(_canvas->viewport());
+    _recorder->record(InputTrace::GpuViewport,
+                      _canvas->isGpuViewportEnabled());
+  }
+  if (_replayer)
+    _replayer->setTarget(_canvas->viewport());
+}
+
+// The tool panel and the shortcuts both come through here, so a recording
+// has every clipboard action.
+void MainWindow::copyItems() {
+  _canvas->copySelectedItems();
+  if (_recorder)
+    _recorder->record(InputTrace::Copy);
+}
+
+void MainWindow::cutItems() {
+  _canvas->cutSelectedItems();
+  if (_recorder)
+    _recorder->record(InputTrace::Cut);
+}
+
+void MainWindow::pasteItems() {
+  // The trace keeps what was pasted; the clipboard a replay runs with may
+  // hold something else.
+  if (_recorder)
+    _recorder->recordPaste(_canvas->clipboardItems());
+  _canvas->pasteItems();
 }
 
 // Override the keyPressEvent to handle Escape key and shortcuts
 void MainWindow::keyPressEvent(QKeyEvent *event) {
   if (event->matches(QKeySequence::Copy)) {
-    _canvas->copySelectedItems();
+    copyItems();
   } else if (event->matches(QKeySequence::Cut)) {
-    _canvas->cutSelectedItems();
+    cutItems();
   } else if (event->matches(QKeySequence::Paste)) {
-    _canvas->pasteItems();
+    pasteItems();
+  } else if (event->matches(QKeySequence::Save)) {
+    saveDocument();
+  } else if (event->matches(QKeySequence::Open)) {
+    openDocument();
   } else if (event->key() == Qt::Key_Escape) {
     // Option 1: Close the main window
     this->close();
@@ -2,9 +2,15 @@
 #ifndef MAIN_WINDOW_H
 #define MAIN_WINDOW_H
 
+#include <QByteArray>
+#include <QHostAddress>
 #include <QMainWindow>
 
 class Canvas;
+class InputRecorder;
+class InputReplayer;
+class QLabel;
+class QProgressBar;
 class ToolPanel;
 
 class MainWindow : public QMainWindow {
@@ -14,13 +20,52 @@ public:
   explicit MainWindow(QWidget *parent = nullptr);
   ~MainWindow();
 
+  // Records the input that reaches the canvas, and the tool panel commands
+  // in between, into fileName when the window closes.
+  void startRecording(const QString &fileName);
+  // Plays a recorded trace back, at its original pace or flat out, and
+  // prints per-frame timings once it ends. With a report file the timings
+  // are written there as CSV and the application quits afterwards.
+  bool startReplay(const QString &fileName, bool originalSpeed,
+                   const QString &reportFile);
+  // Restores the board autosaved in directory, if any, and journals every
+  // change there from now on.
+  bool startAutosave(const QString &directory);
+  // Shares strokes live with other instances: hosts a session on address
+  // and port, or joins the one at hostName and takes over its board.
+  bool hostSession(const QHostAddress &address, quint16 port,
+                   const QByteArray &secret);
+  void joinSession(const QString &hostName, quint16 port,
+                   const QByteArray &secret);
+
 protected:
   // Override the keyPressEvent to handle key presses
   void keyPressEvent(QKeyEvent *event) override;
 
+private slots:
+  void updateHistoryStatus();
+  void updateAllocationStatus();
+  void updateLayers();
+  void saveDocument();
+  void openDocument();
+  void exportImage();
+  void chooseFrameRate();
+  void chooseFillTolerance();
+  void setGpuViewport(bool enabled);
+  void copyItems();
+  void cutItems();
+  void pasteItems();
+
 private:
   Canvas *_canvas;
   ToolPanel *_toolPanel;
+  QLabel *_historyLabel;
+  QLabel *_allocationLabel;
+  quint64 _lastAllocations;
+  QProgressBar *_exportProgress;
+  InputRecorder *_recorder;
+  QString _traceFileName;
+  InputReplayer *_replayer;
 };
 
 #endif // MAIN_WINDOW_H